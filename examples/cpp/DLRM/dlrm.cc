@@ -26,7 +26,8 @@ void parse_input_args(char **argv, int argc, DLRMConfig &apConfig);
 DLRMConfig::DLRMConfig(void)
     : sparse_feature_size(64), sigmoid_bot(-1), sigmoid_top(-1),
       embedding_bag_size(1), loss_threshold(0.0f), arch_interaction_op("cat"),
-      dataset_path(""), data_size(-1) {
+      dataset_path(""), data_size(-1),
+      embedding_update(EMBEDDING_UPDATE_DENSE) {
   embedding_size.push_back(1000000);
   embedding_size.push_back(1000000);
   embedding_size.push_back(1000000);
@@ -68,9 +69,22 @@ Tensor create_emb(FFModel *model,
                   Tensor const &input,
                   int input_dim,
                   int output_dim,
-                  int idx) {
+                  int idx,
+                  EmbeddingUpdateType update_type) {
   float range = sqrt(1.0f / input_dim);
   Initializer *embed_init = new UniformInitializer(std::rand(), -range, range);
+  if (update_type != EMBEDDING_UPDATE_DENSE) {
+    // sparse updates only support float tables
+    return model->embedding(input,
+                            input_dim,
+                            output_dim,
+                            AGGR_MODE_SUM,
+                            DT_FLOAT /*dtype*/,
+                            NULL /*weight_sharing*/,
+                            embed_init,
+                            NULL /*name*/,
+                            update_type);
+  }
   Tensor t = model->embedding(input,
                               input_dim,
                               output_dim,
@@ -158,7 +172,12 @@ void FlexFlow::top_level_task(Task const *task,
   for (size_t i = 0; i < dlrmConfig.embedding_size.size(); i++) {
     int input_dim = dlrmConfig.embedding_size[i];
     int output_dim = dlrmConfig.sparse_feature_size;
-    ly.push_back(create_emb(&ff, sparse_inputs[i], input_dim, output_dim, i));
+    ly.push_back(create_emb(&ff,
+                            sparse_inputs[i],
+                            input_dim,
+                            output_dim,
+                            i,
+                            dlrmConfig.embedding_update));
   }
   Tensor z = interact_features(&ff, x, ly, dlrmConfig.arch_interaction_op);
   Tensor p =
@@ -226,6 +245,8 @@ void FlexFlow::top_level_task(Task const *task,
       // }
     }
   }
+  // Write the rows cached on the GPUs back to host-resident tables
+  ff.flush_embedding_caches();
   // End timer
   {
     runtime->issue_execution_fence(ctx);
@@ -301,6 +322,18 @@ void parse_input_args(char **argv, int argc, DLRMConfig &config) {
       config.data_size = atoi(argv[++i]);
       continue;
     }
+    if (!strcmp(argv[i], "--embedding-update")) {
+      std::string mode(argv[++i]);
+      if (mode == "sgd") {
+        config.embedding_update = EMBEDDING_UPDATE_SPARSE_SGD;
+      } else if (mode == "adagrad") {
+        config.embedding_update = EMBEDDING_UPDATE_ROWWISE_ADAGRAD;
+      } else {
+        assert(mode == "dense");
+        config.embedding_update = EMBEDDING_UPDATE_DENSE;
+      }
+      continue;
+    }
   }
 }
 
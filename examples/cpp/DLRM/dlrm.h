@@ -29,6 +29,7 @@ struct DLRMConfig {
   std::vector<int> embedding_size, mlp_bot, mlp_top;
   std::string arch_interaction_op, dataset_path;
   int data_size;
+  EmbeddingUpdateType embedding_update;
 };
 
 struct ArgsConfig {
@@ -17,6 +17,7 @@
 
 #include "flexflow/ffconst.h"
 #include "flexflow/fftype.h"
+#include "flexflow/utils/adapter_segments.h"
 #include "legion.h"
 #include <cstddef>
 #include <cstdlib>
@@ -42,12 +43,18 @@ struct OptimizerTasks {
   bool reset_gradients_to_zero = false;
   bool update_weights = false;
   bool save_updated_weights = false;
+  // Save a checkpoint of the weights after this step's update
+  bool save_checkpoint = false;
+  int training_step = 0;
 };
 
 void set_optimizer_tasks(OptimizerTasks &tasks,
                          int max_training_steps,
                          int completed_training_steps,
-                         int gradient_accumulation_steps);
+                         int gradient_accumulation_steps,
+                         int checkpoint_interval = -1,
+                         bool first_chunk = true,
+                         bool last_chunk = true);
 
 class BatchConfig {
 public:
@@ -58,11 +65,20 @@ public:
   int num_active_tokens() const;
   int num_active_infr_tokens() const;
   int num_active_peft_tokens() const;
+  // Groups the tokens of the PEFT requests into runs that use the same
+  // adapter. Requests that need the backward pass get their own segment.
+  void get_adapter_segments(std::vector<AdapterSegment> &segments) const;
+  // Removes an inference request and all its tokens from the batch
+  void remove_request(int request_index);
   static int max_requests_per_batch();
   static int max_tokens_per_batch();
   static int max_verify_tokens_per_batch();
   static int max_spec_tree_token_num();
   static int max_sequence_length();
+  // Tokens of a PEFT request whose activations are kept for the backward
+  // pass. Long dataset entries are processed one chunk per batch, so this
+  // is bounded by the batch size rather than the sequence length.
+  static int max_peft_chunk_tokens(int max_sequence_length);
   friend std::ostream &operator<<(std::ostream &os, BatchConfig const &bc);
   void print() const;
   void save_to_file(std::string const &filename) const;
@@ -93,6 +109,9 @@ public:
       batch_config_request_id = -1;
       peft_model_id = PEFTModelID::NO_ID;
       peft_bwd = false;
+      peft_entry_length = 0;
+      peft_next_token_id = -1;
+      peft_truncated_bwd = false;
       optimizer_tasks = {true, false, false, false};
     }
     int first_token_depth_in_request;
@@ -107,6 +126,13 @@ public:
     // PEFT fields
     PEFTModelID peft_model_id;
     bool peft_bwd;
+    // length of the dataset entry this chunk belongs to, and the token that
+    // follows the chunk (-1 for the last chunk of the entry)
+    int peft_entry_length;
+    TokenId peft_next_token_id;
+    // whether the gradients of the chunk skip the keys and values of the
+    // earlier chunks of the entry
+    bool peft_truncated_bwd;
     OptimizerTasks optimizer_tasks;
   };
   struct PerTokenInfo {
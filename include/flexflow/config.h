@@ -57,6 +57,8 @@ namespace FlexFlow {
 // Pre-assigned const flags
 #define MAP_TO_FB_MEMORY 0xABCD0000
 #define MAP_TO_ZC_MEMORY 0xABCE0000
+// Semantic tag of the regions whose instances the mapper lets Legion collect
+#define DISCARDABLE_SEMANTIC_TAG 0xABCF0000
 
 #ifdef FF_USE_NCCL
 constexpr ParameterSyncType CHOSEN_SYNC_TYPE = ParameterSyncType::NCCL;
@@ -106,6 +108,7 @@ struct FFHandler {
   size_t peft_activation_reserve_space_size;
   PEFTWeightAllocator *peft_weight_allocator;
   size_t peft_weight_reserve_space_size;
+  size_t peft_adapter_pool_size;
   // Quantization fields
   DataType quantization_type;
   bool allowTensorOpMathConversion;
@@ -119,6 +122,7 @@ struct FFInitInfo {
   size_t offload_reserve_space_size;
   size_t peft_activation_reserve_space_size;
   size_t peft_weight_reserve_space_size;
+  size_t peft_adapter_pool_size;
   DataType quantization_type;
   bool allowTensorOpMathConversion;
   // int myRank, allRanks;
@@ -180,6 +184,28 @@ public:
   bool enable_peft;
   size_t peft_activation_reserve_space_size;
   size_t peft_weight_reserve_space_size;
+  // part of the PEFT weight reserve space used to page inference-only LoRA
+  // adapters in and out of GPU memory (0 = load all adapters up front)
+  size_t peft_adapter_pool_size;
+  // run the backward pass of each chunk of a finetuning entry that does not
+  // fit in a batch right after its forward pass, without the gradients of the
+  // keys and values of the earlier chunks
+  bool peft_truncated_backprop;
+  // On-demand weight loading fields
+  bool lazy_weight_loading;
+  int weight_prefetch_depth;
+  // Speculative inference fields
+  bool adaptive_speculation;
+  int speculation_token_budget;
+  std::string speculation_stats_file;
+  bool ngram_speculation;
+  std::string ngram_corpus_file;
+  // Co-serving fields: time per output token (ms) that inference requests
+  // should stay below when finetuning shares the batch (0 = no limit)
+  double coserving_latency_slo;
+  std::string coserving_log_file;
+  // Threads that tokenize prompts and detokenize outputs while serving
+  int num_tokenizer_workers;
   // Control parallelizable dimensions
   bool only_data_parallel;
   bool enable_sample_parallel;
@@ -211,6 +237,29 @@ public:
   int base_optimize_threshold;
   bool enable_control_replication;
   int python_data_loader_type;
+  // shuffles the samples of every epoch when not negative
+  int data_shuffle_seed;
+  // threads each CPU embedding task pools its bags with
+  int embedding_cpu_threads;
+  // device rows caching each larger embedding table, which then stays in
+  // host memory (0 keeps whole tables on the device)
+  int embedding_cache_rows;
+  // lookups after which a row is admitted into the embedding cache
+  int embedding_cache_admit_threshold;
+  // updates all parameters on a device with one optimizer task
+  bool fused_optimizer_update;
+  // bytes of NCCL gradients all-reduced together while the backward pass
+  // runs (0 all-reduces each gradient in its optimizer update)
+  size_t gradient_bucket_size;
+  // trains half precision weights through FP32 master copies held by the
+  // optimizer, with a dynamically scaled loss
+  bool mixed_precision;
+  // initial loss scale, and steps without overflow before it grows
+  float loss_scale;
+  int loss_scale_window;
+  // shards the Adam moments of NCCL parameters across their data-parallel
+  // replicas, each of which updates its slice of the weights
+  bool shard_optimizer_states;
   bool perform_memory_search{false};
 };
 
@@ -0,0 +1,93 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FLEXFLOW_COSERVING_CONTROLLER_H
+#define _FLEXFLOW_COSERVING_CONTROLLER_H
+
+#include <istream>
+#include <ostream>
+#include <vector>
+
+namespace FlexFlow {
+
+// Decides how many finetuning tokens each co-serving batch may contain,
+// trading finetuning throughput against the latency of inference requests.
+//
+// Every iteration the controller observes the time since the previous batch
+// was prepared (the time per output token of decoding requests), the number
+// of inference requests waiting for a batch slot and the number of
+// inference tokens in the batch. The finetuning budget follows an AIMD
+// policy: it is halved when the smoothed iteration latency comes within
+// safety_margin of the latency SLO, kept while inference requests are
+// queued, grown by increase_step tokens otherwise, and set to the whole
+// batch when there is no inference work at all.
+//
+// Each decision is written as one JSON line to the log, if any, together
+// with the observation it was based on. replay() runs the observations of a
+// log through the controller's current settings, so that policies can be
+// compared offline.
+class CoServingController {
+public:
+  struct Observation {
+    // time since the previous batch was prepared, or 0 for the first one
+    double iteration_latency_us = 0;
+    int queue_depth = 0;
+    int inference_tokens = 0;
+    int max_tokens_per_batch = 0;
+  };
+
+  CoServingController();
+  void set_latency_slo(double latency_slo_us);
+  void set_safety_margin(double safety_margin);
+  void set_min_finetuning_tokens(int min_finetuning_tokens);
+  void set_increase_step(int increase_step);
+  void set_smoothing(double smoothing);
+  void set_log(std::ostream *log);
+  bool is_enabled() const {
+    return latency_slo_us > 0;
+  }
+  int get_finetuning_budget() const {
+    return finetuning_budget;
+  }
+  double get_smoothed_latency() const {
+    return smoothed_latency_us;
+  }
+
+  // Returns the number of finetuning tokens the next batch may contain
+  int update(Observation const &observation);
+  void reset();
+
+  // Replays the observations of a decision log, appending the logged
+  // decisions to recorded and the ones of this controller to replayed
+  void replay(std::istream &log,
+              std::vector<int> &recorded,
+              std::vector<int> &replayed);
+
+private:
+  double latency_slo_us;
+  double safety_margin;
+  int min_finetuning_tokens;
+  int increase_step;
+  double smoothing;
+  std::ostream *log;
+
+  double smoothed_latency_us;
+  int finetuning_budget;
+  long iteration;
+};
+
+}; // namespace FlexFlow
+
+#endif // _FLEXFLOW_COSERVING_CONTROLLER_H
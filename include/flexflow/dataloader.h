@@ -17,6 +17,9 @@
 #define __FLEXFLOW_DATALOADER_H__
 
 #include "flexflow/model.h"
+#include "flexflow/utils/epoch_sampler.h"
+#include "flexflow/utils/sharded_record_reader.h"
+#include <memory>
 
 struct NetConfig {
   NetConfig(void);
@@ -45,6 +48,15 @@ public:
                    int num_samples_,
                    DataType datatype_);
 
+  // Streams the samples from shard files of raw records (e.g. written with
+  // numpy's tofile) instead of loading the entire dataset first; only the
+  // next few batches are kept in host memory
+  SingleDataLoader(FlexFlow::FFModel &ff,
+                   FlexFlow::ParallelTensor input,
+                   std::vector<std::string> const &shard_paths,
+                   DataType datatype_,
+                   int num_prefetch_batches = 2);
+
   void next_batch(FlexFlow::FFModel &);
 
   void reset(void);
@@ -92,6 +104,18 @@ public:
       std::vector<Legion::PhysicalRegion> const &regions,
       Legion::Context ctx,
       Legion::Runtime *runtime);
+  template <typename DT>
+  static void
+      load_stream_batch(Legion::Task const *task,
+                        std::vector<Legion::PhysicalRegion> const &regions,
+                        Legion::Context ctx,
+                        Legion::Runtime *runtime);
+  template <typename DT, int NDIM>
+  static void load_stream_batch_with_dim(
+      Legion::Task const *task,
+      std::vector<Legion::PhysicalRegion> const &regions,
+      Legion::Context ctx,
+      Legion::Runtime *runtime);
 
 private:
   template <int NDIM>
@@ -105,8 +129,15 @@ private:
 
 public:
   int num_samples, next_index;
+  // with FFConfig::data_shuffle_seed, the samples of the current epoch in
+  // the order they are loaded in; the streaming reader shuffles by itself
+  int shuffle_seed, epoch;
+  std::vector<size_t> sample_order;
   DataType datatype;
   FlexFlow::ParallelTensor full_input, batch_input;
+  // Only set when streaming, in which case full_input holds one batch
+  std::unique_ptr<FlexFlow::ShardedRecordReader> stream;
+  bool stream_reset_pending;
 };
 
 #define MAX_NUM_SAMPLES 4196
@@ -115,6 +146,11 @@ struct SampleIdxs {
   int idxs[MAX_NUM_SAMPLES];
 };
 
+struct StreamLoadArg {
+  FlexFlow::ShardedRecordReader *reader;
+  bool reset;
+};
+
 struct IndexLoadArg {
   int num_samples;
   size_t size_per_sample;
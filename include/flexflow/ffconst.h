@@ -52,6 +52,15 @@ enum OptimizerType {
   OPTIMIZER_TYPE_ADAM = 62,
 };
 
+// How an embedding op updates its table: through the model's optimizer
+// with a dense gradient, or in its backward pass with the row-sparse
+// gradient of the rows the batch used
+enum EmbeddingUpdateType {
+  EMBEDDING_UPDATE_DENSE = 63,
+  EMBEDDING_UPDATE_SPARSE_SGD = 64,
+  EMBEDDING_UPDATE_ROWWISE_ADAGRAD = 65,
+};
+
 enum CompMode {
   COMP_MODE_TRAINING = 70,
   COMP_MODE_INFERENCE = 71,
@@ -137,6 +137,8 @@ flexflow_tensor_t flexflow_model_get_label_tensor(flexflow_model_t handle);
 
 void flexflow_model_zero_gradients(flexflow_model_t handle);
 
+void flexflow_model_flush_embedding_caches(flexflow_model_t handle);
+
 flexflow_tensor_t flexflow_model_add_exp(flexflow_model_t handle,
                                          const flexflow_tensor_t x,
                                          char const *name);
@@ -235,7 +237,9 @@ flexflow_tensor_t
                                  enum DataType dtype,
                                  flexflow_op_t shared_op,
                                  flexflow_initializer_t kernel_initializer,
-                                 char const *name);
+                                 char const *name,
+                                 enum EmbeddingUpdateType update_type,
+                                 const flexflow_tensor_t lengths);
 
 flexflow_tensor_t
     flexflow_model_add_pool2d(flexflow_model_t handle,
@@ -893,6 +897,14 @@ flexflow_single_dataloader_t
                                        int num_samples,
                                        enum DataType data_type);
 
+flexflow_single_dataloader_t flexflow_single_dataloader_create_streaming(
+    flexflow_model_t ffmodel,
+    flexflow_tensor_t input,
+    char const **shard_paths,
+    int num_shards,
+    int num_prefetch_batches,
+    enum DataType data_type);
+
 void flexflow_single_dataloader_destroy(flexflow_single_dataloader_t handle);
 
 void flexflow_single_dataloader_set_num_samples(
@@ -4,10 +4,14 @@
 // Copyright (c) 2019-2020 zili wang <wzlnot@gmail.com>.
 
 #include <algorithm>
+#include <atomic>
 #include <cctype>
 #include <codecvt>
 #include <fstream>
 #include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <nlohmann/json.hpp>
 #include <regex>
 #include <stdint.h>
@@ -16,6 +20,7 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
+#include <vector>
 
 using json = nlohmann::json;
 
@@ -33,6 +38,85 @@ struct hash_pair {
 
 enum tokenizer_mode { GPT2_TOKENIZER, OPT_TOKENIZER };
 
+// Open-addressing hash table that maps a pair of BPE symbol ids to the rank
+// of their merge and the id of the merged symbol
+class BPEMergeTable {
+public:
+  struct Entry {
+    uint64_t key;
+    uint32_t rank;
+    int32_t merged_id;
+  };
+  void reserve(size_t num_merges);
+  // returns false if the pair is already in the table
+  bool insert(int32_t left, int32_t right, uint32_t rank, int32_t merged_id);
+  Entry const *find(int32_t left, int32_t right) const;
+  size_t size() const {
+    return num_entries;
+  }
+
+private:
+  static uint64_t make_key(int32_t left, int32_t right) {
+    return ((uint64_t)(uint32_t)left << 32) | (uint64_t)(uint32_t)right;
+  }
+  size_t slot_of(uint64_t key) const {
+    return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+  }
+  static const uint64_t EMPTY_KEY = ~0ULL;
+  std::vector<Entry> slots;
+  size_t mask = 0;
+  size_t num_entries = 0;
+};
+
+// Thread-safe cache from the raw bytes of a pre-token to its BPE symbol ids.
+// Words are hashed to one of num_shards shards, each guarded by its own
+// mutex and evicting its least recently used words once the bytes it holds
+// exceed its share of the capacity
+class BPEWordCache {
+public:
+  struct Stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t insertions;
+    uint64_t evictions;
+    size_t num_entries;
+    size_t bytes;
+    size_t capacity_bytes;
+  };
+  BPEWordCache(size_t capacity_bytes, size_t num_shards = 16);
+  // On a hit, appends the cached symbols of word to symbols
+  bool lookup(std::string const &word, std::vector<int32_t> &symbols);
+  void insert(std::string const &word,
+              int32_t const *word_symbols,
+              size_t num_symbols);
+  // Evicts entries as needed to fit the new capacity
+  void set_capacity(size_t capacity_bytes);
+  void clear();
+  Stats get_stats() const;
+  void reset_stats();
+
+private:
+  struct Entry {
+    std::string word;
+    std::vector<int32_t> symbols;
+  };
+  struct Shard {
+    std::mutex mutex;
+    // most recently used entries are at the front
+    std::list<Entry> lru;
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    size_t bytes = 0;
+    size_t capacity_bytes = 0;
+  };
+  static size_t entry_bytes(size_t word_length, size_t num_symbols);
+  Shard &shard_of(std::string const &word);
+  void evict(Shard &shard, size_t capacity_bytes);
+  size_t num_shards;
+  size_t capacity_bytes;
+  std::unique_ptr<Shard[]> shards;
+  std::atomic<uint64_t> hits, misses, insertions, evictions;
+};
+
 class GPT_Tokenizer {
 
 public:
@@ -45,6 +129,9 @@ public:
                 const std::string unk_token_str = "<unk>",
                 const std::string mask_token_str = "<mask>") {
     mode = mode_;
+    bytes_encoder = bytes_to_unicode();
+    unicode_to_bytes();
+    load_char_classes();
     load_vocab(vocab_file);
     load_merge(merge_file);
     bos_token = bos_token_str;
@@ -52,12 +139,20 @@ public:
     pad_token = pad_token_str;
     unk_token = unk_token_str;
     mask_token = mask_token_str;
-    bytes_encoder = bytes_to_unicode();
-    unicode_to_bytes();
+    load_symbol_vocab_ids();
   };
   // ~GPT_Tokenizer();
+  // bpe(), tokenize(), tokenize_symbols(), encode() and decode() may be
+  // called concurrently from multiple threads, which then share the BPE word
+  // cache. The legacy_* methods are not thread-safe
   std::vector<std::string> bpe(std::wstring token);
   std::vector<std::string> tokenize(std::string str);
+  // Tokenize str into BPE symbol ids, without building intermediate strings
+  void tokenize_symbols(std::string const &str, std::vector<int32_t> &symbols);
+  // Reference implementation based on std::regex and per-merge pair sets.
+  // It is only kept to validate and benchmark tokenize()
+  std::vector<std::string> legacy_bpe(std::wstring token);
+  std::vector<std::string> legacy_tokenize(std::string str);
   int32_t convert_token_to_id(std::string token);
   void encode(std::string str,
               size_t max_length,
@@ -72,17 +167,40 @@ public:
   std::string unk_token;
   std::string mask_token;
   std::string strip(std::string const &inpt);
+  BPEWordCache::Stats get_cache_stats() const {
+    return cache.get_stats();
+  }
+  void set_cache_capacity(size_t capacity_bytes) {
+    cache.set_capacity(capacity_bytes);
+  }
 
 private:
   std::unordered_map<std::string, int32_t> vocab;
   std::unordered_map<int32_t, std::string> inverse_vocab;
   std::unordered_map<wbigram_pair, uint32_t, hash_pair> bpe_ranks;
+  // BPE symbols are identified by the raw bytes they cover; ids 0-255 are
+  // the single-byte symbols
+  std::unordered_map<std::string, int32_t> symbol_ids;
+  std::vector<std::string> symbol_tokens;
+  std::vector<int32_t> symbol_vocab_ids;
+  BPEMergeTable merge_table;
+  enum char_class { CHAR_WHITESPACE, CHAR_LETTER, CHAR_NUMBER, CHAR_OTHER };
+  std::vector<std::pair<uint32_t, uint32_t>> letter_ranges, number_ranges;
+  char_class classify(uint32_t codepoint) const;
+  size_t pre_tokenize_next(std::string const &str, size_t pos) const;
+  void bpe_symbols(char const *data,
+                   size_t length,
+                   std::vector<int32_t> &symbols);
+  int32_t get_symbol_id(std::string const &raw_bytes);
+  void load_char_classes();
+  void load_symbol_vocab_ids();
   wchar_t *bytes_to_unicode();
   void unicode_to_bytes();
   wchar_t *bytes_encoder;
   std::unordered_map<wchar_t, char> bytes_decoder;
   uint32_t cache_max_size = 500000;
   uint32_t cache_word_max_length = 30;
+  static const size_t default_cache_capacity_bytes = 64 * 1024 * 1024;
   std::string unicode_letter_expr =
       "\\u0041-\\u005A\\u0061-\\u007A\\u00AA-\\u00AA\\u00B5-\\u00B5"
       "\\u00BA-\\u00BA\\u00C0-\\u00D6\\u00D8-\\u00F6\\u00F8-\\u02C1"
@@ -205,7 +323,8 @@ private:
       unicode_number_expr + "]+|\\s+(?!\\S)|\\s+");
 
   const std::wregex pat = std::wregex(wpat_expr);
-  std::unordered_map<std::wstring, std::vector<std::string>> cache;
+  BPEWordCache cache{default_cache_capacity_bytes};
+  std::unordered_map<std::wstring, std::vector<std::string>> legacy_cache;
   void load_vocab(std::string const &vocab_file);
   void load_merge(std::string const &merge_file);
 
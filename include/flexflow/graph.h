@@ -123,6 +123,8 @@ struct GraphCostResultWithMemory {
   MemoryUsage mem_cost; ///< Memory usage
   ///< Corresponding machine views (device placement views)
   std::unordered_map<Node, MachineView> views;
+  ///< Operators whose outputs are recomputed in the backward pass
+  std::unordered_set<Node> recomputed;
 
   /**
    * @brief Get the multi-objective cost that combines the run time and memory
@@ -254,6 +256,8 @@ public:
 
 public:
   mutable std::unique_ptr<RecursiveLogger> logger;
+  ///< Weighs the run time of recomputing outputs against their memory
+  MemoryOptimConfig mem_config;
 
   void clear_cache();
 
@@ -369,6 +373,9 @@ public:
   FFModel *model;
   SearchHelper *search;
   std::unordered_map<Node, std::unordered_set<Edge>> inEdges, outEdges;
+  ///< Operators the memory-aware search chose to recompute the outputs of in
+  ///< the backward pass, instead of keeping them from the forward pass
+  std::unordered_set<Node> recomputed_nodes;
 
 private:
   void remove_inverse_parallel_ops();
@@ -393,6 +400,8 @@ struct GraphOptimizeResultWithMemory {
   MemoryUsage mem_cost;      ///< Memory usage
   ///< Corresponding machine views (device placement views)
   std::unordered_map<Node, MachineView> views;
+  ///< Operators whose outputs are recomputed in the backward pass
+  std::unordered_set<Node> recomputed;
 
   friend std::ostream &operator<<(std::ostream &,
                                   GraphOptimizeResultWithMemory const &);
@@ -33,7 +33,7 @@ public:
                             std::vector<Legion::PhysicalRegion> const &regions,
                             Legion::Context ctx,
                             Legion::Runtime *runtime);
-  template <int NDIM>
+  template <typename DT, int NDIM>
   static void
       backward_task_with_dim(Legion::Task const *task,
                              std::vector<Legion::PhysicalRegion> const &regions,
@@ -46,9 +46,11 @@ public:
   void backward_with_dim(FFModel *model,
                          const ParallelTensor logit,
                          const ParallelTensor label);
+  // The kernels compute in FP32 whatever the type DT of the logits
+  template <typename DT>
   static void sparse_categorical_crossentropy_loss_backward_kernel_wrapper(
-      float *logit_grad_ptr,
-      float const *logit_ptr,
+      DT *logit_grad_ptr,
+      DT const *logit_ptr,
       int const *label_ptr,
       size_t logit_volume,
       size_t logit_grad_volume,
@@ -56,22 +58,25 @@ public:
       int num_classes,
       int k,
       float scale_factor);
+  template <typename DT>
   static void categorical_crossentropy_loss_backward_kernel_wrapper(
-      float *logit_grad_ptr,
-      float const *logit_ptr,
+      DT *logit_grad_ptr,
+      DT const *logit_ptr,
       float const *label_ptr,
       size_t logit_volume,
       size_t logit_grad_volume,
       float scale_factor);
+  template <typename DT>
   static void mean_squared_error_avg_loss_backward_kernel_wrapper(
-      float *logit_grad_ptr,
-      float const *logit_ptr,
+      DT *logit_grad_ptr,
+      DT const *logit_ptr,
       float const *label_ptr,
       size_t logit_volume,
       size_t logit_grad_volume,
       float scale_factor);
-  static void identity_loss_backward_kernel_wrapper(float *loss_grad_ptr,
-                                                    float const *loss_ptr,
+  template <typename DT>
+  static void identity_loss_backward_kernel_wrapper(DT *loss_grad_ptr,
+                                                    DT const *loss_ptr,
                                                     size_t loss_volume,
                                                     size_t loss_grad_volume,
                                                     float scale_factor);
@@ -83,6 +88,8 @@ public:
   // scale factor for computing the logit gradients
   // normally 1.0f / global_batch_size
   float scale_factor;
+  // type of the logits (DT_FLOAT or DT_HALF)
+  DataType data_type;
 };
 
 }; // namespace FlexFlow
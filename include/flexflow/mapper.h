@@ -313,6 +313,7 @@ private: // Default helper functions
                              RegionRequirement const &req,
                              bool &created,
                              size_t *footprint);
+  bool is_discardable_region(MapperContext ctx, LogicalRegion region);
   LayoutConstraintID
       default_select_layout_constraints(MapperContext ctx,
                                         Memory target_memory,
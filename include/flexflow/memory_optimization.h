@@ -17,6 +17,7 @@
 #define _FLEXFLOW_MEMORY_OPTIMIZATION_H_
 
 #include <cassert>
+#include <cstddef>
 #include <string>
 
 namespace FlexFlow {
@@ -61,6 +62,29 @@ public:
         run_time_cost_factor{factor} {}
 };
 
+/**
+ * @brief Bytes of the FP32 optimizer states of a weight of num_elements
+ * elements (counting all its replicas).
+ * @details Every replica keeps num_states states per element, unless the
+ * states are sharded, in which case the replicas each keep the states of a
+ * 1/num_replicas slice of the weight.
+ */
+size_t optimizer_states_memory(size_t num_elements,
+                               int num_replicas,
+                               int num_states,
+                               bool sharded);
+
+/**
+ * @brief Whether the memory-aware search should recompute the outputs of an
+ * operator in the backward pass instead of keeping them from the forward pass.
+ * @details Recomputing costs forward_time more run time and saves
+ * output_mem_mb, weighed by run_time_cost_factor as in the multi-objective
+ * cost of Graph::optimal_cost_with_memory.
+ */
+bool should_recompute_outputs(MemoryOptimConfig const &config,
+                              float forward_time,
+                              float output_mem_mb);
+
 /**
  * @brief Hold the result (including memory information) of a graph_optimize on
  * a PCG.
@@ -21,6 +21,7 @@
 #include "flexflow/memory_optimization.h"
 #include "flexflow/node.h"
 #include "flexflow/operator_params.h"
+#include "flexflow/utils/gradient_buckets.h"
 #include "flexflow/utils/hash_utils.h"
 #include "flexflow/utils/memory_allocator.h"
 #include "flexflow/utils/tuple.h"
@@ -76,6 +77,7 @@ enum TaskIDs {
   EMBED_FWD_TASK_ID,
   EMBED_INF_TASK_ID,
   EMBED_BWD_TASK_ID,
+  EMBED_CACHE_FLUSH_TASK_ID,
   GATHER_INIT_TASK_ID,
   GATHER_FWD_TASK_ID,
   GATHER_BWD_TASK_ID,
@@ -210,9 +212,18 @@ enum TaskIDs {
   // Optimizer with PS
   SGD_UPD_PS_TASK_ID,
   ADAM_UPD_PS_TASK_ID,
+  SGD_UPD_FUSED_PS_TASK_ID,
+  ADAM_UPD_FUSED_PS_TASK_ID,
   // Optimizer with NCCL
   SGD_UPD_NCCL_TASK_ID,
   ADAM_UPD_NCCL_TASK_ID,
+  SGD_UPD_FUSED_NCCL_TASK_ID,
+  ADAM_UPD_FUSED_NCCL_TASK_ID,
+  GRADIENT_ALLREDUCE_TASK_ID,
+  // Mixed precision
+  AMP_UNSCALE_GRAD_TASK_ID,
+  AMP_UPDATE_LOSS_SCALE_TASK_ID,
+  AMP_CONVERT_WEIGHT_TASK_ID,
   // Initializer
   GLOROT_INIT_TASK_ID,
   ZERO_INIT_TASK_ID,
@@ -234,6 +245,9 @@ enum TaskIDs {
   PY_DL_FLOAT_INDEX_LOAD_ENTIRE_CPU_TASK_ID,
   PY_DL_INT32_INDEX_LOAD_ENTIRE_CPU_TASK_ID,
   PY_DL_INT64_INDEX_LOAD_ENTIRE_CPU_TASK_ID,
+  PY_DL_FLOAT_LOAD_STREAM_CPU_TASK_ID,
+  PY_DL_INT32_LOAD_STREAM_CPU_TASK_ID,
+  PY_DL_INT64_LOAD_STREAM_CPU_TASK_ID,
   PY_DL_FLOAT_LOAD_BATCH_GPU_TASK_ID,
   PY_DL_INT32_LOAD_BATCH_GPU_TASK_ID,
   PY_DL_INT64_LOAD_BATCH_GPU_TASK_ID,
@@ -273,6 +287,7 @@ enum TaskIDs {
   RM_LOAD_TOKENS_TASK_ID,
   RM_LOAD_POSITION_TASK_ID,
   RM_LOAD_BATCH_CONFIG_TASK_ID,
+  RM_PLAN_NEXT_BATCH_TASK_ID,
   RM_PREPARE_NEXT_BATCH_TASK_ID,
   RM_PREPARE_NEXT_BATCH_INIT_TASK_ID,
   RM_PREPARE_NEXT_BATCH_BEAM_TASK_ID,
@@ -527,7 +542,9 @@ public:
                  float rate,
                  unsigned long long seed = 0,
                  char const *name = NULL);
-  // Add an embedding layer
+  // Add an embedding layer. With aggregation, each sample of input is a bag
+  // of input->dims[0] indices, or of only the first lengths[b] of them for
+  // ragged bags if an int32 lengths tensor with one entry per bag is given
   Tensor embedding(const Tensor input,
                    int num_entries,
                    int outDim,
@@ -535,7 +552,9 @@ public:
                    DataType dtype = DT_FLOAT,
                    Layer const *shared_op = NULL,
                    Initializer *kernel_initializer = NULL,
-                   char const *name = NULL);
+                   char const *name = NULL,
+                   EmbeddingUpdateType update_type = EMBEDDING_UPDATE_DENSE,
+                   const Tensor lengths = NULL);
   // Add a gather layer
   Tensor gather(const Tensor input,
                 const Tensor index,
@@ -1118,7 +1137,16 @@ public:
 #ifdef FF_USE_NCCL
   ncclComm_t *find_nccl_comms(MachineView const &view) const;
   void finish_nccl_comms();
+  // Splits the NCCL-synchronized parameters into gradient buckets of
+  // config.gradient_bucket_size bytes
+  void create_gradient_buckets();
 #endif
+  void all_reduce_gradient_bucket(int bucket);
+  // Discards the outputs of op, which the memory-aware search chose to
+  // recompute in the backward pass
+  void discard_outputs(Op const *op);
+  // Reruns the forward pass of op, and of the discarded operators it reads
+  void recompute_outputs(Op *op);
 #ifdef FF_USE_PROPAGATE
   void propagate(std::map<Op *, ParallelConfig> const &current,
                  std::map<Op *, ParallelConfig> &next) const;
@@ -1128,6 +1156,9 @@ public:
                bool use_propagation) const;
   void recompile_on_condition(RecompileState &r);
   void zero_gradients();
+  // Writes the rows updated in the device caches of host-resident embedding
+  // tables back to the tables, e.g. before reading their weights
+  void flush_embedding_caches();
   void print_layers(int id);
 
   std::unordered_map<Op *, std::vector<std::pair<Op *, int>>>
@@ -1178,6 +1209,17 @@ public:
   std::vector<Layer *> layers;
   std::vector<Op *> operators;
   std::vector<ParallelTensor> parameters;
+  // Gradients all-reduced while the backward pass runs, by parameter id of
+  // gradient_buckets
+  GradientBuckets gradient_buckets;
+  std::vector<ParallelTensor> bucketed_parameters;
+  std::map<ParallelTensor, int> bucketed_parameter_ids;
+  // The last bucket all-reduce launched, which the next one waits for
+  FutureMap last_bucket_all_reduce;
+  Domain last_bucket_domain;
+  // Operators whose outputs are discarded until the backward pass
+  // recomputes them
+  std::set<Op *> discarded_operators;
   // PEFT related
   std::unordered_map<Layer *, Layer *> base_layer_to_peft_layer;
   std::unordered_map<Layer *, std::vector<PEFTModelID>> peft_layer_to_peft_id;
@@ -1186,6 +1228,8 @@ public:
 
   FFHandler handlers[MAX_NUM_WORKERS];
   Legion::Future current_metrics;
+  // the LossScaler of mixed precision training
+  Legion::Future loss_scaler;
   // Cached operators: key: operator hash, value: operator pointer
   std::tuple<
       std::unordered_map<
@@ -1211,8 +1255,9 @@ public:
           ElementBinary *>,
       std::unordered_map<std::pair<ParallelTensorShape, ElementUnaryParams>,
                          ElementUnary *>,
-      std::unordered_map<std::pair<ParallelTensorShape, EmbeddingParams>,
-                         Embedding *>,
+      std::unordered_map<
+          std::pair<std::vector<ParallelTensorShape>, EmbeddingParams>,
+          Embedding *>,
       std::unordered_map<
           std::pair<std::vector<ParallelTensorShape>, ExpertsParams>,
           Experts *>,
@@ -0,0 +1,150 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FLEXFLOW_NGRAM_DRAFTER_H
+#define _FLEXFLOW_NGRAM_DRAFTER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace FlexFlow {
+
+// Index over a list of token sequences ("documents") that maps each n-gram of
+// min_order to max_order tokens to its most recent occurrences. Tokens can be
+// appended to the last document one at a time, so the same structure indexes
+// a request's own (growing) context and a static corpus shared by requests.
+// N-grams never span two documents.
+class NgramIndex {
+public:
+  using TokenId = int;
+  inline static uint32_t const NONE = UINT32_MAX;
+
+  NgramIndex(int min_order, int max_order);
+  void start_document();
+  void append(TokenId token);
+  void add_document(TokenId const *tokens, size_t num_tokens);
+
+  int get_min_order() const {
+    return min_order;
+  }
+  int get_max_order() const {
+    return max_order;
+  }
+  size_t num_tokens() const {
+    return tokens.size();
+  }
+  size_t num_documents() const {
+    return document_starts.size();
+  }
+  TokenId token(size_t pos) const {
+    return tokens[pos];
+  }
+  // Number of tokens from pos to the end of the document containing pos
+  size_t continuation_length(size_t pos) const;
+
+  // Appends to positions the positions right after the max_results most
+  // recent occurrences of ngram[0..n) that are followed by at least one
+  // token in their document, newest first
+  void lookup(TokenId const *ngram,
+              int n,
+              size_t max_results,
+              std::vector<size_t> &positions) const;
+
+  // Reserve space for num_tokens more tokens
+  void reserve(size_t num_tokens);
+
+private:
+  // Open-addressing hash table slot; key 0 marks an empty slot
+  struct Slot {
+    uint64_t key;
+    uint32_t end;
+  };
+  static uint64_t hash(TokenId const *ngram, int n);
+  Slot &find_slot(uint64_t key);
+  Slot const *find_slot(uint64_t key) const;
+  void grow_table();
+
+  int min_order, max_order;
+  std::vector<TokenId> tokens;
+  std::vector<size_t> document_starts;
+  // n-gram hash -> end position of its last occurrence, for all orders
+  std::vector<Slot> table;
+  size_t num_keys;
+  // prev[n - min_order][p]: end position of the previous occurrence of the
+  // n-gram ending at p, or NONE
+  std::vector<std::vector<uint32_t>> prev;
+};
+
+// Proposes token trees for speculative inference without a draft model, by
+// looking up the last tokens of a request in an index of its own context
+// (prompt lookup) and in an optional corpus index shared by all requests.
+// Every occurrence of the longest matching suffixes contributes the tokens
+// that followed it; the continuations are merged into a trie, and the
+// max_tokens trie nodes supported by the most (and longest) matches form the
+// proposed tree.
+class NgramDrafter {
+public:
+  using TokenId = NgramIndex::TokenId;
+  using RequestGuid = size_t;
+  struct Config {
+    int min_order = 2;
+    int max_order = 4;
+    // occurrences of each suffix used to build a tree
+    int max_matches = 8;
+    // maximum number of children of a tree node
+    int max_width = 3;
+    // maximum number of speculated tokens in a tree
+    int max_tokens = 24;
+    // weight of a corpus match relative to a match in the request's context
+    double corpus_weight = 0.5;
+  };
+
+  NgramDrafter();
+  explicit NgramDrafter(Config const &config);
+  Config const &get_config() const {
+    return config;
+  }
+  void set_corpus(std::shared_ptr<NgramIndex const> corpus);
+  // Builds a corpus index with the drafter's n-gram orders
+  std::shared_ptr<NgramIndex>
+      build_corpus(std::vector<std::vector<TokenId>> const &documents) const;
+
+  // Returns a token tree continuing context as (token, depth) pairs in DFS
+  // order, where the children of the last context token have depth 1. Tokens
+  // of context that were not seen by previous calls for guid are added to
+  // the request's index first, so context must only grow between calls.
+  std::vector<std::pair<TokenId, int>>
+      propose(RequestGuid guid,
+              std::vector<TokenId> const &context,
+              int max_depth,
+              int max_width);
+  void remove_request(RequestGuid guid);
+  size_t num_requests() const {
+    return request_indices.size();
+  }
+
+private:
+  Config config;
+  std::shared_ptr<NgramIndex const> corpus;
+  std::unordered_map<RequestGuid, std::unique_ptr<NgramIndex>> request_indices;
+};
+
+}; // namespace FlexFlow
+
+#endif // _FLEXFLOW_NGRAM_DRAFTER_H
@@ -432,6 +432,12 @@ public:
   virtual bool has_inplace_output();
   virtual void do_inplace_output();
   virtual bool is_parallel_op() const;
+  // Whether the backward pass updates the weights itself, in which case the
+  // optimizer skips them and they have no gradients
+  virtual bool updates_weights_in_backward() const;
+  // Whether the forward pass can run again in the backward pass to recompute
+  // the outputs, which requires it to only read its inputs and weights
+  virtual bool can_recompute_outputs() const;
   virtual void serialize(Legion::Serializer &) const;
   virtual Op *
       materialize(FFModel &ff, ParallelTensor inputs[], int num_inputs) const;
@@ -500,6 +506,9 @@ public:
   bool profiling;
   bool inference_debugging;
   bool add_bias_only_once;
+  // Set when the outputs are discarded after the forward pass and recomputed
+  // in the backward pass (see FFModel::backward)
+  bool recompute_outputs = false;
 #ifdef FF_USE_NCCL
   ncclUniqueId ncclId;
 #endif
@@ -65,6 +65,7 @@ public:
   bool can_inplace_output() override;
   bool has_inplace_output() override;
   void do_inplace_output() override;
+  bool can_recompute_outputs() const override;
   static Op *
       create_operator_from_layer(FFModel &model,
                                  Layer const *layer,
@@ -24,28 +24,45 @@ enum { OUT_CHANNELS = 0 };
 };
 
 class Embedding;
+class EmbeddingMeta;
+
+// Arguments of the forward and backward tasks that are not part of the
+// EmbeddingMeta, which the CPU variants run without
+struct EmbeddingTaskArgs {
+  AggrMode aggr;
+  DataType input_type;
+  // the last region holds the lengths of ragged bags
+  bool has_lengths;
+  int num_threads;
+  // hyperparameters of the sparse update applied by the backward task
+  EmbeddingUpdateType update_type;
+  float lr, weight_decay, epsilon;
+};
 
 class Embedding : public Op {
 public:
   using Params = EmbeddingParams;
-  using Input = ParallelTensor;
+  // the indices, optionally followed by the lengths of ragged bags
+  using Input = std::vector<ParallelTensor>;
 
   Embedding(FFModel &model,
             LayerID const &_layer_guid,
             const ParallelTensor _input,
+            const ParallelTensor _lengths,
             int _num_entries,
             int _out_channels,
             AggrMode _aggr,
+            EmbeddingUpdateType _update_type,
             bool allocate_weights,
             DataType _dtype,
             char const *name);
   Embedding(FFModel &model,
             Embedding const &other,
-            const ParallelTensor input,
+            Input const &inputs,
             bool allocate_weights);
   Embedding(FFModel &model,
             Params const &params,
-            Input const input,
+            Input const &inputs,
             bool allocate_weights = false,
             char const *name = nullptr);
   void init(FFModel const &) override;
@@ -69,6 +86,9 @@ public:
   void print_layer(FFModel const &model) override {
     assert(0);
   }
+  bool updates_weights_in_backward() const override;
+  // Writes the rows updated in the device cache back to the table
+  void flush_cache(FFModel const &ff);
   // Parameter* get_parameter(int index);
   // void create_weights(FFModel& model);
   // void create_input_partition(FFModel& model);
@@ -103,6 +123,11 @@ public:
                         std::vector<Legion::PhysicalRegion> const &regions,
                         Legion::Context ctx,
                         Legion::Runtime *runtime);
+  static void
+      flush_cache_task(Legion::Task const *task,
+                       std::vector<Legion::PhysicalRegion> const &regions,
+                       Legion::Context ctx,
+                       Legion::Runtime *runtime);
 
   bool measure_operator_cost(Simulator *sim,
                              MachineView const &pc,
@@ -129,6 +154,20 @@ private:
   int input_channel_out_replica_dim() const;
   int output_vocab_size_replica_dim() const;
 
+  EmbeddingTaskArgs get_task_args(FFModel const &ff) const;
+  static void
+      sparse_backward_task(EmbeddingMeta *m,
+                           EmbeddingTaskArgs const *args,
+                           std::vector<Legion::PhysicalRegion> const &regions,
+                           Legion::Task const *task,
+                           Legion::Context ctx,
+                           Legion::Runtime *runtime);
+  static void sparse_backward_task_cpu(
+      EmbeddingTaskArgs const *args,
+      std::vector<Legion::PhysicalRegion> const &regions,
+      Legion::Task const *task,
+      Legion::Context ctx,
+      Legion::Runtime *runtime);
   int output_size(ParallelDim output_dims[MAX_TENSOR_DIM]);
   int weight_size(ParallelDim weights_dims[MAX_TENSOR_DIM]);
 
@@ -139,6 +178,12 @@ private:
 public:
   int num_entries, out_channels;
   AggrMode aggr;
+  EmbeddingUpdateType update_type;
+  // per-row accumulators of EMBEDDING_UPDATE_ROWWISE_ADAGRAD
+  Legion::LogicalRegion adagrad_state;
+  // Tables with more rows than FFConfig::embedding_cache_rows stay in host
+  // memory, and each GPU caches cache_rows of them (0 if not cached)
+  int cache_rows, cache_admit_threshold;
 };
 
 }; // namespace FlexFlow
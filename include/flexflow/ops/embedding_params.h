@@ -11,10 +11,11 @@ struct EmbeddingParams {
   int num_entries, out_channels;
   LayerID layer_guid;
   AggrMode aggr;
+  EmbeddingUpdateType update_type;
   DataType data_type;
   char name[MAX_OPNAME];
 
-  bool is_valid(ParallelTensorShape const &) const;
+  bool is_valid(std::vector<ParallelTensorShape> const &) const;
 };
 bool operator==(EmbeddingParams const &, EmbeddingParams const &);
 
@@ -222,7 +222,11 @@ public:
   // PEFT specific fields
   void *softmax_activation_buffer;
   void *query_activation_buffer;
-  size_t allocated_peft_buffer_size1 = 0, allocated_peft_buffer_size2 = 0;
+  // gradients of the keys and values of the earlier chunks of a finetuning
+  // entry, until these chunks run their backward pass
+  void *kv_grad_buffer = nullptr;
+  size_t allocated_peft_buffer_size1 = 0, allocated_peft_buffer_size2 = 0,
+         allocated_peft_buffer_size3 = 0;
 };
 
 }; // namespace FlexFlow
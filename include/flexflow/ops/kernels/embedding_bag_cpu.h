@@ -0,0 +1,78 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FLEXFLOW_OPS_KERNELS_EMBEDDING_BAG_CPU_H
+#define _FLEXFLOW_OPS_KERNELS_EMBEDDING_BAG_CPU_H
+
+#include "flexflow/ffconst.h"
+#include <cstdint>
+
+namespace FlexFlow {
+namespace Kernels {
+namespace EmbeddingBagCPU {
+
+// Instruction sets of the row kernels. The AVX2 and AVX-512 variants are
+// compiled with per-function target attributes and picked at run time, so
+// they need neither FF_USE_AVX2 nor -m flags; a requested instruction set
+// the CPU lacks falls back to the best one it has.
+enum Isa {
+  ISA_SCALAR = 0,
+  ISA_AVX2 = 1,
+  ISA_AVX512 = 2,
+  ISA_AUTO = 3,
+};
+
+Isa best_isa();
+char const *isa_name(Isa isa);
+
+// Pools the rows of weight (num_rows x block_size, row major) selected by
+// num_bags bags, where bag b holds the next lengths[b] entries of indices,
+// and writes the sum (AGGR_MODE_SUM) or mean (AGGR_MODE_AVG) of bag b to
+// row b of output. Empty bags produce zeros. Bags are split between
+// num_threads threads by number of indices; the threads other than the
+// calling one come from a pool kept across calls.
+template <typename TI>
+void forward(TI const *indices,
+             int const *lengths,
+             int num_bags,
+             float const *weight,
+             int64_t num_rows,
+             int block_size,
+             AggrMode aggr,
+             float *output,
+             int num_threads = 1,
+             Isa isa = ISA_AUTO);
+
+// Adds row b of output_grad (divided by lengths[b] for AGGR_MODE_AVG) to
+// the rows of weight_grad selected by bag b. Threads own disjoint ranges of
+// rows and visit the bags in order, so the result does not depend on
+// num_threads.
+template <typename TI>
+void backward(TI const *indices,
+              int const *lengths,
+              int num_bags,
+              float const *output_grad,
+              int64_t num_rows,
+              int block_size,
+              AggrMode aggr,
+              float *weight_grad,
+              int num_threads = 1,
+              Isa isa = ISA_AUTO);
+
+} // namespace EmbeddingBagCPU
+} // namespace Kernels
+} // namespace FlexFlow
+
+#endif // _FLEXFLOW_OPS_KERNELS_EMBEDDING_BAG_CPU_H
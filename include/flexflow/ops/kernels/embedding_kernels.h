@@ -5,6 +5,7 @@
 #include "flexflow/device.h"
 #include "flexflow/fftype.h"
 #include "flexflow/op_meta.h"
+#include "flexflow/utils/embedding_cache.h"
 
 namespace FlexFlow {
 
@@ -13,24 +14,85 @@ public:
   EmbeddingMeta(FFHandler handle, Op const *op);
   DataType input_data_type;
   AggrMode aggr;
+  // scratch space of sparse_backward_kernel_wrapper, grown on demand
+  void *sparse_workspace;
+  size_t sparse_workspace_size;
+  // Slots of the rows of a host-resident table cached on this GPU (null if
+  // the table is on the device). cache_table holds the cached rows followed
+  // by the transient rows of the current batch, and cache_slot_rows the
+  // table row of each of them.
+  EmbeddingCache *cache;
+  float *cache_table;
+  int64_t *cache_slot_rows;
+  int cache_capacity;
+  // slots of the indices of the last forward batch
+  int *cache_slots;
+  size_t cache_num_slots;
+  EmbeddingCache::Transfer *cache_transfers;
+  size_t cache_transfer_capacity;
 };
 
 namespace Kernels {
 namespace Embedding {
+// With aggregation, each of the batch_size bags holds in_dim entries of
+// input, or only the first lengths[b] of them when lengths (a device array
+// of batch_size ints) is not null
 void forward_kernel_wrapper(EmbeddingMeta const *m,
                             GenericTensorAccessorR const &input,
                             GenericTensorAccessorW const &output,
                             GenericTensorAccessorR const &weight,
                             int in_dim,
                             int out_dim,
-                            int batch_size);
+                            int batch_size,
+                            int const *lengths = nullptr);
 void backward_kernel_wrapper(EmbeddingMeta const *m,
                              GenericTensorAccessorR const &input,
                              GenericTensorAccessorR const &output,
                              GenericTensorAccessorW const &weight_grad,
                              int in_dim,
                              int out_dim,
-                             int batch_size);
+                             int batch_size,
+                             int const *lengths = nullptr);
+// Applies the gradient of the rows the batch touched directly to weight,
+// with SGD or, when adagrad_state is not null, with row-wise Adagrad
+void sparse_backward_kernel_wrapper(EmbeddingMeta *m,
+                                    GenericTensorAccessorR const &input,
+                                    GenericTensorAccessorR const &output_grad,
+                                    GenericTensorAccessorW const &weight,
+                                    float *adagrad_state,
+                                    int in_dim,
+                                    int out_dim,
+                                    int batch_size,
+                                    int64_t num_rows,
+                                    float lr,
+                                    float weight_decay,
+                                    float epsilon);
+
+// Looks up the rows of the batch in m->cache, copying the missing rows in
+// from the host-resident table (and evicted rows that were updated back to
+// it) before pooling them from the cache
+void cached_forward_kernel_wrapper(EmbeddingMeta *m,
+                                   GenericTensorAccessorR const &input,
+                                   GenericTensorAccessorW const &output,
+                                   GenericTensorAccessorW const &table,
+                                   int in_dim,
+                                   int out_dim,
+                                   int batch_size,
+                                   bool update);
+// sparse_backward_kernel_wrapper for the rows the last forward batch cached
+void cached_sparse_backward_kernel_wrapper(
+    EmbeddingMeta *m,
+    GenericTensorAccessorR const &output_grad,
+    GenericTensorAccessorW const &table,
+    float *adagrad_state,
+    int in_dim,
+    int out_dim,
+    int batch_size,
+    float lr,
+    float weight_decay,
+    float epsilon);
+void flush_cache_kernel_wrapper(EmbeddingMeta *m,
+                                GenericTensorAccessorW const &table);
 
 void rand_generate_int64_wrapper(int64_t *ptr, size_t size, int64_t p);
 void rand_generate_int32_wrapper(int32_t *ptr, size_t size, int32_t p);
@@ -43,6 +105,7 @@ void forward_kernel(TI const *input_ptr,
                     int in_dim,
                     int out_dim,
                     int batch_size,
+                    int const *lengths,
                     AggrMode aggr,
                     int outputSize,
                     ffStream_t stream);
@@ -54,9 +117,45 @@ void backward_kernel(TI const *input_ptr,
                      int in_dim,
                      int out_dim,
                      int batch_size,
+                     int const *lengths,
                      AggrMode aggr,
                      int outputSize,
                      ffStream_t stream);
+template <typename TI>
+void sparse_backward_kernel(EmbeddingMeta *m,
+                            TI const *input_ptr,
+                            float const *output_grad_ptr,
+                            float *weight_ptr,
+                            float *adagrad_state_ptr,
+                            int in_dim,
+                            int out_dim,
+                            int batch_size,
+                            int64_t num_rows,
+                            AggrMode aggr,
+                            float lr,
+                            float weight_decay,
+                            float epsilon,
+                            int64_t const *state_rows,
+                            ffStream_t stream);
+// Copies the rows listed in transfers from the table to m->cache_table if
+// to_cache is set, and back to the table otherwise
+void copy_cache_rows(EmbeddingMeta *m,
+                     std::vector<EmbeddingCache::Transfer> const &transfers,
+                     bool to_cache,
+                     float *table,
+                     int out_dim,
+                     ffStream_t stream);
+__global__ void embed_cache_load(EmbeddingCache::Transfer const *transfers,
+                                 int num_transfers,
+                                 int out_dim,
+                                 float const *table,
+                                 float *cache,
+                                 int64_t *slot_rows);
+__global__ void embed_cache_store(EmbeddingCache::Transfer const *transfers,
+                                  int num_transfers,
+                                  int out_dim,
+                                  float const *cache,
+                                  float *table);
 template <typename TD>
 __global__ void rand_generate_int(TD *ptr, size_t size, TD p);
 } // namespace Internal
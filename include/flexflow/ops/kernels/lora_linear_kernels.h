@@ -26,6 +26,13 @@ struct LoraLinearModelState {
   std::string cache_folder;
   // Huggingface model ID (for download and/or upload)
   std::string peft_model_id;
+  // Inference-only adapters are paged through the PEFT weight allocator's
+  // adapter pool when it is enabled. w0 and w1 then share one pool block and
+  // are only valid during the inference task that acquired them; their host
+  // copy is read from the weight files on first use.
+  int paged_block = -1;
+  std::string w0_filepath, w1_filepath;
+  std::vector<char> host_weights;
 };
 
 class LoraLinearMeta : public OpMeta {
@@ -42,6 +49,9 @@ public:
 namespace Kernels {
 namespace LoraLinear {
 void init_kernel_wrapper(LoraLinearMeta *m, int seed);
+// Copies paged weights on the task stream, from host memory when an adapter
+// is loaded into the pool or within the pool when it is compacted
+void copy_paged_weights(void *dst, void const *src, size_t num_bytes);
 void inference_kernel_wrapper(LoraLinearMeta *m,
                               BatchConfig const *bc,
                               GenericTensorAccessorR const &input,
@@ -45,6 +45,7 @@ public:
   void print_layer(FFModel const &model) override {
     assert(0);
   }
+  bool can_recompute_outputs() const override;
   static Op *
       create_operator_from_layer(FFModel &model,
                                  Layer const *layer,
@@ -123,6 +123,12 @@ public:
   // parameters only used to upload model after finetuning
   std::string base_model_name_or_path;
   std::string precision;
+  // whether to continue finetuning from the latest complete checkpoint under
+  // finetuned_models/<peft_model_id>/checkpoints, if there is one
+  bool resume_from_checkpoint = false;
+  // training step of the checkpoint the weights are loaded from (set when
+  // the adapter is added to the model), or -1
+  int resume_training_step = -1;
 };
 
 class LoraLinearParams {
@@ -16,7 +16,10 @@
 #ifndef _FLEXFLOW_OPTIMIZER_H_
 #define _FLEXFLOW_OPTIMIZER_H_
 
+#include "flexflow/accessor.h"
 #include "flexflow/parallel_tensor.h"
+#include "flexflow/utils/loss_scaler.h"
+#include "flexflow/utils/multi_tensor_update.h"
 #include "legion.h"
 
 namespace FlexFlow {
@@ -30,7 +33,66 @@ public:
   virtual void init(void) = 0;
   virtual void next(void) = 0;
   virtual void update(const ParallelTensor p) = 0;
+  // Updates params with one task per device for each group of parameters
+  // that share a sync type and a machine view, instead of one per parameter
+  virtual void fused_update(std::vector<ParallelTensor> const &params) = 0;
+  // Number of states the optimizer keeps for each weight element
+  virtual int num_states(void) const = 0;
+#ifdef FF_USE_NCCL
+  // All-reduces the gradients of one bucket (see FFModel::backward)
+  static void
+      nccl_all_reduce_task(Legion::Task const *task,
+                           std::vector<Legion::PhysicalRegion> const &regions,
+                           Legion::Context ctx,
+                           Legion::Runtime *runtime);
+  static void
+      nccl_all_reduce_task_gpu(OpMeta const *meta,
+                               std::vector<MultiTensorEntry> const &gradients);
+#endif
+  // Mixed precision training (see FFConfig::mixed_precision) updates an FP32
+  // master copy of each half precision parameter
+  void init_master_weights();
+  // Returns the tensor the optimizer updates for parameter p
+  ParallelTensor get_master_weight(const ParallelTensor p) const;
+  // Unscales the gradients of all parameters into FP32, and returns
+  // loss_scaler updated with whether any of them overflowed. The update
+  // tasks skip the step if so.
+  Legion::Future unscale_gradients(Legion::Future const &loss_scaler);
+  // Copies the updated master weights into the half precision weights
+  void copy_master_weights();
+  static bool
+      unscale_gradients_task(Legion::Task const *task,
+                             std::vector<Legion::PhysicalRegion> const &regions,
+                             Legion::Context ctx,
+                             Legion::Runtime *runtime);
+  static LossScaler
+      update_loss_scale_task(Legion::Task const *task,
+                             std::vector<Legion::PhysicalRegion> const &regions,
+                             Legion::Context ctx,
+                             Legion::Runtime *runtime);
+  static void
+      convert_weight_task(Legion::Task const *task,
+                          std::vector<Legion::PhysicalRegion> const &regions,
+                          Legion::Context ctx,
+                          Legion::Runtime *runtime);
+  // Writes grad * inverse_scale into master_grad, which may alias grad, and
+  // returns whether any of the results is not finite
+  static bool
+      unscale_gradients_task_gpu(GenericTensorAccessorR const &grad,
+                                 GenericTensorAccessorW const &master_grad,
+                                 float inverse_scale);
+  static void convert_weight_task_gpu(GenericTensorAccessorR const &src,
+                                      GenericTensorAccessorW const &dst);
   FFModel const *model;
+  // FP32 master weights by the region of their half precision parameter
+  std::map<Legion::LogicalRegion, ParallelTensor> master_weights;
+  // Set when FFModel all-reduces the gradients in buckets during the
+  // backward pass, so that the NCCL update tasks do not all-reduce them again
+  bool gradients_all_reduced = false;
+  // Set when each data-parallel replica of an NCCL parameter only keeps the
+  // optimizer states of its slice of the weights (see
+  // FFConfig::shard_optimizer_states)
+  bool shard_states = false;
 };
 
 class SGDOptimizer : public Optimizer {
@@ -43,11 +105,29 @@ public:
   void init(void);
   void next(void);
   void update(const ParallelTensor p);
+  void fused_update(std::vector<ParallelTensor> const &params);
+  int num_states(void) const;
   void set_weight_decay(double _weight_decay);
+  MultiTensorUpdate::SGDParams get_update_params() const;
   static void ps_update_task(Legion::Task const *task,
                              std::vector<Legion::PhysicalRegion> const &regions,
                              Legion::Context ctx,
                              Legion::Runtime *runtime);
+  static void
+      fused_ps_update_task(Legion::Task const *task,
+                           std::vector<Legion::PhysicalRegion> const &regions,
+                           Legion::Context ctx,
+                           Legion::Runtime *runtime);
+  static void fused_ps_update_task_cpu(
+      Legion::Task const *task,
+      std::vector<Legion::PhysicalRegion> const &regions,
+      Legion::Context ctx,
+      Legion::Runtime *runtime);
+  // meta is null for a parameter server update, which does not all-reduce
+  static void
+      fused_update_task_gpu(SGDOptimizer const *op,
+                            OpMeta const *meta,
+                            std::vector<MultiTensorEntry> const &tensors);
   static void ps_update_task_gpu(SGDOptimizer const *op,
                                  float const *w_grad_ptr,
                                  size_t size,
@@ -66,6 +146,11 @@ public:
                                    size_t size,
                                    float *w_ptr,
                                    float *v_ptr);
+  static void
+      fused_nccl_update_task(Legion::Task const *task,
+                             std::vector<Legion::PhysicalRegion> const &regions,
+                             Legion::Context ctx,
+                             Legion::Runtime *runtime);
 #endif
   double lr, momentum;
   bool nesterov;
@@ -85,11 +170,29 @@ public:
   void init(void);
   void next(void);
   void update(const ParallelTensor p);
+  void fused_update(std::vector<ParallelTensor> const &params);
+  int num_states(void) const;
   void set_weight_decay(double _weight_decay);
+  MultiTensorUpdate::AdamParams get_update_params() const;
   static void ps_update_task(Legion::Task const *task,
                              std::vector<Legion::PhysicalRegion> const &regions,
                              Legion::Context ctx,
                              Legion::Runtime *runtime);
+  static void
+      fused_ps_update_task(Legion::Task const *task,
+                           std::vector<Legion::PhysicalRegion> const &regions,
+                           Legion::Context ctx,
+                           Legion::Runtime *runtime);
+  static void fused_ps_update_task_cpu(
+      Legion::Task const *task,
+      std::vector<Legion::PhysicalRegion> const &regions,
+      Legion::Context ctx,
+      Legion::Runtime *runtime);
+  // meta is null for a parameter server update, which does not all-reduce
+  static void
+      fused_update_task_gpu(AdamOptimizer const *op,
+                            OpMeta const *meta,
+                            std::vector<MultiTensorEntry> const &tensors);
   static void ps_update_task_gpu(AdamOptimizer const *op,
                                  float const *w_grad_ptr,
                                  size_t size,
@@ -110,6 +213,22 @@ public:
                                    float *w_ptr,
                                    float *v_ptr,
                                    float *m_ptr);
+  // Reduce-scatters the gradients, updates the slice of the weights the
+  // replica keeps the moments of, and all-gathers the updated weights.
+  // Each replica owns shard elements of the size weight elements.
+  static void sharded_nccl_update_task_gpu(AdamOptimizer const *op,
+                                           OpMeta const *meta,
+                                           float const *w_grad_ptr,
+                                           size_t size,
+                                           float *w_ptr,
+                                           float *v_ptr,
+                                           float *m_ptr,
+                                           size_t shard);
+  static void
+      fused_nccl_update_task(Legion::Task const *task,
+                             std::vector<Legion::PhysicalRegion> const &regions,
+                             Legion::Context ctx,
+                             Legion::Runtime *runtime);
 #endif
   double alpha, beta1, beta2, weight_decay, epsilon;
   double alpha_t, beta1_t, beta2_t;
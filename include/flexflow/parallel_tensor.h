@@ -200,6 +200,9 @@ public:
   Op const *owner_op = nullptr;
   int owner_idx = 0;
   bool create_gradients = false;
+  // Mapped to zero-copy host memory instead of the framebuffer of the GPUs
+  // that use it
+  bool host_resident = false;
 
   // The following fields are initialized after model.compile
   MachineView machine_view = MachineView::NO_VIEW;
@@ -17,8 +17,16 @@
 
 #include "flexflow/batch_config.h"
 #include "flexflow/inference.h"
+#include "flexflow/coserving_controller.h"
 #include "flexflow/model.h"
+#include "flexflow/ngram_drafter.h"
+#include "flexflow/speculation_controller.h"
+#include "flexflow/token_tree.h"
+#include "flexflow/tokenizer_pool.h"
 #include "flexflow/utils/file_loader.h"
+#include "flexflow/utils/token_dataset.h"
+#include <atomic>
+#include <fstream>
 #include <future>
 #include <mutex>
 #include <tokenizers_cpp.h>
@@ -73,18 +81,30 @@ struct Request {
   int llm_cache_size = 0;
 
   Status status = PENDING;
+  // Inference requests can be submitted pre-tokenized by leaving the prompt
+  // empty and setting tokens (without the BOS token)
   std::vector<BatchConfig::TokenId> tokens;
   std::string prompt;
   std::vector<struct BeamTree> beam_trees;
+  // Requests of the same class (e.g. workload or prompt template) share
+  // speculation acceptance statistics
+  std::string speculation_class;
   // PEFT field
   RequestType req_type = REQ_INFERENCE;
   size_t processed_finetuning_tokens = 0;
   int completed_training_steps = 0;
+  // tokens of the current dataset entry in the KV cache, and tokens at its
+  // end that ran their backward pass
   int dataset_entry_processed_tokens = 0;
+  int dataset_entry_bwd_tokens = 0;
   int max_training_steps = 1;
   // how many gradient accumulation steps to do before updating the weights. if
   // left as -1, it will be set to the number of entries in the dataset
   int gradient_accumulation_steps = -1;
+  // save a checkpoint of the finetuned weights every checkpoint_interval
+  // training steps (at the next weight update); -1 only saves the final
+  // weights
+  int checkpoint_interval = -1;
   int benchmarking_tokens = -1;
   std::vector<int> finetuning_tokens_per_batch;
   bool warmup = false;
@@ -92,6 +112,15 @@ struct Request {
   std::vector<std::pair<std::vector<BatchConfig::TokenId>,
                         std::vector<BatchConfig::TokenId>>>
       dataset;
+  // Set instead of dataset when dataset_filepath is a pre-tokenized
+  // TokenDataset, whose entries are read in place from the mapped file.
+  // dataset_bos_token_id (if >= 0) is prepended to every input
+  std::shared_ptr<TokenDataset> tokenized_dataset;
+  BatchConfig::TokenId dataset_bos_token_id = -1;
+  size_t get_dataset_size() const;
+  size_t get_dataset_input_length(size_t entry) const;
+  size_t get_dataset_output_length(size_t entry) const;
+  BatchConfig::TokenId get_dataset_input_token(size_t entry, size_t pos) const;
   std::vector<float> finetuning_losses;
   friend std::ostream &operator<<(std::ostream &os, Request const &req);
 };
@@ -141,12 +170,16 @@ public:
   void push_spec_infer_tree_width(int tree_width);
   int get_max_sequence_length();
   void set_enable_peft_finetuning(bool enable_peft_finetuning_);
+  // finetuning requests of peft_model_id start after training_steps steps
+  void set_resumed_training_steps(PEFTModelID const &peft_model_id,
+                                  int training_steps);
   static void set_inference_finished(bool finished = true);
   int register_ssm_model(FFModel *model);
   void register_tokenizer(ModelType model_type,
                           int bos_token_id,
                           int eos_token_id,
                           std::string const &path);
+  void set_num_tokenizer_workers(int num_workers);
   void register_output_filepath(std::string const &);
   void initBitMask(BatchConfig::BitMask &bitmask, int initLength);
   void appendPendingRequest(BatchConfig::BitMask &bitmask, int initLength);
@@ -162,10 +195,18 @@ public:
 
   FFModel *get_ssm_model(int model_id);
 
+  void load_model_weights(FFModel *model);
   void serve_incr_decoding(FFModel *model);
   void serve_spec_infer(FFModel *model);
   GenerationResult get_generation_result(RequestGuid const &guid);
   RequestGuid register_new_request(Request const &request_);
+  // Tokenize the prompts of all requests in parallel, then admit them
+  std::vector<RequestGuid>
+      register_new_requests(std::vector<Request> const &requests);
+  // Admit a request whose prompt has already been tokenized
+  RequestGuid
+      register_tokenized_request(Request const &request_,
+                                 std::vector<TokenId> const &prompt_tokens);
   RequestGuid register_new_peft_request(Request const &request_);
 
   // Methods to start and terminate request manager's background task
@@ -176,11 +217,25 @@ public:
   // Methods to check and mark request completion
   bool is_request_completed(RequestGuid const &guid);
   void trigger_request_completion_future(RequestGuid const &guid);
+  // Detokenize a completed request on the tokenizer pool, then update its
+  // generation result and output file and trigger its completion future
+  void publish_generation_result(RequestGuid guid,
+                                 std::vector<TokenId> const &tokens,
+                                 std::string const &profile_line,
+                                 bool write_tokens_to_file);
   // Methods for preparing next batches
   bool check_inf_req_completion(BatchConfig const &old_bc, int i);
+  void complete_inf_request(BatchConfig const &old_bc, int i);
   void check_batch(BatchConfig const &old_bc, BatchConfig const &new_bc);
   BatchConfig prepare_next_batch(BatchConfig const &bc,
                                  InferenceResult const &result);
+  // prepare_next_batch in two halves: the plan only reads the previous batch
+  // config, so it is built while that batch runs, and the patch adds the
+  // tokens sampled by the batch and drops the requests that ended with EOS
+  BatchConfig plan_next_batch(BatchConfig const &old_bc);
+  void patch_next_batch(BatchConfig const &old_bc,
+                        InferenceResult const &result,
+                        BatchConfig &new_bc);
   BatchConfigFuture prepare_next_batch(BatchConfigFuture const &bc,
                                        InferenceResultFuture const &result,
                                        Legion::Context ctx,
@@ -188,19 +243,27 @@ public:
   BeamSearchBatchConfig
       prepare_next_batch_beam(BeamSearchBatchConfig const &old_bc,
                               BeamInferenceResult const &result);
+  // model_id is the SSM that produced result; the SSMs share the batch
+  // prepared by prepare_next_batch_init and each keeps its own beam trees
   BeamSearchBatchConfigFuture
       prepare_next_batch_beam(BeamSearchBatchConfigFuture const &old_bc,
                               BeamInferenceResultFuture const &result,
+                              int model_id,
                               Legion::Context ctx,
                               Legion::Runtime *runtime);
-  BeamSearchBatchConfig
-      prepare_next_batch_init(TreeVerifyBatchConfig const &old_bc,
-                              InferenceResult const &result,
-                              int model_id);
+  // max_speculation_depth is the number of SSM steps that will be run for
+  // the returned batch; new requests are only admitted when it is
+  // MAX_BEAM_DEPTH, so that their prompts are fully processed
+  BeamSearchBatchConfig prepare_next_batch_init(
+      TreeVerifyBatchConfig const &old_bc,
+      InferenceResult const &result,
+      int model_id,
+      int max_speculation_depth = BeamSearchBatchConfig::MAX_BEAM_DEPTH);
   BeamSearchBatchConfigFuture
       prepare_next_batch_init(TreeVerifyBatchConfigFuture const &old_bc,
                               InferenceResultFuture const &result,
                               int model_id,
+                              int max_speculation_depth,
                               Legion::Context ctx,
                               Legion::Runtime *runtime);
   TreeVerifyBatchConfig prepare_next_batch_verify(
@@ -217,24 +280,33 @@ public:
                             BeamTree &tree,
                             int request_index);
 
+  // Builds the token tree of an SSM for the request in slot request_index of
+  // old_bc into tree of trees
+  void traverse_beam_tree(BeamSearchBatchConfig const &old_bc,
+                          int request_index,
+                          int first_token_depth_in_request,
+                          TokenTreeArena &trees,
+                          int tree);
+
+  // Draft a token tree for the request in slot request_index from n-grams
+  // (--ngram-speculation), and set its causal mask in the verify batch
+  void draft_token_tree(Request const &request,
+                        int request_index,
+                        int max_depth,
+                        BatchConfig::BitMask &bitmask);
+
+  // Sets the causal mask of the verify batch from the parents of the token
+  // tree in slot request_index
+  void set_token_tree_mask(int request_index, BatchConfig::BitMask &bitmask);
+
+  // Returns the (token, depth) pairs the LLM verified for the token tree in
+  // slot request_index, given its outputs for the first outputs.size() tree
+  // nodes, which start at first_result_index of the previous batch. Also sets
+  // the tokens to commit to the LLM's KV cache
   std::vector<std::pair<BatchConfig::TokenId, int>>
-      traverse_beam_tree(BeamSearchBatchConfig const &old_bc,
-                         int request_index,
-                         int first_token_depth_in_request);
-
-  // remove guid after put the cached tree in request
-  std::vector<std::pair<BatchConfig::TokenId, int>> merge_dfs_trees(
-      std::vector<std::vector<std::pair<BatchConfig::TokenId, int>>>
-          input_trees,
-      int root_depth,
-      RequestGuid guid);
-
-  std::vector<std::pair<BatchConfig::TokenId, int>> traverse_verify_tree(
-      size_t guid,
-      std::vector<std::pair<BatchConfig::TokenId, int>> const
-          &inputSerializedTree,
-      std::vector<std::pair<BatchConfig::TokenId, int>> const
-          &outputSerializedTree);
+      traverse_verify_tree(int request_index,
+                           std::vector<BatchConfig::TokenId> const &outputs,
+                           int first_result_index);
   static void background_serving_task(
       Legion::Task const *task,
       std::vector<Legion::PhysicalRegion> const &regions,
@@ -256,6 +328,11 @@ public:
                              std::vector<Legion::PhysicalRegion> const &regions,
                              Legion::Context ctx,
                              Legion::Runtime *runtime);
+  static BatchConfig plan_next_batch_task(
+      Legion::Task const *task,
+      std::vector<Legion::PhysicalRegion> const &regions,
+      Legion::Context ctx,
+      Legion::Runtime *runtime);
   static BatchConfig prepare_next_batch_task(
       Legion::Task const *task,
       std::vector<Legion::PhysicalRegion> const &regions,
@@ -290,13 +367,52 @@ private:
 
   // peft benchmarking
   bool enable_peft_finetuning = false;
+  // finetuning entries that do not fit in a batch run the backward pass of
+  // each chunk right after its forward pass, without the gradients of the
+  // keys and values of the earlier chunks
+  bool peft_truncated_backprop = false;
+  // training steps of the checkpoints the PEFT adapters resumed from
+  std::unordered_map<PEFTModelID, int> resumed_training_steps;
   static bool inference_finished;
+  // limits the finetuning tokens of each batch to meet the inference SLO
+  void configure_coserving(FFConfig const &config);
+  int get_finetuning_token_budget(BatchConfig const &new_bc);
+  CoServingController coserving_controller;
+  std::ofstream coserving_log;
+  double last_batch_time = 0;
 
   // tree width in each speculative step, if not specified 1
   std::vector<int> spec_infer_tree_width;
+  int get_spec_infer_tree_width(RequestGuid guid, int ssm_decoding_steps);
+  // adaptive speculation depth and width
+  void configure_speculation(FFConfig const &config);
+  void plan_speculation(BeamSearchBatchConfig &new_bc,
+                        int max_speculation_depth);
+  bool adaptive_speculation = false;
+  int speculation_token_budget = -1;
+  std::string speculation_stats_file;
+  SpeculationController speculation_controller;
+  std::unordered_map<RequestGuid, SpeculationController::Plan>
+      speculation_plans;
+  // deepest tree wanted by the last planned batch, used to decide how many
+  // SSM steps to run for the next one. It is read when a batch is launched,
+  // before the batches still in flight have been planned, so it may lag
+  // behind by as many batches as are pipelined
+  std::atomic<int> next_speculation_depth;
+  // drafts token trees without SSMs when --ngram-speculation is set
+  void configure_ngram_drafter(FFConfig const &config);
+  std::unique_ptr<NgramDrafter> ngram_drafter;
 
   // private fields
   std::unique_ptr<Tokenizer> tokenizer_;
+  // Created on first use, with config.num_tokenizer_workers workers once the
+  // background server starts
+  TokenizerPool *get_tokenizer_pool();
+  TokenizerPool::TokenizerFactory tokenizer_factory;
+  std::unique_ptr<TokenizerPool> tokenizer_pool;
+  std::mutex tokenizer_pool_mutex;
+  int num_tokenizer_workers;
+  std::mutex output_file_mutex;
   bool verbose;
   ModelType model_type;
   int bos_token_id;
@@ -311,12 +427,16 @@ private:
   std::mutex request_to_promise_mutex;
   RequestGuid next_available_guid;
 
-  // TODO: Move this two vector to request struct
-  std::unordered_map<RequestGuid,
-                     std::vector<std::pair<BatchConfig::TokenId, int>>>
-      dfs_tree_inputs;
-  std::unordered_map<RequestGuid, std::vector<std::pair<int, int>>>
-      committed_tokens;
+  // Speculated token tree of the request in each batch slot, kept across the
+  // init, beam and verify steps of an iteration
+  TokenTreeArena token_trees;
+  // Per batch slot, (abs_depth, index in the previous batch) of the tokens to
+  // commit to the LLM's KV cache
+  std::vector<std::vector<std::pair<int, int>>> committed_tokens;
+  // Scratch space reused across iterations
+  TokenTreeArena ssm_token_tree;
+  std::vector<BatchConfig::TokenId> tree_outputs;
+  std::vector<int> accepted_nodes;
 
   // Multi-model support
   std::vector<FFModel *> ssm_models;
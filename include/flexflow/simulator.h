@@ -768,6 +768,12 @@ public:
   int max_num_segments; // simulation could be slow if the number of segments
                         // are too large
 private:
+#ifdef FF_USE_NCCL
+  // Time to all-reduce the gradient of a weight across its replicas
+  float estimate_weight_sync_time(Op const *op,
+                                  ParallelConfig const &pc,
+                                  int weight_idx);
+#endif
   float estimate_repartition_xfer_cost(
       int repartition_dim,
       int repartition_degree,
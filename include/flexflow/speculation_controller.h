@@ -0,0 +1,117 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FLEXFLOW_SPECULATION_CONTROLLER_H
+#define _FLEXFLOW_SPECULATION_CONTROLLER_H
+
+#include <cstddef>
+#include <map>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace FlexFlow {
+
+// Chooses the speculation depth and tree width of each request from the
+// acceptance lengths observed when verifying its previous token trees.
+//
+// Acceptance is modeled as geometric: each speculated token is accepted with
+// probability alpha given that its parent was, and a layer with k candidates
+// is accepted with probability 1 - (1 - alpha)^k. alpha is estimated per
+// request with exponentially decayed counts, using the estimate of the
+// request's class (e.g. a workload or prompt template) as a prior, which in
+// turn falls back to prior_acceptance.
+//
+// Token trees are a chain that fans out into `width` chains at
+// branch_layer, mirroring the trees built from spec_infer_tree_width.
+// plan() picks a (depth, width) per request that maximizes the expected
+// number of accepted tokens of the whole batch subject to a budget on the
+// number of speculated tokens sent to the verifier, skipping tokens whose
+// expected gain is below min_token_gain. When the budget is smaller than the
+// number of requests, only the requests most likely to be accepted speculate
+// one token each, and the others get depth 0.
+class SpeculationController {
+public:
+  using RequestGuid = size_t;
+  struct Plan {
+    int depth;
+    int width;
+  };
+
+  SpeculationController();
+  void set_max_depth(int max_depth);
+  // Trees fan out at branch_layer (0 is the first speculated layer) into at
+  // most max_width chains
+  void set_branching(int branch_layer, int max_width);
+  void set_min_token_gain(double min_token_gain);
+  void set_prior_acceptance(double prior_acceptance);
+  void set_decay(double decay);
+  int get_max_depth() const {
+    return max_depth;
+  }
+
+  // Record that accepted of the depth speculated tokens of guid's last tree
+  // were accepted by the verifier
+  void record(RequestGuid guid,
+              std::string const &request_class,
+              int depth,
+              int accepted);
+  void remove_request(RequestGuid guid);
+  double get_acceptance_rate(RequestGuid guid,
+                             std::string const &request_class) const;
+
+  int tree_size(int depth, int width) const;
+  double expected_accepted_tokens(double alpha, int depth, int width) const;
+  std::vector<Plan>
+      plan(std::vector<std::pair<RequestGuid, std::string>> const &requests,
+           int token_budget) const;
+
+  // Write the acceptance-length histograms (overall and per class) and the
+  // current acceptance estimates as JSON
+  void export_stats(std::ostream &os) const;
+
+private:
+  struct Counts {
+    double accepted = 0;
+    double rejected = 0;
+  };
+  struct ClassStats {
+    Counts counts;
+    // histogram[d][a]: number of trees of depth d with a accepted tokens
+    std::vector<std::vector<size_t>> histogram;
+  };
+  void update(Counts &counts, int depth, int accepted) const;
+  double estimate(Counts const &counts, double prior) const;
+  double class_acceptance_rate(std::string const &request_class) const;
+  Plan best_plan(double alpha, double lambda) const;
+
+  int max_depth;
+  int branch_layer;
+  int max_width;
+  double min_token_gain;
+  double prior_acceptance;
+  double decay;
+  // pseudo-count weight given to the prior of each estimate
+  double prior_weight;
+  std::unordered_map<RequestGuid, Counts> request_stats;
+  std::map<std::string, ClassStats> class_stats;
+  ClassStats global_stats;
+};
+
+}; // namespace FlexFlow
+
+#endif // _FLEXFLOW_SPECULATION_CONTROLLER_H
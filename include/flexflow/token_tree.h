@@ -0,0 +1,114 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FLEXFLOW_TOKEN_TREE_H
+#define _FLEXFLOW_TOKEN_TREE_H
+
+#include <cstddef>
+#include <vector>
+
+namespace FlexFlow {
+
+// Fixed-capacity storage for the speculated token trees of all requests in a
+// batch. Tree t owns nodes [t * max_nodes, (t + 1) * max_nodes) of flat
+// token, depth, parent and probability arrays, so building, merging and
+// verifying trees never allocates once the arena is constructed. Node 0 of a
+// tree is its root and every node is stored after its parent; the index of a
+// node is also its position among the tree's tokens in a verify batch.
+class TokenTreeArena {
+public:
+  using TokenId = int;
+  inline static int const NONE = -1;
+
+  TokenTreeArena(int max_trees, int max_nodes);
+  int get_max_trees() const {
+    return max_trees;
+  }
+  int get_max_nodes() const {
+    return max_nodes;
+  }
+
+  // Makes tree a single root node
+  void reset(int tree, TokenId token, int depth, float prob = 1.0f);
+  // Removes all nodes of tree
+  void clear(int tree) {
+    sizes[tree] = 0;
+  }
+  // Appends a child of parent and returns its index, or NONE if the tree is
+  // full
+  int add_node(int tree, int parent, TokenId token, float prob = 0.0f);
+  // Returns the first child of parent whose token is token, or NONE
+  int find_child(int tree, int parent, TokenId token) const;
+
+  int size(int tree) const {
+    return sizes[tree];
+  }
+  TokenId token(int tree, int node) const {
+    return tokens[index(tree, node)];
+  }
+  int depth(int tree, int node) const {
+    return depths[index(tree, node)];
+  }
+  int parent(int tree, int node) const {
+    return parents[index(tree, node)];
+  }
+  float prob(int tree, int node) const {
+    return probs[index(tree, node)];
+  }
+  int first_child(int tree, int node) const {
+    return first_children[index(tree, node)];
+  }
+  int next_sibling(int tree, int node) const {
+    return next_siblings[index(tree, node)];
+  }
+
+  // Adds the nodes of other_tree (a tree of other with the same root) that
+  // are not in tree yet, keeping the probability of nodes present in both.
+  // Returns the number of nodes that did not fit.
+  int merge(int tree, TokenTreeArena const &other, int other_tree);
+
+  // Finds the speculated tokens a target model accepts. outputs[k] is the
+  // token the model generated after the path from the root to node k, for the
+  // first num_outputs nodes of tree. Starting from the root, the path follows
+  // the first child whose token is the output of the current node. Replaces
+  // accepted with the nodes of the path, root first.
+  void verify(int tree,
+              TokenId const *outputs,
+              int num_outputs,
+              std::vector<int> &accepted) const;
+
+  // Sets bit j of masks[k] iff node k is node j or one of its ancestors, for
+  // all nodes j of tree
+  void ancestor_masks(int tree, unsigned long long *masks) const;
+
+private:
+  size_t index(int tree, int node) const {
+    return (size_t)tree * max_nodes + node;
+  }
+
+  int max_trees, max_nodes;
+  std::vector<int> sizes;
+  std::vector<TokenId> tokens;
+  std::vector<int> depths, parents;
+  std::vector<float> probs;
+  // children of a node in insertion order, as a linked list
+  std::vector<int> first_children, last_children, next_siblings;
+  // node of tree for each node of the other tree during merge
+  std::vector<int> merge_map;
+};
+
+}; // namespace FlexFlow
+
+#endif // _FLEXFLOW_TOKEN_TREE_H
@@ -0,0 +1,68 @@
+/* Copyright 2023 CMU, Stanford, Facebook, LANL
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tokenizers_cpp.h>
+#include <vector>
+
+namespace FlexFlow {
+
+// A pool of worker threads that encode and decode text off the request
+// manager's scheduling path. Tokenizer instances are not thread-safe, so each
+// worker owns its own instance, created by the factory passed to the pool.
+class TokenizerPool {
+public:
+  using Tokenizer = tokenizers::Tokenizer;
+  using TokenizerFactory = std::function<std::unique_ptr<Tokenizer>()>;
+  using Work = std::function<void(Tokenizer *)>;
+
+  TokenizerPool(TokenizerFactory const &factory, int num_workers);
+  ~TokenizerPool();
+  int get_num_workers() const;
+
+  // Run work on the next available worker, with that worker's tokenizer
+  void submit(Work work);
+  std::future<std::vector<int32_t>> encode_async(std::string const &text);
+  std::future<std::string> decode_async(std::vector<int32_t> const &tokens);
+  // Split the inputs into one contiguous chunk per worker and block until
+  // all of them have been processed. Results are in input order. Errors of
+  // the tokenizer are rethrown to the caller, here and by the futures above
+  std::vector<std::vector<int32_t>>
+      encode_batch(std::vector<std::string> const &texts);
+  std::vector<std::string>
+      decode_batch(std::vector<std::vector<int32_t>> const &token_lists);
+
+private:
+  void worker_loop(int worker_id);
+  static void wait_for_chunks(std::vector<std::future<void>> &chunks);
+
+  std::vector<std::unique_ptr<Tokenizer>> tokenizers;
+  std::vector<std::thread> workers;
+  std::deque<Work> pending_work;
+  std::mutex work_mutex;
+  std::condition_variable work_cv;
+  bool stopping;
+};
+
+}; // namespace FlexFlow
@@ -0,0 +1,61 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FLEXFLOW_UTILS_ADAPTER_SEGMENTS_H_
+#define _FLEXFLOW_UTILS_ADAPTER_SEGMENTS_H_
+
+#include <cstddef>
+#include <vector>
+
+namespace FlexFlow {
+
+// A request of a batch that runs through a LoRA adapter
+struct AdapterRequest {
+  size_t adapter;
+  int request_index;
+  int first_token_offset;
+  int num_tokens;
+  // exclusive requests (e.g. requests that need the backward pass) always
+  // get a segment of their own
+  bool exclusive;
+};
+
+// Consecutive tokens of one or more requests that use the same adapter, so
+// that LoRA layers can process them with a single GEMM
+struct AdapterSegment {
+  size_t adapter;
+  // the first request of the segment
+  int request_index;
+  int first_token_offset;
+  int num_tokens;
+};
+
+// Sorts the requests by their position in the batch and merges neighbouring
+// requests that use the same adapter into segments
+void group_adapter_segments(std::vector<AdapterRequest> &requests,
+                            std::vector<AdapterSegment> &segments);
+
+// Picks a free batch slot for a new request that uses adapter: preferably
+// the slot after (or else before) one whose request uses the same adapter,
+// so that requests sharing an adapter occupy neighbouring slots and their
+// tokens are contiguous in later batches. slot_adapters[i] is only read
+// for slots that are not free. Returns -1 if no slot is free.
+int choose_adapter_slot(std::vector<bool> const &free_slots,
+                        std::vector<size_t> const &slot_adapters,
+                        size_t adapter);
+
+}; // namespace FlexFlow
+
+#endif // _FLEXFLOW_UTILS_ADAPTER_SEGMENTS_H_
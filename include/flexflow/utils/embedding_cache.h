@@ -0,0 +1,111 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FLEXFLOW_UTILS_EMBEDDING_CACHE_H_
+#define _FLEXFLOW_UTILS_EMBEDDING_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <vector>
+
+namespace FlexFlow {
+
+// Slot bookkeeping for an embedding table kept in host memory, whose most
+// frequently used rows are cached in num_slots rows of device memory. A row
+// missing from the cache is admitted once it has been looked up
+// admit_threshold times, and only replaces the least recently used cached
+// row if it has been looked up more often (counts are halved every
+// aging_period lookups so that the hot set follows the workload). Missing
+// rows that are not admitted get a transient slot past the cached ones that
+// only lives for one batch. The cache only computes slots: callers copy the
+// rows listed by lookup() and flush() between the two memories.
+class EmbeddingCache {
+public:
+  inline static int const NONE = -1;
+  struct Transfer {
+    int64_t row;
+    int slot;
+  };
+
+  EmbeddingCache(int64_t num_rows,
+                 int num_slots,
+                 int admit_threshold = 2,
+                 int64_t aging_period = 0);
+
+  // Writes the slot of each index of the next batch to slots. Callers must
+  // first copy the rows in writebacks (dirty rows that were evicted) from
+  // the device to the host, then the rows in loads from the host to the
+  // device. If update is set, the batch writes its rows back to the device:
+  // cached rows become dirty, and callers copy the transient rows back to
+  // the host once they are updated.
+  template <typename TI>
+  void lookup(TI const *indices,
+              size_t num_indices,
+              bool update,
+              int *slots,
+              std::vector<Transfer> &loads,
+              std::vector<Transfer> &writebacks);
+  // Appends every dirty cached row to writebacks and marks them clean
+  void flush(std::vector<Transfer> &writebacks);
+
+  // rows of the last batch that were given a transient slot
+  std::vector<Transfer> const &get_transient_rows() const {
+    return transient_rows;
+  }
+  int get_num_slots() const {
+    return num_slots;
+  }
+  size_t num_cached_rows() const {
+    return lru.size();
+  }
+  bool is_cached(int64_t row) const {
+    int slot = slot_of_row[row];
+    return slot != NONE && slot < num_slots;
+  }
+  double hit_rate() const {
+    return num_hits + num_misses == 0
+               ? 0.0
+               : (double)num_hits / (num_hits + num_misses);
+  }
+  // a hit is a lookup of a row that was cached before its batch
+  uint64_t num_hits, num_misses, num_admissions, num_evictions,
+      num_writebacks;
+
+private:
+  struct Slot {
+    int64_t row;
+    uint64_t last_step, load_step;
+    bool dirty;
+    std::list<int>::iterator lru_position;
+  };
+  int admit(int64_t row, std::vector<Transfer> &writebacks);
+
+  int64_t num_rows;
+  int num_slots, admit_threshold;
+  int64_t aging_period, num_lookups_since_aging;
+  uint64_t step;
+  std::vector<uint32_t> frequency;
+  std::vector<int> slot_of_row;
+  std::vector<Slot> slot_info;
+  std::vector<int> free_slots;
+  // cached slots, most recently used first
+  std::list<int> lru;
+  std::vector<Transfer> transient_rows;
+};
+
+}; // namespace FlexFlow
+
+#endif // _FLEXFLOW_UTILS_EMBEDDING_CACHE_H_
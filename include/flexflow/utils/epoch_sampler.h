@@ -0,0 +1,53 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FLEXFLOW_UTILS_EPOCH_SAMPLER_H_
+#define _FLEXFLOW_UTILS_EPOCH_SAMPLER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace FlexFlow {
+
+// Order in which an epoch visits the samples of a dataset. Without a seed,
+// every epoch visits the full batches in storage order. With a seed, each
+// epoch uses a different permutation that only depends on the seed and the
+// epoch, so the data loaders of a model's inputs and labels stay aligned,
+// and reruns see the same batches. The indices within each batch are sorted,
+// which keeps the gathers of a batch close to storage order without
+// changing which samples are batched together.
+class EpochSampler {
+public:
+  EpochSampler(size_t num_samples, int batch_size, int seed = -1);
+  bool is_shuffled() const {
+    return seed >= 0;
+  }
+  // Full batches per epoch; the remaining samples are skipped, which are
+  // different ones in each epoch when shuffling
+  size_t get_num_batches() const {
+    return num_samples / batch_size;
+  }
+  // Sets order to the sample indices of all the batches of the epoch
+  void get_epoch_order(uint64_t epoch, std::vector<size_t> &order) const;
+
+private:
+  size_t num_samples;
+  int batch_size, seed;
+};
+
+}; // namespace FlexFlow
+
+#endif // _FLEXFLOW_UTILS_EPOCH_SAMPLER_H_
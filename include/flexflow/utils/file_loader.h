@@ -18,6 +18,11 @@
 #include "flexflow/batch_config.h"
 #include "flexflow/inference.h"
 #include "flexflow/model.h"
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
 
 using namespace std;
 using namespace FlexFlow;
@@ -32,15 +37,37 @@ public:
                  size_t _qkv_inner_dim,
                  int _tensor_parallelism_degree,
                  bool _use_full_precision);
+  ~FileDataLoader();
 
   BatchConfig::TokenId *generate_requests(int num, int length);
 
   template <typename DT>
   void load_single_weight_tensor(FFModel *ff, Layer *l, int weight_idx);
+  template <typename DT>
+  void read_single_weight_tensor(FFModel *ff,
+                                 Layer *l,
+                                 int weight_idx,
+                                 DT *data);
 
   void load_quantization_weight(FFModel *ff, Layer *l, int weight_idx);
+  void read_quantization_weight(FFModel *ff,
+                                Layer *l,
+                                int weight_idx,
+                                char *data);
+  void read_weight(FFModel *ff, Layer *l, int weight_idx, char *data);
+  void set_weight_tensor(FFModel *ff, Layer *l, int weight_idx, char *data);
+  static size_t get_weight_buffer_size(Layer const *l, int weight_idx);
   void load_weights(FFModel *ff);
 
+  // On-demand weight loading: register_weights records every weight of the
+  // (compiled) model without loading it; materialize_weights loads the
+  // weights of an operator right before it is launched, while the next
+  // prefetch_depth layers are read from disk in the background
+  void register_weights(FFModel *ff, int prefetch_depth);
+  bool has_pending_weights() const;
+  void materialize_weights(FFModel *ff, Op const *op);
+  void materialize_all_weights(FFModel *ff);
+
   void load_positions(FFModel *ff,
                       Tensor pt,
                       ParallelTensor position_pt,
@@ -53,4 +80,28 @@ private:
   std::string prompts_filepath;
   std::string weights_folder;
   bool use_full_precision;
+
+  struct PendingWeight {
+    Layer *layer = nullptr;
+    int weight_idx = -1;
+    char *host_buffer = nullptr;
+    std::future<void> loaded;
+    bool materialized = false;
+  };
+  void prefetch_weights(FFModel *ff, size_t first_index);
+  void materialize_weight(FFModel *ff, size_t index);
+  void read_loop();
+  // pending weights are stored in layer order
+  std::vector<PendingWeight> pending_weights;
+  std::unordered_map<ParallelTensor, size_t> pending_weight_index;
+  size_t num_pending_weights = 0;
+  int weight_prefetch_depth = 0;
+  // A fixed number of threads read the prefetched weights from disk, however
+  // many weight tensors the prefetched layers hold
+  static int const NUM_WEIGHT_READERS = 4;
+  std::vector<std::thread> weight_readers;
+  std::deque<std::packaged_task<void()>> weight_reads;
+  std::mutex weight_reads_mutex;
+  std::condition_variable weight_reads_available;
+  bool stop_weight_readers = false;
 };
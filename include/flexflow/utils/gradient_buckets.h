@@ -0,0 +1,93 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FLEXFLOW_UTILS_GRADIENT_BUCKETS_H_
+#define _FLEXFLOW_UTILS_GRADIENT_BUCKETS_H_
+
+#include <cstddef>
+#include <map>
+#include <vector>
+
+namespace FlexFlow {
+
+// Splits the parameters of a model into buckets whose gradients are
+// all-reduced together. Parameters are added in reverse topological order,
+// the order in which the backward pass computes their gradients, and fill
+// the open bucket of their group (the devices sharing their all-reduce)
+// until it would exceed bucket_size bytes. bucket_size 0 gives every
+// parameter a bucket of its own.
+//
+// mark_ready() then follows one backward pass. Buckets are released in
+// order, each once its gradients and all earlier buckets are ready, so that
+// every device issues the same sequence of all-reduces.
+class GradientBuckets {
+public:
+  inline static int const NONE = -1;
+
+  GradientBuckets(size_t bucket_size = 0);
+  // Returns the id of the new parameter
+  int add_parameter(size_t group, size_t bytes);
+
+  // Starts a new backward pass
+  void reset();
+  // Records that the gradient of param is computed, and appends the buckets
+  // this releases to ready
+  void mark_ready(int param, std::vector<int> &ready);
+  // Ends the backward pass, releasing the buckets not released yet, in
+  // order, whether or not all their gradients were marked
+  void release_remaining(std::vector<int> &ready);
+
+  size_t get_bucket_size() const {
+    return bucket_size;
+  }
+  size_t num_buckets() const {
+    return buckets.size();
+  }
+  size_t num_parameters() const {
+    return param_buckets.size();
+  }
+  int get_bucket(int param) const {
+    return param_buckets[param];
+  }
+  std::vector<int> const &get_parameters(int bucket) const {
+    return buckets[bucket].params;
+  }
+  size_t get_group(int bucket) const {
+    return buckets[bucket].group;
+  }
+  size_t get_bytes(int bucket) const {
+    return buckets[bucket].bytes;
+  }
+
+private:
+  struct Bucket {
+    size_t group, bytes;
+    std::vector<int> params;
+    // gradients not yet marked in the current backward pass
+    int num_pending;
+  };
+  size_t bucket_size;
+  std::vector<Bucket> buckets;
+  std::vector<int> param_buckets;
+  std::vector<bool> param_ready;
+  // the bucket each group is filling
+  std::map<size_t, int> open_buckets;
+  // the first bucket not released in the current backward pass
+  int next_bucket;
+};
+
+}; // namespace FlexFlow
+
+#endif // _FLEXFLOW_UTILS_GRADIENT_BUCKETS_H_
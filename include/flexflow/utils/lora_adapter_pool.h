@@ -0,0 +1,101 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FLEXFLOW_UTILS_LORA_ADAPTER_POOL_H_
+#define _FLEXFLOW_UTILS_LORA_ADAPTER_POOL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <vector>
+
+namespace FlexFlow {
+
+// Residency bookkeeping for LoRA weights paged into a fixed range of device
+// memory. Every (layer, adapter) pair registers one block; acquire() makes a
+// block resident for a batch, placing it in the first hole that fits. When
+// no hole fits, the blocks least recently used by earlier batches are
+// evicted, and resident blocks are slid towards offset 0 when the free space
+// is fragmented. The pool only computes offsets: callers copy the block's
+// weights in when acquire() reports a load, and apply the returned moves
+// (in order, before the load) to compact the device memory.
+class LoraAdapterPool {
+public:
+  using BlockId = int;
+  inline static size_t const NONE = SIZE_MAX;
+  // Copy size bytes from offset src to offset dst. Moves never overlap their
+  // own source, so each can be a plain memcpy.
+  struct Move {
+    size_t src, dst, size;
+  };
+
+  LoraAdapterPool(size_t capacity, size_t alignment = 256);
+  BlockId add_block(size_t size);
+
+  // Returns the offset of block, which is used by batch `step` (steps never
+  // decrease), or NONE if it does not fit even after evicting all blocks
+  // that were not used by this step. Sets needs_load if the block was not
+  // resident, and appends to moves the copies compaction requires.
+  size_t acquire(BlockId block,
+                 uint64_t step,
+                 bool &needs_load,
+                 std::vector<Move> &moves);
+  bool is_resident(BlockId block) const {
+    return blocks[block].offset != NONE;
+  }
+  size_t get_offset(BlockId block) const {
+    return blocks[block].offset;
+  }
+  size_t get_block_size(BlockId block) const {
+    return blocks[block].size;
+  }
+  size_t get_capacity() const {
+    return capacity;
+  }
+  size_t get_used_size() const {
+    return used_size;
+  }
+  size_t num_blocks() const {
+    return blocks.size();
+  }
+  size_t num_resident_blocks() const {
+    return resident.size();
+  }
+  size_t num_loads, num_evictions, num_compactions;
+
+private:
+  struct Block {
+    size_t size;
+    size_t offset;
+    uint64_t last_step;
+    std::list<BlockId>::iterator lru_position;
+  };
+  size_t find_hole(size_t size) const;
+  void place(BlockId block, size_t offset, uint64_t step);
+  void evict(BlockId block);
+  void compact(std::vector<Move> &moves);
+
+  size_t capacity, alignment, used_size;
+  std::vector<Block> blocks;
+  // resident blocks by offset
+  std::map<size_t, BlockId> resident;
+  // resident blocks, most recently used first
+  std::list<BlockId> lru;
+};
+
+}; // namespace FlexFlow
+
+#endif // _FLEXFLOW_UTILS_LORA_ADAPTER_POOL_H_
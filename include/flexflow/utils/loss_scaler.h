@@ -0,0 +1,60 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FLEXFLOW_UTILS_LOSS_SCALER_H_
+#define _FLEXFLOW_UTILS_LOSS_SCALER_H_
+
+#include <cstdint>
+
+namespace FlexFlow {
+
+// Dynamic loss scaling for mixed precision training. The loss gradient is
+// multiplied by scale, so that small half precision gradients do not flush
+// to zero, and the optimizer divides it out again. A step whose gradients
+// overflow is skipped and backs the scale off; growth_interval steps in a
+// row without overflow grow it again. The scaler is plain data, so that it
+// can travel between tasks in a future.
+class LossScaler {
+public:
+  LossScaler(float init_scale = 65536.0f,
+             int growth_interval = 2000,
+             float growth_factor = 2.0f,
+             float backoff_factor = 0.5f);
+  // Records whether the gradients of a step overflowed and adjusts the
+  // scale. Returns whether the step is applied.
+  bool update(bool overflow);
+  float get_scale() const {
+    return scale;
+  }
+  float get_inverse_scale() const {
+    return 1.0f / scale;
+  }
+  // whether the last step passed to update() is skipped
+  bool skip_step() const {
+    return found_overflow;
+  }
+
+public:
+  float scale, growth_factor, backoff_factor;
+  int growth_interval;
+  // steps without overflow since the scale last changed
+  int good_steps;
+  bool found_overflow;
+  int64_t num_steps, num_skipped_steps;
+};
+
+}; // namespace FlexFlow
+
+#endif // _FLEXFLOW_UTILS_LOSS_SCALER_H_
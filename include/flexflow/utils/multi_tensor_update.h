@@ -0,0 +1,65 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FLEXFLOW_UTILS_MULTI_TENSOR_UPDATE_H_
+#define _FLEXFLOW_UTILS_MULTI_TENSOR_UPDATE_H_
+
+#include <cstddef>
+
+namespace FlexFlow {
+
+// One parameter in the flat table of a fused optimizer update. w_grad holds
+// num_replicas consecutive copies of the size gradients (one per replica
+// under a parameter server), which are summed before updating w. v and m
+// are the optimizer states the update rule needs; the others are null.
+struct MultiTensorEntry {
+  float const *w_grad;
+  float *w, *v, *m;
+  size_t size;
+  int num_replicas;
+};
+
+namespace MultiTensorUpdate {
+
+// Tensors one GPU kernel launch updates. The table is passed as a kernel
+// argument, which must stay below 4KB.
+int const MAX_TENSORS_PER_LAUNCH = 64;
+
+struct SGDParams {
+  float lr, weight_decay, momentum;
+  bool nesterov;
+};
+
+struct AdamParams {
+  float alpha_t, beta1, beta2, weight_decay, epsilon;
+};
+
+// Apply the update rules of SGDOptimizer and AdamOptimizer to every tensor
+// of the table. Unless vectorize is false, the CPU versions process eight
+// elements at a time with AVX2/FMA when the CPU supports them; their
+// results then differ from the scalar ones only by rounding.
+void sgd_cpu(SGDParams const &params,
+             MultiTensorEntry const *tensors,
+             int num_tensors,
+             bool vectorize = true);
+void adam_cpu(AdamParams const &params,
+              MultiTensorEntry const *tensors,
+              int num_tensors,
+              bool vectorize = true);
+
+} // namespace MultiTensorUpdate
+}; // namespace FlexFlow
+
+#endif // _FLEXFLOW_UTILS_MULTI_TENSOR_UPDATE_H_
@@ -0,0 +1,81 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FLEXFLOW_UTILS_PEFT_CHECKPOINT_WRITER_H_
+#define _FLEXFLOW_UTILS_PEFT_CHECKPOINT_WRITER_H_
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace FlexFlow {
+
+// Writes PEFT weight checkpoints on a background thread, so that the tasks
+// that snapshot the weights do not wait for the file system. Callers copy
+// the weights into a staging buffer obtained from get_staging_buffer() and
+// hand it over with write(); buffers are recycled once written. Each file
+// is written under a temporary name and renamed when complete, so an
+// interrupted run never leaves a truncated checkpoint behind.
+class PEFTCheckpointWriter {
+public:
+  PEFTCheckpointWriter();
+  ~PEFTCheckpointWriter();
+  static PEFTCheckpointWriter *get_checkpoint_writer();
+
+  std::vector<char> get_staging_buffer(size_t size);
+  // Queues data to be written to filepath, creating its parent directories
+  void write(std::string const &filepath, std::vector<char> &&data);
+  // Blocks until all queued files are written
+  void flush();
+
+private:
+  struct Job {
+    std::string filepath;
+    std::vector<char> data;
+  };
+  void write_loop();
+  // Writes job.data to a temporary file renamed to job.filepath once complete.
+  // Failures are logged and skip the file.
+  void write_file(Job const &job);
+
+  std::mutex mutex;
+  std::condition_variable job_available, jobs_done;
+  std::deque<Job> jobs;
+  std::vector<std::vector<char>> free_buffers;
+  int num_writing;
+  bool terminating;
+  std::thread writer;
+};
+
+// Whether the weight update of training_step (counted from 1), which ends
+// gradient_accumulation_steps steps, is the first one at or after a multiple
+// of checkpoint_interval
+bool is_peft_checkpoint_step(int training_step,
+                             int gradient_accumulation_steps,
+                             int checkpoint_interval);
+
+// Returns the largest n such that checkpoints_folder/step_<n> holds all of
+// expected_files (paths relative to the step folder), or -1 if there is no
+// such checkpoint. Files only appear once fully written, so this is the
+// latest checkpoint a run can resume from.
+int find_latest_peft_checkpoint(std::string const &checkpoints_folder,
+                                std::vector<std::string> const &expected_files);
+
+}; // namespace FlexFlow
+
+#endif // _FLEXFLOW_UTILS_PEFT_CHECKPOINT_WRITER_H_
@@ -0,0 +1,71 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FLEXFLOW_UTILS_PEFT_CHUNKING_H_
+#define _FLEXFLOW_UTILS_PEFT_CHUNKING_H_
+
+namespace FlexFlow {
+
+// A chunk of a finetuning dataset entry to process in a batch
+struct PeftChunk {
+  int first_token_depth = 0;
+  int num_tokens = 0;
+  // whether the chunk runs its backward pass, or only its forward pass to
+  // fill the KV cache
+  bool bwd = false;
+  // whether the chunk is the first or the last of the entry to run its
+  // backward pass
+  bool first_bwd_chunk = false;
+  bool last_bwd_chunk = false;
+};
+
+// Next chunk of a dataset entry with entry_length tokens to add to a batch
+// that has num_free_tokens free tokens. The keys and values of the first
+// num_fwd_tokens tokens of the entry are in the KV cache, and the last
+// num_bwd_tokens tokens have run their backward pass.
+//
+// An entry that does not fit in the free tokens is split into chunks. With
+// truncated_backprop, each chunk runs its forward and backward passes in one
+// batch, and its gradients do not reach the keys and values of the earlier
+// chunks. Otherwise, the chunks first run their forward pass to fill the KV
+// cache, then run their backward pass from the last to the first one,
+// recomputing their activations, so that the gradients of the keys and values
+// of the earlier chunks are accumulated until these chunks run their backward
+// pass. Returns an empty chunk only if there are no free tokens.
+PeftChunk get_next_peft_chunk(int entry_length,
+                              int num_fwd_tokens,
+                              int num_bwd_tokens,
+                              int num_free_tokens,
+                              bool truncated_backprop);
+
+// Sets labels to the labels of the num_tokens tokens of a chunk of a dataset
+// entry, where each token is labeled with the one that follows it. The last
+// token of the chunk is labeled with next_token_id, the first token of the
+// next chunk, and the last token of the entry (next_token_id < 0) has no
+// label. Returns the number of labeled tokens, the first ones of the chunk.
+int get_peft_chunk_labels(int const *tokens,
+                          int num_tokens,
+                          int next_token_id,
+                          int *labels);
+
+// Factor applied to the loss gradients of a chunk of an entry with
+// entry_length tokens. The loss is averaged over the labeled tokens of the
+// whole entry, so that the gradients accumulated over its chunks are the
+// ones of the unchunked entry.
+float get_peft_loss_scale(int entry_length, int num_tokens);
+
+}; // namespace FlexFlow
+
+#endif // _FLEXFLOW_UTILS_PEFT_CHUNKING_H_
@@ -17,15 +17,21 @@
 #define _FLEXFLOW_UTILS_PEFT_WEIGHT_ALLOCATOR_H_
 
 #include "flexflow/config.h"
+#include "flexflow/utils/lora_adapter_pool.h"
 #include <mutex>
 
 namespace FlexFlow {
 
 class PEFTWeightAllocator {
 public:
-  PEFTWeightAllocator(void *_base_ptr, size_t _total_size)
+  PEFTWeightAllocator(void *_base_ptr,
+                      size_t _total_size,
+                      size_t _adapter_pool_size = 0)
       : base_ptr(_base_ptr), total_size(_total_size), sync_offset(0),
-        local_offset(_total_size) {}
+        local_offset(_total_size - _adapter_pool_size),
+        adapter_pool(_adapter_pool_size), paging_step(0) {
+    assert(_adapter_pool_size < _total_size);
+  }
 
   inline void *allocate_sync_weights_untyped(PEFTModelID const &peft_model_id,
                                              size_t datalen) {
@@ -79,12 +85,61 @@ public:
         allocate_local_weights_untyped(peft_model_id, sizeof(DT) * count));
   }
 
+  // Paged weights live in an adapter pool at the top of the reserve space
+  // and are only resident while recently used (see LoraAdapterPool)
+  bool has_adapter_pool() const {
+    return adapter_pool.get_capacity() > 0;
+  }
+
+  LoraAdapterPool::BlockId register_paged_weights(size_t datalen) {
+    const std::lock_guard<std::mutex> lock(peft_weight_allocator_mutex);
+    return adapter_pool.add_block(datalen);
+  }
+
+  // All the LoRA layers of a batch share a paging step, so that the blocks
+  // the batch needs in one layer never evict those of an earlier layer.
+  // Layers run in increasing id order on each GPU, so a layer whose id is not
+  // larger than the previous one, or of another model, starts the next batch.
+  // Copies into the pool are ordered on the task stream.
+  uint64_t begin_paging_step(LayerID const &layer_guid) {
+    const std::lock_guard<std::mutex> lock(peft_weight_allocator_mutex);
+    if (paging_step == 0 || layer_guid.model_id != paging_layer.model_id ||
+        layer_guid.id <= paging_layer.id) {
+      paging_step++;
+    }
+    paging_layer = layer_guid;
+    return paging_step;
+  }
+
+  // Returns the device address of the block, or nullptr if the pool cannot
+  // hold it along with the blocks already acquired by this step. The moves
+  // are relative to get_adapter_pool_ptr().
+  void *acquire_paged_weights(LoraAdapterPool::BlockId block,
+                              uint64_t step,
+                              bool &needs_load,
+                              std::vector<LoraAdapterPool::Move> &moves) {
+    const std::lock_guard<std::mutex> lock(peft_weight_allocator_mutex);
+    size_t offset = adapter_pool.acquire(block, step, needs_load, moves);
+    if (offset == LoraAdapterPool::NONE) {
+      return nullptr;
+    }
+    return get_adapter_pool_ptr() + offset;
+  }
+
+  char *get_adapter_pool_ptr() {
+    return static_cast<char *>(base_ptr) + total_size -
+           adapter_pool.get_capacity();
+  }
+
 public:
   void *base_ptr;
   size_t total_size;
   off_t sync_offset, local_offset;
   std::unordered_map<PEFTModelID, std::pair<off_t, size_t>> sync_weights;
   std::mutex peft_weight_allocator_mutex;
+  LoraAdapterPool adapter_pool;
+  uint64_t paging_step;
+  LayerID paging_layer;
 };
 
 }; // namespace FlexFlow
@@ -0,0 +1,83 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FLEXFLOW_UTILS_ROW_SPARSE_GRADIENT_H_
+#define _FLEXFLOW_UTILS_ROW_SPARSE_GRADIENT_H_
+
+#include "flexflow/ffconst.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace FlexFlow {
+
+// Gradient of an embedding table as the rows a batch touched, each listed
+// once in increasing order with the sum of its gradients, instead of a
+// dense tensor the size of the table. Applying it with apply_sgd() or
+// apply_rowwise_adagrad() only reads and writes those rows.
+class RowSparseGradient {
+public:
+  // Collects the gradient of num_bags bags, where bag b holds the next
+  // lengths[b] entries of indices and row b of output_grad (block_size
+  // floats) is its gradient, divided by the bag length for AGGR_MODE_AVG.
+  // Duplicate indices are grouped with an LSD radix sort that only visits
+  // the bytes needed to represent num_rows - 1.
+  template <typename TI>
+  void build(TI const *indices,
+             int const *lengths,
+             int num_bags,
+             float const *output_grad,
+             int64_t num_rows,
+             int block_size,
+             AggrMode aggr);
+
+  // weight[r] -= lr * (g[r] + weight_decay * weight[r])
+  void apply_sgd(float lr, float weight_decay, float *weight) const;
+  // Adagrad with one accumulator per row:
+  //   state[r] += mean(g'[r] * g'[r]), with g' = g + weight_decay * weight
+  //   weight[r] -= lr * g'[r] / (sqrt(state[r]) + epsilon)
+  void apply_rowwise_adagrad(float lr,
+                             float weight_decay,
+                             float epsilon,
+                             float *weight,
+                             float *state) const;
+
+  size_t num_unique_rows() const {
+    return rows.size();
+  }
+  int get_block_size() const {
+    return block_size;
+  }
+  // the i-th row touched, in increasing order, and its gradient
+  int64_t row(size_t i) const {
+    return rows[i];
+  }
+  float const *row_values(size_t i) const {
+    return values.data() + i * block_size;
+  }
+
+private:
+  int block_size = 0;
+  std::vector<int64_t> rows;
+  std::vector<float> values;
+  // radix sort buffers, kept to avoid reallocating them every batch
+  std::vector<uint64_t> keys, sorted_keys;
+  std::vector<uint32_t> entries, sorted_entries;
+  std::vector<int> entry_bags;
+};
+
+}; // namespace FlexFlow
+
+#endif // _FLEXFLOW_UTILS_ROW_SPARSE_GRADIENT_H_
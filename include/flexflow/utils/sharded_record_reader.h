@@ -0,0 +1,106 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FLEXFLOW_UTILS_SHARDED_RECORD_READER_H_
+#define _FLEXFLOW_UTILS_SHARDED_RECORD_READER_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace FlexFlow {
+
+// Streams batches of fixed-size records from a dataset that is split into
+// shard files, so that training does not need the whole dataset in host
+// memory. The shards are read in order, as if concatenated, and each holds
+// a whole number of records. Background threads read the next batches with
+// pread() into a ring of buffers while the current batch is consumed. With a
+// shuffle seed, each epoch visits the records in the order of an
+// EpochSampler.
+class ShardedRecordReader {
+public:
+  ShardedRecordReader(std::vector<std::string> const &shard_paths,
+                      size_t record_size,
+                      int batch_size,
+                      int num_prefetch_batches = 2,
+                      int num_threads = 2,
+                      int shuffle_seed = -1);
+  ~ShardedRecordReader();
+
+  size_t get_num_records() const {
+    return num_records;
+  }
+  // Batches per epoch; the records after the last full batch are skipped
+  int get_num_batches() const {
+    return num_batches;
+  }
+  size_t get_batch_size_in_bytes() const {
+    return batch_size * record_size;
+  }
+  // Blocks until the next batch is read and returns its records, which stay
+  // valid until the next call to next_batch() or reset(). Epochs follow each
+  // other without a reset().
+  char const *next_batch();
+  // Restarts at the first batch of the next epoch. Batches that were already
+  // prefetched are kept if the reader is at the start of an epoch.
+  void reset();
+
+  size_t get_bytes_read();
+  // Read throughput over the time at least one read was in flight
+  double get_bytes_per_second();
+  // Time next_batch() waited for reads to finish
+  double get_wait_seconds();
+
+private:
+  struct Shard {
+    std::string path;
+    int fd;
+    size_t first_record, num_records;
+  };
+  struct Slot {
+    std::vector<char> data;
+    long batch;
+    bool ready;
+  };
+  void read_loop();
+  std::vector<size_t> const &get_epoch_order(long epoch);
+  void read_batch(size_t const *records, char *data);
+  void read_records(size_t first_record, size_t count, char *data);
+  static double now();
+
+  std::vector<Shard> shards;
+  size_t record_size, num_records;
+  int batch_size, num_batches, shuffle_seed;
+  std::map<long, std::vector<size_t>> epoch_orders;
+
+  std::mutex mutex;
+  std::condition_variable slot_ready, slot_free;
+  // batch b of the (unbounded) sequence of batches lives in slot b % size
+  std::vector<Slot> slots;
+  long next_to_read, next_to_consume;
+  int num_reading;
+  bool resetting, terminating;
+  size_t bytes_read;
+  double busy_seconds, busy_start, wait_seconds;
+  std::vector<std::thread> readers;
+};
+
+}; // namespace FlexFlow
+
+#endif // _FLEXFLOW_UTILS_SHARDED_RECORD_READER_H_
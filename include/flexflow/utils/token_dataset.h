@@ -0,0 +1,108 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FLEXFLOW_UTILS_TOKEN_DATASET_H
+#define _FLEXFLOW_UTILS_TOKEN_DATASET_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace FlexFlow {
+
+// Read-only view of a pre-tokenized dataset file. Each entry is a pair of
+// token sequences (an input and an optional output). The file is
+// memory-mapped, so opening it only touches the header, and tokens are paged
+// in as they are read.
+//
+// File layout (little-endian):
+//   Header                                 (64 bytes)
+//   uint64_t offsets[2 * num_entries + 1]  (in tokens)
+//   int32_t  tokens[num_tokens]
+// The input of entry i is tokens[offsets[2i], offsets[2i+1]) and its output
+// is tokens[offsets[2i+1], offsets[2i+2]). Tokens are stored exactly as
+// produced by the tokenizer, without BOS/EOS tokens.
+//
+// Files are produced by inference/utils/tokenize_dataset.py or
+// TokenDataset::write.
+class TokenDataset {
+public:
+  static char const MAGIC[8];
+  static uint32_t const VERSION = 1;
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t num_entries;
+    uint64_t num_tokens;
+    uint64_t offsets_offset; // in bytes from the start of the file
+    uint64_t tokens_offset;  // in bytes from the start of the file
+    uint64_t reserved[2];
+  };
+  static_assert(sizeof(Header) == 64, "Unexpected TokenDataset header size");
+
+  struct TokenSpan {
+    int32_t const *data;
+    size_t size;
+    int32_t operator[](size_t i) const {
+      return data[i];
+    }
+    std::vector<int32_t> to_vector() const {
+      return std::vector<int32_t>(data, data + size);
+    }
+  };
+
+  explicit TokenDataset(std::string const &filepath);
+  ~TokenDataset();
+  TokenDataset(TokenDataset const &) = delete;
+  TokenDataset &operator=(TokenDataset const &) = delete;
+
+  // Returns true if the file starts with the TokenDataset magic bytes
+  static bool is_token_dataset(std::string const &filepath);
+  static void
+      write(std::string const &filepath,
+            std::vector<std::pair<std::vector<int32_t>,
+                                  std::vector<int32_t>>> const &entries);
+
+  size_t size() const {
+    return num_entries;
+  }
+  size_t get_num_tokens() const {
+    return num_tokens;
+  }
+  TokenSpan input(size_t entry) const;
+  TokenSpan output(size_t entry) const;
+  // Length of the longest input + output, computed from the offsets only
+  size_t max_entry_length() const;
+  std::string const &get_filepath() const {
+    return filepath;
+  }
+
+private:
+  std::string filepath;
+  int fd;
+  void *mapped;
+  size_t mapped_size;
+  size_t num_entries;
+  size_t num_tokens;
+  uint64_t const *offsets;
+  int32_t const *tokens;
+};
+
+}; // namespace FlexFlow
+
+#endif // _FLEXFLOW_UTILS_TOKEN_DATASET_H
@@ -256,7 +256,20 @@ void FlexFlow::top_level_task(Task const *task,
   rm->start_background_server(&model);
 
   int total_num_requests = 0;
-  {
+  if (TokenDataset::is_token_dataset(file_paths.prompt_file_path)) {
+    // Pre-tokenized prompts (see inference/utils/tokenize_dataset.py)
+    TokenDataset prompts(file_paths.prompt_file_path);
+    std::vector<Request> requests;
+    for (size_t i = 0; i < prompts.size(); i++) {
+      Request inference_req;
+      inference_req.tokens = prompts.input(i).to_vector();
+      inference_req.max_sequence_length = 128;
+      requests.push_back(inference_req);
+      total_num_requests++;
+    }
+    printf("Loaded %d pre-tokenized prompts\n", total_num_requests);
+    std::vector<GenerationResult> result = model.generate(requests);
+  } else {
     using json = nlohmann::json;
     std::ifstream file_handle(file_paths.prompt_file_path);
     assert(file_handle.good() && "Prompt file does not exist.");
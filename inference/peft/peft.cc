@@ -326,7 +326,20 @@ void FlexFlow::top_level_task(Task const *task,
     std::vector<Request> requests;
 
     // Add inference requests
-    if (!file_paths.prompt_file_path.empty()) {
+    if (!file_paths.prompt_file_path.empty() &&
+        TokenDataset::is_token_dataset(file_paths.prompt_file_path)) {
+      // Pre-tokenized prompts (see inference/utils/tokenize_dataset.py)
+      TokenDataset prompts(file_paths.prompt_file_path);
+      for (size_t i = 0; i < prompts.size(); i++) {
+        Request inference_req;
+        inference_req.tokens = prompts.input(i).to_vector();
+        inference_req.max_sequence_length = 128;
+        inference_req.peft_model_id =
+            (peft_model_id != nullptr) ? *peft_model_id : PEFTModelID::NO_ID;
+        requests.push_back(inference_req);
+      }
+      printf("Loaded %zu pre-tokenized inference prompts\n", prompts.size());
+    } else if (!file_paths.prompt_file_path.empty()) {
       using json = nlohmann::json;
       std::ifstream file_handle(file_paths.prompt_file_path);
       assert(file_handle.good() && "Prompt file does not exist.");
@@ -137,11 +137,15 @@ void parse_input_args(char **argv,
 
 void get_model_meta(FilePaths &file_paths,
                     ModelMeta &model_metadata,
-                    bool use_full_precision) {
+                    bool use_full_precision,
+                    bool ngram_speculation) {
+  // With --ngram-speculation, token trees are drafted from n-grams instead of
+  // SSMs
   if (model_metadata.model_names.llm_model_name.empty() ||
-      model_metadata.model_names.ssm_model_names.size() == 0) {
-    assert(false && "SpecInfer needs at least one LLM and one SSM for "
-                    "speculative inference");
+      (model_metadata.model_names.ssm_model_names.size() == 0 &&
+       !ngram_speculation)) {
+    assert(false && "SpecInfer needs at least one LLM and one SSM (or "
+                    "--ngram-speculation) for speculative inference");
   }
   model_metadata.llm_model_config_path =
       join_path({file_paths.cache_folder_path,
@@ -294,7 +298,10 @@ void FlexFlow::top_level_task(Task const *task,
                    max_sequence_length,
                    expansion_degree);
 
-  get_model_meta(file_paths, model_metadata, use_full_precision);
+  get_model_meta(file_paths,
+                 model_metadata,
+                 use_full_precision,
+                 ffconfig.ngram_speculation);
 
   assert(ffconfig.data_parallelism_degree * ffconfig.tensor_parallelism_degree *
              ffconfig.pipeline_parallelism_degree ==
@@ -405,7 +412,20 @@ void FlexFlow::top_level_task(Task const *task,
 
   // Register requests from prompt file
   int total_num_requests = 0;
-  {
+  if (TokenDataset::is_token_dataset(file_paths.prompt_file_path)) {
+    // Pre-tokenized prompts (see inference/utils/tokenize_dataset.py)
+    TokenDataset prompts(file_paths.prompt_file_path);
+    std::vector<Request> requests;
+    for (size_t i = 0; i < prompts.size(); i++) {
+      Request inference_req;
+      inference_req.tokens = prompts.input(i).to_vector();
+      inference_req.max_sequence_length = 128;
+      requests.push_back(inference_req);
+      total_num_requests++;
+    }
+    printf("Loaded %d pre-tokenized prompts\n", total_num_requests);
+    tree_model.generate(requests);
+  } else {
     using json = nlohmann::json;
     std::ifstream file_handle(file_paths.prompt_file_path);
     assert(file_handle.good() && "Prompt file does not exist.");
@@ -0,0 +1,89 @@
+#!/usr/bin/env python
+"""Convert a JSON prompt/dataset file into FlexFlow's pre-tokenized format.
+
+The input is the same JSON list of strings that the inference drivers accept
+via -prompt and -finetuning-dataset. The output can be passed to the same flags
+in place of the JSON file. Entries are tokenized without special tokens, since
+the RequestManager adds the BOS token itself.
+
+See include/flexflow/utils/token_dataset.h for the file layout.
+"""
+import argparse, json, struct
+import numpy as np
+from transformers import AutoTokenizer
+
+MAGIC = b"FFTOKDS\0"
+VERSION = 1
+HEADER_FORMAT = "<8sIIQQQQ16x"
+
+
+def parse_args():
+    parser = argparse.ArgumentParser()
+    parser.add_argument(
+        "model_name", type=str, help="Name of the model whose tokenizer to use"
+    )
+    parser.add_argument("input_file", type=str, help="JSON list of strings")
+    parser.add_argument("output_file", type=str, help="Output token dataset file")
+    parser.add_argument(
+        "--batch-size",
+        type=int,
+        default=1024,
+        help="Number of entries to tokenize at once",
+    )
+    return parser.parse_args()
+
+
+def write_token_dataset(output_file, inputs, outputs=None):
+    """Write lists of input (and optional output) token arrays to output_file"""
+    if outputs is None:
+        outputs = [np.empty(0, dtype=np.int32)] * len(inputs)
+    assert len(inputs) == len(outputs)
+    lengths = np.empty(2 * len(inputs), dtype=np.uint64)
+    lengths[0::2] = [len(x) for x in inputs]
+    lengths[1::2] = [len(x) for x in outputs]
+    offsets = np.zeros(2 * len(inputs) + 1, dtype=np.uint64)
+    np.cumsum(lengths, out=offsets[1:])
+    num_tokens = int(offsets[-1])
+    header_size = struct.calcsize(HEADER_FORMAT)
+    offsets_offset = header_size
+    tokens_offset = offsets_offset + offsets.nbytes
+    with open(output_file, "wb") as f:
+        f.write(
+            struct.pack(
+                HEADER_FORMAT,
+                MAGIC,
+                VERSION,
+                header_size,
+                len(inputs),
+                num_tokens,
+                offsets_offset,
+                tokens_offset,
+            )
+        )
+        f.write(offsets.astype("<u8").tobytes())
+        for inp, out in zip(inputs, outputs):
+            f.write(np.asarray(inp, dtype="<i4").tobytes())
+            f.write(np.asarray(out, dtype="<i4").tobytes())
+    return num_tokens
+
+
+def main(args):
+    tokenizer = AutoTokenizer.from_pretrained(args.model_name)
+    with open(args.input_file, "r") as f:
+        texts = json.load(f)
+    assert all(isinstance(t, str) for t in texts), "Expected a JSON list of strings"
+    inputs = []
+    for i in range(0, len(texts), args.batch_size):
+        batch = tokenizer(
+            texts[i : i + args.batch_size], add_special_tokens=False
+        ).input_ids
+        inputs.extend(np.asarray(ids, dtype=np.int32) for ids in batch)
+    num_tokens = write_token_dataset(args.output_file, inputs)
+    print(
+        f"Wrote {len(inputs)} entries ({num_tokens} tokens) to {args.output_file}"
+    )
+
+
+if __name__ == "__main__":
+    args = parse_args()
+    main(args)
@@ -79,6 +79,16 @@ ff_arg_to_sysarg = {
     "search_num_workers": "--search-num-workers",
     "base_optimize_threshold": "--base-optimize-threshold",
     "python_data_loader_type": "--python-data-loader-type",
+    "data_shuffle_seed": "--data-shuffle-seed",
+    "embedding_cpu_threads": "--embedding-cpu-threads",
+    "embedding_cache_rows": "--embedding-cache-rows",
+    "embedding_cache_admit_threshold": "--embedding-cache-admit",
+    "fused_optimizer_update": "--fused-optimizer-update",
+    "gradient_bucket_size": "--gradient-bucket-size",
+    "mixed_precision": "--mixed-precision",
+    "loss_scale": "--loss-scale",
+    "loss_scale_window": "--loss-scale-window",
+    "shard_optimizer_states": "--shard-optimizer-states",
     "substitution_json_path": "--substitution-json",
     "perform_memory_search": "--memory-search",
     # Inference args
@@ -92,6 +102,18 @@ ff_arg_to_sysarg = {
     "enable_peft": "-enable-peft",
     "peft_activation_reserve_space_size": "-peft-activation-reserve-space-size",
     "peft_weight_reserve_space_size": "-peft-weight-reserve-space-size",
+    "peft_adapter_pool_size": "-peft-adapter-pool-size",
+    "peft_truncated_backprop": "--peft-truncated-backprop",
+    "lazy_weight_loading": "--lazy-weight-loading",
+    "weight_prefetch_depth": "-weight-prefetch-depth",
+    "num_tokenizer_workers": "-tokenizer-workers",
+    "adaptive_speculation": "--adaptive-speculation",
+    "speculation_token_budget": "-speculation-token-budget",
+    "speculation_stats_file": "-speculation-stats-file",
+    "ngram_speculation": "--ngram-speculation",
+    "ngram_corpus_file": "-ngram-corpus",
+    "coserving_latency_slo": "-coserving-latency-slo",
+    "coserving_log_file": "-coserving-log-file",
 }
 
 
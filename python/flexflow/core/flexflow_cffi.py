@@ -22,6 +22,7 @@ from flexflow.type import (
     ActiMode,
     RegularizerMode,
     AggrMode,
+    EmbeddingUpdateType,
     PoolType,
     DataType,
     LossType,
@@ -1461,6 +1462,8 @@ class SingleDataLoader(object):
         assert type(input) is Tensor, "SingleDataLoader input is wrong"
         if type(full_input) is Tensor:
             self.init_from_tensor(ffmodel, input, full_input, num_samples, data_type)
+        elif type(full_input) is list:
+            self.init_from_shards(ffmodel, input, full_input, num_samples, data_type)
         else:
             self.init_from_ptr(ffmodel, input, full_input, num_samples, data_type)
         self._handle = ffi.gc(self.handle, ffc().flexflow_single_dataloader_destroy)
@@ -1479,6 +1482,18 @@ class SingleDataLoader(object):
             ffmodel.handle, input.handle, full_input, num_samples, c_data_type
         )
 
+    def init_from_shards(self, ffmodel, input, shard_paths, num_prefetch_batches, data_type):
+        c_data_type = enum_to_int(DataType, data_type)
+        c_paths = [get_c_name(path) for path in shard_paths]
+        self.handle = ffc().flexflow_single_dataloader_create_streaming(
+            ffmodel.handle,
+            input.handle,
+            c_paths,
+            len(c_paths),
+            num_prefetch_batches,
+            c_data_type,
+        )
+
     @property
     def num_samples(self):
         return ffc().flexflow_single_dataloader_get_num_samples(self.handle)
@@ -2551,6 +2566,8 @@ class FFModel(object):
         shared_op=None,
         kernel_initializer=None,
         name=None,
+        update_type=EmbeddingUpdateType.EMBEDDING_UPDATE_DENSE,
+        lengths=None,
     ):
         """Layer that turns positive integers into dense vectors of fixed size
 
@@ -2578,11 +2595,24 @@ class FFModel(object):
         :param name: the name of the layer. Default is None.
         :type name: string
 
+        :param update_type: how the table is trained. EMBEDDING_UPDATE_SPARSE_SGD and EMBEDDING_UPDATE_ROWWISE_ADAGRAD update only the rows of the batch in the backward pass, with the learning rate of the model's optimizer, and require a DT_FLOAT table. Default is EMBEDDING_UPDATE_DENSE.
+        :type update_type: EmbeddingUpdateType
+
+        :param lengths: a DT_INT32 tensor with the shape of input without its last dimension, for ragged bags. Bag b then only holds the first lengths[b] of its indices, and aggr must not be AGGR_MODE_NONE. Default is None, i.e., every bag holds all the indices of the input's last dimension.
+        :type lengths: Tensor
+
         :returns:  Tensor -- the output tensor.
         """
         c_name = get_c_name(name)
+        if lengths is None:
+            lengths_handle = ffi.new("flexflow_tensor_t *")
+            lengths_handle.impl = ffi.NULL
+            lengths_handle = lengths_handle[0]
+        else:
+            lengths_handle = lengths.handle
         shared_op_handle = self.__get_op_handle(shared_op)
         c_aggr = enum_to_int(AggrMode, aggr)
+        c_update_type = enum_to_int(EmbeddingUpdateType, update_type)
         c_dtype = enum_to_int(DataType, dtype)
         if kernel_initializer is None:
             kernel_initializer = GlorotUniformInitializer(42)
@@ -2602,6 +2632,8 @@ class FFModel(object):
             shared_op_handle,
             kernel_initializer.handle,
             c_name,
+            c_update_type,
+            lengths_handle,
         )
         # NOTE: We must keep a reference to the initializer or else it will be
         # immediately destructed
@@ -4430,6 +4462,7 @@ class FFModel(object):
                 self.backward()
                 self.update()
                 self._ffconfig.end_trace(self._tracing_id)
+        self.flush_embedding_caches()
 
     def eval(self, x=None, y=None, batch_size=None):
         """Returns the loss value & metrics values for the model in test mode.
@@ -4479,6 +4512,14 @@ class FFModel(object):
         """
         ffc().flexflow_model_zero_gradients(self.handle)
 
+    def flush_embedding_caches(self):
+        """Write the rows updated in the device caches of host-resident
+        embedding tables back to the tables.
+
+        :returns:  None -- no returns.
+        """
+        ffc().flexflow_model_flush_embedding_caches(self.handle)
+
     def set_optimizer(self, optimizer):
         if isinstance(optimizer, SGDOptimizer) == True:
             ffc().flexflow_model_set_sgd_optimizer(self.handle, optimizer.handle)
@@ -4547,6 +4588,29 @@ class FFModel(object):
             else:
                 return self.__create_data_loader_ptr(batch_tensor, full_array)
 
+    def create_streaming_data_loader(
+        self, batch_tensor, shard_paths, data_type, num_prefetch_batches=2
+    ):
+        """Create a SingleDataloader instance that streams the data from files.
+
+        :param batch_tensor: a batch-sized tensor. Usually it is a input tensor of the model.
+        :type batch_tensor: Tensor
+
+        :param shard_paths: files of raw samples (e.g. written with numpy.ndarray.tofile), read in order.
+        :type shard_paths: list of str
+
+        :param data_type: the type of the samples.
+        :type data_type: DataType
+
+        :param num_prefetch_batches: number of batches read ahead on background threads.
+        :type num_prefetch_batches: int
+
+        :returns:  SingleDataloader -- returns a dataloader instance.
+        """
+        return SingleDataLoader(
+            self, batch_tensor, list(shard_paths), num_prefetch_batches, data_type
+        )
+
     def __create_data_loader_attach(self, batch_tensor, full_array):
         full_array_shape = full_array.shape
         num_samples = full_array_shape[0]
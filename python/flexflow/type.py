@@ -52,6 +52,12 @@ class OptimizerType(Enum):
     OPTIMIZER_TYPE_ADAM = 62
 
 
+class EmbeddingUpdateType(Enum):
+    EMBEDDING_UPDATE_DENSE = 63
+    EMBEDDING_UPDATE_SPARSE_SGD = 64
+    EMBEDDING_UPDATE_ROWWISE_ADAGRAD = 65
+
+
 class CompMode(Enum):
     TRAINING = 70
     INFERENCE = 71
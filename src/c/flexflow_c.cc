@@ -263,6 +263,11 @@ void flexflow_model_zero_gradients(flexflow_model_t handle_) {
   handle->zero_gradients();
 }
 
+void flexflow_model_flush_embedding_caches(flexflow_model_t handle_) {
+  FFModel *handle = FFCObjectWrapper::unwrap(handle_);
+  handle->flush_embedding_caches();
+}
+
 flexflow_tensor_t flexflow_model_add_exp(flexflow_model_t handle_,
                                          const flexflow_tensor_t x_,
                                          char const *name) {
@@ -523,9 +528,12 @@ flexflow_tensor_t
                                  DataType dtype,
                                  flexflow_op_t shared_op_,
                                  flexflow_initializer_t kernel_initializer_,
-                                 char const *name) {
+                                 char const *name,
+                                 enum EmbeddingUpdateType update_type,
+                                 const flexflow_tensor_t lengths_) {
   FFModel *handle = FFCObjectWrapper::unwrap(handle_);
   const Tensor input = FFCObjectWrapper::unwrap_const(input_);
+  const Tensor lengths = FFCObjectWrapper::unwrap_const(lengths_);
   Layer *shared_op = FFCObjectWrapper::unwrap(shared_op_);
   Initializer *kernel_initializer =
       FFCObjectWrapper::unwrap(kernel_initializer_);
@@ -538,9 +546,12 @@ flexflow_tensor_t
                                     dtype,
                                     shared_op,
                                     kernel_initializer,
-                                    name);
+                                    name,
+                                    update_type,
+                                    lengths);
   DEBUG_PRINT("[Embedding] new Tensor %p, input %p, num_entries %d, out_dim "
-              "%d, aggr %d, dtype %d, shared_op %p, kernel_init %p, name %s",
+              "%d, aggr %d, dtype %d, shared_op %p, kernel_init %p, name %s, "
+              "update_type %d, lengths %p",
               tensor,
               input,
               num_entries,
@@ -549,7 +560,9 @@ flexflow_tensor_t
               dtype,
               shared_op,
               kernel_initializer,
-              name);
+              name,
+              update_type,
+              lengths);
   return FFCObjectWrapper::wrap(tensor);
 }
 
@@ -2357,6 +2370,25 @@ flexflow_single_dataloader_t
   return FFCObjectWrapper::wrap(dataloader);
 }
 
+flexflow_single_dataloader_t flexflow_single_dataloader_create_streaming(
+    flexflow_model_t ffmodel_,
+    flexflow_tensor_t input_,
+    char const **shard_paths,
+    int num_shards,
+    int num_prefetch_batches,
+    enum DataType data_type) {
+  FFModel *ffmodel = FFCObjectWrapper::unwrap(ffmodel_);
+  Tensor input = FFCObjectWrapper::unwrap(input_);
+  assert(input->parallel_tensor != nullptr);
+  std::vector<std::string> paths(shard_paths, shard_paths + num_shards);
+  SingleDataLoader *dataloader = new SingleDataLoader(*ffmodel,
+                                                      input->parallel_tensor,
+                                                      paths,
+                                                      data_type,
+                                                      num_prefetch_batches);
+  return FFCObjectWrapper::wrap(dataloader);
+}
+
 void flexflow_single_dataloader_destroy(flexflow_single_dataloader_t handle_) {
   SingleDataLoader *handle = FFCObjectWrapper::unwrap(handle_);
   DEBUG_PRINT("[SingleDataLoader] delete %p", handle);
@@ -14,6 +14,7 @@
  */
 
 #include "flexflow/dataloader.h"
+#include "flexflow/ffconst_utils.h"
 #include <fstream>
 #include <sstream>
 #include <string>
@@ -30,6 +31,8 @@ SingleDataLoader::SingleDataLoader(FFModel &ff,
   Runtime *runtime = ff.config.lg_hlr;
   num_samples = num_samples_;
   datatype = datatype_;
+  shuffle_seed = ff.config.data_shuffle_seed;
+  epoch = 0;
   // Create full input
   assert(input->num_dims == full_input_->num_dims);
   for (int i = 0; i < input->num_dims - 1; i++) {
@@ -95,6 +98,8 @@ SingleDataLoader::SingleDataLoader(FFModel &ff,
                                    DataType datatype_) {
   num_samples = num_samples_;
   datatype = datatype_;
+  shuffle_seed = ff.config.data_shuffle_seed;
+  epoch = 0;
   // Currently assume that the leading dim of input is a replica dim of degree 1
   assert(input->dims[input->num_dims - 1].is_replica_dim);
   assert(input->dims[input->num_dims - 1].size == 1);
@@ -142,6 +147,59 @@ SingleDataLoader::SingleDataLoader(FFModel &ff,
   next_batch(ff);
 }
 
+SingleDataLoader::SingleDataLoader(FFModel &ff,
+                                   ParallelTensor input,
+                                   std::vector<std::string> const &shard_paths,
+                                   DataType datatype_,
+                                   int num_prefetch_batches) {
+  datatype = datatype_;
+  shuffle_seed = ff.config.data_shuffle_seed;
+  epoch = 0;
+  // Currently assume that the leading dim of input is a replica dim of degree 1
+  assert(input->dims[input->num_dims - 1].is_replica_dim);
+  assert(input->dims[input->num_dims - 1].size == 1);
+
+  batch_input = input;
+  ParallelDim dims[MAX_TENSOR_DIM];
+  for (int i = 1; i < input->num_dims; i++) {
+    dims[i - 1].size = input->dims[input->num_dims - 1 - i].size;
+    dims[i - 1].parallel_idx = -1;
+    dims[i - 1].degree = 1;
+  }
+  size_t size_per_sample = 1;
+  for (int i = 1; i < input->num_dims - 1; i++) {
+    assert(dims[i].size != 0);
+    size_per_sample *= dims[i].size;
+  }
+  stream.reset(
+      new ShardedRecordReader(shard_paths,
+                              size_per_sample * data_type_size(datatype),
+                              ff.config.batchSize,
+                              num_prefetch_batches,
+                              2 /*num_threads*/,
+                              shuffle_seed));
+  num_samples = stream->get_num_batches() * ff.config.batchSize;
+  printf("Streaming %lu samples from %lu data shards\n",
+         stream->get_num_records(),
+         shard_paths.size());
+  // full_input only holds the batch that is loaded next
+  dims[0].size = ff.config.batchSize;
+  switch (input->num_dims - 1) {
+#define DIMFUNC(DIM)                                                           \
+  case DIM: {                                                                  \
+    full_input = ff.create_parallel_tensor<DIM>(dims, datatype);               \
+    ff.map_tensor(full_input, NULL);                                           \
+    break;                                                                     \
+  }
+    LEGION_FOREACH_N(DIMFUNC)
+#undef DIMFUNC
+    default:
+      assert(false);
+  }
+  reset();
+  next_batch(ff);
+}
+
 template <int NDIM>
 void SingleDataLoader::index_loader_xd_launcher(FFModel &ff,
                                                 int task_id,
@@ -202,10 +260,58 @@ void SingleDataLoader::index_loader_xd_launcher(FFModel &ff,
 }
 
 void SingleDataLoader::reset() {
+  // Epochs are counted like in the streaming reader, which moves on to the
+  // next epoch when reset before reaching its end
+  if (next_index > 0) {
+    epoch++;
+  }
   next_index = 0;
+  if (shuffle_seed >= 0 && stream == nullptr) {
+    // the sample dim is right below the replica dim
+    int batch_size = batch_input->dims[batch_input->num_dims - 2].size;
+    EpochSampler(num_samples, batch_size, shuffle_seed)
+        .get_epoch_order(epoch, sample_order);
+  }
+  // The reader is reset by the next stream task, so that the batches that
+  // were already launched are loaded first
+  stream_reset_pending = stream != nullptr;
+  if (stream != nullptr && stream->get_bytes_read() > 0) {
+    printf("Streaming data loader: read %.1lf MB at %.1lf MB/s, waited %.3lf "
+           "s for data\n",
+           stream->get_bytes_read() / 1e6,
+           stream->get_bytes_per_second() / 1e6,
+           stream->get_wait_seconds());
+  }
 }
 
 void SingleDataLoader::next_batch(FFModel &ff) {
+  if (stream != nullptr) {
+    int stream_task_id = -1;
+    if (datatype == DT_FLOAT) {
+      stream_task_id = PY_DL_FLOAT_LOAD_STREAM_CPU_TASK_ID;
+    } else if (datatype == DT_INT32) {
+      stream_task_id = PY_DL_INT32_LOAD_STREAM_CPU_TASK_ID;
+    } else if (datatype == DT_INT64) {
+      stream_task_id = PY_DL_INT64_LOAD_STREAM_CPU_TASK_ID;
+    } else {
+      assert(0);
+    }
+    StreamLoadArg arg;
+    arg.reader = stream.get();
+    arg.reset = stream_reset_pending;
+    stream_reset_pending = false;
+    // Copy the next prefetched batch into full_input, from which the load
+    // tasks below gather the samples of each partition
+    TaskLauncher launcher(stream_task_id,
+                          TaskArgument(&arg, sizeof(StreamLoadArg)));
+    launcher.add_region_requirement(RegionRequirement(full_input->region,
+                                                      WRITE_DISCARD,
+                                                      EXCLUSIVE,
+                                                      full_input->region,
+                                                      MAP_TO_ZC_MEMORY));
+    launcher.add_field(0, FID_DATA);
+    ff.config.lg_hlr->execute_task(ff.config.lg_ctx, launcher);
+  }
   int task_id = -1;
   if (datatype == DT_FLOAT) {
     task_id = PY_DL_FLOAT_LOAD_BATCH_GPU_TASK_ID;
@@ -238,14 +344,15 @@ void SingleDataLoader::next_batch_xd_launcher(FFModel &ff, int task_id) {
     Domain domain =
         runtime->get_index_space_domain(ctx, batch_input->parallel_is);
     ArgumentMap argmap;
-    int idx = next_index;
+    int idx = stream != nullptr ? 0 : next_index;
     for (Domain::DomainPointIterator it(domain); it; it++) {
       SampleIdxs meta;
       assert(ff.config.batchSize == batch_input->dims[NDIM - 1].size);
       meta.num_samples =
           batch_input->dims[NDIM - 1].size / batch_input->dims[NDIM - 1].degree;
       for (int i = 0; i < meta.num_samples; i++) {
-        meta.idxs[i] = idx++;
+        meta.idxs[i] = sample_order.empty() ? idx : sample_order[idx];
+        idx++;
       }
       argmap.set_point(*it, TaskArgument(&meta, sizeof(SampleIdxs)));
     }
@@ -441,6 +548,54 @@ void SingleDataLoader::index_load_entire_dataset_from_numpy_with_dim(
   std::cout << std::endl;
 }
 
+// Task body
+template <typename DT>
+void SingleDataLoader::load_stream_batch(
+    Task const *task,
+    std::vector<PhysicalRegion> const &regions,
+    Context ctx,
+    Runtime *runtime) {
+  assert(regions.size() == 1);
+  assert(task->regions.size() == regions.size());
+  Domain domain = runtime->get_index_space_domain(
+      ctx, task->regions[0].region.get_index_space());
+  switch (domain.get_dim()) {
+#define DIMFUNC(DIM)                                                           \
+  case DIM:                                                                    \
+    return load_stream_batch_with_dim<DT, DIM>(task, regions, ctx, runtime);
+    LEGION_FOREACH_N(DIMFUNC)
+#undef DIMFUNC
+    default:
+      assert(false);
+  }
+}
+
+template <typename DT, int NDIM>
+void SingleDataLoader::load_stream_batch_with_dim(
+    Task const *task,
+    std::vector<PhysicalRegion> const &regions,
+    Context ctx,
+    Runtime *runtime) {
+  assert(regions.size() == 1);
+  assert(task->regions.size() == regions.size());
+  StreamLoadArg const *arg = (StreamLoadArg const *)task->args;
+  AccessorWO<DT, NDIM> const acc_input(regions[0], FID_DATA);
+  Rect<NDIM> rect_input = runtime->get_index_space_domain(
+      ctx, task->regions[0].region.get_index_space());
+  assert(acc_input.accessor.is_dense_arbitrary(rect_input));
+  assert(rect_input.volume() * sizeof(DT) ==
+         arg->reader->get_batch_size_in_bytes());
+
+  if (arg->reset) {
+    arg->reader->reset();
+  }
+  // blocks until the background readers have read the batch
+  char const *batch = arg->reader->next_batch();
+  memcpy(acc_input.ptr(rect_input.lo),
+         batch,
+         arg->reader->get_batch_size_in_bytes());
+}
+
 void SingleDataLoader::register_cpu_tasks(Runtime *runtime,
                                           bool pre_register,
                                           bool enable_control_replication) {
@@ -567,6 +722,60 @@ void SingleDataLoader::register_cpu_tasks(Runtime *runtime,
           registrar);
     }
   }
+  // float Load stream batch
+  {
+    TaskVariantRegistrar registrar(PY_DL_FLOAT_LOAD_STREAM_CPU_TASK_ID,
+                                   "Float Load Stream Batch");
+    registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
+    registrar.set_leaf();
+    if (pre_register) {
+      Runtime::preregister_task_variant<
+          SingleDataLoader::load_stream_batch<float>>(
+          registrar, "Float Load Stream Batch Task");
+    } else {
+      if (enable_control_replication) {
+        registrar.global_registration = false;
+      }
+      runtime->register_task_variant<
+          SingleDataLoader::load_stream_batch<float>>(registrar);
+    }
+  }
+  // int32 Load stream batch
+  {
+    TaskVariantRegistrar registrar(PY_DL_INT32_LOAD_STREAM_CPU_TASK_ID,
+                                   "Int32 Load Stream Batch");
+    registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
+    registrar.set_leaf();
+    if (pre_register) {
+      Runtime::preregister_task_variant<
+          SingleDataLoader::load_stream_batch<int32_t>>(
+          registrar, "Int32 Load Stream Batch Task");
+    } else {
+      if (enable_control_replication) {
+        registrar.global_registration = false;
+      }
+      runtime->register_task_variant<
+          SingleDataLoader::load_stream_batch<int32_t>>(registrar);
+    }
+  }
+  // int64 Load stream batch
+  {
+    TaskVariantRegistrar registrar(PY_DL_INT64_LOAD_STREAM_CPU_TASK_ID,
+                                   "Int64 Load Stream Batch");
+    registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
+    registrar.set_leaf();
+    if (pre_register) {
+      Runtime::preregister_task_variant<
+          SingleDataLoader::load_stream_batch<int64_t>>(
+          registrar, "Int64 Load Stream Batch Task");
+    } else {
+      if (enable_control_replication) {
+        registrar.global_registration = false;
+      }
+      runtime->register_task_variant<
+          SingleDataLoader::load_stream_batch<int64_t>>(registrar);
+    }
+  }
 }
 
 void SingleDataLoader::register_gpu_tasks(Runtime *runtime,
@@ -666,3 +875,19 @@ template void SingleDataLoader::index_load_entire_dataset_from_numpy<int64_t>(
     std::vector<PhysicalRegion> const &regions,
     Context ctx,
     Runtime *runtime);
+
+template void SingleDataLoader::load_stream_batch<float>(
+    Task const *task,
+    std::vector<PhysicalRegion> const &regions,
+    Context ctx,
+    Runtime *runtime);
+template void SingleDataLoader::load_stream_batch<int32_t>(
+    Task const *task,
+    std::vector<PhysicalRegion> const &regions,
+    Context ctx,
+    Runtime *runtime);
+template void SingleDataLoader::load_stream_batch<int64_t>(
+    Task const *task,
+    std::vector<PhysicalRegion> const &regions,
+    Context ctx,
+    Runtime *runtime);
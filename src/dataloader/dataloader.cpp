@@ -46,29 +46,29 @@ void SingleDataLoader::load_input(Task const *task,
   coord_t batch_size = batch_input_domain.hi()[num_dims - 1] -
                        batch_input_domain.lo()[num_dims - 1] + 1;
   coord_t num_elements_per_batch = batch_input_domain.get_volume() / batch_size;
-  // FIXME: currently assume continous indices
   assert(batch_size == meta->num_samples);
-  for (int i = 1; i < batch_size; i++) {
-    assert(meta->idxs[i] == meta->idxs[0] + i);
-  }
-  coord_t start_idx = meta->idxs[0];
-  const DT *input_zc = full_input_ptr + start_idx * num_elements_per_batch;
-  // const int point = task->index_point.point_data[0];
-  // printf("Load batch point %d, start_idx %ld, ptr %p\n", point, start_idx,
-  // input_zc);
   hipStream_t stream;
   checkCUDA(get_legion_stream(&stream));
-  // printf("ptr(%p, %p), idx0 %d nb_elements_per_batch %d, batch_size %d,
-  // %d\n", acc_full_input.ptr, input_zc, start_idx, num_elements_per_batch,
-  // batch_size, start_idx * num_elements_per_batch);
-  hipLaunchKernelGGL(HIP_KERNEL_NAME(copy_kernel<DT>),
-                     GET_BLOCKS(batch_input_domain.get_volume()),
-                     CUDA_NUM_THREADS,
-                     0,
-                     stream,
-                     batch_input_ptr,
-                     input_zc,
-                     batch_input_domain.get_volume());
+  // Shuffled batches are gathered, copying each run of consecutive samples
+  // at once
+  for (int i = 0; i < batch_size;) {
+    int run = 1;
+    while (i + run < batch_size && meta->idxs[i + run] == meta->idxs[i] + run) {
+      run++;
+    }
+    const DT *input_zc =
+        full_input_ptr + (coord_t)meta->idxs[i] * num_elements_per_batch;
+    coord_t num_elements = run * num_elements_per_batch;
+    hipLaunchKernelGGL(HIP_KERNEL_NAME(copy_kernel<DT>),
+                       GET_BLOCKS(num_elements),
+                       CUDA_NUM_THREADS,
+                       0,
+                       stream,
+                       batch_input_ptr + i * num_elements_per_batch,
+                       input_zc,
+                       num_elements);
+    i += run;
+  }
   checkCUDA(hipDeviceSynchronize());
 }
 
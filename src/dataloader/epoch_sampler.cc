@@ -0,0 +1,52 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "flexflow/utils/epoch_sampler.h"
+
+#include <algorithm>
+#include <cassert>
+#include <random>
+
+namespace FlexFlow {
+
+EpochSampler::EpochSampler(size_t _num_samples, int _batch_size, int _seed)
+    : num_samples(_num_samples), batch_size(_batch_size), seed(_seed) {
+  assert(batch_size > 0);
+}
+
+void EpochSampler::get_epoch_order(uint64_t epoch,
+                                   std::vector<size_t> &order) const {
+  order.resize(num_samples);
+  for (size_t i = 0; i < num_samples; i++) {
+    order[i] = i;
+  }
+  if (is_shuffled()) {
+    // Fisher-Yates with the raw engine output, whose sequence (unlike that
+    // of std::shuffle) is the same with every standard library
+    std::seed_seq seq{(uint32_t)seed, (uint32_t)epoch, (uint32_t)(epoch >> 32)};
+    std::mt19937_64 rng(seq);
+    for (size_t i = num_samples; i > 1; i--) {
+      std::swap(order[i - 1], order[rng() % i]);
+    }
+  }
+  order.resize(get_num_batches() * batch_size);
+  if (is_shuffled()) {
+    for (size_t i = 0; i < order.size(); i += batch_size) {
+      std::sort(order.begin() + i, order.begin() + i + batch_size);
+    }
+  }
+}
+
+}; // namespace FlexFlow
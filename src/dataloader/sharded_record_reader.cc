@@ -0,0 +1,265 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "flexflow/utils/sharded_record_reader.h"
+#include "flexflow/utils/epoch_sampler.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace FlexFlow {
+
+ShardedRecordReader::ShardedRecordReader(
+    std::vector<std::string> const &shard_paths,
+    size_t _record_size,
+    int _batch_size,
+    int num_prefetch_batches,
+    int num_threads,
+    int _shuffle_seed)
+    : record_size(_record_size), num_records(0), batch_size(_batch_size),
+      shuffle_seed(_shuffle_seed), next_to_read(0), next_to_consume(0),
+      num_reading(0), resetting(false), terminating(false), bytes_read(0),
+      busy_seconds(0), busy_start(0), wait_seconds(0) {
+  assert(record_size > 0 && batch_size > 0);
+  assert(num_prefetch_batches > 0 && num_threads > 0);
+  for (std::string const &path : shard_paths) {
+    Shard shard;
+    shard.path = path;
+    shard.fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (shard.fd < 0 || fstat(shard.fd, &st) != 0) {
+      printf("Unable to open data shard %s: %s\n",
+             path.c_str(),
+             strerror(errno));
+      assert(false);
+    }
+    if (st.st_size % record_size != 0) {
+      printf("Data shard %s (%lu bytes) does not hold whole records of %lu "
+             "bytes\n",
+             path.c_str(),
+             (size_t)st.st_size,
+             record_size);
+      assert(false);
+    }
+    shard.first_record = num_records;
+    shard.num_records = st.st_size / record_size;
+    if (shard.num_records == 0) {
+      close(shard.fd);
+      continue;
+    }
+    num_records += shard.num_records;
+    shards.push_back(shard);
+  }
+  num_batches = num_records / batch_size;
+  assert(num_batches > 0 && "the data shards hold less than one batch");
+  // one slot for the batch being consumed, the others for prefetching
+  slots.resize(num_prefetch_batches + 1);
+  for (Slot &slot : slots) {
+    slot.data.resize(get_batch_size_in_bytes());
+    slot.batch = -1;
+    slot.ready = false;
+  }
+  for (int i = 0; i < num_threads; i++) {
+    readers.push_back(std::thread(&ShardedRecordReader::read_loop, this));
+  }
+}
+
+ShardedRecordReader::~ShardedRecordReader() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    terminating = true;
+  }
+  slot_free.notify_all();
+  for (std::thread &reader : readers) {
+    reader.join();
+  }
+  for (Shard const &shard : shards) {
+    close(shard.fd);
+  }
+}
+
+/*static*/
+double ShardedRecordReader::now() {
+  return std::chrono::duration<double>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+char const *ShardedRecordReader::next_batch() {
+  std::unique_lock<std::mutex> lock(mutex);
+  long batch = next_to_consume++;
+  // the slot of the previous batch can be refilled
+  slot_free.notify_all();
+  Slot const &slot = slots[batch % slots.size()];
+  double start = now();
+  slot_ready.wait(lock, [&] { return slot.batch == batch && slot.ready; });
+  wait_seconds += now() - start;
+  return slot.data.data();
+}
+
+void ShardedRecordReader::reset() {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (next_to_consume % num_batches == 0) {
+    return;
+  }
+  // Drop the prefetched batches of the current epoch once the reads that
+  // are in flight have finished
+  resetting = true;
+  slot_ready.wait(lock, [this] { return num_reading == 0; });
+  next_to_consume = (next_to_consume / num_batches + 1) * num_batches;
+  next_to_read = next_to_consume;
+  for (Slot &slot : slots) {
+    slot.batch = -1;
+    slot.ready = false;
+  }
+  resetting = false;
+  slot_free.notify_all();
+}
+
+size_t ShardedRecordReader::get_bytes_read() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return bytes_read;
+}
+
+double ShardedRecordReader::get_bytes_per_second() {
+  std::lock_guard<std::mutex> lock(mutex);
+  double seconds = busy_seconds + (num_reading > 0 ? now() - busy_start : 0);
+  return seconds > 0 ? bytes_read / seconds : 0;
+}
+
+double ShardedRecordReader::get_wait_seconds() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return wait_seconds;
+}
+
+void ShardedRecordReader::read_loop() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    // a slot is free once the batch that used it before has been consumed,
+    // and the batch after that has been requested
+    slot_free.wait(lock, [this] {
+      return terminating ||
+             (!resetting &&
+              next_to_read < next_to_consume + (long)slots.size() - 1);
+    });
+    if (terminating) {
+      break;
+    }
+    long batch = next_to_read++;
+    Slot &slot = slots[batch % slots.size()];
+    slot.batch = batch;
+    slot.ready = false;
+    if (num_reading++ == 0) {
+      busy_start = now();
+    }
+    size_t first = (size_t)(batch % num_batches) * batch_size;
+    size_t const *records =
+        shuffle_seed >= 0 ? &get_epoch_order(batch / num_batches)[first]
+                          : nullptr;
+    lock.unlock();
+
+    if (records != nullptr) {
+      read_batch(records, &slot.data[0]);
+    } else {
+      read_records(first, batch_size, &slot.data[0]);
+    }
+
+    lock.lock();
+    if (--num_reading == 0) {
+      busy_seconds += now() - busy_start;
+    }
+    bytes_read += get_batch_size_in_bytes();
+    slot.ready = true;
+    slot_ready.notify_all();
+  }
+}
+
+std::vector<size_t> const &ShardedRecordReader::get_epoch_order(long epoch) {
+  // Only the epochs of the batches that have not been consumed are needed
+  long oldest = std::max(next_to_consume - 1, 0L) / num_batches;
+  while (!epoch_orders.empty() && epoch_orders.begin()->first < oldest) {
+    epoch_orders.erase(epoch_orders.begin());
+  }
+  auto it = epoch_orders.find(epoch);
+  if (it == epoch_orders.end()) {
+    it = epoch_orders.emplace(epoch, std::vector<size_t>()).first;
+    EpochSampler(num_records, batch_size, shuffle_seed)
+        .get_epoch_order(epoch, it->second);
+  }
+  return it->second;
+}
+
+void ShardedRecordReader::read_batch(size_t const *records, char *data) {
+  // Read each run of consecutive records at once
+  for (int i = 0; i < batch_size;) {
+    int count = 1;
+    while (i + count < batch_size &&
+           records[i + count] == records[i] + count) {
+      count++;
+    }
+    read_records(records[i], count, data + i * record_size);
+    i += count;
+  }
+}
+
+void ShardedRecordReader::read_records(size_t first_record,
+                                       size_t count,
+                                       char *data) {
+  while (count > 0) {
+    // the last shard that starts at or before first_record
+    auto it = std::upper_bound(
+        shards.begin(),
+        shards.end(),
+        first_record,
+        [](size_t record, Shard const &shard) {
+          return record < shard.first_record;
+        });
+    assert(it != shards.begin());
+    Shard const &shard = *(--it);
+    size_t offset = first_record - shard.first_record;
+    size_t num = std::min(count, shard.num_records - offset);
+    size_t size = num * record_size;
+    off_t position = offset * record_size;
+    char *ptr = data;
+    while (size > 0) {
+      ssize_t ret = pread(shard.fd, ptr, size, position);
+      if (ret < 0 && errno == EINTR) {
+        continue;
+      }
+      if (ret <= 0) {
+        printf("Unable to read data shard %s at offset %ld: %s\n",
+               shard.path.c_str(),
+               (long)position,
+               ret < 0 ? strerror(errno) : "unexpected end of file");
+        assert(false);
+      }
+      ptr += ret;
+      size -= ret;
+      position += ret;
+    }
+    data += num * record_size;
+    first_record += num;
+    count -= num;
+  }
+}
+
+}; // namespace FlexFlow
@@ -21,6 +21,7 @@ using namespace Legion;
 
 Loss::Loss(std::string const &loss, bool _repl_labels) {
   repl_labels = _repl_labels;
+  data_type = DT_FLOAT;
   if (loss == "categorical_crossentropy") {
     loss_type = LOSS_CATEGORICAL_CROSSENTROPY;
   } else if (loss == "sparse_categorical_crossentropy") {
@@ -36,7 +37,7 @@ Loss::Loss(std::string const &loss, bool _repl_labels) {
 }
 
 Loss::Loss(LossType _loss_type, bool _repl_labels)
-    : loss_type(_loss_type), repl_labels(_repl_labels) {}
+    : loss_type(_loss_type), repl_labels(_repl_labels), data_type(DT_FLOAT) {}
 
 void Loss::backward(FFModel *model,
                     const ParallelTensor logit,
@@ -53,6 +54,8 @@ void Loss::backward(FFModel *model,
     scale_factor = 1.0f / model->config.batchSize;
   }
   // scale_factor = 1.0f;
+  data_type = logit->data_type;
+  assert(data_type == DT_FLOAT || data_type == DT_HALF);
   //  Use the same parallel strategy as the owner of logit
   std::string pcname = logit->owner_op->name;
   Context ctx = model->config.lg_ctx;
@@ -88,6 +91,10 @@ void Loss::backward(FFModel *model,
   launcher.add_region_requirement(RegionRequirement(
       label->part, 0 /*projection id*/, READ_ONLY, EXCLUSIVE, label->region));
   launcher.add_field(2, FID_DATA);
+  if (model->config.mixed_precision) {
+    // the gradients are scaled by the current loss scale
+    launcher.add_future(model->loss_scaler);
+  }
   runtime->execute_index_space(ctx, launcher);
 }
 
@@ -95,12 +102,16 @@ void Loss::backward_task(Task const *task,
                          std::vector<PhysicalRegion> const &regions,
                          Context ctx,
                          Runtime *runtime) {
+  Loss const *loss = (Loss *)task->args;
   Domain domain = runtime->get_index_space_domain(
       ctx, task->regions[0].region.get_index_space());
   switch (domain.get_dim()) {
 #define DIMFUNC(DIM)                                                           \
   case DIM:                                                                    \
-    return backward_task_with_dim<DIM>(task, regions, ctx, runtime);
+    if (loss->data_type == DT_HALF) {                                          \
+      return backward_task_with_dim<half, DIM>(task, regions, ctx, runtime);   \
+    }                                                                          \
+    return backward_task_with_dim<float, DIM>(task, regions, ctx, runtime);
     LEGION_FOREACH_N(DIMFUNC)
 #undef DIMFUNC
     default:
@@ -108,7 +119,7 @@ void Loss::backward_task(Task const *task,
   }
 }
 
-template <int NDIM>
+template <typename DT, int NDIM>
 void Loss::backward_task_with_dim(Task const *task,
                                   std::vector<PhysicalRegion> const &regions,
                                   Context ctx,
@@ -116,16 +127,20 @@ void Loss::backward_task_with_dim(Task const *task,
   assert(regions.size() == 3);
   assert(task->regions.size() == 3);
   Loss const *loss = (Loss *)task->args;
+  float scale_factor = loss->scale_factor;
+  if (!task->futures.empty()) {
+    scale_factor *= Future(task->futures[0]).get_result<LossScaler>().scale;
+  }
 
   if (loss->loss_type == LOSS_SPARSE_CATEGORICAL_CROSSENTROPY) {
     // sparse_categorical_crossentropy has label of dim: (batch_size, 1)
-    TensorAccessorW<float, NDIM> acc_logit_grad(regions[0],
-                                                task->regions[0],
-                                                FID_DATA,
-                                                ctx,
-                                                runtime,
-                                                true /*readOutput*/);
-    TensorAccessorR<float, NDIM> acc_logit(
+    TensorAccessorW<DT, NDIM> acc_logit_grad(regions[0],
+                                             task->regions[0],
+                                             FID_DATA,
+                                             ctx,
+                                             runtime,
+                                             true /*readOutput*/);
+    TensorAccessorR<DT, NDIM> acc_logit(
         regions[1], task->regions[1], FID_DATA, ctx, runtime);
     TensorAccessorR<int, NDIM> acc_label(
         regions[2], task->regions[2], FID_DATA, ctx, runtime);
@@ -157,18 +172,18 @@ void Loss::backward_task_with_dim(Task const *task,
         num_samples,
         num_classes,
         k,
-        loss->scale_factor);
+        scale_factor);
   } else {
     if (loss->repl_labels) {
       assert(false && "Loss not yet supported for aggr_spec.");
     }
-    TensorAccessorW<float, NDIM> acc_logit_grad(regions[0],
-                                                task->regions[0],
-                                                FID_DATA,
-                                                ctx,
-                                                runtime,
-                                                true /*readOutput*/);
-    TensorAccessorR<float, NDIM> acc_logit(
+    TensorAccessorW<DT, NDIM> acc_logit_grad(regions[0],
+                                             task->regions[0],
+                                             FID_DATA,
+                                             ctx,
+                                             runtime,
+                                             true /*readOutput*/);
+    TensorAccessorR<DT, NDIM> acc_logit(
         regions[1], task->regions[1], FID_DATA, ctx, runtime);
     TensorAccessorR<float, NDIM> acc_label(
         regions[2], task->regions[2], FID_DATA, ctx, runtime);
@@ -187,7 +202,7 @@ void Loss::backward_task_with_dim(Task const *task,
           acc_label.ptr,
           acc_logit.rect.volume(),
           acc_logit_grad.rect.volume(),
-          loss->scale_factor);
+          scale_factor);
     } else if (loss->loss_type == LOSS_MEAN_SQUARED_ERROR_AVG_REDUCE) {
       Loss::mean_squared_error_avg_loss_backward_kernel_wrapper(
           acc_logit_grad.ptr,
@@ -195,13 +210,13 @@ void Loss::backward_task_with_dim(Task const *task,
           acc_label.ptr,
           acc_logit.rect.volume(),
           acc_logit_grad.rect.volume(),
-          loss->scale_factor);
+          scale_factor);
     } else if (loss->loss_type == LOSS_IDENTITY) {
       Loss::identity_loss_backward_kernel_wrapper(acc_logit_grad.ptr,
                                                   acc_logit.ptr,
                                                   acc_logit.rect.volume(),
                                                   acc_logit_grad.rect.volume(),
-                                                  loss->scale_factor);
+                                                  scale_factor);
     } else {
       fprintf(stderr,
               "Unsupported loss --- report this error to the FlexFlow "
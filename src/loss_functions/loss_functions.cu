@@ -20,47 +20,64 @@ namespace FlexFlow {
 
 using namespace Legion;
 
+// The kernels load the logits of type DT into FP32, and fold the scale
+// factor (which includes the loss scale of mixed precision training) into
+// the gradient before storing it back as DT
+template <typename DT>
 __global__ void
-    sparse_categorical_crossentropy_loss_backward(float *logit_grad,
+    sparse_categorical_crossentropy_loss_backward(DT *logit_grad,
+                                                  DT const *logit,
                                                   int const *label,
-                                                  coord_t num_samples,
+                                                  coord_t num_elements,
                                                   coord_t num_classes,
-                                                  int const k) {
-  CUDA_KERNEL_LOOP(i, num_samples) {
-    int label_idx = label[i / k];
-    logit_grad[i * num_classes + label_idx] -= 1.0f;
+                                                  int const k,
+                                                  float scale) {
+  CUDA_KERNEL_LOOP(i, num_elements) {
+    int label_idx = label[i / num_classes / k];
+    float grad = (float)logit[i];
+    if (i % num_classes == label_idx) {
+      grad -= 1.0f;
+    }
+    logit_grad[i] = (DT)(grad * scale);
   }
 }
 
-__global__ void categorical_crossentropy_loss_backward(float *logit_grad,
-                                                       float const *logit,
+template <typename DT>
+__global__ void categorical_crossentropy_loss_backward(DT *logit_grad,
+                                                       DT const *logit,
                                                        float const *label,
-                                                       coord_t num_elements) {
+                                                       coord_t num_elements,
+                                                       float scale) {
   CUDA_KERNEL_LOOP(i, num_elements) {
-    logit_grad[i] = logit[i] - label[i];
+    logit_grad[i] = (DT)(((float)logit[i] - label[i]) * scale);
   }
 }
 
-__global__ void mean_squared_error_avg_loss_backward(float *logit_grad,
-                                                     float const *logit,
+template <typename DT>
+__global__ void mean_squared_error_avg_loss_backward(DT *logit_grad,
+                                                     DT const *logit,
                                                      float const *label,
-                                                     coord_t num_elements) {
+                                                     coord_t num_elements,
+                                                     float scale) {
   CUDA_KERNEL_LOOP(i, num_elements) {
-    logit_grad[i] = logit[i] - label[i];
+    logit_grad[i] = (DT)(((float)logit[i] - label[i]) * scale);
   }
 }
 
-__global__ void identity_loss_backward(float *loss_grad,
-                                       float const *loss,
-                                       coord_t num_elements) {
+template <typename DT>
+__global__ void identity_loss_backward(DT *loss_grad,
+                                       DT const *loss,
+                                       coord_t num_elements,
+                                       float scale) {
   CUDA_KERNEL_LOOP(i, num_elements) {
-    loss_grad[i] = 1.0f;
+    loss_grad[i] = (DT)scale;
   }
 }
 
+template <typename DT>
 void Loss::sparse_categorical_crossentropy_loss_backward_kernel_wrapper(
-    float *logit_grad_ptr,
-    float const *logit_ptr,
+    DT *logit_grad_ptr,
+    DT const *logit_ptr,
     int const *label_ptr,
     size_t logit_volume,
     size_t logit_grad_volume,
@@ -70,72 +87,94 @@ void Loss::sparse_categorical_crossentropy_loss_backward_kernel_wrapper(
     float scale_factor) {
   cudaStream_t stream;
   checkCUDA(get_legion_stream(&stream));
-  checkCUDA(cudaMemcpy(logit_grad_ptr,
-                       logit_ptr,
-                       logit_volume * sizeof(float),
-                       cudaMemcpyDeviceToDevice));
-  sparse_categorical_crossentropy_loss_backward<<<GET_BLOCKS(num_samples),
+  assert(logit_grad_volume == logit_volume);
+  assert(logit_volume == (size_t)num_samples * num_classes);
+  sparse_categorical_crossentropy_loss_backward<<<GET_BLOCKS(logit_volume),
                                                   CUDA_NUM_THREADS,
                                                   0,
-                                                  stream>>>(
-      logit_grad_ptr, label_ptr, num_samples, num_classes, k);
-  // Scale logit gradients by op->scale_factor
-  scale_kernel<<<GET_BLOCKS(logit_grad_volume), CUDA_NUM_THREADS, 0, stream>>>(
-      logit_grad_ptr, logit_grad_volume, 0.0f, scale_factor * k);
+                                                  stream>>>(logit_grad_ptr,
+                                                            logit_ptr,
+                                                            label_ptr,
+                                                            logit_volume,
+                                                            num_classes,
+                                                            k,
+                                                            scale_factor * k);
 }
 
+template <typename DT>
 void Loss::categorical_crossentropy_loss_backward_kernel_wrapper(
-    float *logit_grad_ptr,
-    float const *logit_ptr,
+    DT *logit_grad_ptr,
+    DT const *logit_ptr,
     float const *label_ptr,
     size_t logit_volume,
     size_t logit_grad_volume,
     float scale_factor) {
   cudaStream_t stream;
   checkCUDA(get_legion_stream(&stream));
+  assert(logit_grad_volume == logit_volume);
   categorical_crossentropy_loss_backward<<<GET_BLOCKS(logit_volume),
                                            CUDA_NUM_THREADS,
                                            0,
                                            stream>>>(
-      logit_grad_ptr, logit_ptr, label_ptr, logit_volume);
-  // Scale logit gradients by loss->scale_factor
-  scale_kernel<<<GET_BLOCKS(logit_grad_volume), CUDA_NUM_THREADS, 0, stream>>>(
-      logit_grad_ptr, logit_grad_volume, 0.0f, scale_factor);
+      logit_grad_ptr, logit_ptr, label_ptr, logit_volume, scale_factor);
 }
 
+template <typename DT>
 void Loss::mean_squared_error_avg_loss_backward_kernel_wrapper(
-    float *logit_grad_ptr,
-    float const *logit_ptr,
+    DT *logit_grad_ptr,
+    DT const *logit_ptr,
     float const *label_ptr,
     size_t logit_volume,
     size_t logit_grad_volume,
     float scale_factor) {
   cudaStream_t stream;
   checkCUDA(get_legion_stream(&stream));
+  assert(logit_grad_volume == logit_volume);
   mean_squared_error_avg_loss_backward<<<GET_BLOCKS(logit_volume),
                                          CUDA_NUM_THREADS,
                                          0,
                                          stream>>>(
-      logit_grad_ptr, logit_ptr, label_ptr, logit_volume);
-  // Scale logit gradients by loss->scale_factor
-  scale_kernel<<<GET_BLOCKS(logit_grad_volume), CUDA_NUM_THREADS, 0, stream>>>(
-      logit_grad_ptr, logit_grad_volume, 0.0f, scale_factor);
+      logit_grad_ptr, logit_ptr, label_ptr, logit_volume, scale_factor);
 }
 
-void Loss::identity_loss_backward_kernel_wrapper(float *loss_grad_ptr,
-                                                 float const *loss_ptr,
+template <typename DT>
+void Loss::identity_loss_backward_kernel_wrapper(DT *loss_grad_ptr,
+                                                 DT const *loss_ptr,
                                                  size_t loss_volume,
                                                  size_t loss_grad_volume,
                                                  float scale_factor) {
   cudaStream_t stream;
   checkCUDA(get_legion_stream(&stream));
+  assert(loss_grad_volume == loss_volume);
   identity_loss_backward<<<GET_BLOCKS(loss_volume),
                            CUDA_NUM_THREADS,
                            0,
-                           stream>>>(loss_grad_ptr, loss_ptr, loss_volume);
-  // Scale logit gradients by loss->scale_factor
-  scale_kernel<<<GET_BLOCKS(loss_grad_volume), CUDA_NUM_THREADS, 0, stream>>>(
-      loss_grad_ptr, loss_grad_volume, 0.0f, scale_factor);
+                           stream>>>(
+      loss_grad_ptr, loss_ptr, loss_volume, scale_factor);
 }
 
+#define INSTANTIATE_LOSS_KERNELS(DT)                                           \
+  template void                                                                \
+      Loss::sparse_categorical_crossentropy_loss_backward_kernel_wrapper<DT>(  \
+          DT *,                                                                \
+          DT const *,                                                          \
+          int const *,                                                         \
+          size_t,                                                              \
+          size_t,                                                              \
+          int,                                                                 \
+          int,                                                                 \
+          int,                                                                 \
+          float);                                                              \
+  template void                                                                \
+      Loss::categorical_crossentropy_loss_backward_kernel_wrapper<DT>(         \
+          DT *, DT const *, float const *, size_t, size_t, float);             \
+  template void                                                                \
+      Loss::mean_squared_error_avg_loss_backward_kernel_wrapper<DT>(           \
+          DT *, DT const *, float const *, size_t, size_t, float);             \
+  template void Loss::identity_loss_backward_kernel_wrapper<DT>(               \
+      DT *, DT const *, size_t, size_t, float);
+INSTANTIATE_LOSS_KERNELS(float)
+INSTANTIATE_LOSS_KERNELS(half)
+#undef INSTANTIATE_LOSS_KERNELS
+
 }; // namespace FlexFlow
@@ -229,6 +229,8 @@ bool FFMapper::is_parameter_server_update_task(TaskID tid) {
   switch (tid) {
     case SGD_UPD_PS_TASK_ID:
     case ADAM_UPD_PS_TASK_ID:
+    case SGD_UPD_FUSED_PS_TASK_ID:
+    case ADAM_UPD_FUSED_PS_TASK_ID:
       return true;
     default:
       return false;
@@ -280,7 +282,8 @@ void FFMapper::select_task_options(const MapperContext ctx,
     output.initial_proc = all_cpus[0];
     return;
   }
-  if ((task.task_id == RM_PREPARE_NEXT_BATCH_TASK_ID) ||
+  if ((task.task_id == RM_PLAN_NEXT_BATCH_TASK_ID) ||
+      (task.task_id == RM_PREPARE_NEXT_BATCH_TASK_ID) ||
       (task.task_id == RM_PREPARE_NEXT_BATCH_INIT_TASK_ID) ||
       (task.task_id == RM_PREPARE_NEXT_BATCH_BEAM_TASK_ID) ||
       (task.task_id == RM_PREPARE_NEXT_BATCH_VERIFY_TASK_ID) ||
@@ -348,7 +351,10 @@ void FFMapper::select_task_options(const MapperContext ctx,
       (task.task_id == PY_DL_INT64_LOAD_ENTIRE_CPU_TASK_ID) ||
       (task.task_id == PY_DL_FLOAT_INDEX_LOAD_ENTIRE_CPU_TASK_ID) ||
       (task.task_id == PY_DL_INT32_INDEX_LOAD_ENTIRE_CPU_TASK_ID) ||
-      (task.task_id == PY_DL_INT64_INDEX_LOAD_ENTIRE_CPU_TASK_ID)) {
+      (task.task_id == PY_DL_INT64_INDEX_LOAD_ENTIRE_CPU_TASK_ID) ||
+      (task.task_id == PY_DL_FLOAT_LOAD_STREAM_CPU_TASK_ID) ||
+      (task.task_id == PY_DL_INT32_LOAD_STREAM_CPU_TASK_ID) ||
+      (task.task_id == PY_DL_INT64_LOAD_STREAM_CPU_TASK_ID)) {
     if (!task.is_index_space) {
       output.initial_proc = all_cpus[0];
       return;
@@ -1366,6 +1372,11 @@ bool FFMapper::default_make_instance(MapperContext ctx,
   }
   if (created) {
     int priority = LEGION_GC_NEVER_PRIORITY;
+    // The data of discarded regions is not needed anymore, so their
+    // instances can be freed
+    if (is_discardable_region(ctx, target_region)) {
+      priority = LEGION_GC_FIRST_PRIORITY;
+    }
     if (priority != 0) {
       runtime->set_garbage_collection_priority(ctx, result, priority);
     }
@@ -1373,6 +1384,23 @@ bool FFMapper::default_make_instance(MapperContext ctx,
   return true;
 }
 
+bool FFMapper::is_discardable_region(MapperContext ctx, LogicalRegion region) {
+  // The tag is attached to the top-level region of a tensor
+  while (runtime->has_parent_logical_partition(ctx, region)) {
+    region = runtime->get_parent_logical_region(
+        ctx, runtime->get_parent_logical_partition(ctx, region));
+  }
+  void const *value;
+  size_t size;
+  return runtime->retrieve_semantic_information(ctx,
+                                                region,
+                                                DISCARDABLE_SEMANTIC_TAG,
+                                                value,
+                                                size,
+                                                true /*can fail*/,
+                                                false /*wait until ready*/);
+}
+
 LayoutConstraintID FFMapper::default_select_layout_constraints(
     MapperContext ctx,
     Memory target_memory,
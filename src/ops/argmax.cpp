@@ -16,6 +16,7 @@
 #include "flexflow/ops/argmax.h"
 #include "flexflow/ffconst_utils.h"
 #include "flexflow/utils/hip_helper.h"
+#include "flexflow/utils/peft_chunking.h"
 #include <hip/hip_runtime.h>
 #include <hipcub/hipcub.hpp>
 
@@ -455,12 +456,17 @@ void ArgMax::forward_kernel(ArgMaxMeta const *m,
     // Skip non-PEFT requests
     if (bc->requestsInfo[i].peft_bwd) {
       assert(num_finetuning_requests == 0 && num_bwd_tokens == 0);
-      num_bwd_tokens = bc->requestsInfo[i].num_tokens_in_batch - 1;
-      // shift labels by 1 position to the left (ignore first token label)
-      for (int j = 0; j < num_bwd_tokens; j++) {
-        token_ids[j] =
-            bc->tokensInfo[j + tokens_previous_requests + 1].token_id;
+      int num_tokens = bc->requestsInfo[i].num_tokens_in_batch;
+      BatchConfig::TokenId chunk_tokens[BatchConfig::MAX_NUM_TOKENS];
+      for (int j = 0; j < num_tokens; j++) {
+        chunk_tokens[j] = bc->tokensInfo[j + tokens_previous_requests].token_id;
       }
+      // same labels as the loss gradients of the softmax backward pass
+      num_bwd_tokens =
+          get_peft_chunk_labels(chunk_tokens,
+                                num_tokens,
+                                bc->requestsInfo[i].peft_next_token_id,
+                                token_ids);
       num_finetuning_requests += 1;
     } else {
       tokens_previous_requests += bc->requestsInfo[i].num_tokens_in_batch;
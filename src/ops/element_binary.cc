@@ -292,6 +292,10 @@ void ElementBinary::do_inplace_output(void) {
   inplace_a = true;
 }
 
+bool ElementBinary::can_recompute_outputs() const {
+  return !inplace_a;
+}
+
 void ElementBinary::init_inference(
     FFModel const &ff,
     std::vector<ParallelTensor> const &batch_inputs,
@@ -241,6 +241,11 @@ void ElementUnary::do_inplace_output(void) {
   inplace = true;
 }
 
+bool ElementUnary::can_recompute_outputs() const {
+  // an in-place forward pass would apply the operator to its own outputs
+  return !inplace;
+}
+
 bool ElementUnary::use_cudnn(OperatorType type) {
   if (type == OP_RELU) {
     return true;
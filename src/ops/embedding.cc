@@ -15,8 +15,10 @@
 
 #include "flexflow/ops/embedding.h"
 #include "flexflow/model.h"
+#include "flexflow/ops/kernels/embedding_bag_cpu.h"
 #include "flexflow/ops/kernels/embedding_kernels.h"
 #include "flexflow/utils/hash_utils.h"
+#include "flexflow/utils/row_sparse_gradient.h"
 
 namespace FlexFlow {
 
@@ -25,9 +27,13 @@ using Legion::ArgumentMap;
 using Legion::Context;
 using Legion::coord_t;
 using Legion::Domain;
+using Legion::FieldAllocator;
+using Legion::FieldSpace;
 using Legion::FutureMap;
 using Legion::IndexLauncher;
+using Legion::IndexSpace;
 using Legion::InlineLauncher;
+using Legion::LogicalRegion;
 using Legion::PhysicalRegion;
 using Legion::Predicate;
 using Legion::Rect;
@@ -38,6 +44,7 @@ using Legion::TaskArgument;
 using Legion::TaskLauncher;
 
 using namespace FlexFlow::Kernels::Embedding;
+namespace EmbeddingBagCPU = FlexFlow::Kernels::EmbeddingBagCPU;
 
 Tensor FFModel::embedding(const Tensor input,
                           int num_entries,
@@ -46,15 +53,29 @@ Tensor FFModel::embedding(const Tensor input,
                           DataType dtype,
                           Layer const *shared_op,
                           Initializer *kernel_initializer,
-                          char const *name) {
+                          char const *name,
+                          EmbeddingUpdateType update_type,
+                          const Tensor lengths) {
+  // sparse updates are only implemented for float tables
+  assert(update_type == EMBEDDING_UPDATE_DENSE || dtype == DT_FLOAT);
+  if (lengths != nullptr) {
+    // one length per bag, i.e., the shape of input without its first dim
+    assert(aggr != AGGR_MODE_NONE);
+    assert(lengths->data_type == DT_INT32);
+    assert(lengths->num_dims == input->num_dims - 1);
+    for (int i = 0; i < lengths->num_dims; i++) {
+      assert(lengths->dims[i] == input->dims[i + 1]);
+    }
+  }
   Layer *embed = new Layer(this,
                            OP_EMBEDDING,
                            dtype,
                            name,
-                           1 /*inputs*/,
+                           lengths == nullptr ? 1 : 2 /*inputs*/,
                            1 /*weights*/,
                            1 /*outputs*/,
-                           input);
+                           input,
+                           lengths);
   if (aggr == AGGR_MODE_NONE) {
     int numdims = input->num_dims + 1;
     int dims[MAX_TENSOR_DIM];
@@ -76,18 +97,21 @@ Tensor FFModel::embedding(const Tensor input,
   }
   {
     int dims[2] = {out_dim, num_entries};
-    embed->weights[0] = create_weight_legion_ordering(2,
-                                                      dims,
-                                                      dtype,
-                                                      embed,
-                                                      true /*create_grad*/,
-                                                      kernel_initializer,
-                                                      CHOSEN_SYNC_TYPE);
+    // a table updated in the backward pass has no gradient tensor
+    embed->weights[0] = create_weight_legion_ordering(
+        2,
+        dims,
+        dtype,
+        embed,
+        update_type == EMBEDDING_UPDATE_DENSE /*create_grad*/,
+        kernel_initializer,
+        CHOSEN_SYNC_TYPE);
   }
   embed->data_type = dtype;
   embed->add_int_property("num_entries", num_entries);
   embed->add_int_property("out_dim", out_dim);
   embed->add_int_property("aggr_mode", aggr);
+  embed->add_int_property("update_type", update_type);
   embed->add_initializer("kernel", kernel_initializer);
   layers.push_back(embed);
   return embed->outputs[0];
@@ -98,6 +122,7 @@ EmbeddingParams Embedding::get_params() const {
   params.num_entries = this->num_entries;
   params.out_channels = this->out_channels;
   params.aggr = this->aggr;
+  params.update_type = this->update_type;
   params.data_type = this->data_type;
   // TODO: get rid of layer_guid
   // https://github.com/flexflow/FlexFlow/issues/304
@@ -116,14 +141,18 @@ Op *Embedding::create_operator_from_layer(
   int out_dim = value;
   layer->get_int_property("aggr_mode", value);
   AggrMode aggr = (AggrMode)value;
+  layer->get_int_property("update_type", value);
+  EmbeddingUpdateType update_type = (EmbeddingUpdateType)value;
   Initializer *kernel_initializer;
   layer->get_initializer("kernel", kernel_initializer);
   return new Embedding(model,
                        layer->layer_guid,
                        inputs[0],
+                       inputs.size() > 1 ? inputs[1] : nullptr,
                        num_entries,
                        out_dim,
                        aggr,
+                       update_type,
                        false /*allocate_weights*/,
                        layer->data_type,
                        layer->name);
@@ -202,6 +231,10 @@ void Embedding::register_output_mappings() {
     int num_dims = this->inputs[0]->num_dims;
     for (int i = 1; i < num_dims - 1; i++) {
       this->register_output_parallel_dims(i, i);
+      if (this->numInputs > 1) {
+        // the lengths have no dimension for the indices of a bag
+        this->register_output_parallel_dims(i - 1, i, 1 /*input_idx*/);
+      }
     }
   }
 }
@@ -219,42 +252,64 @@ void Embedding::register_mappings() {
 
 /* Params */
 
-bool EmbeddingParams::is_valid(ParallelTensorShape const &input) const {
-  return input.is_valid();
+bool EmbeddingParams::is_valid(
+    std::vector<ParallelTensorShape> const &inputs) const {
+  if (inputs.size() == 1) {
+    return inputs[0].is_valid();
+  }
+  if (inputs.size() != 2 || aggr == AGGR_MODE_NONE) {
+    return false;
+  }
+  ParallelTensorShape const &input = inputs[0];
+  ParallelTensorShape const &lengths = inputs[1];
+  if (lengths.data_type != DT_INT32 ||
+      lengths.num_dims != input.num_dims - 1) {
+    return false;
+  }
+  for (int i = 0; i < lengths.num_dims; i++) {
+    if (lengths.dims[i].size != input.dims[i + 1].size) {
+      return false;
+    }
+  }
+  return input.is_valid() && lengths.is_valid();
 }
 
 bool operator==(EmbeddingParams const &lhs, EmbeddingParams const &rhs) {
   return lhs.layer_guid == rhs.layer_guid &&
          lhs.out_channels == rhs.out_channels &&
          lhs.num_entries == rhs.num_entries && lhs.aggr == rhs.aggr &&
-         lhs.data_type == rhs.data_type;
+         lhs.update_type == rhs.update_type && lhs.data_type == rhs.data_type;
 }
 
 Embedding::Embedding(FFModel &model,
                      EmbeddingParams const &params,
-                     ParallelTensor const input,
+                     Input const &inputs,
                      bool allocate_weights,
                      char const *name)
     : Embedding(model,
                 params.layer_guid,
-                input,
+                inputs[0],
+                inputs.size() > 1 ? inputs[1] : nullptr,
                 params.num_entries,
                 params.out_channels,
                 params.aggr,
+                params.update_type,
                 allocate_weights,
                 params.data_type,
                 params.name) {}
 
 Embedding::Embedding(FFModel &model,
                      Embedding const &other,
-                     const ParallelTensor input,
+                     Input const &inputs,
                      bool allocate_weights)
     : Embedding(model,
                 other.layer_guid,
-                input,
+                inputs[0],
+                inputs.size() > 1 ? inputs[1] : nullptr,
                 other.num_entries,
                 other.out_channels,
                 other.aggr,
+                other.update_type,
                 allocate_weights,
                 other.data_type,
                 other.name) {}
@@ -262,9 +317,11 @@ Embedding::Embedding(FFModel &model,
 Embedding::Embedding(FFModel &model,
                      LayerID const &_layer_guid,
                      const ParallelTensor _input,
+                     const ParallelTensor _lengths,
                      int _num_entries,
                      int _out_channels,
                      AggrMode _aggr,
+                     EmbeddingUpdateType _update_type,
                      bool allocate_weights,
                      DataType dtype,
                      char const *name)
@@ -272,13 +329,19 @@ Embedding::Embedding(FFModel &model,
          OP_EMBEDDING,
          dtype,
          name,
-         1 /*inputs*/,
+         _lengths == nullptr ? 1 : 2 /*inputs*/,
          1 /*weights*/,
          allocate_weights,
          1 /*outputs*/,
-         _input),
-      num_entries(_num_entries), out_channels(_out_channels), aggr(_aggr) {
+         _input,
+         _lengths),
+      num_entries(_num_entries), out_channels(_out_channels), aggr(_aggr),
+      update_type(_update_type), adagrad_state(LogicalRegion::NO_REGION) {
   layer_guid = _layer_guid;
+  int max_cache_rows = model.config.embedding_cache_rows;
+  cache_rows =
+      max_cache_rows > 0 && num_entries > max_cache_rows ? max_cache_rows : 0;
+  cache_admit_threshold = model.config.embedding_cache_admit_threshold;
   std::vector<ParallelDim *> weight_dim_sets;
 
   int weight_ndim;
@@ -294,21 +357,30 @@ Embedding::Embedding(FFModel &model,
   // register mappings between inputs/weights and outputs
   this->register_mappings();
 
+  std::vector<ParallelDim const *> input_dim_sets = {_input->dims};
+  if (_lengths != nullptr) {
+    assert(aggr != AGGR_MODE_NONE);
+    assert(_lengths->data_type == DT_INT32);
+    assert(_lengths->num_dims == _input->num_dims - 1);
+    input_dim_sets.push_back(_lengths->dims);
+  }
   this->solve_parallel_dim_mappings(
-      {_input->dims}, weight_dim_sets, {output_dims});
+      input_dim_sets, weight_dim_sets, {output_dims});
 
   if (allocate_weights) {
     Initializer *weight_initializer = new GlorotUniform(std::rand() /*seed*/);
     // Initializer *weight_initializer = new ZeroInitializer(/*seed*/);
 
-    weights[0] =
-        model.create_parallel_weight_legion_ordering(weight_ndim,
-                                                     weight_dims,
-                                                     dtype,
-                                                     nullptr /*owner_op*/,
-                                                     true /*create_grad*/,
-                                                     weight_initializer,
-                                                     CHOSEN_SYNC_TYPE);
+    weights[0] = model.create_parallel_weight_legion_ordering(
+        weight_ndim,
+        weight_dims,
+        dtype,
+        nullptr /*owner_op*/,
+        update_type == EMBEDDING_UPDATE_DENSE /*create_grad*/,
+        weight_initializer,
+        CHOSEN_SYNC_TYPE);
+    // a cached table stays in host memory
+    weights[0]->host_resident = cache_rows > 0;
   }
 
   outputs[0] = model.create_parallel_tensor_legion_ordering(
@@ -345,11 +417,13 @@ void Embedding::init(FFModel const &ff) {
                                                     outputs[0]->region));
   launcher.add_field(0, FID_DATA);
   // regions[2]: weight
-  launcher.add_region_requirement(RegionRequirement(weights[0]->part,
-                                                    0 /*projection*/,
-                                                    READ_ONLY,
-                                                    EXCLUSIVE,
-                                                    weights[0]->region));
+  launcher.add_region_requirement(
+      RegionRequirement(weights[0]->part,
+                        0 /*projection*/,
+                        READ_ONLY,
+                        EXCLUSIVE,
+                        weights[0]->region,
+                        weights[0]->host_resident ? MAP_TO_ZC_MEMORY : 0));
   launcher.add_field(1, FID_DATA);
   // regions[3]: input_grad
   launcher.add_region_requirement(RegionRequirement(inputs[0]->part_grad,
@@ -361,6 +435,30 @@ void Embedding::init(FFModel const &ff) {
   FutureMap fm = runtime->execute_index_space(ctx, launcher);
   fm.wait_all_results();
   set_opmeta_from_futuremap(ff, fm);
+  if (update_type != EMBEDDING_UPDATE_DENSE) {
+    // Sparse updates write the rows of the batch straight into the table,
+    // which therefore must not be replicated across devices
+    assert(weights[0]->get_total_num_parts() == 1);
+    assert(weights[0]->data_type == DT_FLOAT);
+  }
+  // the cache is only kept coherent by sparse updates
+  assert(cache_rows == 0 || update_type != EMBEDDING_UPDATE_DENSE);
+  // the GPU cache and sparse update kernels only handle fixed-length bags
+  assert(numInputs == 1 ||
+         outputs[0]->machine_view.device_type == MachineView::CPU ||
+         update_type == EMBEDDING_UPDATE_DENSE);
+  if (update_type == EMBEDDING_UPDATE_ROWWISE_ADAGRAD &&
+      adagrad_state == LogicalRegion::NO_REGION) {
+    // one accumulator per row instead of one per element
+    IndexSpace is =
+        runtime->create_index_space(ctx, Rect<1>(0, num_entries - 1));
+    FieldSpace fs = runtime->create_field_space(ctx);
+    FieldAllocator allocator = runtime->create_field_allocator(ctx, fs);
+    allocator.allocate_field(sizeof(float), FID_DATA);
+    adagrad_state = runtime->create_logical_region(ctx, is, fs);
+    runtime->fill_field<float>(
+        ctx, adagrad_state, adagrad_state, FID_DATA, 0.0f);
+  }
 }
 
 void Embedding::init_inference(FFModel const &ff,
@@ -391,11 +489,13 @@ void Embedding::init_inference(FFModel const &ff,
                                                     batch_outputs[0]->region));
   launcher.add_field(0, FID_DATA);
   // regions[2]: weight
-  launcher.add_region_requirement(RegionRequirement(weights[0]->part,
-                                                    0 /*projection*/,
-                                                    READ_ONLY,
-                                                    EXCLUSIVE,
-                                                    weights[0]->region));
+  launcher.add_region_requirement(
+      RegionRequirement(weights[0]->part,
+                        0 /*projection*/,
+                        READ_ONLY,
+                        EXCLUSIVE,
+                        weights[0]->region,
+                        weights[0]->host_resident ? MAP_TO_ZC_MEMORY : 0));
   launcher.add_field(1, FID_DATA);
   FutureMap fm = runtime->execute_index_space(ctx, launcher);
   fm.wait_all_results();
@@ -412,6 +512,10 @@ OpMeta *Embedding::init_task(Task const *task,
   m->profiling = embed->profiling;
   m->inference_debugging = embed->inference_debugging;
   m->aggr = embed->aggr;
+  if (embed->cache_rows > 0) {
+    m->cache = new EmbeddingCache(
+        embed->num_entries, embed->cache_rows, embed->cache_admit_threshold);
+  }
   std::strcpy(m->op_name, embed->name);
   m->layer_guid = embed->layer_guid;
   return m;
@@ -422,9 +526,10 @@ void Embedding::forward(FFModel const &ff) {
   Context ctx = ff.config.lg_ctx;
   Runtime *runtime = ff.config.lg_hlr;
   set_argumentmap_for_forward(ff, argmap);
+  EmbeddingTaskArgs args = get_task_args(ff);
   IndexLauncher launcher(EMBED_FWD_TASK_ID,
                          parallel_is,
-                         TaskArgument(NULL, 0),
+                         TaskArgument(&args, sizeof(EmbeddingTaskArgs)),
                          argmap,
                          Predicate::TRUE_PRED,
                          false /*must*/,
@@ -445,13 +550,24 @@ void Embedding::forward(FFModel const &ff) {
                                                     outputs[0]->region,
                                                     MAP_TO_ZC_MEMORY));
   launcher.add_field(1, FID_DATA);
-  // regions[2]: weight
-  launcher.add_region_requirement(RegionRequirement(weights[0]->part,
-                                                    0 /*projection*/,
-                                                    READ_ONLY,
-                                                    EXCLUSIVE,
-                                                    weights[0]->region));
+  // regions[2]: weight, which evicted cache rows are written back to
+  launcher.add_region_requirement(
+      RegionRequirement(weights[0]->part,
+                        0 /*projection*/,
+                        cache_rows > 0 ? READ_WRITE : READ_ONLY,
+                        EXCLUSIVE,
+                        weights[0]->region,
+                        weights[0]->host_resident ? MAP_TO_ZC_MEMORY : 0));
   launcher.add_field(2, FID_DATA);
+  if (numInputs > 1) {
+    // regions[3]: lengths
+    launcher.add_region_requirement(RegionRequirement(inputs[1]->part,
+                                                      0 /*projection*/,
+                                                      READ_ONLY,
+                                                      EXCLUSIVE,
+                                                      inputs[1]->region));
+    launcher.add_field(3, FID_DATA);
+  }
   runtime->execute_index_space(ctx, launcher);
 }
 
@@ -494,12 +610,23 @@ FutureMap Embedding::inference(FFModel const &ff,
                                                     MAP_TO_ZC_MEMORY));
   launcher.add_field(1, FID_DATA);
   // regions[2]: weight
-  launcher.add_region_requirement(RegionRequirement(weights[0]->part,
-                                                    0 /*projection*/,
-                                                    READ_ONLY,
-                                                    EXCLUSIVE,
-                                                    weights[0]->region));
+  launcher.add_region_requirement(
+      RegionRequirement(weights[0]->part,
+                        0 /*projection*/,
+                        READ_ONLY,
+                        EXCLUSIVE,
+                        weights[0]->region,
+                        weights[0]->host_resident ? MAP_TO_ZC_MEMORY : 0));
   launcher.add_field(2, FID_DATA);
+  if (batch_inputs.size() > 1) {
+    // regions[3]: lengths
+    launcher.add_region_requirement(RegionRequirement(batch_inputs[1]->part,
+                                                      0 /*projection*/,
+                                                      READ_ONLY,
+                                                      EXCLUSIVE,
+                                                      batch_inputs[1]->region));
+    launcher.add_field(3, FID_DATA);
+  }
   return runtime->execute_index_space(ctx, launcher);
 }
 
@@ -507,14 +634,17 @@ FutureMap Embedding::inference(FFModel const &ff,
   regions[0](I): input
   regions[1](O): output
   regions[2](I): kernel
+  regions[3](I): lengths (ragged bags only)
 */
 void Embedding::forward_task(Task const *task,
                              std::vector<PhysicalRegion> const &regions,
                              Context ctx,
                              Runtime *runtime) {
   EmbeddingMeta *m = *((EmbeddingMeta **)task->local_args);
-  assert(regions.size() == 3);
-  assert(task->regions.size() == 3);
+  EmbeddingTaskArgs const *args = (EmbeddingTaskArgs const *)task->args;
+  assert(task->arglen == sizeof(EmbeddingTaskArgs));
+  assert(regions.size() == (args->has_lengths ? 4 : 3));
+  assert(task->regions.size() == regions.size());
   // Assert that weight and output must have the same data type
   // otherwise, a cast operator should be inserted
   assert(m->weight_type[0] == m->output_type[0]);
@@ -557,22 +687,53 @@ void Embedding::forward_task(Task const *task,
     effective_batch_size = output.domain.get_volume() / out_dim;
     assert(effective_batch_size * in_dim == input.domain.get_volume());
   }
-  forward_kernel_wrapper(
-      m, input, output, kernel, in_dim, out_dim, effective_batch_size);
+  if (m->cache != nullptr) {
+    assert(!args->has_lengths);
+    GenericTensorAccessorW table =
+        helperGetGenericTensorAccessorRW(m->weight_type[0],
+                                         regions[2],
+                                         task->regions[2],
+                                         FID_DATA,
+                                         ctx,
+                                         runtime);
+    cached_forward_kernel_wrapper(m,
+                                  input,
+                                  output,
+                                  table,
+                                  in_dim,
+                                  out_dim,
+                                  effective_batch_size,
+                                  args->update_type != EMBEDDING_UPDATE_DENSE);
+  } else {
+    int const *lengths = nullptr;
+    if (args->has_lengths) {
+      lengths = helperGetTensorPointerRO<int32_t>(
+          regions[3], task->regions[3], FID_DATA, ctx, runtime);
+    }
+    forward_kernel_wrapper(m,
+                           input,
+                           output,
+                           kernel,
+                           in_dim,
+                           out_dim,
+                           effective_batch_size,
+                           lengths);
+  }
 }
 
 /*
   regions[0](I): input
   regions[1](O): output
   regions[2](I): kernel
+  regions[3](I): lengths (ragged bags only)
 */
 void Embedding::inference_task(Task const *task,
                                std::vector<PhysicalRegion> const &regions,
                                Context ctx,
                                Runtime *runtime) {
   EmbeddingMeta *m = *((EmbeddingMeta **)task->local_args);
-  assert(regions.size() == 3);
-  assert(task->regions.size() == 3);
+  assert(regions.size() == 3 || regions.size() == 4);
+  assert(task->regions.size() == regions.size());
   // Assert that weight and output must have the same data type
   // otherwise, a cast operator should be inserted
   BatchConfig const *bc = BatchConfig::from_future(task->futures[0]);
@@ -619,8 +780,19 @@ void Embedding::inference_task(Task const *task,
     effective_batch_size = output.domain.get_volume() / out_dim;
     assert(effective_batch_size * in_dim == input.domain.get_volume());
   }
-  forward_kernel_wrapper(
-      m, input, output, kernel, in_dim, out_dim, effective_batch_size);
+  int const *lengths = nullptr;
+  if (regions.size() == 4) {
+    lengths = helperGetTensorPointerRO<int32_t>(
+        regions[3], task->regions[3], FID_DATA, ctx, runtime);
+  }
+  forward_kernel_wrapper(m,
+                         input,
+                         output,
+                         kernel,
+                         in_dim,
+                         out_dim,
+                         effective_batch_size,
+                         lengths);
   if (m->inference_debugging) {
     assert(task->index_point.get_dim() == 1);
     int shard_id = task->index_point.point_data[0];
@@ -634,9 +806,10 @@ void Embedding::backward(FFModel const &ff) {
   Context ctx = ff.config.lg_ctx;
   Runtime *runtime = ff.config.lg_hlr;
   set_argumentmap_for_backward(ff, argmap);
+  EmbeddingTaskArgs args = get_task_args(ff);
   IndexLauncher launcher(EMBED_BWD_TASK_ID,
                          parallel_is,
-                         TaskArgument(NULL, 0),
+                         TaskArgument(&args, sizeof(EmbeddingTaskArgs)),
                          argmap,
                          Predicate::TRUE_PRED,
                          false /*must*/,
@@ -656,16 +829,123 @@ void Embedding::backward(FFModel const &ff) {
                                                     EXCLUSIVE,
                                                     outputs[0]->region_grad));
   launcher.add_field(1, FID_DATA);
-  // regions[2]: weight_grad
-  launcher.add_region_requirement(RegionRequirement(weights[0]->part_grad,
+  if (update_type == EMBEDDING_UPDATE_DENSE) {
+    // regions[2]: weight_grad
+    launcher.add_region_requirement(RegionRequirement(weights[0]->part_grad,
+                                                      0 /*projection*/,
+                                                      READ_WRITE,
+                                                      EXCLUSIVE,
+                                                      weights[0]->region_grad));
+    launcher.add_field(2, FID_DATA);
+  } else {
+    // regions[2]: weight, updated in place with the rows the batch touched
+    launcher.add_region_requirement(
+        RegionRequirement(weights[0]->part,
+                          0 /*projection*/,
+                          READ_WRITE,
+                          EXCLUSIVE,
+                          weights[0]->region,
+                          weights[0]->host_resident ? MAP_TO_ZC_MEMORY : 0));
+    launcher.add_field(2, FID_DATA);
+    if (update_type == EMBEDDING_UPDATE_ROWWISE_ADAGRAD) {
+      // regions[3]: per-row Adagrad state
+      launcher.add_region_requirement(
+          RegionRequirement(adagrad_state,
+                            READ_WRITE,
+                            EXCLUSIVE,
+                            adagrad_state,
+                            cache_rows > 0 ? MAP_TO_ZC_MEMORY : 0));
+      launcher.add_field(3, FID_DATA);
+    }
+  }
+  if (numInputs > 1) {
+    // last region: lengths
+    int idx = update_type == EMBEDDING_UPDATE_ROWWISE_ADAGRAD ? 4 : 3;
+    launcher.add_region_requirement(RegionRequirement(inputs[1]->part,
+                                                      0 /*projection*/,
+                                                      READ_ONLY,
+                                                      EXCLUSIVE,
+                                                      inputs[1]->region));
+    launcher.add_field(idx, FID_DATA);
+  }
+  runtime->execute_index_space(ctx, launcher);
+}
+
+void Embedding::flush_cache(FFModel const &ff) {
+  if (cache_rows == 0) {
+    return;
+  }
+  ArgumentMap argmap;
+  Context ctx = ff.config.lg_ctx;
+  Runtime *runtime = ff.config.lg_hlr;
+  set_argumentmap_for_forward(ff, argmap);
+  IndexLauncher launcher(EMBED_CACHE_FLUSH_TASK_ID,
+                         parallel_is,
+                         TaskArgument(NULL, 0),
+                         argmap,
+                         Predicate::TRUE_PRED,
+                         false /*must*/,
+                         0 /*mapper_id*/,
+                         outputs[0]->machine_view.hash());
+  // regions[0]: weight
+  launcher.add_region_requirement(RegionRequirement(weights[0]->part,
                                                     0 /*projection*/,
                                                     READ_WRITE,
                                                     EXCLUSIVE,
-                                                    weights[0]->region_grad));
-  launcher.add_field(2, FID_DATA);
+                                                    weights[0]->region,
+                                                    MAP_TO_ZC_MEMORY));
+  launcher.add_field(0, FID_DATA);
   runtime->execute_index_space(ctx, launcher);
 }
 
+/*
+  regions[0](I/O): weight
+*/
+void Embedding::flush_cache_task(Task const *task,
+                                 std::vector<PhysicalRegion> const &regions,
+                                 Context ctx,
+                                 Runtime *runtime) {
+  EmbeddingMeta *m = *((EmbeddingMeta **)task->local_args);
+  assert(regions.size() == 1);
+  assert(task->regions.size() == 1);
+  GenericTensorAccessorW weight = helperGetGenericTensorAccessorRW(
+      m->weight_type[0], regions[0], task->regions[0], FID_DATA, ctx, runtime);
+  flush_cache_kernel_wrapper(m, weight);
+}
+
+bool Embedding::updates_weights_in_backward() const {
+  return update_type != EMBEDDING_UPDATE_DENSE;
+}
+
+EmbeddingTaskArgs Embedding::get_task_args(FFModel const &ff) const {
+  EmbeddingTaskArgs args;
+  args.aggr = aggr;
+  args.input_type = inputs[0]->data_type;
+  args.has_lengths = numInputs > 1;
+  args.num_threads = ff.config.embedding_cpu_threads;
+  args.update_type = update_type;
+  args.lr = 0.0f;
+  args.weight_decay = 0.0f;
+  args.epsilon = 1e-8f;
+  // sparse updates reuse the hyperparameters of the model's optimizer
+  if (update_type != EMBEDDING_UPDATE_DENSE) {
+    if (SGDOptimizer const *sgd =
+            dynamic_cast<SGDOptimizer const *>(ff.optimizer)) {
+      args.lr = sgd->lr;
+      args.weight_decay = sgd->weight_decay;
+    } else if (AdamOptimizer const *adam =
+                   dynamic_cast<AdamOptimizer const *>(ff.optimizer)) {
+      args.lr = adam->alpha;
+      args.weight_decay = adam->weight_decay;
+      args.epsilon = adam->epsilon;
+    } else {
+      assert(false && "Sparse embedding updates require an SGD or Adam "
+                      "optimizer");
+    }
+  }
+  return args;
+}
+
 Legion::FutureMap
     Embedding::peft_bwd(FFModel const &ff,
                         BatchConfigFuture const &bc,
@@ -680,9 +960,15 @@ void Embedding::backward_task(Task const *task,
                               std::vector<PhysicalRegion> const &regions,
                               Context ctx,
                               Runtime *runtime) {
-  EmbeddingMeta const *m = *((EmbeddingMeta **)task->local_args);
-  assert(regions.size() == 3);
-  assert(task->regions.size() == 3);
+  EmbeddingMeta *m = *((EmbeddingMeta **)task->local_args);
+  EmbeddingTaskArgs const *args = (EmbeddingTaskArgs const *)task->args;
+  assert(task->arglen == sizeof(EmbeddingTaskArgs));
+  if (args->update_type != EMBEDDING_UPDATE_DENSE) {
+    sparse_backward_task(m, args, regions, task, ctx, runtime);
+    return;
+  }
+  assert(regions.size() == (args->has_lengths ? 4 : 3));
+  assert(task->regions.size() == regions.size());
   // Assert that weight and output must have the same data type
   // otherwise, a cast operator should be inserted
   assert(m->weight_type[0] == m->output_type[0]);
@@ -724,13 +1010,84 @@ void Embedding::backward_task(Task const *task,
     effective_batch_size = output_grad.domain.get_volume() / out_dim;
     assert(effective_batch_size * in_dim == input.domain.get_volume());
   }
+  int const *lengths = nullptr;
+  if (args->has_lengths) {
+    lengths = helperGetTensorPointerRO<int32_t>(
+        regions[3], task->regions[3], FID_DATA, ctx, runtime);
+  }
   backward_kernel_wrapper(m,
                           input,
                           output_grad,
                           kernel_grad,
                           in_dim,
                           out_dim,
-                          effective_batch_size);
+                          effective_batch_size,
+                          lengths);
+}
+
+/*
+  regions[0](I): input
+  regions[1](I): output_grad
+  regions[2](I/O): weight
+  regions[3](I/O): Adagrad state (EMBEDDING_UPDATE_ROWWISE_ADAGRAD only)
+*/
+void Embedding::sparse_backward_task(
+    EmbeddingMeta *m,
+    EmbeddingTaskArgs const *args,
+    std::vector<PhysicalRegion> const &regions,
+    Task const *task,
+    Context ctx,
+    Runtime *runtime) {
+  bool adagrad = args->update_type == EMBEDDING_UPDATE_ROWWISE_ADAGRAD;
+  assert(regions.size() == (adagrad ? 4 : 3));
+  assert(task->regions.size() == regions.size());
+  assert(!args->has_lengths);
+  assert(m->input_type[0] == DT_INT32 || m->input_type[0] == DT_INT64);
+  GenericTensorAccessorR input = helperGetGenericTensorAccessorRO(
+      m->input_type[0], regions[0], task->regions[0], FID_DATA, ctx, runtime);
+  GenericTensorAccessorR output_grad = helperGetGenericTensorAccessorRO(
+      m->output_type[0], regions[1], task->regions[1], FID_DATA, ctx, runtime);
+  GenericTensorAccessorW weight = helperGetGenericTensorAccessorRW(
+      m->weight_type[0], regions[2], task->regions[2], FID_DATA, ctx, runtime);
+  int out_dim = output_grad.domain.hi()[0] - output_grad.domain.lo()[0] + 1;
+  assert(weight.domain.hi()[0] - weight.domain.lo()[0] + 1 == out_dim);
+  int64_t num_rows = weight.domain.get_volume() / out_dim;
+  int effective_batch_size = output_grad.domain.get_volume() / out_dim;
+  int in_dim = m->aggr == AGGR_MODE_NONE
+                   ? 1
+                   : input.domain.hi()[0] - input.domain.lo()[0] + 1;
+  assert(effective_batch_size * in_dim == input.domain.get_volume());
+  float *state = nullptr;
+  if (adagrad) {
+    state = helperGetTensorPointerRW<float>(
+        regions[3], task->regions[3], FID_DATA, ctx, runtime);
+  }
+  if (m->cache != nullptr) {
+    // the rows of the batch are in the cache since the forward pass
+    cached_sparse_backward_kernel_wrapper(m,
+                                          output_grad,
+                                          weight,
+                                          state,
+                                          in_dim,
+                                          out_dim,
+                                          effective_batch_size,
+                                          args->lr,
+                                          args->weight_decay,
+                                          args->epsilon);
+    return;
+  }
+  sparse_backward_kernel_wrapper(m,
+                                 input,
+                                 output_grad,
+                                 weight,
+                                 state,
+                                 in_dim,
+                                 out_dim,
+                                 effective_batch_size,
+                                 num_rows,
+                                 args->lr,
+                                 args->weight_decay,
+                                 args->epsilon);
 }
 
 #ifdef DEADCODE
@@ -929,359 +1286,254 @@ bool Embedding::measure_operator_cost(Simulator *sim,
   return true;
 }
 
-void EmbeddingLookup_int64_t_float_float__avx2_fma(int const block_size,
-                                                   int const output_size,
-                                                   int const index_size,
-                                                   int const data_size,
-                                                   float const *input,
-                                                   int64_t const *indices,
-                                                   int const *lengths,
-                                                   float const *weight,
-                                                   bool normalize_by_lengths,
-                                                   float *out) {
-#ifdef FF_USE_AVX2
-  const int64_t prefdist_T0 = 16;
-  if (block_size == 128) {
-    // unrolling 16 times
-    int64_t dataInd = 0;
-    for (int64_t rangeIndex = 0; rangeIndex < output_size; ++rangeIndex) {
-      float *op = &out[rangeIndex * block_size];
-      __m256 vop0 = _mm256_setzero_ps();
-      __m256 vop8 = _mm256_setzero_ps();
-      __m256 vop16 = _mm256_setzero_ps();
-      __m256 vop24 = _mm256_setzero_ps();
-      __m256 vop32 = _mm256_setzero_ps();
-      __m256 vop40 = _mm256_setzero_ps();
-      __m256 vop48 = _mm256_setzero_ps();
-      __m256 vop56 = _mm256_setzero_ps();
-      __m256 vop64 = _mm256_setzero_ps();
-      __m256 vop72 = _mm256_setzero_ps();
-      __m256 vop80 = _mm256_setzero_ps();
-      __m256 vop88 = _mm256_setzero_ps();
-      __m256 vop96 = _mm256_setzero_ps();
-      __m256 vop104 = _mm256_setzero_ps();
-      __m256 vop112 = _mm256_setzero_ps();
-      __m256 vop120 = _mm256_setzero_ps();
-      for (int64_t start = dataInd; dataInd < start + lengths[rangeIndex];
-           ++dataInd) {
-        const int64_t idx = indices[dataInd];
-        float wgt = 1.f;
-        if (weight) {
-          wgt = weight[dataInd];
-        }
-        __m256 vwgt = _mm256_set1_ps(wgt);
-        float const *ip = &input[idx * block_size];
-        const int64_t next_T0 = (dataInd < index_size - prefdist_T0)
-                                    ? (dataInd + prefdist_T0)
-                                    : dataInd;
-        const int64_t idx_pref_T0 = indices[next_T0];
-        assert(idx >= 0 && idx_pref_T0 >= 0 && idx < data_size &&
-               idx_pref_T0 < data_size);
-        float const *ip_next_T0 = &input[idx_pref_T0 * block_size];
-        vop0 = _mm256_fmadd_ps(vwgt, _mm256_loadu_ps(ip + (0)), vop0);
-        _mm_prefetch((&ip_next_T0[0]), _MM_HINT_T0);
-        vop8 = _mm256_fmadd_ps(vwgt, _mm256_loadu_ps(ip + (8)), vop8);
-        _mm_prefetch((&ip_next_T0[8]), _MM_HINT_T0);
-        vop16 = _mm256_fmadd_ps(vwgt, _mm256_loadu_ps(ip + (16)), vop16);
-        _mm_prefetch((&ip_next_T0[16]), _MM_HINT_T0);
-        vop24 = _mm256_fmadd_ps(vwgt, _mm256_loadu_ps(ip + (24)), vop24);
-        _mm_prefetch((&ip_next_T0[24]), _MM_HINT_T0);
-        vop32 = _mm256_fmadd_ps(vwgt, _mm256_loadu_ps(ip + (32)), vop32);
-        _mm_prefetch((&ip_next_T0[32]), _MM_HINT_T0);
-        vop40 = _mm256_fmadd_ps(vwgt, _mm256_loadu_ps(ip + (40)), vop40);
-        _mm_prefetch((&ip_next_T0[40]), _MM_HINT_T0);
-        vop48 = _mm256_fmadd_ps(vwgt, _mm256_loadu_ps(ip + (48)), vop48);
-        _mm_prefetch((&ip_next_T0[48]), _MM_HINT_T0);
-        vop56 = _mm256_fmadd_ps(vwgt, _mm256_loadu_ps(ip + (56)), vop56);
-        _mm_prefetch((&ip_next_T0[56]), _MM_HINT_T0);
-        vop64 = _mm256_fmadd_ps(vwgt, _mm256_loadu_ps(ip + (64)), vop64);
-        _mm_prefetch((&ip_next_T0[64]), _MM_HINT_T0);
-        vop72 = _mm256_fmadd_ps(vwgt, _mm256_loadu_ps(ip + (72)), vop72);
-        _mm_prefetch((&ip_next_T0[72]), _MM_HINT_T0);
-        vop80 = _mm256_fmadd_ps(vwgt, _mm256_loadu_ps(ip + (80)), vop80);
-        _mm_prefetch((&ip_next_T0[80]), _MM_HINT_T0);
-        vop88 = _mm256_fmadd_ps(vwgt, _mm256_loadu_ps(ip + (88)), vop88);
-        _mm_prefetch((&ip_next_T0[88]), _MM_HINT_T0);
-        vop96 = _mm256_fmadd_ps(vwgt, _mm256_loadu_ps(ip + (96)), vop96);
-        _mm_prefetch((&ip_next_T0[96]), _MM_HINT_T0);
-        vop104 = _mm256_fmadd_ps(vwgt, _mm256_loadu_ps(ip + (104)), vop104);
-        _mm_prefetch((&ip_next_T0[104]), _MM_HINT_T0);
-        vop112 = _mm256_fmadd_ps(vwgt, _mm256_loadu_ps(ip + (112)), vop112);
-        _mm_prefetch((&ip_next_T0[112]), _MM_HINT_T0);
-        vop120 = _mm256_fmadd_ps(vwgt, _mm256_loadu_ps(ip + (120)), vop120);
-        _mm_prefetch((&ip_next_T0[120]), _MM_HINT_T0);
-      }
-      if (normalize_by_lengths == false) {
-        _mm256_storeu_ps(&op[0], vop0);
-        _mm256_storeu_ps(&op[8], vop8);
-        _mm256_storeu_ps(&op[16], vop16);
-        _mm256_storeu_ps(&op[24], vop24);
-        _mm256_storeu_ps(&op[32], vop32);
-        _mm256_storeu_ps(&op[40], vop40);
-        _mm256_storeu_ps(&op[48], vop48);
-        _mm256_storeu_ps(&op[56], vop56);
-        _mm256_storeu_ps(&op[64], vop64);
-        _mm256_storeu_ps(&op[72], vop72);
-        _mm256_storeu_ps(&op[80], vop80);
-        _mm256_storeu_ps(&op[88], vop88);
-        _mm256_storeu_ps(&op[96], vop96);
-        _mm256_storeu_ps(&op[104], vop104);
-        _mm256_storeu_ps(&op[112], vop112);
-        _mm256_storeu_ps(&op[120], vop120);
-      } else if (lengths[rangeIndex]) {
-        __m256 vlen_inv = _mm256_set1_ps(1.0f / lengths[rangeIndex]);
-        _mm256_storeu_ps(&op[0], _mm256_mul_ps(vop0, vlen_inv));
-        _mm256_storeu_ps(&op[8], _mm256_mul_ps(vop8, vlen_inv));
-        _mm256_storeu_ps(&op[16], _mm256_mul_ps(vop16, vlen_inv));
-        _mm256_storeu_ps(&op[24], _mm256_mul_ps(vop24, vlen_inv));
-        _mm256_storeu_ps(&op[32], _mm256_mul_ps(vop32, vlen_inv));
-        _mm256_storeu_ps(&op[40], _mm256_mul_ps(vop40, vlen_inv));
-        _mm256_storeu_ps(&op[48], _mm256_mul_ps(vop48, vlen_inv));
-        _mm256_storeu_ps(&op[56], _mm256_mul_ps(vop56, vlen_inv));
-        _mm256_storeu_ps(&op[64], _mm256_mul_ps(vop64, vlen_inv));
-        _mm256_storeu_ps(&op[72], _mm256_mul_ps(vop72, vlen_inv));
-        _mm256_storeu_ps(&op[80], _mm256_mul_ps(vop80, vlen_inv));
-        _mm256_storeu_ps(&op[88], _mm256_mul_ps(vop88, vlen_inv));
-        _mm256_storeu_ps(&op[96], _mm256_mul_ps(vop96, vlen_inv));
-        _mm256_storeu_ps(&op[104], _mm256_mul_ps(vop104, vlen_inv));
-        _mm256_storeu_ps(&op[112], _mm256_mul_ps(vop112, vlen_inv));
-        _mm256_storeu_ps(&op[120], _mm256_mul_ps(vop120, vlen_inv));
-      }
-    }
-    __m256 vwgt = _mm256_set1_ps(wgt);
-    float const *ip = &input[idx * block_size];
-    const int64_t next_T0 = (dataInd < index_size - prefdist_T0)
-                                ? (dataInd + prefdist_T0)
-                                : dataInd;
-    const int64_t idx_pref_T0 = indices[next_T0];
-    assert(idx >= 0 && idx_pref_T0 >= 0 && idx < data_size &&
-           idx_pref_T0 < data_size);
-    float const *ip_next_T0 = &input[idx_pref_T0 * block_size];
-    vop0 = _mm256_fmadd_ps(vwgt, _mm256_loadu_ps(ip + (0)), vop0);
-    _mm_prefetch((&ip_next_T0[0]), _MM_HINT_T0);
-    vop8 = _mm256_fmadd_ps(vwgt, _mm256_loadu_ps(ip + (8)), vop8);
-    _mm_prefetch((&ip_next_T0[8]), _MM_HINT_T0);
-    vop16 = _mm256_fmadd_ps(vwgt, _mm256_loadu_ps(ip + (16)), vop16);
-    _mm_prefetch((&ip_next_T0[16]), _MM_HINT_T0);
-    vop24 = _mm256_fmadd_ps(vwgt, _mm256_loadu_ps(ip + (24)), vop24);
-    _mm_prefetch((&ip_next_T0[24]), _MM_HINT_T0);
-  }
-  if (normalize_by_lengths == false) {
-    _mm256_storeu_ps(&op[0], vop0);
-    _mm256_storeu_ps(&op[8], vop8);
-    _mm256_storeu_ps(&op[16], vop16);
-    _mm256_storeu_ps(&op[24], vop24);
-  } else if (lengths[rangeIndex]) {
-    __m256 vlen_inv = _mm256_set1_ps(1.0f / lengths[rangeIndex]);
-    _mm256_storeu_ps(&op[0], _mm256_mul_ps(vop0, vlen_inv));
-    _mm256_storeu_ps(&op[8], _mm256_mul_ps(vop8, vlen_inv));
-    _mm256_storeu_ps(&op[16], _mm256_mul_ps(vop16, vlen_inv));
-    _mm256_storeu_ps(&op[24], _mm256_mul_ps(vop24, vlen_inv));
+// Returns the lengths of the num_bags bags of a CPU task, read from its last
+// region for ragged bags and otherwise in_dim for every bag (kept in fixed)
+static int const *get_bag_lengths(EmbeddingTaskArgs const *args,
+                                  std::vector<PhysicalRegion> const &regions,
+                                  Task const *task,
+                                  int num_bags,
+                                  int in_dim,
+                                  std::vector<int> &fixed,
+                                  Context ctx,
+                                  Runtime *runtime) {
+  if (!args->has_lengths) {
+    fixed.assign(num_bags, in_dim);
+    return fixed.data();
   }
-}
-}
-else {
-  // generic code
-  int64_t dataInd = 0;
-  for (int64_t rangeIndex = 0; rangeIndex < output_size; ++rangeIndex) {
-    float *op = &out[rangeIndex * block_size];
-    int j = 0;
-    for (; j + 8 <= block_size; j += 8) {
-      _mm256_storeu_ps(op + j, _mm256_setzero_ps());
-    }
-    for (; j < block_size; j++) {
-      op[j] = 0.0f;
-    }
-    for (int64_t start = dataInd; dataInd < start + lengths[rangeIndex];
-         ++dataInd) {
-      const int64_t idx = indices[dataInd];
-      float wgt = 1.f;
-      if (weight) {
-        wgt = weight[dataInd];
-      }
-      __m256 vwgt = _mm256_set1_ps(wgt);
-      float const *ip = &input[idx * block_size];
-      const int64_t next_T0 = (dataInd < index_size - prefdist_T0)
-                                  ? (dataInd + prefdist_T0)
-                                  : dataInd;
-      const int64_t idx_pref_T0 = indices[next_T0];
-      assert(idx >= 0 && idx_pref_T0 >= 0 && idx < data_size &&
-             idx_pref_T0 < data_size);
-      float const *ip_next_T0 = &input[idx_pref_T0 * block_size];
-      j = 0;
-      for (; j + 8 <= block_size; j += 8) {
-        _mm256_storeu_ps(&op[j],
-                         _mm256_fmadd_ps(vwgt,
-                                         _mm256_loadu_ps(&ip[j]),
-                                         _mm256_loadu_ps(&op[j])));
-        _mm_prefetch((&ip_next_T0[j]), _MM_HINT_T0);
-      }
-      for (; j < block_size; j++) {
-        op[j] += wgt * ip[j];
-      }
-    }
-    if (normalize_by_lengths && lengths[rangeIndex]) {
-      float len_inv = 1.0f / lengths[rangeIndex];
-      __m256 vlen_inv = _mm256_set1_ps(len_inv);
-      j = 0;
-      for (; j + 8 <= block_size; j += 8) {
-        _mm256_storeu_ps(&op[j],
-                         _mm256_mul_ps(_mm256_loadu_ps(&op[j]), vlen_inv));
-      }
-      for (; j < block_size; j++) {
-        op[j] = len_inv * op[j];
-      }
-    }
+  size_t idx = regions.size() - 1;
+  GenericTensorAccessorR lengths = helperGetGenericTensorAccessorRO(
+      DT_INT32, regions[idx], task->regions[idx], FID_DATA, ctx, runtime);
+  assert(lengths.domain.get_volume() == (size_t)num_bags);
+  int const *ptr = lengths.get_int32_ptr();
+  for (int b = 0; b < num_bags; b++) {
+    assert(ptr[b] >= 0 && ptr[b] <= in_dim);
   }
-}
-#else
-  assert(0);
-#endif
-}
-
-void embed_forward(int64_t const *input,
-                   int const *lengths,
-                   float *output,
-                   float const *embed,
-                   int block_size,
-                   int output_size,
-                   int index_size,
-                   int data_size) {
-  EmbeddingLookup_int64_t_float_float__avx2_fma(block_size,
-                                                output_size,
-                                                index_size,
-                                                data_size,
-                                                embed,
-                                                input,
-                                                lengths,
-                                                nullptr,
-                                                false,
-                                                output);
+  return ptr;
 }
 
-void embed_backward_generic(int64_t const *input,
-                            int const *lengths,
-                            float const *output,
-                            float *embed,
-                            int block_size,
-                            int output_size,
-                            int index_size,
-                            int data_size) {
-  // FIXME: Not functionaly correct.
-  for (int i = 0; i < output_size * block_size; i++) {
-    int idx = i / block_size;
-    int off = i % block_size;
-    int64_t wordIdx = input[idx];
-    // FIXME: Need to be atomic depending on the strategy
-    embed[wordIdx * block_size + off] += output[i];
-    ;
+// The input holds in_dim indices per bag, of which a ragged bag only uses the
+// first lengths[b]. The EmbeddingBagCPU kernels expect the bags back to back,
+// so the indices of ragged bags are packed into packed.
+template <typename TI>
+static TI const *get_bag_indices(TI const *input,
+                                 EmbeddingTaskArgs const *args,
+                                 int const *lengths,
+                                 int num_bags,
+                                 int in_dim,
+                                 std::vector<TI> &packed) {
+  if (!args->has_lengths) {
+    return input;
   }
+  packed.clear();
+  for (int b = 0; b < num_bags; b++) {
+    TI const *bag = input + (size_t)b * in_dim;
+    packed.insert(packed.end(), bag, bag + lengths[b]);
+  }
+  return packed.data();
 }
 
-void embed_backward(int64_t const *input,
-                    int const *lengths,
-                    float const *output,
-                    float *embed,
-                    int block_size,
-                    int output_size,
-                    int index_size,
-                    int data_size) {
-  embed_backward_generic(input,
-                         lengths,
-                         output,
-                         embed,
-                         block_size,
-                         output_size,
-                         index_size,
-                         data_size);
-}
-
+/*
+  regions[0](I): input
+  regions[1](O): output
+  regions[2](I): kernel
+  regions[3](I): lengths (ragged bags only)
+*/
 void Embedding::forward_task_cpu(Task const *task,
                                  std::vector<PhysicalRegion> const &regions,
                                  Context ctx,
                                  Runtime *runtime) {
-  assert(regions.size() == 3);
-  assert(task->regions.size() == 3);
-  // const Embedding* embed = (Embedding*) task->args;
-  AccessorRO<int64_t, 2> const acc_input(regions[0], FID_DATA);
-  AccessorWO<float, 2> const acc_output(regions[1], FID_DATA);
-  AccessorRO<float, 2> const acc_weight(regions[2], FID_DATA);
-  Rect<2> rect_input = runtime->get_index_space_domain(
-      ctx, task->regions[0].region.get_index_space());
-  Rect<2> rect_output = runtime->get_index_space_domain(
-      ctx, task->regions[1].region.get_index_space());
-  Rect<2> rect_weight = runtime->get_index_space_domain(
-      ctx, task->regions[2].region.get_index_space());
-  coord_t batch_size = rect_input.hi[1] - rect_input.lo[1] + 1;
-  // Input and output have same batch size
-  assert(batch_size == rect_output.hi[1] - rect_output.lo[1] + 1);
-  coord_t out_dim = rect_output.hi[0] - rect_output.lo[0] + 1;
-  // Weight and output have same out dim
-  assert(out_dim == rect_weight.hi[1] - rect_weight.lo[1] + 1);
-  // const int64_t* input = acc_input.ptr(rect_input);
-  // float* output = acc_output.ptr(rect_output);
-  // const float* weight = acc_weight.ptr(rect_weight);
-  int block_size = out_dim;
-  int output_size = batch_size;
-  int data_size = 1000000; // FIXME
-  // For now we are assuming the length is always 1
-  int index_size = rect_input.hi[1] - rect_input.lo[1] + 1;
-  coord_t in_dim = rect_input.hi[0] - rect_input.lo[0] + 1;
-  assert(in_dim == 1);
-  std::vector<int> lengths(output_size, 1);
-  embed_forward(acc_input.ptr(rect_input),
-                lengths.data(),
-                acc_output.ptr(rect_output),
-                acc_weight.ptr(rect_weight),
-                block_size,
-                output_size,
-                index_size,
-                data_size);
+  EmbeddingTaskArgs const *args = (EmbeddingTaskArgs const *)task->args;
+  assert(task->arglen == sizeof(EmbeddingTaskArgs));
+  assert(regions.size() == (args->has_lengths ? 4 : 3));
+  assert(task->regions.size() == regions.size());
+  GenericTensorAccessorR input = helperGetGenericTensorAccessorRO(
+      args->input_type, regions[0], task->regions[0], FID_DATA, ctx, runtime);
+  GenericTensorAccessorW output = helperGetGenericTensorAccessorWO(
+      DT_FLOAT, regions[1], task->regions[1], FID_DATA, ctx, runtime);
+  GenericTensorAccessorR kernel = helperGetGenericTensorAccessorRO(
+      DT_FLOAT, regions[2], task->regions[2], FID_DATA, ctx, runtime);
+  int out_dim = output.domain.hi()[0] - output.domain.lo()[0] + 1;
+  assert(kernel.domain.hi()[0] - kernel.domain.lo()[0] + 1 == out_dim);
+  int64_t num_rows = kernel.domain.get_volume() / out_dim;
+  int num_bags = output.domain.get_volume() / out_dim;
+  // Every sample of the input is one bag, or one bag per index without
+  // aggregation
+  int in_dim = input.domain.get_volume() / num_bags;
+  assert(in_dim * num_bags == input.domain.get_volume());
+  assert(args->aggr != AGGR_MODE_NONE || in_dim == 1);
+  AggrMode aggr = args->aggr == AGGR_MODE_NONE ? AGGR_MODE_SUM : args->aggr;
+  std::vector<int> fixed_lengths;
+  int const *lengths = get_bag_lengths(
+      args, regions, task, num_bags, in_dim, fixed_lengths, ctx, runtime);
+  if (args->input_type == DT_INT32) {
+    std::vector<int32_t> packed;
+    int32_t const *indices = get_bag_indices(
+        input.get_int32_ptr(), args, lengths, num_bags, in_dim, packed);
+    EmbeddingBagCPU::forward(indices,
+                             lengths,
+                             num_bags,
+                             kernel.get_float_ptr(),
+                             num_rows,
+                             out_dim,
+                             aggr,
+                             output.get_float_ptr(),
+                             args->num_threads);
+  } else {
+    assert(args->input_type == DT_INT64);
+    std::vector<int64_t> packed;
+    int64_t const *indices = get_bag_indices(
+        input.get_int64_ptr(), args, lengths, num_bags, in_dim, packed);
+    EmbeddingBagCPU::forward(indices,
+                             lengths,
+                             num_bags,
+                             kernel.get_float_ptr(),
+                             num_rows,
+                             out_dim,
+                             aggr,
+                             output.get_float_ptr(),
+                             args->num_threads);
+  }
 }
 
+/*
+  regions[0](I): input
+  regions[1](I): output_grad
+  regions[2](I/O): weight_grad, or weight for sparse updates
+  regions[3](I/O): Adagrad state (EMBEDDING_UPDATE_ROWWISE_ADAGRAD only)
+  last region(I): lengths (ragged bags only)
+*/
 void Embedding::backward_task_cpu(Task const *task,
                                   std::vector<PhysicalRegion> const &regions,
                                   Context ctx,
                                   Runtime *runtime) {
-  assert(regions.size() == 3);
-  assert(task->regions.size() == 3);
-  // const Embedding* embed = (Embedding*) task->args;
-  AccessorRO<int64_t, 2> const acc_input(regions[0], FID_DATA);
-  AccessorRO<float, 2> const acc_output(regions[1], FID_DATA);
-  AccessorRW<float, 2> const acc_weight(regions[2], FID_DATA);
-  Rect<2> rect_input = runtime->get_index_space_domain(
-      ctx, task->regions[0].region.get_index_space());
-  Rect<2> rect_output = runtime->get_index_space_domain(
-      ctx, task->regions[1].region.get_index_space());
-  Rect<2> rect_weight = runtime->get_index_space_domain(
-      ctx, task->regions[2].region.get_index_space());
-  coord_t batch_size = rect_input.hi[1] - rect_input.lo[1] + 1;
-  // Input and output have same batch size
-  assert(batch_size == rect_output.hi[1] - rect_output.lo[1] + 1);
-  // coord_t in_dim = rect_input.hi[0] - rect_input.lo[0] + 1;
-  coord_t out_dim = rect_output.hi[0] - rect_output.lo[0] + 1;
-  // Weight and output have same out dim
-  assert(out_dim == rect_weight.hi[1] - rect_weight.lo[1] + 1);
-  // const int64_t* input = acc_input.ptr(rect_input);
-  // const float* output = acc_output.ptr(rect_output);
-  // float* weight = acc_weight.ptr(rect_weight);
-  int block_size = out_dim;
-  int output_size = batch_size;
-  int index_size = rect_input.hi[1] - rect_input.lo[0] + 1;
-  int data_size = 1000000; // FIXME
-  std::vector<int> lengths(output_size, 1);
-  embed_backward(acc_input.ptr(rect_input),
-                 lengths.data(),
-                 acc_output.ptr(rect_output),
-                 acc_weight.ptr(rect_weight),
-                 block_size,
-                 output_size,
-                 index_size,
-                 data_size);
+  EmbeddingTaskArgs const *args = (EmbeddingTaskArgs const *)task->args;
+  assert(task->arglen == sizeof(EmbeddingTaskArgs));
+  if (args->update_type != EMBEDDING_UPDATE_DENSE) {
+    sparse_backward_task_cpu(args, regions, task, ctx, runtime);
+    return;
+  }
+  assert(regions.size() == (args->has_lengths ? 4 : 3));
+  assert(task->regions.size() == regions.size());
+  GenericTensorAccessorR input = helperGetGenericTensorAccessorRO(
+      args->input_type, regions[0], task->regions[0], FID_DATA, ctx, runtime);
+  GenericTensorAccessorR output_grad = helperGetGenericTensorAccessorRO(
+      DT_FLOAT, regions[1], task->regions[1], FID_DATA, ctx, runtime);
+  GenericTensorAccessorW weight_grad = helperGetGenericTensorAccessorRW(
+      DT_FLOAT, regions[2], task->regions[2], FID_DATA, ctx, runtime);
+  int out_dim = output_grad.domain.hi()[0] - output_grad.domain.lo()[0] + 1;
+  assert(weight_grad.domain.hi()[0] - weight_grad.domain.lo()[0] + 1 ==
+         out_dim);
+  int64_t num_rows = weight_grad.domain.get_volume() / out_dim;
+  int num_bags = output_grad.domain.get_volume() / out_dim;
+  int in_dim = input.domain.get_volume() / num_bags;
+  assert(in_dim * num_bags == input.domain.get_volume());
+  assert(args->aggr != AGGR_MODE_NONE || in_dim == 1);
+  AggrMode aggr = args->aggr == AGGR_MODE_NONE ? AGGR_MODE_SUM : args->aggr;
+  std::vector<int> fixed_lengths;
+  int const *lengths = get_bag_lengths(
+      args, regions, task, num_bags, in_dim, fixed_lengths, ctx, runtime);
+  if (args->input_type == DT_INT32) {
+    std::vector<int32_t> packed;
+    int32_t const *indices = get_bag_indices(
+        input.get_int32_ptr(), args, lengths, num_bags, in_dim, packed);
+    EmbeddingBagCPU::backward(indices,
+                              lengths,
+                              num_bags,
+                              output_grad.get_float_ptr(),
+                              num_rows,
+                              out_dim,
+                              aggr,
+                              weight_grad.get_float_ptr(),
+                              args->num_threads);
+  } else {
+    assert(args->input_type == DT_INT64);
+    std::vector<int64_t> packed;
+    int64_t const *indices = get_bag_indices(
+        input.get_int64_ptr(), args, lengths, num_bags, in_dim, packed);
+    EmbeddingBagCPU::backward(indices,
+                              lengths,
+                              num_bags,
+                              output_grad.get_float_ptr(),
+                              num_rows,
+                              out_dim,
+                              aggr,
+                              weight_grad.get_float_ptr(),
+                              args->num_threads);
+  }
+}
+
+void Embedding::sparse_backward_task_cpu(
+    EmbeddingTaskArgs const *args,
+    std::vector<PhysicalRegion> const &regions,
+    Task const *task,
+    Context ctx,
+    Runtime *runtime) {
+  bool adagrad = args->update_type == EMBEDDING_UPDATE_ROWWISE_ADAGRAD;
+  assert(regions.size() == (adagrad ? 4 : 3) + (args->has_lengths ? 1 : 0));
+  assert(task->regions.size() == regions.size());
+  GenericTensorAccessorR input = helperGetGenericTensorAccessorRO(
+      args->input_type, regions[0], task->regions[0], FID_DATA, ctx, runtime);
+  GenericTensorAccessorR output_grad = helperGetGenericTensorAccessorRO(
+      DT_FLOAT, regions[1], task->regions[1], FID_DATA, ctx, runtime);
+  GenericTensorAccessorW weight = helperGetGenericTensorAccessorRW(
+      DT_FLOAT, regions[2], task->regions[2], FID_DATA, ctx, runtime);
+  int out_dim = output_grad.domain.hi()[0] - output_grad.domain.lo()[0] + 1;
+  assert(weight.domain.hi()[0] - weight.domain.lo()[0] + 1 == out_dim);
+  int64_t num_rows = weight.domain.get_volume() / out_dim;
+  int num_bags = output_grad.domain.get_volume() / out_dim;
+  int in_dim = input.domain.get_volume() / num_bags;
+  assert(in_dim * num_bags == input.domain.get_volume());
+  assert(args->aggr != AGGR_MODE_NONE || in_dim == 1);
+  AggrMode aggr = args->aggr == AGGR_MODE_NONE ? AGGR_MODE_SUM : args->aggr;
+  std::vector<int> fixed_lengths;
+  int const *lengths = get_bag_lengths(
+      args, regions, task, num_bags, in_dim, fixed_lengths, ctx, runtime);
+  // reused across batches to keep the sort buffers allocated
+  thread_local RowSparseGradient grad;
+  if (args->input_type == DT_INT32) {
+    std::vector<int32_t> packed;
+    int32_t const *indices = get_bag_indices(
+        input.get_int32_ptr(), args, lengths, num_bags, in_dim, packed);
+    grad.build(indices,
+               lengths,
+               num_bags,
+               output_grad.get_float_ptr(),
+               num_rows,
+               out_dim,
+               aggr);
+  } else {
+    assert(args->input_type == DT_INT64);
+    std::vector<int64_t> packed;
+    int64_t const *indices = get_bag_indices(
+        input.get_int64_ptr(), args, lengths, num_bags, in_dim, packed);
+    grad.build(indices,
+               lengths,
+               num_bags,
+               output_grad.get_float_ptr(),
+               num_rows,
+               out_dim,
+               aggr);
+  }
+  if (adagrad) {
+    GenericTensorAccessorW state = helperGetGenericTensorAccessorRW(
+        DT_FLOAT, regions[3], task->regions[3], FID_DATA, ctx, runtime);
+    assert(state.domain.get_volume() == num_rows);
+    grad.apply_rowwise_adagrad(args->lr,
+                               args->weight_decay,
+                               args->epsilon,
+                               weight.get_float_ptr(),
+                               state.get_float_ptr());
+  } else {
+    grad.apply_sgd(args->lr, args->weight_decay, weight.get_float_ptr());
+  }
 }
 
 EmbeddingMeta::EmbeddingMeta(FFHandler _handle, Op const *op)
-    : OpMeta(_handle, op) {}
+    : OpMeta(_handle, op), sparse_workspace(nullptr),
+      sparse_workspace_size(0), cache(nullptr), cache_table(nullptr),
+      cache_slot_rows(nullptr), cache_capacity(0), cache_slots(nullptr),
+      cache_num_slots(0), cache_transfers(nullptr),
+      cache_transfer_capacity(0) {}
 }
 ; // namespace FlexFlow
 
@@ -1292,6 +1544,7 @@ size_t hash<FlexFlow::EmbeddingParams>::operator()(
   hash_combine(key, params.layer_guid.id);
   hash_combine(key, params.out_channels);
   hash_combine(key, params.aggr);
+  hash_combine(key, params.update_type);
   hash_combine(key, params.num_entries);
   hash_combine(key, params.data_type);
   return key;
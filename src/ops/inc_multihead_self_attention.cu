@@ -914,6 +914,27 @@ std::string get_peft_dbg_folder(IncMultiHeadSelfAttentionMeta const *m,
   return dst_filepath.string();
 }
 
+// Copies the key or value gradients of num_tokens tokens accumulated in
+// accumulated_grads, with max_sequence_length tokens per row, to grads, with
+// num_tokens tokens per row
+template <typename DT>
+void load_accumulated_kv_grads(DT *grads,
+                               DT const *accumulated_grads,
+                               int num_tokens,
+                               int num_rows,
+                               cudaStream_t stream) {
+  size_t pitch = sizeof(DT) * BatchConfig::max_sequence_length();
+  size_t width = sizeof(DT) * num_tokens;
+  checkCUDA(cudaMemcpy2DAsync(grads,
+                              width,
+                              accumulated_grads,
+                              pitch,
+                              width,
+                              num_rows,
+                              cudaMemcpyDeviceToDevice,
+                              stream));
+}
+
 template <typename DT>
 void peft_bwd_kernel(IncMultiHeadSelfAttentionMeta const *m,
                      BatchConfig const *bc,
@@ -952,9 +973,25 @@ void peft_bwd_kernel(IncMultiHeadSelfAttentionMeta const *m,
     int num_tokens = bc->requestsInfo[i].num_tokens_in_batch;
     int num_total_tokens = bc->requestsInfo[i].first_token_depth_in_request +
                            bc->requestsInfo[i].num_tokens_in_batch;
-    // Currently assume we are calculating gradients for all tokens
-    // of a request
-    assert(num_tokens == num_total_tokens);
+    // A dataset entry that does not fit in a batch is processed one chunk
+    // per batch, whose queries attend to the earlier tokens through the KV
+    // cache. With --peft-truncated-backprop, gradients only flow into the
+    // keys and values of the chunk's own tokens. Otherwise the chunks run
+    // their backward pass from the last to the first one: the gradients of
+    // the keys and values of the cached tokens are accumulated in
+    // m->kv_grad_buffer, and added to the ones of their own chunk. The last
+    // chunk of the entry overwrites the gradients left by the previous entry.
+    int num_cached_tokens = num_total_tokens - num_tokens;
+    bool accumulate_kv_grads =
+        !bc->requestsInfo[i].peft_truncated_bwd &&
+        num_tokens < bc->requestsInfo[i].peft_entry_length;
+    bool has_later_chunks =
+        num_total_tokens < bc->requestsInfo[i].peft_entry_length;
+    // m->kv_grad_buffer's layout: [max_num_tokens, kProjSize * num_heads, 2]
+    int kv_grad_ld = BatchConfig::max_sequence_length();
+    DT *key_grads = static_cast<DT *>(m->kv_grad_buffer);
+    DT *value_grads = key_grads + kv_grad_ld * m->kProjSize * m->num_q_heads;
+    assert(!accumulate_kv_grads || m->allocated_peft_buffer_size3 > 0);
     int kt_block_size = m->kProjSize;
     int kt_req_block_size =
         kt_block_size * m->num_q_heads * BatchConfig::max_sequence_length();
@@ -1015,7 +1052,9 @@ void peft_bwd_kernel(IncMultiHeadSelfAttentionMeta const *m,
       float alpha = 1.0f, beta = 0.0f;
       // matrix A: qk_prods_softmax
       // matrix A's layout: [num_new_tokens, total_tokens, num_heads]
-      DT const *A = static_cast<DT *>(m->qk_prods_softmax);
+      // (the columns of the cached tokens are skipped)
+      DT const *A = static_cast<DT *>(m->qk_prods_softmax) +
+                    num_cached_tokens * num_tokens;
       // matrix B: attn_heads gradients
       // matrix B's layout: [vProjSize * num_heads, num_new_tokens]
       DT const *B = static_cast<DT *>(m->handle.workSpace);
@@ -1026,17 +1065,27 @@ void peft_bwd_kernel(IncMultiHeadSelfAttentionMeta const *m,
                   (m->qProjSize * m->num_q_heads); // skip over regions reserved
                                                    // for Q and K gradients
       // after transpositions
-      int m_ = num_tokens;   // total_tokens
+      int m_ = num_tokens;   // num_new_tokens
       int n_ = m->vProjSize; // num_new_tokens
       int k_ = num_tokens;   // num_new_tokens
       // before transpositions
       int lda = num_tokens; // num_new_tokens
       int ldb = m->vProjSize * m->num_q_heads;
-      int ldc = num_tokens; // total_tokens
+      int ldc = num_tokens; // num_new_tokens
       // N.B. strides are applied before transpose operations
-      int strideA = num_tokens * num_tokens; // num_new_tokens * total_tokens
+      int strideA = num_tokens * num_total_tokens;
       int strideB = m->vProjSize;
       int strideC = num_tokens * m->vProjSize;
+      if (accumulate_kv_grads && has_later_chunks) {
+        // add the gradients from the later chunks of the entry
+        load_accumulated_kv_grads(
+            C,
+            value_grads + bc->requestsInfo[i].first_token_depth_in_request,
+            num_tokens,
+            m->vProjSize * m->num_q_heads,
+            stream);
+        beta = 1.0f;
+      }
       checkCUDA(cublasGemmStridedBatchedEx(m->handle.blas,
                                            CUBLAS_OP_T,
                                            CUBLAS_OP_T,
@@ -1069,6 +1118,35 @@ void peft_bwd_kernel(IncMultiHeadSelfAttentionMeta const *m,
             get_peft_dbg_folder(m, shard_id) + ".qk_prods.softmax";
         save_tensor(A, m_ * k_ * m->num_q_heads, filename2.c_str());
       }
+      if (accumulate_kv_grads && num_cached_tokens > 0) {
+        // accumulate the gradients w.r.t. the values of the cached tokens,
+        // from the columns of qk_prods_softmax skipped above
+        beta = has_later_chunks ? 1.0f : 0.0f;
+        DT const *A_cached = static_cast<DT *>(m->qk_prods_softmax);
+        checkCUDA(cublasGemmStridedBatchedEx(m->handle.blas,
+                                             CUBLAS_OP_T,
+                                             CUBLAS_OP_T,
+                                             num_cached_tokens,
+                                             n_,
+                                             k_,
+                                             &alpha,
+                                             A_cached,
+                                             cublas_data_type,
+                                             lda,
+                                             strideA,
+                                             B,
+                                             cublas_data_type,
+                                             ldb,
+                                             strideB,
+                                             &beta,
+                                             value_grads,
+                                             cublas_data_type,
+                                             kv_grad_ld,
+                                             kv_grad_ld * m->vProjSize,
+                                             m->num_q_heads,
+                                             compute_type,
+                                             CUBLAS_GEMM_DEFAULT_TENSOR_OP));
+      }
     }
     // Step 3: compute gradients w.r.t. the qk_prods_softmax tensor
     {
@@ -1084,7 +1162,7 @@ void peft_bwd_kernel(IncMultiHeadSelfAttentionMeta const *m,
       DT *C = static_cast<DT *>(m->qk_prods_softmax);
       // after transposition & striding
       int m_ = num_tokens; // num_new_tokens
-      int n_ = num_tokens;
+      int n_ = num_total_tokens;
       int k_ = m->vProjSize;
       // before transposition and striding
       int lda = m->vProjSize * m->num_q_heads;
@@ -1092,7 +1170,7 @@ void peft_bwd_kernel(IncMultiHeadSelfAttentionMeta const *m,
       int ldc = num_tokens; // num_new_tokens
       int strideA = m->vProjSize;
       int strideB = m->vProjSize;
-      int strideC = num_tokens * num_tokens; // num_new_tokens * total_tokens
+      int strideC = num_tokens * num_total_tokens;
 
       checkCUDA(cublasGemmStridedBatchedEx(m->handle.blas,
                                            CUBLAS_OP_T,
@@ -1120,18 +1198,20 @@ void peft_bwd_kernel(IncMultiHeadSelfAttentionMeta const *m,
       if (m->inference_debugging) {
         std::string filename =
             get_peft_dbg_folder(m, shard_id) + ".qk_prods.softmax_grad";
-        save_tensor(
-            C, num_tokens * num_tokens * m->num_q_heads, filename.c_str());
+        save_tensor(C,
+                    num_tokens * num_total_tokens * m->num_q_heads,
+                    filename.c_str());
         std::string filename2 = get_peft_dbg_folder(m, shard_id) + ".vcache";
-        save_tensor(
-            B, m->vProjSize * m->num_q_heads * num_tokens, filename2.c_str());
+        save_tensor(B,
+                    m->vProjSize * m->num_q_heads * num_total_tokens,
+                    filename2.c_str());
       }
     }
     // Step 4: softmax backpropagation
     {
       float alpha = 1.0f, beta = 0.0f;
       int n_param = m->num_q_heads;
-      int c_param = num_tokens;
+      int c_param = num_total_tokens;
       int h_param = 1;
       int w_param = num_tokens;
       checkCUDNN(cudnnSetTensor4dDescriptor(m->qk_tensor,
@@ -1157,8 +1237,9 @@ void peft_bwd_kernel(IncMultiHeadSelfAttentionMeta const *m,
         DT *C = static_cast<DT *>(m->qk_prods);
         std::string filename =
             get_peft_dbg_folder(m, shard_id) + ".qk_prods.softmax_grad_in";
-        save_tensor(
-            C, num_tokens * num_tokens * m->num_q_heads, filename.c_str());
+        save_tensor(C,
+                    num_tokens * num_total_tokens * m->num_q_heads,
+                    filename.c_str());
       }
 
       //  TODO: fill all elements above diagonal to force causal attention
@@ -1171,7 +1252,7 @@ void peft_bwd_kernel(IncMultiHeadSelfAttentionMeta const *m,
                                       0,
                                       stream>>>(static_cast<DT *>(m->qk_prods),
                                                 num_tokens,
-                                                num_tokens,
+                                                num_total_tokens,
                                                 m->num_q_heads,
                                                 entries_above_diagonal,
                                                 DT(0.0f));
@@ -1180,8 +1261,9 @@ void peft_bwd_kernel(IncMultiHeadSelfAttentionMeta const *m,
         DT *C = static_cast<DT *>(m->qk_prods);
         std::string filename = get_peft_dbg_folder(m, shard_id) +
                                ".qk_prods.softmax_grad_in.masked";
-        save_tensor(
-            C, num_tokens * num_tokens * m->num_q_heads, filename.c_str());
+        save_tensor(C,
+                    num_tokens * num_total_tokens * m->num_q_heads,
+                    filename.c_str());
       }
     }
     // Step 5: compute gradients w.r.t. key
@@ -1191,8 +1273,10 @@ void peft_bwd_kernel(IncMultiHeadSelfAttentionMeta const *m,
         alpha = 1.0f / sqrt(m->kProjSize);
       }
       // matrix A: gradients w.r.t. qk_prods
-      // matrix A's layout: [num_new_tokens, num_tokens, num_heads]
-      DT const *A = static_cast<DT *>(m->qk_prods);
+      // matrix A's layout: [num_new_tokens, total_tokens, num_heads]
+      // (the columns of the cached tokens are skipped)
+      DT const *A =
+          static_cast<DT *>(m->qk_prods) + num_cached_tokens * num_tokens;
       // matrix B: query activation (in query_activation_buffer)
       // matrix B's layout: [m->qProjSize * num_heads, num_new_tokens]
       DT const *B = static_cast<DT *>(m->query_activation_buffer);
@@ -1211,9 +1295,19 @@ void peft_bwd_kernel(IncMultiHeadSelfAttentionMeta const *m,
       int lda = num_tokens; // num_new_tokens
       int ldb = m->kProjSize * m->num_q_heads;
       int ldc = num_tokens;
-      int strideA = num_tokens * num_tokens;
+      int strideA = num_tokens * num_total_tokens;
       int strideB = m->kProjSize;
       int strideC = num_tokens * m->kProjSize;
+      if (accumulate_kv_grads && has_later_chunks) {
+        // add the gradients from the later chunks of the entry
+        load_accumulated_kv_grads(
+            C,
+            key_grads + bc->requestsInfo[i].first_token_depth_in_request,
+            num_tokens,
+            m->kProjSize * m->num_q_heads,
+            stream);
+        beta = 1.0f;
+      }
       checkCUDA(cublasGemmStridedBatchedEx(m->handle.blas,
                                            CUBLAS_OP_T,
                                            CUBLAS_OP_T,
@@ -1247,6 +1341,35 @@ void peft_bwd_kernel(IncMultiHeadSelfAttentionMeta const *m,
         save_tensor(
             C, num_tokens * (m->qProjSize * m->num_q_heads), filename2.c_str());
       }
+      if (accumulate_kv_grads && num_cached_tokens > 0) {
+        // accumulate the gradients w.r.t. the keys of the cached tokens,
+        // from the columns of qk_prods skipped above
+        beta = has_later_chunks ? 1.0f : 0.0f;
+        DT const *A_cached = static_cast<DT *>(m->qk_prods);
+        checkCUDA(cublasGemmStridedBatchedEx(m->handle.blas,
+                                             CUBLAS_OP_T,
+                                             CUBLAS_OP_T,
+                                             num_cached_tokens,
+                                             n_,
+                                             k_,
+                                             &alpha,
+                                             A_cached,
+                                             cublas_data_type,
+                                             lda,
+                                             strideA,
+                                             B,
+                                             cublas_data_type,
+                                             ldb,
+                                             strideB,
+                                             &beta,
+                                             key_grads,
+                                             cublas_data_type,
+                                             kv_grad_ld,
+                                             kv_grad_ld * m->kProjSize,
+                                             m->num_q_heads,
+                                             compute_type,
+                                             CUBLAS_GEMM_DEFAULT_TENSOR_OP));
+      }
     }
     // Step 6: compute gradients w.r.t query
     {
@@ -1255,7 +1378,7 @@ void peft_bwd_kernel(IncMultiHeadSelfAttentionMeta const *m,
         alpha = 1.0f / sqrt(m->kProjSize);
       }
       // matrix A: gradients w.r.t. qk_prods
-      // matrix A's layout: [num_new_tokens, num_tokens, num_heads]
+      // matrix A's layout: [num_new_tokens, total_tokens, num_heads]
       DT const *A = static_cast<DT *>(m->qk_prods);
       // matrix B: key cache
       // matrix B's layout: [vProjSize * num_heads, max_num_tokens, num_req]
@@ -1266,12 +1389,12 @@ void peft_bwd_kernel(IncMultiHeadSelfAttentionMeta const *m,
       // after transposition & striding
       int m_ = num_tokens; // num_new_tokens
       int n_ = m->qProjSize;
-      int k_ = num_tokens;
+      int k_ = num_total_tokens;
       // before transposition and striding
       int lda = num_tokens; // num_new_tokens
       int ldb = m->qProjSize * m->num_q_heads;
       int ldc = num_tokens;
-      int strideA = num_tokens * num_tokens;
+      int strideA = num_tokens * num_total_tokens;
       int strideB = m->qProjSize;
       int strideC = num_tokens * m->qProjSize;
       checkCUDA(cublasGemmStridedBatchedEx(m->handle.blas,
@@ -1314,12 +1437,15 @@ void peft_bwd_kernel(IncMultiHeadSelfAttentionMeta const *m,
         /*q&k*/
         int parallelism = num_tokens * m->hidden_size;
         DT *A = static_cast<DT *>(m->devQKVProjArray);
+        // positions of the request's tokens
+        BatchConfig::PerTokenInfo const *token_infos =
+            m->token_infos + bc->requestsInfo[i].first_token_offset_in_batch;
         apply_rotary_embedding_bwd<<<GET_BLOCKS(parallelism),
                                      min(CUDA_NUM_THREADS, parallelism),
                                      0,
                                      stream>>>(A,
                                                m->complex_input,
-                                               m->token_infos,
+                                               token_infos,
                                                m->qProjSize,
                                                num_tokens,
                                                m->hidden_size);
@@ -1493,25 +1619,44 @@ void compute_attention_kernel_prompt(IncMultiHeadSelfAttentionMeta *m,
     int total_tokens = bc->requestsInfo[i].first_token_depth_in_request +
                        bc->requestsInfo[i].num_tokens_in_batch;
     int max_peft_tokens = bc->requestsInfo[i].max_sequence_length;
+    // Only the current chunk of a PEFT request keeps its activations
+    int max_peft_chunk_tokens =
+        BatchConfig::max_peft_chunk_tokens(max_peft_tokens);
     // Copy query to m->query_activation_buffer if we need to compute
     // PEFT backward
     if (bc->requestsInfo[i].peft_bwd) {
       size_t activation_size_needed =
-          sizeof(DT) * max_peft_tokens * m->num_q_heads * m->qProjSize;
+          sizeof(DT) * max_peft_chunk_tokens * m->num_q_heads * m->qProjSize;
       if (activation_size_needed > m->allocated_peft_buffer_size1) {
         MemoryAllocator *allocator = m->handle.peft_activation_allocator;
         m->query_activation_buffer =
             allocator->allocate_instance_untyped(activation_size_needed);
         m->allocated_peft_buffer_size1 = activation_size_needed;
       }
-      int parallelism = m->hidden_size * num_tokens;
+      // the chunks of an entry that does not fit in a batch accumulate the
+      // gradients of the keys and values of the earlier chunks
+      if (!bc->requestsInfo[i].peft_truncated_bwd &&
+          num_new_tokens < bc->requestsInfo[i].peft_entry_length) {
+        size_t kv_grad_size_needed = sizeof(DT) * 2 * m->kProjSize *
+                                     m->num_q_heads *
+                                     BatchConfig::max_sequence_length();
+        if (kv_grad_size_needed > m->allocated_peft_buffer_size3) {
+          MemoryAllocator *allocator = m->handle.peft_activation_allocator;
+          m->kv_grad_buffer =
+              allocator->allocate_instance_untyped(kv_grad_size_needed);
+          m->allocated_peft_buffer_size3 = kv_grad_size_needed;
+        }
+      }
+      int parallelism = m->hidden_size * num_new_tokens;
       store_query_cache<<<GET_BLOCKS(parallelism),
                           min(CUDA_NUM_THREADS, parallelism),
                           0,
                           stream>>>(
-          static_cast<DT *>(m->devQKVProjArray),
+          static_cast<DT *>(m->devQKVProjArray) +
+              bc->requestsInfo[i].first_token_offset_in_batch *
+                  m->qProjSize * m->num_q_heads * QKV_WEIGHT_NUM,
           static_cast<DT *>(m->query_activation_buffer),
-          num_tokens,
+          num_new_tokens,
           m->hidden_size);
     }
     // Step 1: compute query-key product QK.T/sqrt(d_k)
@@ -1650,7 +1795,7 @@ void compute_attention_kernel_prompt(IncMultiHeadSelfAttentionMeta *m,
     if (bc->requestsInfo[i].peft_bwd) {
       DT *C_softmax = static_cast<DT *>(m->qk_prods_softmax);
       size_t activation_size_needed =
-          sizeof(DT) * max_peft_tokens * max_peft_tokens * m->num_q_heads;
+          sizeof(DT) * max_peft_chunk_tokens * max_peft_tokens * m->num_q_heads;
       if (activation_size_needed > m->allocated_peft_buffer_size2) {
         MemoryAllocator *allocator = m->handle.peft_activation_allocator;
         m->softmax_activation_buffer =
@@ -2140,6 +2285,7 @@ IncMultiHeadSelfAttentionMeta::IncMultiHeadSelfAttentionMeta(
   }
   allocated_peft_buffer_size1 = 0;
   allocated_peft_buffer_size2 = 0;
+  allocated_peft_buffer_size3 = 0;
   cudaStreamSynchronize(stream);
 }
 
@@ -0,0 +1,482 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "flexflow/ops/kernels/embedding_bag_cpu.h"
+#include <algorithm>
+#include <cassert>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FF_EMBEDDING_BAG_X86
+#endif
+
+namespace FlexFlow {
+namespace Kernels {
+namespace EmbeddingBagCPU {
+
+namespace {
+
+// Rows of the indices this far ahead are prefetched while pooling a row
+int64_t const PREFETCH_DISTANCE = 8;
+
+template <typename TI>
+struct Bags {
+  TI const *indices;
+  // bag b holds the indices in [offsets[b], offsets[b + 1])
+  std::vector<int64_t> offsets;
+  int64_t num_rows;
+  int block_size;
+  AggrMode aggr;
+
+  int64_t row(int64_t i) const {
+    int64_t idx = indices[i];
+    assert(idx >= 0 && idx < num_rows);
+    return idx;
+  }
+  float scale(int64_t bag) const {
+    int64_t length = offsets[bag + 1] - offsets[bag];
+    return aggr == AGGR_MODE_AVG && length > 0 ? 1.0f / length : 1.0f;
+  }
+};
+
+// Worker threads shared by all calls, so that the kernels do not start
+// threads for every batch. The pool grows to the most threads a call asked
+// for; concurrent calls queue their work on the same workers.
+class WorkerPool {
+public:
+  static WorkerPool &get_pool() {
+    static WorkerPool pool;
+    return pool;
+  }
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> lock(work_mutex);
+      stopping = true;
+    }
+    work_cv.notify_all();
+    for (auto &worker : workers) {
+      worker.join();
+    }
+  }
+  // Runs f(t) for t in [0, num_threads), on the calling thread for t == 0
+  template <typename F>
+  void run(int num_threads, F const &f) {
+    int remaining = num_threads - 1;
+    if (remaining == 0) {
+      f(0);
+      return;
+    }
+    std::mutex done_mutex;
+    std::condition_variable done_cv;
+    {
+      std::lock_guard<std::mutex> lock(work_mutex);
+      while ((int)workers.size() < num_threads - 1) {
+        workers.emplace_back(&WorkerPool::worker_loop, this);
+      }
+      for (int t = 1; t < num_threads; t++) {
+        pending_work.push_back([&, t] {
+          f(t);
+          // notify with the lock held, since the caller returns as soon as
+          // it sees remaining == 0
+          std::lock_guard<std::mutex> done_lock(done_mutex);
+          if (--remaining == 0) {
+            done_cv.notify_one();
+          }
+        });
+      }
+    }
+    work_cv.notify_all();
+    f(0);
+    std::unique_lock<std::mutex> done_lock(done_mutex);
+    done_cv.wait(done_lock, [&] { return remaining == 0; });
+  }
+
+private:
+  void worker_loop() {
+    std::unique_lock<std::mutex> lock(work_mutex);
+    while (true) {
+      work_cv.wait(lock, [this] { return stopping || !pending_work.empty(); });
+      if (pending_work.empty()) {
+        break;
+      }
+      std::function<void()> work = std::move(pending_work.front());
+      pending_work.pop_front();
+      lock.unlock();
+      work();
+      lock.lock();
+    }
+  }
+
+  std::vector<std::thread> workers;
+  std::deque<std::function<void()>> pending_work;
+  std::mutex work_mutex;
+  std::condition_variable work_cv;
+  bool stopping = false;
+};
+
+// Runs f(t) for t in [0, num_threads), on the calling thread for t == 0
+template <typename F>
+void run_parallel(int num_threads, F const &f) {
+  WorkerPool::get_pool().run(num_threads, f);
+}
+
+// Pools bag b into op (block_size floats)
+template <typename TI>
+void pool_scalar(Bags<TI> const &bags,
+                 float const *weight,
+                 int64_t b,
+                 float *op) {
+  int const n = bags.block_size;
+  float const scale = bags.scale(b);
+  std::fill(op, op + n, 0.0f);
+  for (int64_t i = bags.offsets[b]; i < bags.offsets[b + 1]; i++) {
+    float const *ip = weight + bags.row(i) * n;
+    for (int j = 0; j < n; j++) {
+      op[j] += scale * ip[j];
+    }
+  }
+}
+
+// y += a * x
+void axpy_scalar(float *y, float const *x, float a, int n) {
+  for (int j = 0; j < n; j++) {
+    y[j] += a * x[j];
+  }
+}
+
+#ifdef FF_EMBEDDING_BAG_X86
+// Mask selecting the first n (at most 8) lanes of a __m256
+__attribute__((target("avx2"))) inline __m256i avx2_mask(int n) {
+  static int32_t const lanes[16] = {
+      -1, -1, -1, -1, -1, -1, -1, -1, 0, 0, 0, 0, 0, 0, 0, 0};
+  return _mm256_loadu_si256((__m256i const *)(lanes + 8 - n));
+}
+
+template <typename TI>
+__attribute__((target("avx2,fma"))) void
+    pool_avx2(Bags<TI> const &bags, float const *weight, int64_t b, float *op) {
+  int const n = bags.block_size;
+  int64_t const start = bags.offsets[b], stop = bags.offsets[b + 1];
+  __m256 const vscale = _mm256_set1_ps(bags.scale(b));
+  int j = 0;
+  // 32 columns at a time, accumulated in registers over the whole bag
+  for (; j + 32 <= n; j += 32) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    __m256 acc2 = _mm256_setzero_ps(), acc3 = _mm256_setzero_ps();
+    for (int64_t i = start; i < stop; i++) {
+      float const *ip = weight + bags.row(i) * n + j;
+      if (i + PREFETCH_DISTANCE < stop) {
+        float const *next = weight + bags.row(i + PREFETCH_DISTANCE) * n + j;
+        _mm_prefetch((char const *)next, _MM_HINT_T0);
+        _mm_prefetch((char const *)(next + 16), _MM_HINT_T0);
+      }
+      acc0 = _mm256_fmadd_ps(vscale, _mm256_loadu_ps(ip), acc0);
+      acc1 = _mm256_fmadd_ps(vscale, _mm256_loadu_ps(ip + 8), acc1);
+      acc2 = _mm256_fmadd_ps(vscale, _mm256_loadu_ps(ip + 16), acc2);
+      acc3 = _mm256_fmadd_ps(vscale, _mm256_loadu_ps(ip + 24), acc3);
+    }
+    _mm256_storeu_ps(op + j, acc0);
+    _mm256_storeu_ps(op + j + 8, acc1);
+    _mm256_storeu_ps(op + j + 16, acc2);
+    _mm256_storeu_ps(op + j + 24, acc3);
+  }
+  // the remaining columns, 8 at a time with a partial last vector
+  for (; j < n; j += 8) {
+    __m256i const mask = avx2_mask(std::min(8, n - j));
+    __m256 acc = _mm256_setzero_ps();
+    for (int64_t i = start; i < stop; i++) {
+      float const *ip = weight + bags.row(i) * n + j;
+      acc = _mm256_fmadd_ps(vscale, _mm256_maskload_ps(ip, mask), acc);
+    }
+    _mm256_maskstore_ps(op + j, mask, acc);
+  }
+}
+
+__attribute__((target("avx2,fma"))) void
+    axpy_avx2(float *y, float const *x, float a, int n) {
+  __m256 const va = _mm256_set1_ps(a);
+  int j = 0;
+  for (; j + 8 <= n; j += 8) {
+    _mm256_storeu_ps(
+        y + j,
+        _mm256_fmadd_ps(va, _mm256_loadu_ps(x + j), _mm256_loadu_ps(y + j)));
+  }
+  if (j < n) {
+    __m256i const mask = avx2_mask(n - j);
+    _mm256_maskstore_ps(y + j,
+                        mask,
+                        _mm256_fmadd_ps(va,
+                                        _mm256_maskload_ps(x + j, mask),
+                                        _mm256_maskload_ps(y + j, mask)));
+  }
+}
+
+template <typename TI>
+__attribute__((target("avx512f"))) void pool_avx512(Bags<TI> const &bags,
+                                                    float const *weight,
+                                                    int64_t b,
+                                                    float *op) {
+  int const n = bags.block_size;
+  int64_t const start = bags.offsets[b], stop = bags.offsets[b + 1];
+  __m512 const vscale = _mm512_set1_ps(bags.scale(b));
+  int j = 0;
+  // 64 columns at a time, accumulated in registers over the whole bag
+  for (; j + 64 <= n; j += 64) {
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+    __m512 acc2 = _mm512_setzero_ps(), acc3 = _mm512_setzero_ps();
+    for (int64_t i = start; i < stop; i++) {
+      float const *ip = weight + bags.row(i) * n + j;
+      if (i + PREFETCH_DISTANCE < stop) {
+        float const *next = weight + bags.row(i + PREFETCH_DISTANCE) * n + j;
+        _mm_prefetch((char const *)next, _MM_HINT_T0);
+        _mm_prefetch((char const *)(next + 16), _MM_HINT_T0);
+        _mm_prefetch((char const *)(next + 32), _MM_HINT_T0);
+        _mm_prefetch((char const *)(next + 48), _MM_HINT_T0);
+      }
+      acc0 = _mm512_fmadd_ps(vscale, _mm512_loadu_ps(ip), acc0);
+      acc1 = _mm512_fmadd_ps(vscale, _mm512_loadu_ps(ip + 16), acc1);
+      acc2 = _mm512_fmadd_ps(vscale, _mm512_loadu_ps(ip + 32), acc2);
+      acc3 = _mm512_fmadd_ps(vscale, _mm512_loadu_ps(ip + 48), acc3);
+    }
+    _mm512_storeu_ps(op + j, acc0);
+    _mm512_storeu_ps(op + j + 16, acc1);
+    _mm512_storeu_ps(op + j + 32, acc2);
+    _mm512_storeu_ps(op + j + 48, acc3);
+  }
+  // the remaining columns, 16 at a time with a partial last vector
+  for (; j < n; j += 16) {
+    __mmask16 const mask = (__mmask16)((1u << std::min(16, n - j)) - 1);
+    __m512 acc = _mm512_setzero_ps();
+    for (int64_t i = start; i < stop; i++) {
+      float const *ip = weight + bags.row(i) * n + j;
+      acc = _mm512_fmadd_ps(vscale, _mm512_maskz_loadu_ps(mask, ip), acc);
+    }
+    _mm512_mask_storeu_ps(op + j, mask, acc);
+  }
+}
+
+__attribute__((target("avx512f"))) void
+    axpy_avx512(float *y, float const *x, float a, int n) {
+  __m512 const va = _mm512_set1_ps(a);
+  int j = 0;
+  for (; j + 16 <= n; j += 16) {
+    _mm512_storeu_ps(
+        y + j,
+        _mm512_fmadd_ps(va, _mm512_loadu_ps(x + j), _mm512_loadu_ps(y + j)));
+  }
+  if (j < n) {
+    __mmask16 const mask = (__mmask16)((1u << (n - j)) - 1);
+    _mm512_mask_storeu_ps(y + j,
+                          mask,
+                          _mm512_fmadd_ps(va,
+                                          _mm512_maskz_loadu_ps(mask, x + j),
+                                          _mm512_maskz_loadu_ps(mask, y + j)));
+  }
+}
+#endif
+
+Isa resolve(Isa isa) {
+  Isa best = best_isa();
+  return isa > best ? best : isa;
+}
+
+template <typename TI>
+Bags<TI> make_bags(TI const *indices,
+                   int const *lengths,
+                   int num_bags,
+                   int64_t num_rows,
+                   int block_size,
+                   AggrMode aggr) {
+  assert(aggr == AGGR_MODE_SUM || aggr == AGGR_MODE_AVG);
+  Bags<TI> bags;
+  bags.indices = indices;
+  bags.offsets.resize(num_bags + 1);
+  bags.offsets[0] = 0;
+  for (int b = 0; b < num_bags; b++) {
+    assert(lengths[b] >= 0);
+    bags.offsets[b + 1] = bags.offsets[b] + lengths[b];
+  }
+  bags.num_rows = num_rows;
+  bags.block_size = block_size;
+  bags.aggr = aggr;
+  return bags;
+}
+
+} // namespace
+
+Isa best_isa() {
+#ifdef FF_EMBEDDING_BAG_X86
+  static Isa const best =
+      __builtin_cpu_supports("avx512f") ? ISA_AVX512
+      : (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+          ? ISA_AVX2
+          : ISA_SCALAR;
+  return best;
+#else
+  return ISA_SCALAR;
+#endif
+}
+
+char const *isa_name(Isa isa) {
+  switch (resolve(isa)) {
+    case ISA_AVX2:
+      return "avx2";
+    case ISA_AVX512:
+      return "avx512";
+    default:
+      return "scalar";
+  }
+}
+
+template <typename TI>
+void forward(TI const *indices,
+             int const *lengths,
+             int num_bags,
+             float const *weight,
+             int64_t num_rows,
+             int block_size,
+             AggrMode aggr,
+             float *output,
+             int num_threads,
+             Isa isa) {
+  Bags<TI> const bags =
+      make_bags(indices, lengths, num_bags, num_rows, block_size, aggr);
+  void (*pool)(Bags<TI> const &, float const *, int64_t, float *) =
+      pool_scalar<TI>;
+#ifdef FF_EMBEDDING_BAG_X86
+  switch (resolve(isa)) {
+    case ISA_AVX2:
+      pool = pool_avx2<TI>;
+      break;
+    case ISA_AVX512:
+      pool = pool_avx512<TI>;
+      break;
+    default:
+      break;
+  }
+#endif
+  num_threads = std::max(1, std::min(num_threads, num_bags));
+  int64_t const total = bags.offsets[num_bags];
+  // thread t pools the bags starting at the first bag at or after its share
+  // of the indices, so that bags of any length balance out
+  auto first_bag = [&](int t) -> int64_t {
+    if (t == num_threads) {
+      return num_bags;
+    }
+    return std::lower_bound(bags.offsets.begin(),
+                            bags.offsets.end() - 1,
+                            total * t / num_threads) -
+           bags.offsets.begin();
+  };
+  run_parallel(num_threads, [&](int t) {
+    for (int64_t b = first_bag(t); b < first_bag(t + 1); b++) {
+      pool(bags, weight, b, output + b * block_size);
+    }
+  });
+}
+
+template <typename TI>
+void backward(TI const *indices,
+              int const *lengths,
+              int num_bags,
+              float const *output_grad,
+              int64_t num_rows,
+              int block_size,
+              AggrMode aggr,
+              float *weight_grad,
+              int num_threads,
+              Isa isa) {
+  Bags<TI> const bags =
+      make_bags(indices, lengths, num_bags, num_rows, block_size, aggr);
+  void (*axpy)(float *, float const *, float, int) = axpy_scalar;
+#ifdef FF_EMBEDDING_BAG_X86
+  switch (resolve(isa)) {
+    case ISA_AVX2:
+      axpy = axpy_avx2;
+      break;
+    case ISA_AVX512:
+      axpy = axpy_avx512;
+      break;
+    default:
+      break;
+  }
+#endif
+  num_threads =
+      (int)std::max<int64_t>(1, std::min<int64_t>(num_threads, num_rows));
+  run_parallel(num_threads, [&](int t) {
+    int64_t const lo = num_rows * t / num_threads;
+    int64_t const hi = num_rows * (t + 1) / num_threads;
+    for (int64_t b = 0; b < num_bags; b++) {
+      float const scale = bags.scale(b);
+      float const *gp = output_grad + b * block_size;
+      for (int64_t i = bags.offsets[b]; i < bags.offsets[b + 1]; i++) {
+        int64_t idx = bags.row(i);
+        if (idx >= lo && idx < hi) {
+          axpy(weight_grad + idx * block_size, gp, scale, block_size);
+        }
+      }
+    }
+  });
+}
+
+template void forward<int32_t>(int32_t const *indices,
+                               int const *lengths,
+                               int num_bags,
+                               float const *weight,
+                               int64_t num_rows,
+                               int block_size,
+                               AggrMode aggr,
+                               float *output,
+                               int num_threads,
+                               Isa isa);
+template void forward<int64_t>(int64_t const *indices,
+                               int const *lengths,
+                               int num_bags,
+                               float const *weight,
+                               int64_t num_rows,
+                               int block_size,
+                               AggrMode aggr,
+                               float *output,
+                               int num_threads,
+                               Isa isa);
+template void backward<int32_t>(int32_t const *indices,
+                                int const *lengths,
+                                int num_bags,
+                                float const *output_grad,
+                                int64_t num_rows,
+                                int block_size,
+                                AggrMode aggr,
+                                float *weight_grad,
+                                int num_threads,
+                                Isa isa);
+template void backward<int64_t>(int64_t const *indices,
+                                int const *lengths,
+                                int num_bags,
+                                float const *output_grad,
+                                int64_t num_rows,
+                                int block_size,
+                                AggrMode aggr,
+                                float *weight_grad,
+                                int num_threads,
+                                Isa isa);
+
+} // namespace EmbeddingBagCPU
+} // namespace Kernels
+} // namespace FlexFlow
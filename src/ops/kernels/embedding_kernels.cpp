@@ -16,6 +16,7 @@
 #include "flexflow/ops/kernels/embedding_kernels.h"
 #include "flexflow/utils/hip_helper.h"
 #include <hip/hip_runtime.h>
+#include <hipcub/hipcub.hpp>
 
 namespace FlexFlow {
 // declare Legion names
@@ -36,7 +37,8 @@ void forward_kernel_wrapper(EmbeddingMeta const *m,
                             GenericTensorAccessorR const &weight,
                             int in_dim,
                             int out_dim,
-                            int batch_size) {
+                            int batch_size,
+                            int const *lengths) {
   hipStream_t stream;
   checkCUDA(get_legion_stream(&stream));
   if (input.data_type == DT_INT32) {
@@ -47,6 +49,7 @@ void forward_kernel_wrapper(EmbeddingMeta const *m,
                                in_dim,
                                out_dim,
                                batch_size,
+                               lengths,
                                m->aggr,
                                output.domain.get_volume(),
                                stream);
@@ -57,6 +60,7 @@ void forward_kernel_wrapper(EmbeddingMeta const *m,
                                in_dim,
                                out_dim,
                                batch_size,
+                               lengths,
                                m->aggr,
                                output.domain.get_volume(),
                                stream);
@@ -67,6 +71,7 @@ void forward_kernel_wrapper(EmbeddingMeta const *m,
                                in_dim,
                                out_dim,
                                batch_size,
+                               lengths,
                                m->aggr,
                                output.domain.get_volume(),
                                stream);
@@ -81,6 +86,7 @@ void forward_kernel_wrapper(EmbeddingMeta const *m,
                                in_dim,
                                out_dim,
                                batch_size,
+                               lengths,
                                m->aggr,
                                output.domain.get_volume(),
                                stream);
@@ -91,6 +97,7 @@ void forward_kernel_wrapper(EmbeddingMeta const *m,
                                in_dim,
                                out_dim,
                                batch_size,
+                               lengths,
                                m->aggr,
                                output.domain.get_volume(),
                                stream);
@@ -101,6 +108,7 @@ void forward_kernel_wrapper(EmbeddingMeta const *m,
                                in_dim,
                                out_dim,
                                batch_size,
+                               lengths,
                                m->aggr,
                                output.domain.get_volume(),
                                stream);
@@ -128,7 +136,8 @@ void backward_kernel_wrapper(EmbeddingMeta const *m,
                              GenericTensorAccessorW const &weight_grad,
                              int in_dim,
                              int out_dim,
-                             int batch_size) {
+                             int batch_size,
+                             int const *lengths) {
   hipStream_t stream;
   checkCUDA(get_legion_stream(&stream));
   if (m->input_type[0] == DT_INT32) {
@@ -139,6 +148,7 @@ void backward_kernel_wrapper(EmbeddingMeta const *m,
                                 in_dim,
                                 out_dim,
                                 batch_size,
+                                lengths,
                                 m->aggr,
                                 output.domain.get_volume(),
                                 stream);
@@ -149,6 +159,7 @@ void backward_kernel_wrapper(EmbeddingMeta const *m,
                                 in_dim,
                                 out_dim,
                                 batch_size,
+                                lengths,
                                 m->aggr,
                                 output.domain.get_volume(),
                                 stream);
@@ -159,6 +170,7 @@ void backward_kernel_wrapper(EmbeddingMeta const *m,
                                 in_dim,
                                 out_dim,
                                 batch_size,
+                                lengths,
                                 m->aggr,
                                 output.domain.get_volume(),
                                 stream);
@@ -173,6 +185,7 @@ void backward_kernel_wrapper(EmbeddingMeta const *m,
                                 in_dim,
                                 out_dim,
                                 batch_size,
+                                lengths,
                                 m->aggr,
                                 output.domain.get_volume(),
                                 stream);
@@ -183,6 +196,7 @@ void backward_kernel_wrapper(EmbeddingMeta const *m,
                                 in_dim,
                                 out_dim,
                                 batch_size,
+                                lengths,
                                 m->aggr,
                                 output.domain.get_volume(),
                                 stream);
@@ -193,6 +207,7 @@ void backward_kernel_wrapper(EmbeddingMeta const *m,
                                 in_dim,
                                 out_dim,
                                 batch_size,
+                                lengths,
                                 m->aggr,
                                 output.domain.get_volume(),
                                 stream);
@@ -211,6 +226,230 @@ void backward_kernel_wrapper(EmbeddingMeta const *m,
   }
 }
 
+void sparse_backward_kernel_wrapper(EmbeddingMeta *m,
+                                    GenericTensorAccessorR const &input,
+                                    GenericTensorAccessorR const &output_grad,
+                                    GenericTensorAccessorW const &weight,
+                                    float *adagrad_state,
+                                    int in_dim,
+                                    int out_dim,
+                                    int batch_size,
+                                    int64_t num_rows,
+                                    float lr,
+                                    float weight_decay,
+                                    float epsilon) {
+  hipStream_t stream;
+  checkCUDA(get_legion_stream(&stream));
+  assert(output_grad.data_type == DT_FLOAT);
+  assert(weight.data_type == DT_FLOAT);
+  if (input.data_type == DT_INT32) {
+    Internal::sparse_backward_kernel(m,
+                                     input.get_int32_ptr(),
+                                     output_grad.get_float_ptr(),
+                                     weight.get_float_ptr(),
+                                     adagrad_state,
+                                     in_dim,
+                                     out_dim,
+                                     batch_size,
+                                     num_rows,
+                                     m->aggr,
+                                     lr,
+                                     weight_decay,
+                                     epsilon,
+                                     nullptr /*state_rows*/,
+                                     stream);
+  } else if (input.data_type == DT_INT64) {
+    Internal::sparse_backward_kernel(m,
+                                     input.get_int64_ptr(),
+                                     output_grad.get_float_ptr(),
+                                     weight.get_float_ptr(),
+                                     adagrad_state,
+                                     in_dim,
+                                     out_dim,
+                                     batch_size,
+                                     num_rows,
+                                     m->aggr,
+                                     lr,
+                                     weight_decay,
+                                     epsilon,
+                                     nullptr /*state_rows*/,
+                                     stream);
+  } else {
+    assert(false && "Unsupported DataType in Embedding");
+  }
+  if (m->profiling) {
+    checkCUDA(hipDeviceSynchronize());
+  }
+}
+
+void cached_forward_kernel_wrapper(EmbeddingMeta *m,
+                                   GenericTensorAccessorR const &input,
+                                   GenericTensorAccessorW const &output,
+                                   GenericTensorAccessorW const &table,
+                                   int in_dim,
+                                   int out_dim,
+                                   int batch_size,
+                                   bool update) {
+  hipStream_t stream;
+  checkCUDA(get_legion_stream(&stream));
+  assert(table.data_type == DT_FLOAT);
+  assert(output.data_type == DT_FLOAT);
+  EmbeddingCache *cache = m->cache;
+  size_t num_indices = (size_t)in_dim * batch_size;
+  // the cache is indexed on the host
+  std::vector<int> slots(num_indices);
+  std::vector<EmbeddingCache::Transfer> loads, writebacks;
+  if (input.data_type == DT_INT32) {
+    std::vector<int32_t> indices(num_indices);
+    checkCUDA(hipMemcpyAsync(indices.data(),
+                             input.get_int32_ptr(),
+                             num_indices * sizeof(int32_t),
+                             hipMemcpyDeviceToHost,
+                             stream));
+    checkCUDA(hipStreamSynchronize(stream));
+    cache->lookup(
+        indices.data(), num_indices, update, slots.data(), loads, writebacks);
+  } else {
+    assert(input.data_type == DT_INT64);
+    std::vector<int64_t> indices(num_indices);
+    checkCUDA(hipMemcpyAsync(indices.data(),
+                             input.get_int64_ptr(),
+                             num_indices * sizeof(int64_t),
+                             hipMemcpyDeviceToHost,
+                             stream));
+    checkCUDA(hipStreamSynchronize(stream));
+    cache->lookup(
+        indices.data(), num_indices, update, slots.data(), loads, writebacks);
+  }
+  // grow the device cache to hold the transient rows of this batch
+  int capacity =
+      cache->get_num_slots() + (int)cache->get_transient_rows().size();
+  if (capacity > m->cache_capacity) {
+    float *cache_table;
+    int64_t *cache_slot_rows;
+    checkCUDA(hipMalloc(&cache_table, sizeof(float) * capacity * out_dim));
+    checkCUDA(hipMalloc(&cache_slot_rows, sizeof(int64_t) * capacity));
+    if (m->cache_table != nullptr) {
+      checkCUDA(hipMemcpyAsync(cache_table,
+                               m->cache_table,
+                               sizeof(float) * m->cache_capacity * out_dim,
+                               hipMemcpyDeviceToDevice,
+                               stream));
+      checkCUDA(hipMemcpyAsync(cache_slot_rows,
+                               m->cache_slot_rows,
+                               sizeof(int64_t) * m->cache_capacity,
+                               hipMemcpyDeviceToDevice,
+                               stream));
+      checkCUDA(hipStreamSynchronize(stream));
+      checkCUDA(hipFree(m->cache_table));
+      checkCUDA(hipFree(m->cache_slot_rows));
+    }
+    m->cache_table = cache_table;
+    m->cache_slot_rows = cache_slot_rows;
+    m->cache_capacity = capacity;
+  }
+  if (num_indices > m->cache_num_slots) {
+    if (m->cache_slots != nullptr) {
+      checkCUDA(hipStreamSynchronize(stream));
+      checkCUDA(hipFree(m->cache_slots));
+    }
+    checkCUDA(hipMalloc(&m->cache_slots, sizeof(int) * num_indices));
+    m->cache_num_slots = num_indices;
+  }
+  // evicted rows are written back before their slots are reused
+  Internal::copy_cache_rows(m,
+                            writebacks,
+                            false /*to_cache*/,
+                            table.get_float_ptr(),
+                            out_dim,
+                            stream);
+  Internal::copy_cache_rows(
+      m, loads, true /*to_cache*/, table.get_float_ptr(), out_dim, stream);
+  checkCUDA(hipMemcpyAsync(m->cache_slots,
+                           slots.data(),
+                           sizeof(int) * num_indices,
+                           hipMemcpyHostToDevice,
+                           stream));
+  Internal::forward_kernel((int const *)m->cache_slots,
+                           output.get_float_ptr(),
+                           (float const *)m->cache_table,
+                           in_dim,
+                           out_dim,
+                           batch_size,
+                           m->aggr,
+                           output.domain.get_volume(),
+                           stream);
+  if (m->profiling) {
+    checkCUDA(hipDeviceSynchronize());
+    printf("[Embedding] %s cache: hit rate %.4f, %llu hits, %llu misses, "
+           "%llu evictions, %llu writebacks\n",
+           m->op_name,
+           cache->hit_rate(),
+           (unsigned long long)cache->num_hits,
+           (unsigned long long)cache->num_misses,
+           (unsigned long long)cache->num_evictions,
+           (unsigned long long)cache->num_writebacks);
+  }
+}
+
+void cached_sparse_backward_kernel_wrapper(
+    EmbeddingMeta *m,
+    GenericTensorAccessorR const &output_grad,
+    GenericTensorAccessorW const &table,
+    float *adagrad_state,
+    int in_dim,
+    int out_dim,
+    int batch_size,
+    float lr,
+    float weight_decay,
+    float epsilon) {
+  hipStream_t stream;
+  checkCUDA(get_legion_stream(&stream));
+  assert((size_t)in_dim * batch_size <= m->cache_num_slots);
+  // the Adagrad state stays indexed by table row
+  Internal::sparse_backward_kernel(m,
+                                   (int const *)m->cache_slots,
+                                   output_grad.get_float_ptr(),
+                                   m->cache_table,
+                                   adagrad_state,
+                                   in_dim,
+                                   out_dim,
+                                   batch_size,
+                                   m->cache_capacity,
+                                   m->aggr,
+                                   lr,
+                                   weight_decay,
+                                   epsilon,
+                                   m->cache_slot_rows,
+                                   stream);
+  // rows that were not admitted into the cache are written back right away
+  Internal::copy_cache_rows(m,
+                            m->cache->get_transient_rows(),
+                            false /*to_cache*/,
+                            table.get_float_ptr(),
+                            out_dim,
+                            stream);
+  if (m->profiling) {
+    checkCUDA(hipDeviceSynchronize());
+  }
+}
+
+void flush_cache_kernel_wrapper(EmbeddingMeta *m,
+                                GenericTensorAccessorW const &table) {
+  hipStream_t stream;
+  checkCUDA(get_legion_stream(&stream));
+  assert(table.data_type == DT_FLOAT);
+  int out_dim = table.domain.hi()[0] - table.domain.lo()[0] + 1;
+  std::vector<EmbeddingCache::Transfer> writebacks;
+  m->cache->flush(writebacks);
+  Internal::copy_cache_rows(m,
+                            writebacks,
+                            false /*to_cache*/,
+                            table.get_float_ptr(),
+                            out_dim,
+                            stream);
+}
+
 void rand_generate_int64_wrapper(int64_t *ptr, size_t size, int64_t p) {
   hipStream_t stream;
   checkCUDA(get_legion_stream(&stream));
@@ -259,18 +498,23 @@ __global__ void embed_forward_with_aggr(TI const *input,
                                         int out_dim,
                                         int in_dim,
                                         int batch_size,
+                                        int const *lengths,
                                         AggrMode aggr) {
-  TD scale = 1.0f / in_dim;
   CUDA_KERNEL_LOOP(i, batch_size * out_dim) {
     output[i] = 0;
     int idx = i / out_dim;
     int off = i % out_dim;
-    for (int j = 0; j < in_dim; j++) {
+    // bag idx holds the first lengths[idx] of its in_dim entries
+    int length = lengths == nullptr ? in_dim : lengths[idx];
+    for (int j = 0; j < length; j++) {
       TI wordIdx = input[idx * in_dim + j];
       output[i] = output[i] + embed[wordIdx * out_dim + off];
-      if (aggr == AGGR_MODE_SUM) {
-      } else {
-        assert(aggr == AGGR_MODE_AVG);
+    }
+    if (aggr == AGGR_MODE_SUM) {
+    } else {
+      assert(aggr == AGGR_MODE_AVG);
+      if (length > 0) {
+        TD scale = 1.0f / length;
         output[i] = output[i] * scale;
       }
     }
@@ -339,19 +583,21 @@ __global__ void embed_backward_with_aggr(TI const *input,
                                          int out_dim,
                                          int in_dim,
                                          int batch_size,
+                                         int const *lengths,
                                          AggrMode aggr) {
-  TD scale = 1.0f / in_dim;
   CUDA_KERNEL_LOOP(i, batch_size * out_dim) {
     int idx = i / out_dim;
     int off = i % out_dim;
+    int length = lengths == nullptr ? in_dim : lengths[idx];
     TD gradient;
     if (aggr == AGGR_MODE_SUM) {
       gradient = output[i];
     } else {
       assert(aggr == AGGR_MODE_AVG);
+      TD scale = 1.0f / length;
       gradient = output[i] * scale;
     }
-    for (int j = 0; j < in_dim; j++) {
+    for (int j = 0; j < length; j++) {
       TI wordIdx = input[idx * in_dim + j];
       atomicAdd(embed + wordIdx * out_dim + off, gradient);
     }
@@ -367,19 +613,21 @@ __global__ void embed_backward_with_aggr<int, half>(int const *input,
                                                     int out_dim,
                                                     int in_dim,
                                                     int batch_size,
+                                                    int const *lengths,
                                                     AggrMode aggr) {
-  half scale = 1.0f / in_dim;
   CUDA_KERNEL_LOOP(i, batch_size * out_dim) {
     int idx = i / out_dim;
     int off = i % out_dim;
+    int length = lengths == nullptr ? in_dim : lengths[idx];
     half gradient;
     if (aggr == AGGR_MODE_SUM) {
       gradient = output[i];
     } else {
       assert(aggr == AGGR_MODE_AVG);
+      half scale = 1.0f / length;
       gradient = output[i] * scale;
     }
-    for (int j = 0; j < in_dim; j++) {
+    for (int j = 0; j < length; j++) {
       int wordIdx = input[idx * in_dim + j];
 #if __CUDA_ARCH__ >= 700
       atomicAdd(embed + wordIdx * out_dim + off, gradient);
@@ -400,19 +648,21 @@ __global__ void embed_backward_with_aggr<int64_t, half>(int64_t const *input,
                                                         int out_dim,
                                                         int in_dim,
                                                         int batch_size,
+                                                        int const *lengths,
                                                         AggrMode aggr) {
-  half scale = 1.0f / in_dim;
   CUDA_KERNEL_LOOP(i, batch_size * out_dim) {
     int idx = i / out_dim;
     int off = i % out_dim;
+    int length = lengths == nullptr ? in_dim : lengths[idx];
     half gradient;
     if (aggr == AGGR_MODE_SUM) {
       gradient = output[i];
     } else {
       assert(aggr == AGGR_MODE_AVG);
+      half scale = 1.0f / length;
       gradient = output[i] * scale;
     }
-    for (int j = 0; j < in_dim; j++) {
+    for (int j = 0; j < length; j++) {
       int64_t wordIdx = input[idx * in_dim + j];
 #if __CUDA_ARCH__ >= 700
       atomicAdd(embed + wordIdx * out_dim + off, gradient);
@@ -434,6 +684,7 @@ void forward_kernel(TI const *input_ptr,
                     int in_dim,
                     int out_dim,
                     int batch_size,
+                    int const *lengths,
                     AggrMode aggr,
                     int outputSize,
                     hipStream_t stream) {
@@ -464,6 +715,7 @@ void forward_kernel(TI const *input_ptr,
                        out_dim,
                        in_dim,
                        batch_size,
+                       lengths,
                        aggr);
   }
 }
@@ -476,6 +728,7 @@ void backward_kernel(TI const *input_ptr,
                      int in_dim,
                      int out_dim,
                      int batch_size,
+                     int const *lengths,
                      AggrMode aggr,
                      int outputSize,
                      hipStream_t stream) {
@@ -505,10 +758,301 @@ void backward_kernel(TI const *input_ptr,
                        out_dim,
                        in_dim,
                        batch_size,
+                       lengths,
                        aggr);
   }
 }
 
+template <typename TI>
+__global__ void embed_sparse_keys(TI const *input,
+                                  int64_t *keys,
+                                  int *entries,
+                                  int num_entries) {
+  CUDA_KERNEL_LOOP(i, num_entries) {
+    keys[i] = input[i];
+    entries[i] = i;
+  }
+}
+
+// One block per row touched by the batch; blocks past the number of unique
+// rows exit immediately. The row's gradient is the sum of the output
+// gradients of the bags that looked it up, visited in entry order.
+__global__ void embed_sparse_update(int64_t const *rows,
+                                    int const *counts,
+                                    int const *offsets,
+                                    int const *entries,
+                                    int const *num_runs,
+                                    float const *output_grad,
+                                    int in_dim,
+                                    int out_dim,
+                                    float scale,
+                                    float lr,
+                                    float weight_decay,
+                                    float epsilon,
+                                    float *weight,
+                                    float *state,
+                                    int64_t const *state_rows) {
+  if (blockIdx.x >= *num_runs) {
+    return;
+  }
+  // out_dim gradients followed by one partial sum per thread
+  extern __shared__ float grad[];
+  float *partial = grad + out_dim;
+  int64_t row = rows[blockIdx.x];
+  float *w = weight + row * out_dim;
+  int begin = offsets[blockIdx.x], end = begin + counts[blockIdx.x];
+  float sum_sq = 0.0f;
+  for (int j = threadIdx.x; j < out_dim; j += blockDim.x) {
+    float g = 0.0f;
+    for (int k = begin; k < end; k++) {
+      g += output_grad[(int64_t)(entries[k] / in_dim) * out_dim + j];
+    }
+    g = g * scale + weight_decay * w[j];
+    if (state == nullptr) {
+      w[j] -= lr * g;
+    } else {
+      grad[j] = g;
+      sum_sq += g * g;
+    }
+  }
+  if (state == nullptr) {
+    return;
+  }
+  partial[threadIdx.x] = sum_sq;
+  __syncthreads();
+  for (int s = blockDim.x / 2; s > 0; s >>= 1) {
+    if (threadIdx.x < s) {
+      partial[threadIdx.x] += partial[threadIdx.x + s];
+    }
+    __syncthreads();
+  }
+  if (threadIdx.x == 0) {
+    int64_t state_row = state_rows == nullptr ? row : state_rows[row];
+    partial[0] = state[state_row] + partial[0] / out_dim;
+    state[state_row] = partial[0];
+  }
+  __syncthreads();
+  float step = lr / (sqrtf(partial[0]) + epsilon);
+  for (int j = threadIdx.x; j < out_dim; j += blockDim.x) {
+    w[j] -= step * grad[j];
+  }
+}
+
+/*static*/
+template <typename TI>
+void sparse_backward_kernel(EmbeddingMeta *m,
+                            TI const *input_ptr,
+                            float const *output_grad_ptr,
+                            float *weight_ptr,
+                            float *adagrad_state_ptr,
+                            int in_dim,
+                            int out_dim,
+                            int batch_size,
+                            int64_t num_rows,
+                            AggrMode aggr,
+                            float lr,
+                            float weight_decay,
+                            float epsilon,
+                            int64_t const *state_rows,
+                            hipStream_t stream) {
+  int num_entries = in_dim * batch_size;
+  if (num_entries == 0) {
+    return;
+  }
+  // only sort on the bits that can differ between row ids
+  int end_bit = 1;
+  while (end_bit < 63 && (int64_t(1) << end_bit) < num_rows) {
+    end_bit++;
+  }
+  // query the temporary storage of the hipcub passes
+  size_t sort_bytes = 0, encode_bytes = 0, scan_bytes = 0;
+  checkCUDA(hipcub::DeviceRadixSort::SortPairs(nullptr,
+                                               sort_bytes,
+                                               (int64_t *)nullptr,
+                                               (int64_t *)nullptr,
+                                               (int *)nullptr,
+                                               (int *)nullptr,
+                                               num_entries,
+                                               0,
+                                               end_bit,
+                                               stream));
+  checkCUDA(hipcub::DeviceRunLengthEncode::Encode(nullptr,
+                                                  encode_bytes,
+                                                  (int64_t *)nullptr,
+                                                  (int64_t *)nullptr,
+                                                  (int *)nullptr,
+                                                  (int *)nullptr,
+                                                  num_entries,
+                                                  stream));
+  checkCUDA(hipcub::DeviceScan::ExclusiveSum(nullptr,
+                                             scan_bytes,
+                                             (int *)nullptr,
+                                             (int *)nullptr,
+                                             num_entries,
+                                             stream));
+  size_t temp_bytes = std::max(sort_bytes, std::max(encode_bytes, scan_bytes));
+  // keys, sorted keys and unique rows (int64), then entries, sorted entries,
+  // run lengths, run offsets and the number of runs (int)
+  size_t bytes = 3 * num_entries * sizeof(int64_t) +
+                 (4 * num_entries + 1) * sizeof(int) + 256 + temp_bytes;
+  if (bytes > m->sparse_workspace_size) {
+    if (m->sparse_workspace != nullptr) {
+      checkCUDA(hipStreamSynchronize(stream));
+      checkCUDA(hipFree(m->sparse_workspace));
+    }
+    checkCUDA(hipMalloc(&m->sparse_workspace, bytes));
+    m->sparse_workspace_size = bytes;
+  }
+  int64_t *keys = (int64_t *)m->sparse_workspace;
+  int64_t *sorted_keys = keys + num_entries;
+  int64_t *unique_rows = sorted_keys + num_entries;
+  int *entries = (int *)(unique_rows + num_entries);
+  int *sorted_entries = entries + num_entries;
+  int *counts = sorted_entries + num_entries;
+  int *offsets = counts + num_entries;
+  int *num_runs = offsets + num_entries;
+  void *temp = (void *)(((uintptr_t)(num_runs + 1) + 255) / 256 * 256);
+
+  hipLaunchKernelGGL(HIP_KERNEL_NAME(embed_sparse_keys<TI>),
+                     GET_BLOCKS(num_entries),
+                     CUDA_NUM_THREADS,
+                     0,
+                     stream,
+                     input_ptr,
+                     keys,
+                     entries,
+                     num_entries);
+  checkCUDA(hipcub::DeviceRadixSort::SortPairs(temp,
+                                               sort_bytes,
+                                               keys,
+                                               sorted_keys,
+                                               entries,
+                                               sorted_entries,
+                                               num_entries,
+                                               0,
+                                               end_bit,
+                                               stream));
+  // runs past num_runs are never read but must not overflow the scan
+  checkCUDA(hipMemsetAsync(counts, 0, num_entries * sizeof(int), stream));
+  checkCUDA(hipcub::DeviceRunLengthEncode::Encode(temp,
+                                                  encode_bytes,
+                                                  sorted_keys,
+                                                  unique_rows,
+                                                  counts,
+                                                  num_runs,
+                                                  num_entries,
+                                                  stream));
+  checkCUDA(hipcub::DeviceScan::ExclusiveSum(
+      temp, scan_bytes, counts, offsets, num_entries, stream));
+
+  float scale = aggr == AGGR_MODE_AVG ? 1.0f / in_dim : 1.0f;
+  int block_size = 128;
+  size_t shared_size =
+      adagrad_state_ptr == nullptr ? 0 : (out_dim + block_size) * sizeof(float);
+  assert(shared_size <= 48 * 1024);
+  hipLaunchKernelGGL(embed_sparse_update,
+                     num_entries,
+                     block_size,
+                     shared_size,
+                     stream,
+                     unique_rows,
+                     counts,
+                     offsets,
+                     sorted_entries,
+                     num_runs,
+                     output_grad_ptr,
+                     in_dim,
+                     out_dim,
+                     scale,
+                     lr,
+                     weight_decay,
+                     epsilon,
+                     weight_ptr,
+                     adagrad_state_ptr,
+                     state_rows);
+}
+
+// One thread per element of the rows to copy; the table is in zero-copy
+// memory, so the rows are read and written in place
+__global__ void embed_cache_load(EmbeddingCache::Transfer const *transfers,
+                                 int num_transfers,
+                                 int out_dim,
+                                 float const *table,
+                                 float *cache,
+                                 int64_t *slot_rows) {
+  CUDA_KERNEL_LOOP(i, (Legion::coord_t)num_transfers * out_dim) {
+    EmbeddingCache::Transfer t = transfers[i / out_dim];
+    int j = i % out_dim;
+    cache[(int64_t)t.slot * out_dim + j] = table[t.row * out_dim + j];
+    if (j == 0) {
+      slot_rows[t.slot] = t.row;
+    }
+  }
+}
+
+__global__ void embed_cache_store(EmbeddingCache::Transfer const *transfers,
+                                  int num_transfers,
+                                  int out_dim,
+                                  float const *cache,
+                                  float *table) {
+  CUDA_KERNEL_LOOP(i, (Legion::coord_t)num_transfers * out_dim) {
+    EmbeddingCache::Transfer t = transfers[i / out_dim];
+    int j = i % out_dim;
+    table[t.row * out_dim + j] = cache[(int64_t)t.slot * out_dim + j];
+  }
+}
+
+void copy_cache_rows(EmbeddingMeta *m,
+                     std::vector<EmbeddingCache::Transfer> const &transfers,
+                     bool to_cache,
+                     float *table,
+                     int out_dim,
+                     hipStream_t stream) {
+  if (transfers.empty()) {
+    return;
+  }
+  if (transfers.size() > m->cache_transfer_capacity) {
+    if (m->cache_transfers != nullptr) {
+      checkCUDA(hipStreamSynchronize(stream));
+      checkCUDA(hipFree(m->cache_transfers));
+    }
+    checkCUDA(hipMalloc(&m->cache_transfers,
+                        sizeof(EmbeddingCache::Transfer) * transfers.size()));
+    m->cache_transfer_capacity = transfers.size();
+  }
+  size_t bytes = sizeof(EmbeddingCache::Transfer) * transfers.size();
+  checkCUDA(hipMemcpyAsync(m->cache_transfers,
+                           transfers.data(),
+                           bytes,
+                           hipMemcpyHostToDevice,
+                           stream));
+  int num_elements = transfers.size() * out_dim;
+  if (to_cache) {
+    hipLaunchKernelGGL(embed_cache_load,
+                       GET_BLOCKS(num_elements),
+                       CUDA_NUM_THREADS,
+                       0,
+                       stream,
+                       m->cache_transfers,
+                       transfers.size(),
+                       out_dim,
+                       table,
+                       m->cache_table,
+                       m->cache_slot_rows);
+  } else {
+    hipLaunchKernelGGL(embed_cache_store,
+                       GET_BLOCKS(num_elements),
+                       CUDA_NUM_THREADS,
+                       0,
+                       stream,
+                       m->cache_transfers,
+                       transfers.size(),
+                       out_dim,
+                       m->cache_table,
+                       table);
+  }
+}
+
 template <typename TD>
 __global__ void rand_generate_int(TD *ptr, size_t size, TD p) {
   CUDA_KERNEL_LOOP(i, size) {
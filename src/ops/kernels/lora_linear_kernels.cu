@@ -46,6 +46,12 @@ void init_kernel_wrapper(LoraLinearMeta *m, int seed) {
   }
 }
 
+void copy_paged_weights(void *dst, void const *src, size_t num_bytes) {
+  cudaStream_t stream;
+  checkCUDA(get_legion_stream(&stream));
+  checkCUDA(cudaMemcpyAsync(dst, src, num_bytes, cudaMemcpyDefault, stream));
+}
+
 void inference_kernel_wrapper(LoraLinearMeta *m,
                               BatchConfig const *bc,
                               GenericTensorAccessorR const &input,
@@ -155,6 +161,10 @@ void init_kernel(LoraLinearMeta *m, int seed, cudaStream_t stream) {
   // Get handle to weights by iterating over m->model_state to get each
   // LoraLinearWeight object
   for (auto &model_state : m->model_state) {
+    if (model_state.second.paged_block >= 0) {
+      // paged weights are always loaded from file
+      continue;
+    }
     LoraLinearWeight weight = model_state.second.weights;
     int w0_num_elements = weight.rank * weight.in_dim;
     int w1_num_elements = weight.rank * weight.out_dim;
@@ -239,17 +249,16 @@ void inference_kernel(LoraLinearMeta *m,
   }
   // Assert that we have at most one request that requires peft_bwd
   assert(num_peft_requests <= 1);
-  for (int i = 0; i < bc->max_requests_per_batch(); i++) {
-    if (bc->request_completed[i]) {
-      continue;
-    }
-    // Skip non-PEFT requests
-    if (bc->requestsInfo[i].peft_model_id == PEFTModelID::NO_ID) {
-      continue;
-    }
-    int num_peft_tokens = bc->requestsInfo[i].num_tokens_in_batch;
-    int max_peft_tokens = bc->requestsInfo[i].max_sequence_length;
-    int first_token_offset = bc->requestsInfo[i].first_token_offset_in_batch;
+  // Requests that use the same adapter and whose tokens are contiguous in
+  // the batch share one pair of GEMMs
+  std::vector<AdapterSegment> segments;
+  bc->get_adapter_segments(segments);
+  for (AdapterSegment const &segment : segments) {
+    int i = segment.request_index;
+    int num_peft_tokens = segment.num_tokens;
+    int max_peft_tokens = BatchConfig::max_peft_chunk_tokens(
+        bc->requestsInfo[i].max_sequence_length);
+    int first_token_offset = segment.first_token_offset;
     assert(m->model_state.find(bc->requestsInfo[i].peft_model_id) !=
            m->model_state.end());
     LoraLinearWeight weight =
@@ -16,6 +16,7 @@
 #include "flexflow/ops/kernels/softmax_kernels.h"
 #include "flexflow/utils/cuda_helper.h"
 #include "flexflow/utils/hash_utils.h"
+#include "flexflow/utils/peft_chunking.h"
 
 namespace FlexFlow {
 // declare Legion names
@@ -322,21 +323,29 @@ void peft_bwd_kernel(SoftmaxMeta const *m,
       tokens_previous_requests += bc->requestsInfo[i].num_tokens_in_batch;
       continue;
     }
-    int num_bwd_tokens = bc->requestsInfo[i].num_tokens_in_batch - 1;
-    // shift labels by 1 position to the left (ignore first token label)
-    for (int j = 0; j < num_bwd_tokens; j++) {
-      token_ids[j] = bc->tokensInfo[j + tokens_previous_requests + 1].token_id;
+    int num_tokens = bc->requestsInfo[i].num_tokens_in_batch;
+    BatchConfig::TokenId chunk_tokens[BatchConfig::MAX_NUM_TOKENS];
+    for (int j = 0; j < num_tokens; j++) {
+      chunk_tokens[j] = bc->tokensInfo[j + tokens_previous_requests].token_id;
+    }
+    // The last token of a chunk is labeled with the first token of the next
+    // chunk of its dataset entry; only the entry's last token has no label
+    int num_bwd_tokens =
+        get_peft_chunk_labels(chunk_tokens,
+                              num_tokens,
+                              bc->requestsInfo[i].peft_next_token_id,
+                              token_ids);
+    DT scale_factor =
+        get_peft_loss_scale(bc->requestsInfo[i].peft_entry_length, num_tokens);
+    if (num_bwd_tokens < num_tokens) {
+      // ignore last token
+      checkCUDA(cudaMemsetAsync(
+          input_grad_ptr +
+              (tokens_previous_requests + num_tokens - 1) * num_classes,
+          0,
+          num_classes * sizeof(DT),
+          stream));
     }
-
-    DT scale_factor = 1.0 / (bc->requestsInfo[i].num_tokens_in_batch - 1);
-    // ignore last token
-    checkCUDA(cudaMemsetAsync(
-        input_grad_ptr + (tokens_previous_requests +
-                          bc->requestsInfo[i].num_tokens_in_batch - 1) *
-                             num_classes,
-        0,
-        num_classes * sizeof(DT),
-        stream));
     checkCUDA(cudaMemcpyAsync(m->handle.workSpace,
                               token_ids,
                               sizeof(BatchConfig::TokenId) * num_bwd_tokens,
@@ -362,7 +371,7 @@ void peft_bwd_kernel(SoftmaxMeta const *m,
                              DT(0.0),
                              scale_factor);
 
-    tokens_previous_requests += num_bwd_tokens + 1;
+    tokens_previous_requests += num_tokens;
   }
   assert(tokens_previous_requests == bc->num_active_tokens());
 }
@@ -744,6 +744,11 @@ void LayerNorm::peft_bwd_task(Task const *task,
   LayerNorm::peft_bwd_kernel_wrapper(m, output_grad, input_grad, gamma);
 }
 
+bool LayerNorm::can_recompute_outputs() const {
+  // the forward pass also recomputes the mean and rstd backward reads
+  return true;
+}
+
 void LayerNorm::backward(FFModel const &ff) {
   ArgumentMap argmap;
   Context ctx = ff.config.lg_ctx;
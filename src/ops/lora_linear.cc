@@ -3,7 +3,9 @@
 #include "flexflow/layer.h"
 #include "flexflow/model.h"
 #include "flexflow/ops/kernels/lora_linear_kernels.h"
+#include "flexflow/request_manager.h"
 #include "flexflow/utils/hash_utils.h"
+#include "flexflow/utils/peft_checkpoint_writer.h"
 #include "flexflow/utils/peft_weight_allocator.h"
 #include "legion/legion_utilities.h"
 #include <sys/stat.h>
@@ -36,6 +38,8 @@ using Legion::Task;
 using Legion::TaskArgument;
 using Legion::TaskLauncher;
 
+Legion::Logger log_lora("LoraLinear");
+
 using namespace FlexFlow::Kernels::LoraLinear;
 
 bool check_lora_layer_match(Layer *potential_target,
@@ -61,6 +65,8 @@ PEFTModelID *FFModel::add_lora_layer(LoraLinearConfig const peft_config) {
   }
   PEFTModelID *peft_model_id = new PEFTModelID(peft_model_global_guid++);
   peft_configs[*peft_model_id] = peft_config;
+  // names of the LoRA weight files of this adapter, without the _A/_B suffix
+  std::set<std::string> peft_weight_names;
 
   for (std::string target_module_name : peft_config.target_modules) {
     assert(target_module_name.length() > 0 &&
@@ -78,6 +84,9 @@ PEFTModelID *FFModel::add_lora_layer(LoraLinearConfig const peft_config) {
         // lora linear layer already added, no need to add again
         Layer *peft_layer = base_layer_to_peft_layer[target_module];
         peft_layer_to_peft_id[peft_layer].push_back(*peft_model_id);
+        std::string peft_layer_name(peft_layer->name);
+        peft_weight_names.insert(
+            peft_layer_name.substr(0, peft_layer_name.find("lora") + 4));
       } else {
         Tensor const input = target_module->inputs[0];
         Tensor const output = target_module->outputs[0];
@@ -97,6 +106,7 @@ PEFTModelID *FFModel::add_lora_layer(LoraLinearConfig const peft_config) {
         name_.erase(last_underscore);
 
         name_ += ".lora";
+        peft_weight_names.insert(name_);
         std::cout << "Adding layer " << name_ << std::endl;
         Layer *peft_layer = new Layer(this,
                                       OP_LORA,
@@ -141,7 +151,36 @@ PEFTModelID *FFModel::add_lora_layer(LoraLinearConfig const peft_config) {
         "finetuned_models",
         peft_config.peft_model_id,
     });
-    fs::remove_all(finetuned_model_folder);
+    if (peft_config.resume_from_checkpoint) {
+      // Every shard saves lora_A and shard 0 also saves lora_B, see
+      // save_peft_weights_if_needed
+      std::vector<std::string> checkpoint_files;
+      for (std::string const &weight_name : peft_weight_names) {
+        for (int shard_id = 0; shard_id < config.tensor_parallelism_degree;
+             shard_id++) {
+          checkpoint_files.push_back(
+              join_path({"shard_" + std::to_string(shard_id),
+                         weight_name + "_A.weight"}));
+        }
+        checkpoint_files.push_back(
+            join_path({"shard_0", weight_name + "_B.weight"}));
+      }
+      int step = find_latest_peft_checkpoint(
+          join_path({finetuned_model_folder, "checkpoints"}), checkpoint_files);
+      if (step >= 0) {
+        std::cout << "Resuming " << peft_config.peft_model_id
+                  << " from the checkpoint of training step " << step
+                  << std::endl;
+      } else {
+        std::cout << "No complete checkpoint of " << peft_config.peft_model_id
+                  << " found, finetuning from the start" << std::endl;
+      }
+      peft_configs[*peft_model_id].resume_training_step = step;
+      RequestManager::get_request_manager()->set_resumed_training_steps(
+          *peft_model_id, std::max(step, 0));
+    } else {
+      fs::remove_all(finetuned_model_folder);
+    }
     std::string finetuned_model_config_folder = join_path({
         finetuned_model_folder,
         "config",
@@ -314,7 +353,7 @@ void LoraLinear::init_inference(
 }
 
 template <typename DT>
-void load_peft_from_file(DT *ptr,
+void read_peft_from_file(DT *host_ptr,
                          size_t num_rows,
                          size_t num_columns,
                          int num_shards,
@@ -337,13 +376,11 @@ void load_peft_from_file(DT *ptr,
   size_t chunk_size = num_rows / num_shards;
   size_t offset = (num_shards > 1) ? shard_id * chunk_size : 0;
 
-  // Allocate memory for the weight shard
-  std::vector<DT> host_array(chunk_size * num_columns);
   // Read the chunk
   size_t total_size_read = 0;
   for (int i = 0; i < num_columns; ++i) {
     in.seekg((i * num_rows + offset) * sizeof(DT));
-    in.read(reinterpret_cast<char *>(host_array.data() + i * chunk_size),
+    in.read(reinterpret_cast<char *>(host_ptr + i * chunk_size),
             chunk_size * sizeof(DT));
     total_size_read += in.gcount();
   }
@@ -357,10 +394,119 @@ void load_peft_from_file(DT *ptr,
            sizeof(DT));
     assert(false);
   }
-  assert(host_array.size() == chunk_size * num_columns);
+  in.close();
+}
+
+template <typename DT>
+void load_peft_from_file(DT *ptr,
+                         size_t num_rows,
+                         size_t num_columns,
+                         int num_shards,
+                         int shard_id,
+                         std::string filepath) {
+  // Allocate memory for the weight shard
+  size_t chunk_size = num_rows / num_shards;
+  std::vector<DT> host_array(chunk_size * num_columns);
+  read_peft_from_file(
+      host_array.data(), num_rows, num_columns, num_shards, shard_id, filepath);
   // Copy weight to device memory
   copy_tensor_host_to_dev(ptr, host_array.data(), chunk_size * num_columns);
-  in.close();
+}
+
+// Makes the paged adapters used by bc resident in the adapter pool and
+// points their weights at the pool. Copies are issued on the task stream in
+// the order the pool returns them, so blocks evicted or moved here are no
+// longer needed by kernels launched earlier.
+void page_in_lora_weights(LoraLinearMeta *m,
+                          BatchConfig const *bc,
+                          int shard_id) {
+  PEFTWeightAllocator *allocator = m->handle.peft_weight_allocator;
+  if (allocator == nullptr || !allocator->has_adapter_pool()) {
+    return;
+  }
+  uint64_t step = allocator->begin_paging_step(m->layer_guid);
+  std::vector<LoraLinearModelState *> paged_states;
+  std::vector<LoraAdapterPool::Move> moves;
+  for (int i = 0; i < bc->max_requests_per_batch(); i++) {
+    if (bc->request_completed[i] ||
+        bc->requestsInfo[i].peft_model_id == PEFTModelID::NO_ID) {
+      continue;
+    }
+    assert(m->model_state.find(bc->requestsInfo[i].peft_model_id) !=
+           m->model_state.end());
+    LoraLinearModelState &state =
+        m->model_state[bc->requestsInfo[i].peft_model_id];
+    if (state.paged_block < 0) {
+      continue;
+    }
+    LoraLinearWeight const &weight = state.weights;
+    size_t w0_size =
+        weight.rank * weight.in_dim * data_type_size(m->input_type[0]);
+    size_t w1_size =
+        weight.rank * weight.out_dim * data_type_size(m->input_type[0]);
+    bool needs_load = false;
+    moves.clear();
+    char *ptr = static_cast<char *>(allocator->acquire_paged_weights(
+        state.paged_block, step, needs_load, moves));
+    if (ptr == nullptr) {
+      log_lora.error("The LoRA adapter pool (%zu MB) cannot hold the "
+                     "adapters of one batch in all layers, increase "
+                     "-peft-adapter-pool-size",
+                     allocator->adapter_pool.get_capacity() / 1024 / 1024);
+      std::abort();
+    }
+    char *pool_ptr = allocator->get_adapter_pool_ptr();
+    for (auto const &move : moves) {
+      copy_paged_weights(pool_ptr + move.dst, pool_ptr + move.src, move.size);
+    }
+    if (needs_load) {
+      if (state.host_weights.empty()) {
+        state.host_weights.resize(w0_size + w1_size);
+        if (m->input_type[0] == DT_FLOAT) {
+          read_peft_from_file((float *)state.host_weights.data(),
+                              weight.in_dim * weight.num_shards,
+                              weight.rank,
+                              weight.num_shards,
+                              shard_id,
+                              state.w0_filepath);
+          read_peft_from_file((float *)(state.host_weights.data() + w0_size),
+                              weight.rank,
+                              weight.out_dim,
+                              1,
+                              shard_id,
+                              state.w1_filepath);
+        } else if (m->input_type[0] == DT_HALF) {
+          read_peft_from_file((half *)state.host_weights.data(),
+                              weight.in_dim * weight.num_shards,
+                              weight.rank,
+                              weight.num_shards,
+                              shard_id,
+                              state.w0_filepath);
+          read_peft_from_file((half *)(state.host_weights.data() + w0_size),
+                              weight.rank,
+                              weight.out_dim,
+                              1,
+                              shard_id,
+                              state.w1_filepath);
+        } else {
+          assert(false && "Data type not supported");
+        }
+      }
+      copy_paged_weights(ptr, state.host_weights.data(), w0_size + w1_size);
+    }
+    paged_states.push_back(&state);
+  }
+  // Compaction may have moved blocks acquired earlier in this step, so the
+  // pointers are only set once all blocks are resident
+  for (LoraLinearModelState *state : paged_states) {
+    bool needs_load = false;
+    char *ptr = static_cast<char *>(allocator->acquire_paged_weights(
+        state->paged_block, step, needs_load, moves));
+    assert(ptr != nullptr && !needs_load);
+    state->weights.w0_ptr = ptr;
+    state->weights.w1_ptr = ptr + state->weights.rank * state->weights.in_dim *
+                                      data_type_size(m->input_type[0]);
+  }
 }
 
 /*
@@ -445,29 +591,59 @@ OpMeta *LoraLinear::init_task(Task const *task,
     int lora_A_num_shards = num_shards;
     int lora_B_num_shards = 1;
 
+    std::string weights_folder_filepath = join_path({
+        lora_config.cache_folder,
+        "weights",
+        lora_config.peft_model_id,
+        dt == DT_FLOAT ? "full-precision" : "half-precision",
+    });
+    std::string w0_filepath = join_path(
+        {weights_folder_filepath, lora_layername_substr + "_A.weight"});
+    std::string w1_filepath = join_path(
+        {weights_folder_filepath, lora_layername_substr + "_B.weight"});
+    if (lora_config.resume_training_step >= 0) {
+      // Checkpoints hold the weights of each shard as they are laid out on
+      // the device
+      std::string checkpoint_folder = join_path({
+          lora_config.cache_folder,
+          "finetuned_models",
+          lora_config.peft_model_id,
+          "checkpoints",
+          "step_" + std::to_string(lora_config.resume_training_step),
+      });
+      w0_filepath = join_path({checkpoint_folder,
+                               "shard_" + std::to_string(shard_id),
+                               lora_layername_substr + "_A.weight"});
+      w1_filepath = join_path(
+          {checkpoint_folder, "shard_0", lora_layername_substr + "_B.weight"});
+      lora_A_num_rows = in_dim;
+      lora_A_num_shards = 1;
+    }
+
     LoraLinearWeight weight;
     weight.in_dim = in_dim;
     weight.out_dim = out_dim;
     weight.rank = rank;
     weight.num_shards = num_shards;
     PEFTWeightAllocator *allocator = m->handle.peft_weight_allocator;
-    weight.w0_ptr = allocator->allocate_local_weights_untyped(
-        model_id, w0_num_elements * data_type_size(dt));
-    weight.w1_ptr = allocator->allocate_local_weights_untyped(
-        model_id, w1_num_elements * data_type_size(dt));
+    int paged_block = -1;
+    if (allocator->has_adapter_pool() && !lora_config.trainable &&
+        !lora_config.init_lora_weights) {
+      // weights are read and copied to the GPU when a batch first uses them
+      paged_block = allocator->register_paged_weights(
+          (w0_num_elements + w1_num_elements) * data_type_size(dt));
+      weight.w0_ptr = weight.w1_ptr = nullptr;
+    } else {
+      weight.w0_ptr = allocator->allocate_local_weights_untyped(
+          model_id, w0_num_elements * data_type_size(dt));
+      weight.w1_ptr = allocator->allocate_local_weights_untyped(
+          model_id, w1_num_elements * data_type_size(dt));
+    }
 
-    if (!lora_config.init_lora_weights) {
+    if ((!lora_config.init_lora_weights ||
+         lora_config.resume_training_step >= 0) &&
+        paged_block < 0) {
       // load weights from file
-      std::string weights_folder_filepath = join_path({
-          lora_config.cache_folder,
-          "weights",
-          lora_config.peft_model_id,
-          dt == DT_FLOAT ? "full-precision" : "half-precision",
-      });
-      std::string w0_filepath = join_path(
-          {weights_folder_filepath, lora_layername_substr + "_A.weight"});
-      std::string w1_filepath = join_path(
-          {weights_folder_filepath, lora_layername_substr + "_B.weight"});
       if (dt == DT_FLOAT) {
         std::cout << "Loading LORA weight "
                   << lora_layername_substr + "_A.weight"
@@ -521,7 +697,8 @@ OpMeta *LoraLinear::init_task(Task const *task,
       } else {
         assert(false && "Data type not supported");
       }
-    } else {
+    } else if (lora_config.init_lora_weights &&
+               lora_config.resume_training_step < 0) {
       // initialize weights
       int seed = 0;
       init_kernel_wrapper(m, seed);
@@ -583,6 +760,9 @@ OpMeta *LoraLinear::init_task(Task const *task,
     m->model_state[model_id].lora_alpha = lora_config.lora_alpha;
     m->model_state[model_id].cache_folder = lora_config.cache_folder;
     m->model_state[model_id].peft_model_id = lora_config.peft_model_id;
+    m->model_state[model_id].paged_block = paged_block;
+    m->model_state[model_id].w0_filepath = w0_filepath;
+    m->model_state[model_id].w1_filepath = w1_filepath;
   }
   return m;
 }
@@ -660,6 +840,8 @@ void LoraLinear::inference_task(Task const *task,
 
   // int num_infr_tokens = bc->num_active_infr_tokens();
   // int num_peft_tokens = bc->num_active_peft_tokens();
+  assert(task->index_point.get_dim() == 1);
+  page_in_lora_weights(m, bc, task->index_point.point_data[0]);
   inference_kernel_wrapper(m, bc, input, output);
 
   if (m->inference_debugging) {
@@ -713,6 +895,10 @@ void LoraLinear::inference_task(Task const *task,
       LoraLinearWeight weight = m->model_state[peft_model_id].weights;
       rank = weight.rank;
       num_tokens = input.domain.get_volume() / weight.in_dim;
+      if (m->model_state[peft_model_id].paged_block >= 0) {
+        // paged weights may have been moved by later layers
+        continue;
+      }
       fs::path dst_filepath_weights =
           get_dst_folder("weights", m->decoding_step, shard_id) / layername;
       std::string filenameA =
@@ -854,6 +1040,10 @@ void lora_inference_debugging(LoraLinearMeta *m,
   assert(m->model_state.size() >= 1 && "Model state empty!");
   for (auto it = m->model_state.begin(); it != m->model_state.end(); ++it) {
     PEFTModelID peft_model_id = it->first;
+    if (m->model_state[peft_model_id].paged_block >= 0) {
+      // paged adapters are not trainable
+      continue;
+    }
     LoraLinearWeight weight = m->model_state[peft_model_id].weights;
     std::string filename_weight_A =
         dst_filepath_weights.string() + ".weight_A.finetuned";
@@ -934,28 +1124,12 @@ template <typename DT>
 void save_peft_to_file(DT const *weight_ptr,
                        size_t size,
                        std::string filepath) {
-  std::ofstream out(filepath, std::ios::binary);
-  // Check if the file was opened successfully
-  if (!out || !out.is_open() || !out.good()) {
-    printf("Could not open file: %s\n", filepath.c_str());
-  }
-  assert(out && out.is_open() && out.good() &&
-         "can't write to lora weight file path");
-  std::vector<DT> host_array(size);
-  copy_tensor_dev_to_host(weight_ptr, host_array.data(), size);
-
-  size_t target_data_size = sizeof(DT) * size;
-  out.write((char *)host_array.data(), target_data_size);
-
-  size_t out_written_size = out.tellp();
-  if (out_written_size != target_data_size) {
-    printf("save weight data error: %lu, %lu, %lu\n",
-           out_written_size,
-           target_data_size,
-           sizeof(DT));
-    assert(false);
-  }
-  out.close();
+  // Snapshot the weights, which the next weight update overwrites, and
+  // leave writing the file to the checkpoint writer's thread
+  PEFTCheckpointWriter *writer = PEFTCheckpointWriter::get_checkpoint_writer();
+  std::vector<char> host_array = writer->get_staging_buffer(sizeof(DT) * size);
+  copy_tensor_dev_to_host(weight_ptr, (DT *)host_array.data(), size);
+  writer->write(filepath, std::move(host_array));
 }
 
 void save_peft_weights_if_needed(LoraLinearMeta *m,
@@ -986,17 +1160,28 @@ void save_peft_weights_if_needed(LoraLinearMeta *m,
     if (!bc->requestsInfo[i].peft_bwd) {
       continue;
     }
-    if (bc->requestsInfo[i].optimizer_tasks.save_updated_weights) {
+    OptimizerTasks const &optimizer_tasks =
+        bc->requestsInfo[i].optimizer_tasks;
+    if (optimizer_tasks.save_updated_weights ||
+        optimizer_tasks.save_checkpoint) {
       assert(m->model_state.find(bc->requestsInfo[i].peft_model_id) !=
              m->model_state.end());
-      std::string weight_export_folder = join_path({
+      std::string finetuned_model_folder = join_path({
           m->model_state[bc->requestsInfo[i].peft_model_id].cache_folder,
           "finetuned_models",
           m->model_state[bc->requestsInfo[i].peft_model_id].peft_model_id,
-          "weights",
-          "shard_" + std::to_string(shard_id),
       });
-      fs::create_directories(weight_export_folder);
+      // Intermediate checkpoints go to checkpoints/step_<training step>
+      std::string weight_export_folder =
+          optimizer_tasks.save_updated_weights
+              ? join_path({finetuned_model_folder,
+                           "weights",
+                           "shard_" + std::to_string(shard_id)})
+              : join_path({finetuned_model_folder,
+                           "checkpoints",
+                           "step_" +
+                               std::to_string(optimizer_tasks.training_step),
+                           "shard_" + std::to_string(shard_id)});
 
       int rank = m->model_state[bc->requestsInfo[i].peft_model_id].weights.rank;
       int w0_num_elements = rank * in_dim;
@@ -1310,6 +1495,7 @@ size_t hash<FlexFlow::LoraLinearParams>::operator()(
     hash_combine(key, kv.second.lora_dropout);
     hash_combine(key, kv.second.target_modules);
     hash_combine(key, kv.second.init_lora_weights);
+    hash_combine(key, kv.second.resume_training_step);
   }
   return key;
 }
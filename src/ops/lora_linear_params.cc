@@ -173,7 +173,9 @@ bool operator==(LoraLinearConfig const &lhs, LoraLinearConfig const &rhs) {
       lhs.init_lora_weights == rhs.init_lora_weights &&
       lhs.optimizer_config == rhs.optimizer_config &&
       lhs.base_model_name_or_path == rhs.base_model_name_or_path &&
-      lhs.precision == rhs.precision) {
+      lhs.precision == rhs.precision &&
+      lhs.resume_from_checkpoint == rhs.resume_from_checkpoint &&
+      lhs.resume_training_step == rhs.resume_training_step) {
     for (int i = 0; i < lhs.target_modules.size(); i++) {
       if (lhs.target_modules[i] != rhs.target_modules[i]) {
         return false;
@@ -215,6 +217,9 @@ std::ostream &operator<<(std::ostream &os, LoraLinearConfig const &llc) {
   os << "init_lora_weights: " << llc.init_lora_weights << std::endl;
   os << "base_model_name_or_path: " << llc.base_model_name_or_path << std::endl;
   os << "precision: " << llc.precision << std::endl;
+  os << "resume_from_checkpoint: " << llc.resume_from_checkpoint
+     << std::endl;
+  os << "resume_training_step: " << llc.resume_training_step << std::endl;
   return os;
 }
 
@@ -0,0 +1,71 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "flexflow/utils/adapter_segments.h"
+
+#include <algorithm>
+
+namespace FlexFlow {
+
+void group_adapter_segments(std::vector<AdapterRequest> &requests,
+                            std::vector<AdapterSegment> &segments) {
+  segments.clear();
+  std::sort(requests.begin(),
+            requests.end(),
+            [](AdapterRequest const &a, AdapterRequest const &b) {
+              return a.first_token_offset < b.first_token_offset;
+            });
+  // whether the last segment can be extended
+  bool open = false;
+  for (AdapterRequest const &r : requests) {
+    if (r.num_tokens == 0) {
+      continue;
+    }
+    if (open && !r.exclusive && segments.back().adapter == r.adapter &&
+        segments.back().first_token_offset + segments.back().num_tokens ==
+            r.first_token_offset) {
+      segments.back().num_tokens += r.num_tokens;
+      continue;
+    }
+    segments.push_back(
+        {r.adapter, r.request_index, r.first_token_offset, r.num_tokens});
+    open = !r.exclusive;
+  }
+}
+
+int choose_adapter_slot(std::vector<bool> const &free_slots,
+                        std::vector<size_t> const &slot_adapters,
+                        size_t adapter) {
+  int num_slots = free_slots.size();
+  int first_free = -1, before = -1;
+  for (int i = 0; i < num_slots; i++) {
+    if (!free_slots[i]) {
+      continue;
+    }
+    if (i > 0 && !free_slots[i - 1] && slot_adapters[i - 1] == adapter) {
+      return i;
+    }
+    if (before < 0 && i + 1 < num_slots && !free_slots[i + 1] &&
+        slot_adapters[i + 1] == adapter) {
+      before = i;
+    }
+    if (first_free < 0) {
+      first_free = i;
+    }
+  }
+  return before >= 0 ? before : first_free;
+}
+
+}; // namespace FlexFlow
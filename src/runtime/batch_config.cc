@@ -15,7 +15,9 @@
 
 #include "flexflow/batch_config.h"
 #include "flexflow/request_manager.h"
+#include "flexflow/utils/peft_checkpoint_writer.h"
 #include "legion.h"
+#include <algorithm>
 #include <cassert>
 #include <climits>
 
@@ -28,7 +30,10 @@ using Legion::Memory;
 void set_optimizer_tasks(OptimizerTasks &tasks,
                          int max_training_steps,
                          int completed_training_steps,
-                         int gradient_accumulation_steps) {
+                         int gradient_accumulation_steps,
+                         int checkpoint_interval,
+                         bool first_chunk,
+                         bool last_chunk) {
   assert(max_training_steps > 0);
   assert(completed_training_steps >= 0);
   assert(gradient_accumulation_steps > 0);
@@ -36,21 +41,35 @@ void set_optimizer_tasks(OptimizerTasks &tasks,
   // Compute gradients should always be true
   tasks.compute_gradients = true;
 
-  // Reset gradients to zero in the first iteration and after weight updates
+  // Reset gradients to zero in the first iteration and after weight updates.
+  // A dataset entry split into chunks accumulates the gradients of all its
+  // chunks, so only its first chunk resets them and only its last chunk
+  // completes the training step.
   tasks.reset_gradients_to_zero =
-      (completed_training_steps == 0) ||
-      (completed_training_steps % gradient_accumulation_steps == 0);
+      first_chunk &&
+      ((completed_training_steps == 0) ||
+       (completed_training_steps % gradient_accumulation_steps == 0));
 
   // Update weights every gradient_accumulation_steps
   tasks.update_weights =
+      last_chunk &&
       ((completed_training_steps + 1) % gradient_accumulation_steps == 0);
 
   // Save updated weights only in the very last training step
   tasks.save_updated_weights =
-      (completed_training_steps == max_training_steps - 1);
+      last_chunk && (completed_training_steps == max_training_steps - 1);
   if (tasks.save_updated_weights) {
     assert(tasks.update_weights);
   }
+
+  // Save a checkpoint at the first weight update after every
+  // checkpoint_interval steps
+  tasks.training_step = completed_training_steps + 1;
+  tasks.save_checkpoint =
+      tasks.update_weights && !tasks.save_updated_weights &&
+      is_peft_checkpoint_step(tasks.training_step,
+                              gradient_accumulation_steps,
+                              checkpoint_interval);
 }
 
 BatchConfig::BatchConfig() : num_tokens(0), num_peft_tokens(0) {
@@ -110,6 +129,59 @@ int BatchConfig::num_active_peft_tokens() const {
   return num_peft_tokens;
 }
 
+void BatchConfig::get_adapter_segments(
+    std::vector<AdapterSegment> &segments) const {
+  std::vector<AdapterRequest> requests;
+  for (int i = 0; i < max_requests_per_batch(); i++) {
+    if (request_completed[i] ||
+        requestsInfo[i].peft_model_id == PEFTModelID::NO_ID) {
+      continue;
+    }
+    requests.push_back({requestsInfo[i].peft_model_id.id,
+                        i,
+                        requestsInfo[i].first_token_offset_in_batch,
+                        requestsInfo[i].num_tokens_in_batch,
+                        requestsInfo[i].peft_bwd});
+  }
+  group_adapter_segments(requests, segments);
+}
+
+void BatchConfig::remove_request(int request_index) {
+  assert(!request_completed[request_index]);
+  assert(!requestsInfo[request_index].peft_bwd);
+  int offset = requestsInfo[request_index].first_token_offset_in_batch;
+  int num_removed_tokens = requestsInfo[request_index].num_tokens_in_batch;
+  for (int t = offset + num_removed_tokens; t < num_tokens; t++) {
+    tokensInfo[t - num_removed_tokens] = tokensInfo[t];
+  }
+  num_tokens -= num_removed_tokens;
+  if (!requestsInfo[request_index].prompt_phase) {
+    num_generation_tokens -= num_removed_tokens;
+  }
+  int num_active_infr_requests = 0;
+  for (int r = 0; r < max_requests_per_batch(); r++) {
+    if (request_completed[r]) {
+      continue;
+    }
+    if (requestsInfo[r].first_token_offset_in_batch > offset) {
+      requestsInfo[r].first_token_offset_in_batch -= num_removed_tokens;
+    }
+    num_active_infr_requests += !requestsInfo[r].peft_bwd;
+  }
+  // the first entries of batch_config_request_id list the slots of the
+  // inference requests
+  bool removed = false;
+  for (int r = 0; r < num_active_infr_requests - 1; r++) {
+    removed |= requestsInfo[r].batch_config_request_id == request_index;
+    if (removed) {
+      requestsInfo[r].batch_config_request_id =
+          requestsInfo[r + 1].batch_config_request_id;
+    }
+  }
+  request_completed[request_index] = true;
+  requestsInfo[request_index].num_tokens_in_batch = 0;
+}
+
 /*static*/
 int BatchConfig::max_requests_per_batch() {
   return RequestManager::get_request_manager()->get_max_requests_per_batch();
@@ -131,6 +203,11 @@ int BatchConfig::max_sequence_length() {
   return RequestManager::get_request_manager()->get_max_sequence_length();
 }
 
+/*static*/
+int BatchConfig::max_peft_chunk_tokens(int max_sequence_length) {
+  return std::min(max_sequence_length, max_tokens_per_batch());
+}
+
 int BatchConfig::max_spec_tree_token_num() {
   return RequestManager::get_request_manager()->get_max_spec_tree_token_num();
 }
@@ -173,6 +250,12 @@ std::ostream &operator<<(std::ostream &os, BatchConfig const &bc) {
       os << "    PEFT Model ID: " << bc.requestsInfo[i].peft_model_id
          << std::endl;
       os << "    PEFT bwd: " << bc.requestsInfo[i].peft_bwd << std::endl;
+      os << "    PEFT entry length: " << bc.requestsInfo[i].peft_entry_length
+         << std::endl;
+      os << "    PEFT next token id: " << bc.requestsInfo[i].peft_next_token_id
+         << std::endl;
+      os << "    PEFT truncated bwd: " << bc.requestsInfo[i].peft_truncated_bwd
+         << std::endl;
       os << "    optimizer_tasks: {"
          << "compute_gradients: " << std::boolalpha
          << bc.requestsInfo[i].optimizer_tasks.compute_gradients
@@ -181,7 +264,9 @@ std::ostream &operator<<(std::ostream &os, BatchConfig const &bc) {
          << ", update_weights: "
          << bc.requestsInfo[i].optimizer_tasks.update_weights
          << ", save_updated_weights: "
-         << bc.requestsInfo[i].optimizer_tasks.save_updated_weights << "}"
+         << bc.requestsInfo[i].optimizer_tasks.save_updated_weights
+         << ", save_checkpoint: "
+         << bc.requestsInfo[i].optimizer_tasks.save_checkpoint << "}"
          << std::endl;
       os << "    Request completed: " << bc.request_completed[i] << std::endl;
       os << "    Request running: " << bc.request_running[i] << std::endl;
@@ -0,0 +1,133 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "flexflow/coserving_controller.h"
+
+#include <algorithm>
+#include <cassert>
+#include <nlohmann/json.hpp>
+#include <string>
+
+namespace FlexFlow {
+
+CoServingController::CoServingController()
+    : latency_slo_us(0), safety_margin(0.1), min_finetuning_tokens(0),
+      increase_step(16), smoothing(0.25), log(nullptr) {
+  reset();
+}
+
+void CoServingController::set_latency_slo(double _latency_slo_us) {
+  assert(_latency_slo_us >= 0);
+  latency_slo_us = _latency_slo_us;
+}
+
+void CoServingController::set_safety_margin(double _safety_margin) {
+  assert(_safety_margin >= 0 && _safety_margin < 1);
+  safety_margin = _safety_margin;
+}
+
+void CoServingController::set_min_finetuning_tokens(
+    int _min_finetuning_tokens) {
+  assert(_min_finetuning_tokens >= 0);
+  min_finetuning_tokens = _min_finetuning_tokens;
+  finetuning_budget = std::max(finetuning_budget, min_finetuning_tokens);
+}
+
+void CoServingController::set_increase_step(int _increase_step) {
+  assert(_increase_step > 0);
+  increase_step = _increase_step;
+}
+
+void CoServingController::set_smoothing(double _smoothing) {
+  assert(_smoothing > 0 && _smoothing <= 1);
+  smoothing = _smoothing;
+}
+
+void CoServingController::set_log(std::ostream *_log) {
+  log = _log;
+}
+
+void CoServingController::reset() {
+  smoothed_latency_us = 0;
+  finetuning_budget = min_finetuning_tokens;
+  iteration = 0;
+}
+
+int CoServingController::update(Observation const &observation) {
+  if (observation.iteration_latency_us > 0) {
+    smoothed_latency_us =
+        smoothed_latency_us == 0
+            ? observation.iteration_latency_us
+            : smoothed_latency_us +
+                  smoothing * (observation.iteration_latency_us -
+                               smoothed_latency_us);
+  }
+  char const *action;
+  if (observation.inference_tokens == 0 && observation.queue_depth == 0) {
+    // no inference work, finetuning can use the whole batch
+    finetuning_budget = observation.max_tokens_per_batch;
+    action = "idle";
+  } else if (smoothed_latency_us > (1 - safety_margin) * latency_slo_us) {
+    finetuning_budget /= 2;
+    action = "back_off";
+  } else if (observation.queue_depth > 0) {
+    action = "hold";
+  } else {
+    finetuning_budget += increase_step;
+    action = "increase";
+  }
+  finetuning_budget =
+      std::max(min_finetuning_tokens,
+               std::min(finetuning_budget, observation.max_tokens_per_batch));
+  if (log != nullptr) {
+    nlohmann::json j;
+    j["iteration"] = iteration;
+    j["iteration_latency_us"] = observation.iteration_latency_us;
+    j["queue_depth"] = observation.queue_depth;
+    j["inference_tokens"] = observation.inference_tokens;
+    j["max_tokens_per_batch"] = observation.max_tokens_per_batch;
+    j["smoothed_latency_us"] = smoothed_latency_us;
+    j["action"] = action;
+    j["finetuning_budget"] = finetuning_budget;
+    *log << j.dump() << "\n";
+  }
+  iteration++;
+  return finetuning_budget;
+}
+
+void CoServingController::replay(std::istream &log_stream,
+                                 std::vector<int> &recorded,
+                                 std::vector<int> &replayed) {
+  std::ostream *saved_log = log;
+  log = nullptr;
+  reset();
+  std::string line;
+  while (std::getline(log_stream, line)) {
+    if (line.empty()) {
+      continue;
+    }
+    nlohmann::json j = nlohmann::json::parse(line);
+    Observation observation;
+    observation.iteration_latency_us = j["iteration_latency_us"];
+    observation.queue_depth = j["queue_depth"];
+    observation.inference_tokens = j["inference_tokens"];
+    observation.max_tokens_per_batch = j["max_tokens_per_batch"];
+    recorded.push_back(j["finetuning_budget"]);
+    replayed.push_back(update(observation));
+  }
+  log = saved_log;
+}
+
+}; // namespace FlexFlow
@@ -0,0 +1,159 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "flexflow/utils/embedding_cache.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace FlexFlow {
+
+EmbeddingCache::EmbeddingCache(int64_t _num_rows,
+                               int _num_slots,
+                               int _admit_threshold,
+                               int64_t _aging_period)
+    : num_hits(0), num_misses(0), num_admissions(0), num_evictions(0),
+      num_writebacks(0), num_rows(_num_rows), num_slots(_num_slots),
+      admit_threshold(_admit_threshold), aging_period(_aging_period),
+      num_lookups_since_aging(0), step(0), frequency(_num_rows, 0),
+      slot_of_row(_num_rows, NONE), slot_info(_num_slots) {
+  assert(num_slots >= 0);
+  if (aging_period <= 0) {
+    aging_period = 16 * (int64_t)std::max(num_slots, 1);
+  }
+  for (int slot = num_slots - 1; slot >= 0; slot--) {
+    free_slots.push_back(slot);
+  }
+}
+
+int EmbeddingCache::admit(int64_t row, std::vector<Transfer> &writebacks) {
+  int slot;
+  if (!free_slots.empty()) {
+    slot = free_slots.back();
+    free_slots.pop_back();
+  } else {
+    if (lru.empty()) {
+      return NONE;
+    }
+    // rows used by the current batch are never evicted
+    Slot &victim = slot_info[lru.back()];
+    if (victim.last_step == step ||
+        frequency[row] <= frequency[victim.row]) {
+      return NONE;
+    }
+    slot = lru.back();
+    if (victim.dirty) {
+      writebacks.push_back({victim.row, slot});
+      num_writebacks++;
+    }
+    slot_of_row[victim.row] = NONE;
+    lru.pop_back();
+    num_evictions++;
+  }
+  Slot &s = slot_info[slot];
+  s.row = row;
+  s.last_step = step;
+  s.load_step = step;
+  s.dirty = false;
+  lru.push_front(slot);
+  s.lru_position = lru.begin();
+  num_admissions++;
+  return slot;
+}
+
+template <typename TI>
+void EmbeddingCache::lookup(TI const *indices,
+                            size_t num_indices,
+                            bool update,
+                            int *slots,
+                            std::vector<Transfer> &loads,
+                            std::vector<Transfer> &writebacks) {
+  step++;
+  // the transient slots of the previous batch are released
+  for (Transfer const &t : transient_rows) {
+    slot_of_row[t.row] = NONE;
+  }
+  transient_rows.clear();
+  for (size_t i = 0; i < num_indices; i++) {
+    int64_t row = indices[i];
+    assert(row >= 0 && row < num_rows);
+    if (frequency[row] < UINT32_MAX) {
+      frequency[row]++;
+    }
+    int slot = slot_of_row[row];
+    if (slot == NONE) {
+      if ((int)frequency[row] >= admit_threshold) {
+        slot = admit(row, writebacks);
+      }
+      if (slot == NONE) {
+        slot = num_slots + (int)transient_rows.size();
+        transient_rows.push_back({row, slot});
+      }
+      slot_of_row[row] = slot;
+      loads.push_back({row, slot});
+    }
+    if (slot < num_slots) {
+      Slot &s = slot_info[slot];
+      if (s.last_step != step) {
+        lru.splice(lru.begin(), lru, s.lru_position);
+        s.last_step = step;
+      }
+      s.dirty = s.dirty || update;
+      if (s.load_step == step) {
+        num_misses++;
+      } else {
+        num_hits++;
+      }
+    } else {
+      num_misses++;
+    }
+    slots[i] = slot;
+  }
+  num_lookups_since_aging += num_indices;
+  if (num_lookups_since_aging >= aging_period) {
+    for (uint32_t &f : frequency) {
+      f >>= 1;
+    }
+    num_lookups_since_aging = 0;
+  }
+}
+
+void EmbeddingCache::flush(std::vector<Transfer> &writebacks) {
+  for (int slot : lru) {
+    Slot &s = slot_info[slot];
+    if (s.dirty) {
+      writebacks.push_back({s.row, slot});
+      s.dirty = false;
+      num_writebacks++;
+    }
+  }
+}
+
+template void EmbeddingCache::lookup<int32_t>(
+    int32_t const *indices,
+    size_t num_indices,
+    bool update,
+    int *slots,
+    std::vector<Transfer> &loads,
+    std::vector<Transfer> &writebacks);
+template void EmbeddingCache::lookup<int64_t>(
+    int64_t const *indices,
+    size_t num_indices,
+    bool update,
+    int *slots,
+    std::vector<Transfer> &loads,
+    std::vector<Transfer> &writebacks);
+
+}; // namespace FlexFlow
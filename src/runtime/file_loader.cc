@@ -17,11 +17,14 @@
 #include "flexflow/ffconst_utils.h"
 #include "flexflow/inference.h"
 
+#include <future>
 #include <vector>
 using namespace std;
 
 using namespace Legion;
 
+Legion::Logger log_file_loader("FileDataLoader");
+
 FileDataLoader::FileDataLoader(std::string _prompts_filepath,
                                std::string _weights_folder,
                                int _num_heads,
@@ -36,6 +39,21 @@ FileDataLoader::FileDataLoader(std::string _prompts_filepath,
       tensor_parallelism_degree(_tensor_parallelism_degree),
       use_full_precision(_use_full_precision){};
 
+FileDataLoader::~FileDataLoader() {
+  {
+    std::lock_guard<std::mutex> lock(weight_reads_mutex);
+    stop_weight_readers = true;
+  }
+  weight_reads_available.notify_all();
+  for (std::thread &reader : weight_readers) {
+    reader.join();
+  }
+  // the weights prefetched but never materialized
+  for (PendingWeight &w : pending_weights) {
+    free(w.host_buffer);
+  }
+}
+
 BatchConfig::TokenId *FileDataLoader::generate_requests(int num, int length) {
 
   BatchConfig::TokenId *prompts =
@@ -96,7 +114,7 @@ void load_attention_weights_multi_query(DT *ptr,
   int file_index = 0;
   int data_index = 0;
   for (auto filename : weight_filenames) {
-    std::cout << "Loading weight file " << filename << std::endl;
+    log_file_loader.print("Loading weight file %s", filename.c_str());
     std::string weight_filepath = join_path({weights_folder, filename});
     size_t partial_size =
         file_index == 0 ? (hidden_dim + 2 * hidden_dim / num_heads) * hidden_dim
@@ -152,7 +170,7 @@ void load_attention_bias_v2(DT *ptr,
   int idx = 0;
 
   for (auto filename : bias_files) {
-    std::cout << "Loading weight file " << filename << std::endl;
+    log_file_loader.print("Loading weight file %s", filename.c_str());
     std::string weight_filepath = join_path({weights_folder, filename});
 
     int n_heads = file_index == 0 ? num_heads : num_kv_heads;
@@ -244,7 +262,7 @@ void load_attention_weights_v2(DT *ptr,
   size_t stride_size = (q_size + v_replicate_size + k_replicate_size + o_size) /
                        tensor_parallelism_degree;
   for (auto filename : weight_filenames) {
-    std::cout << "Loading weight file " << filename << std::endl;
+    log_file_loader.print("Loading weight file %s", filename.c_str());
     std::string weight_filepath = join_path({weights_folder, filename});
 
     int data_index = 0;
@@ -299,7 +317,7 @@ void load_attention_weights_v2(DT *ptr,
                            tensor_parallelism_degree);
 
   {
-    std::cout << "Loading weight file " << o_file << std::endl;
+    log_file_loader.print("Loading weight file %s", o_file.c_str());
     std::string weight_filepath = join_path({weights_folder, o_file});
 
     std::ifstream in(weight_filepath, std::ios::in | std::ios::binary);
@@ -421,7 +439,7 @@ void load_attention_weights_quantized(char *ptr,
 
   // q, k, v, o -> 0, 1, 2, 3
   for (auto filename : weight_filenames) {
-    std::cout << "Loading weight file " << filename << std::endl;
+    log_file_loader.print("Loading weight file %s", filename.c_str());
     std::string weight_filepath = join_path({weights_folder, filename});
 
     size_t partial_size = one_weight_file_size;
@@ -471,7 +489,7 @@ void load_attention_weights_quantized(char *ptr,
   size_t offset = data_type == DT_INT8 ? one_weight_file_size * 4
                                        : (one_weight_file_size * 4) / 2;
   for (auto filename : weight_filenames) {
-    std::cout << "Loading weight file " << filename << std::endl;
+    log_file_loader.print("Loading weight file %s", filename.c_str());
     std::string weight_filepath = join_path({weights_folder, filename});
 
     for (int i = 0; i < 2; i++) {
@@ -646,17 +664,28 @@ void load_from_quantized_file(char *ptr,
   }
 }
 
-void FileDataLoader::load_quantization_weight(FFModel *ff,
-                                              Layer *l,
-                                              int weight_idx) {
+size_t FileDataLoader::get_weight_buffer_size(Layer const *l, int weight_idx) {
   Tensor weight = l->weights[weight_idx];
   size_t volume = 1;
-  std::vector<int> dims_vec;
   for (int i = 0; i < weight->num_dims; i++) {
-    dims_vec.push_back(weight->dims[i]);
     volume *= weight->dims[i];
   }
-  char *data = (char *)malloc(sizeof(char) * volume);
+  switch (weight->data_type) {
+    case DT_INT4:
+    case DT_INT8:
+      // quantized weights are stored as raw bytes
+      return volume;
+    default:
+      return volume * data_type_size(weight->data_type);
+  }
+}
+
+void FileDataLoader::read_quantization_weight(FFModel *ff,
+                                              Layer *l,
+                                              int weight_idx,
+                                              char *data) {
+  Tensor weight = l->weights[weight_idx];
+  size_t volume = get_weight_buffer_size(l, weight_idx);
 
   std::string weight_filename = removeGuidOperatorName(std::string(l->name));
 
@@ -695,35 +724,35 @@ void FileDataLoader::load_quantization_weight(FFModel *ff,
                              weight->data_type,
                              use_full_precision);
   }
+}
 
-  ParallelTensor weight_pt;
-  ff->get_parallel_tensor_from_tensor(weight, weight_pt);
-  weight_pt->set_tensor<char>(ff, dims_vec, data);
-
-  delete data;
+void FileDataLoader::load_quantization_weight(FFModel *ff,
+                                              Layer *l,
+                                              int weight_idx) {
+  char *data = (char *)malloc(get_weight_buffer_size(l, weight_idx));
+  read_quantization_weight(ff, l, weight_idx, data);
+  set_weight_tensor(ff, l, weight_idx, data);
+  free(data);
 }
 
 template <typename DT>
-void FileDataLoader::load_single_weight_tensor(FFModel *ff,
+void FileDataLoader::read_single_weight_tensor(FFModel *ff,
                                                Layer *l,
-                                               int weight_idx) {
+                                               int weight_idx,
+                                               DT *data) {
   Tensor weight = l->weights[weight_idx];
-
-  // Create a buffer to store weight data from the file
   size_t volume = 1;
-  std::vector<int> dims_vec;
   for (int i = 0; i < weight->num_dims; i++) {
-    dims_vec.push_back(weight->dims[i]);
     volume *= weight->dims[i];
   }
   assert(data_type_size(weight->data_type) == sizeof(DT));
-  DT *data = (DT *)malloc(sizeof(DT) * volume);
 
   std::string weight_filename = removeGuidOperatorName(std::string(l->name));
 
   if (ff->config.benchmarking) {
-    std::cout << "Initializing weight " << weight_filename
-              << " with random data (benchmarking mode)" << std::endl;
+    log_file_loader.print("Initializing weight %s with random data "
+                          "(benchmarking mode)",
+                          weight_filename.c_str());
     // If benchmarking, we don't need to load the weights
     // We can just fill the weight tensor with random data
   } else {
@@ -758,7 +787,7 @@ void FileDataLoader::load_single_weight_tensor(FFModel *ff,
       weight_filename += (weight_idx == 0)
                              ? ".attn_bias"
                              : ((weight_idx == 1) ? ".weight" : ".bias");
-      std::cout << "Loading weight file " << weight_filename << std::endl;
+      log_file_loader.print("Loading weight file %s", weight_filename.c_str());
       std::string weight_filepath =
           join_path({weights_folder, weight_filename});
       load_from_file(data, volume, weight_filepath);
@@ -769,20 +798,73 @@ void FileDataLoader::load_single_weight_tensor(FFModel *ff,
       if (weight_filename != "embed_tokens_weight_lm_head") {
         weight_filename += weight_idx == 0 ? ".weight" : ".bias";
       }
-      std::cout << "Loading weight file " << weight_filename << std::endl;
+      log_file_loader.print("Loading weight file %s", weight_filename.c_str());
       std::string weight_filepath =
           join_path({weights_folder, weight_filename});
       load_from_file(data, volume, weight_filepath);
     }
   }
+}
 
+template <typename DT>
+void FileDataLoader::load_single_weight_tensor(FFModel *ff,
+                                               Layer *l,
+                                               int weight_idx) {
+  // Create a buffer to store weight data from the file
+  DT *data = (DT *)malloc(get_weight_buffer_size(l, weight_idx));
+  read_single_weight_tensor<DT>(ff, l, weight_idx, data);
   // Copy the weight data from the buffer to the weight's ParallelTensor
+  set_weight_tensor(ff, l, weight_idx, (char *)data);
+  // Free buffer memory
+  free(data);
+}
+
+void FileDataLoader::read_weight(FFModel *ff,
+                                 Layer *l,
+                                 int weight_idx,
+                                 char *data) {
+  switch (l->weights[weight_idx]->data_type) {
+    case DT_HALF:
+      read_single_weight_tensor<half>(ff, l, weight_idx, (half *)data);
+      break;
+    case DT_FLOAT:
+      read_single_weight_tensor<float>(ff, l, weight_idx, (float *)data);
+      break;
+    case DT_INT4:
+    case DT_INT8:
+      // load weights in quantization
+      read_quantization_weight(ff, l, weight_idx, data);
+      break;
+    default:
+      assert(false && "Unsupported data type");
+  }
+}
+
+void FileDataLoader::set_weight_tensor(FFModel *ff,
+                                       Layer *l,
+                                       int weight_idx,
+                                       char *data) {
+  Tensor weight = l->weights[weight_idx];
+  std::vector<int> dims_vec;
+  for (int i = 0; i < weight->num_dims; i++) {
+    dims_vec.push_back(weight->dims[i]);
+  }
   ParallelTensor weight_pt;
   ff->get_parallel_tensor_from_tensor(weight, weight_pt);
-  weight_pt->set_tensor<DT>(ff, dims_vec, data);
-
-  // Free buffer memory
-  delete data;
+  switch (weight->data_type) {
+    case DT_HALF:
+      weight_pt->set_tensor<half>(ff, dims_vec, (half *)data);
+      break;
+    case DT_FLOAT:
+      weight_pt->set_tensor<float>(ff, dims_vec, (float *)data);
+      break;
+    case DT_INT4:
+    case DT_INT8:
+      weight_pt->set_tensor<char>(ff, dims_vec, data);
+      break;
+    default:
+      assert(false && "Unsupported data type");
+  }
 }
 
 void FileDataLoader::load_weights(FFModel *ff) {
@@ -817,3 +899,128 @@ void FileDataLoader::load_weights(FFModel *ff) {
     }
   }
 }
+
+void FileDataLoader::register_weights(FFModel *ff, int prefetch_depth) {
+  assert(pending_weights.empty() && "weights are already registered");
+  weight_prefetch_depth = std::max(prefetch_depth, 0);
+  num_pending_weights = 0;
+  for (Layer *l : ff->layers) {
+    if (l->numWeights < 1 || l->name == NULL || strlen(l->name) < 1) {
+      continue;
+    }
+    // TODO: currently skip Lora layers
+    if (l->op_type == OP_LORA) {
+      continue;
+    }
+    for (int i = 0; i < l->numWeights; i++) {
+      Tensor weight = l->weights[i];
+      if (weight == NULL) {
+        continue;
+      }
+      ParallelTensor weight_pt;
+      ff->get_parallel_tensor_from_tensor(weight, weight_pt);
+      assert(weight_pt != nullptr);
+      pending_weight_index[weight_pt] = pending_weights.size();
+      pending_weights.emplace_back();
+      pending_weights.back().layer = l;
+      pending_weights.back().weight_idx = i;
+      num_pending_weights++;
+    }
+  }
+  log_file_loader.print("Registered %zu weight tensors for on-demand loading "
+                        "(prefetch depth %d layers)",
+                        num_pending_weights,
+                        weight_prefetch_depth);
+  for (int i = 0; i < NUM_WEIGHT_READERS; i++) {
+    weight_readers.emplace_back(&FileDataLoader::read_loop, this);
+  }
+  // Start streaming the first layers in right away so that they are ready
+  // by the time the first batch arrives
+  prefetch_weights(ff, 0);
+}
+
+bool FileDataLoader::has_pending_weights() const {
+  return num_pending_weights > 0;
+}
+
+void FileDataLoader::prefetch_weights(FFModel *ff, size_t first_index) {
+  // Issue asynchronous reads for the layer that owns first_index and the
+  // following weight_prefetch_depth layers. Only the file I/O runs on the
+  // background threads; the copies into the weight regions are issued from
+  // the caller's thread in materialize_weight.
+  Layer const *last_layer = nullptr;
+  int num_layers = 0;
+  for (size_t idx = first_index; idx < pending_weights.size(); idx++) {
+    PendingWeight &w = pending_weights[idx];
+    if (w.layer != last_layer) {
+      if (num_layers > weight_prefetch_depth) {
+        break;
+      }
+      last_layer = w.layer;
+      num_layers++;
+    }
+    if (w.materialized || w.host_buffer != nullptr) {
+      continue;
+    }
+    w.host_buffer =
+        (char *)malloc(get_weight_buffer_size(w.layer, w.weight_idx));
+    std::packaged_task<void()> job([this, ff, &w]() {
+      read_weight(ff, w.layer, w.weight_idx, w.host_buffer);
+    });
+    w.loaded = job.get_future();
+    {
+      std::lock_guard<std::mutex> lock(weight_reads_mutex);
+      weight_reads.push_back(std::move(job));
+    }
+    weight_reads_available.notify_one();
+  }
+}
+
+void FileDataLoader::read_loop() {
+  while (true) {
+    std::packaged_task<void()> job;
+    {
+      std::unique_lock<std::mutex> lock(weight_reads_mutex);
+      weight_reads_available.wait(lock, [this] {
+        return stop_weight_readers || !weight_reads.empty();
+      });
+      if (stop_weight_readers) {
+        return;
+      }
+      job = std::move(weight_reads.front());
+      weight_reads.pop_front();
+    }
+    job();
+  }
+}
+
+void FileDataLoader::materialize_weight(FFModel *ff, size_t index) {
+  PendingWeight &w = pending_weights[index];
+  if (w.materialized) {
+    return;
+  }
+  prefetch_weights(ff, index);
+  assert(w.host_buffer != nullptr);
+  w.loaded.wait();
+  set_weight_tensor(ff, w.layer, w.weight_idx, w.host_buffer);
+  free(w.host_buffer);
+  w.host_buffer = nullptr;
+  w.materialized = true;
+  num_pending_weights--;
+}
+
+void FileDataLoader::materialize_weights(FFModel *ff, Op const *op) {
+  for (int i = 0; i < op->numWeights; i++) {
+    auto const &it = pending_weight_index.find(op->weights[i]);
+    if (it == pending_weight_index.end()) {
+      continue;
+    }
+    materialize_weight(ff, it->second);
+  }
+}
+
+void FileDataLoader::materialize_all_weights(FFModel *ff) {
+  for (size_t idx = 0; idx < pending_weights.size(); idx++) {
+    materialize_weight(ff, idx);
+  }
+}
@@ -4,9 +4,255 @@
 // Copyright (c) 2019-2020 zili wang <wzlnot@gmail.com>.
 
 #include <flexflow/gpt_tokenizer.h>
+#include <queue>
 
 using json = nlohmann::json;
 
+void BPEMergeTable::reserve(size_t num_merges) {
+  size_t capacity = 16;
+  while (capacity < 2 * num_merges) {
+    capacity <<= 1;
+  }
+  std::vector<Entry> old_slots;
+  old_slots.swap(slots);
+  Entry empty = {EMPTY_KEY, 0, -1};
+  slots.assign(capacity, empty);
+  mask = capacity - 1;
+  num_entries = 0;
+  for (auto const &e : old_slots) {
+    if (e.key != EMPTY_KEY) {
+      insert((int32_t)(e.key >> 32), (int32_t)e.key, e.rank, e.merged_id);
+    }
+  }
+}
+
+bool BPEMergeTable::insert(int32_t left,
+                           int32_t right,
+                           uint32_t rank,
+                           int32_t merged_id) {
+  if (2 * (num_entries + 1) > slots.size()) {
+    reserve(num_entries + 1);
+  }
+  uint64_t key = make_key(left, right);
+  size_t slot = slot_of(key);
+  while (slots[slot].key != EMPTY_KEY) {
+    if (slots[slot].key == key) {
+      return false;
+    }
+    slot = (slot + 1) & mask;
+  }
+  slots[slot].key = key;
+  slots[slot].rank = rank;
+  slots[slot].merged_id = merged_id;
+  num_entries++;
+  return true;
+}
+
+BPEMergeTable::Entry const *BPEMergeTable::find(int32_t left,
+                                                int32_t right) const {
+  if (num_entries == 0) {
+    return nullptr;
+  }
+  uint64_t key = make_key(left, right);
+  size_t slot = slot_of(key);
+  while (slots[slot].key != EMPTY_KEY) {
+    if (slots[slot].key == key) {
+      return &slots[slot];
+    }
+    slot = (slot + 1) & mask;
+  }
+  return nullptr;
+}
+
+BPEWordCache::BPEWordCache(size_t capacity_bytes_, size_t num_shards_)
+    : num_shards(num_shards_), capacity_bytes(capacity_bytes_),
+      shards(new Shard[num_shards_]), hits(0), misses(0), insertions(0),
+      evictions(0) {
+  assert(num_shards > 0);
+  for (size_t i = 0; i < num_shards; i++) {
+    shards[i].capacity_bytes = capacity_bytes / num_shards;
+  }
+}
+
+/*static*/
+size_t BPEWordCache::entry_bytes(size_t word_length, size_t num_symbols) {
+  // approximate the footprint of the list node, the index entry and the
+  // two heap allocations on top of the payload
+  return sizeof(Entry) + 4 * sizeof(void *) + 2 * word_length +
+         num_symbols * sizeof(int32_t);
+}
+
+BPEWordCache::Shard &BPEWordCache::shard_of(std::string const &word) {
+  // use different hash bits than the shard's own unordered_map
+  uint64_t h = std::hash<std::string>{}(word);
+  return shards[(size_t)((h * 0x9E3779B97F4A7C15ULL) >> 40) % num_shards];
+}
+
+bool BPEWordCache::lookup(std::string const &word,
+                          std::vector<int32_t> &symbols) {
+  Shard &shard = shard_of(word);
+  {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(word);
+    if (it != shard.index.end()) {
+      shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+      std::vector<int32_t> const &cached = it->second->symbols;
+      symbols.insert(symbols.end(), cached.begin(), cached.end());
+      hits.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+  }
+  misses.fetch_add(1, std::memory_order_relaxed);
+  return false;
+}
+
+void BPEWordCache::insert(std::string const &word,
+                          int32_t const *word_symbols,
+                          size_t num_symbols) {
+  size_t bytes = entry_bytes(word.size(), num_symbols);
+  Shard &shard = shard_of(word);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  if (bytes > shard.capacity_bytes) {
+    return;
+  }
+  if (shard.index.find(word) != shard.index.end()) {
+    // another thread inserted the same word concurrently
+    return;
+  }
+  Entry e;
+  e.word = word;
+  e.symbols.assign(word_symbols, word_symbols + num_symbols);
+  shard.lru.push_front(std::move(e));
+  shard.index[word] = shard.lru.begin();
+  shard.bytes += bytes;
+  insertions.fetch_add(1, std::memory_order_relaxed);
+  evict(shard, shard.capacity_bytes);
+}
+
+void BPEWordCache::evict(Shard &shard, size_t capacity_bytes) {
+  while (shard.bytes > capacity_bytes && !shard.lru.empty()) {
+    Entry const &e = shard.lru.back();
+    shard.bytes -= entry_bytes(e.word.size(), e.symbols.size());
+    shard.index.erase(e.word);
+    shard.lru.pop_back();
+    evictions.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void BPEWordCache::set_capacity(size_t capacity_bytes_) {
+  capacity_bytes = capacity_bytes_;
+  for (size_t i = 0; i < num_shards; i++) {
+    std::lock_guard<std::mutex> lock(shards[i].mutex);
+    shards[i].capacity_bytes = capacity_bytes / num_shards;
+    evict(shards[i], shards[i].capacity_bytes);
+  }
+}
+
+void BPEWordCache::clear() {
+  for (size_t i = 0; i < num_shards; i++) {
+    std::lock_guard<std::mutex> lock(shards[i].mutex);
+    shards[i].lru.clear();
+    shards[i].index.clear();
+    shards[i].bytes = 0;
+  }
+}
+
+BPEWordCache::Stats BPEWordCache::get_stats() const {
+  Stats stats;
+  stats.hits = hits.load(std::memory_order_relaxed);
+  stats.misses = misses.load(std::memory_order_relaxed);
+  stats.insertions = insertions.load(std::memory_order_relaxed);
+  stats.evictions = evictions.load(std::memory_order_relaxed);
+  stats.num_entries = 0;
+  stats.bytes = 0;
+  stats.capacity_bytes = capacity_bytes;
+  for (size_t i = 0; i < num_shards; i++) {
+    std::lock_guard<std::mutex> lock(shards[i].mutex);
+    stats.num_entries += shards[i].index.size();
+    stats.bytes += shards[i].bytes;
+  }
+  return stats;
+}
+
+void BPEWordCache::reset_stats() {
+  hits = 0;
+  misses = 0;
+  insertions = 0;
+  evictions = 0;
+}
+
+// Decode the UTF-8 character starting at str[pos]. Invalid sequences are
+// returned as a single byte so that the caller always makes progress
+static size_t decode_utf8(std::string const &str, size_t pos, uint32_t &cp) {
+  unsigned char c = (unsigned char)str[pos];
+  size_t length = 1;
+  if (c < 0x80) {
+    cp = c;
+    return 1;
+  } else if ((c & 0xE0) == 0xC0) {
+    cp = c & 0x1F;
+    length = 2;
+  } else if ((c & 0xF0) == 0xE0) {
+    cp = c & 0x0F;
+    length = 3;
+  } else if ((c & 0xF8) == 0xF0) {
+    cp = c & 0x07;
+    length = 4;
+  } else {
+    cp = 0xFFFD;
+    return 1;
+  }
+  if (pos + length > str.size()) {
+    cp = 0xFFFD;
+    return 1;
+  }
+  for (size_t i = 1; i < length; i++) {
+    unsigned char cc = (unsigned char)str[pos + i];
+    if ((cc & 0xC0) != 0x80) {
+      cp = 0xFFFD;
+      return 1;
+    }
+    cp = (cp << 6) | (cc & 0x3F);
+  }
+  return length;
+}
+
+static bool in_ranges(std::vector<std::pair<uint32_t, uint32_t>> const &ranges,
+                      uint32_t cp) {
+  auto it = std::upper_bound(
+      ranges.begin(),
+      ranges.end(),
+      cp,
+      [](uint32_t v, std::pair<uint32_t, uint32_t> const &r) -> bool {
+        return v < r.first;
+      });
+  if (it == ranges.begin()) {
+    return false;
+  }
+  --it;
+  return cp <= it->second;
+}
+
+// Parse a regex character class body of the form "\uXXXX-\uYYYY..."
+static std::vector<std::pair<uint32_t, uint32_t>>
+    parse_unicode_ranges(std::string const &expr) {
+  std::vector<std::pair<uint32_t, uint32_t>> ranges;
+  size_t pos = 0;
+  while ((pos = expr.find("\\u", pos)) != std::string::npos) {
+    uint32_t first = std::stoul(expr.substr(pos + 2, 4), nullptr, 16);
+    uint32_t last = first;
+    pos += 6;
+    if (pos < expr.size() && expr[pos] == '-') {
+      assert(expr.compare(pos + 1, 2, "\\u") == 0);
+      last = std::stoul(expr.substr(pos + 3, 4), nullptr, 16);
+      pos += 7;
+    }
+    ranges.push_back(std::make_pair(first, last));
+  }
+  std::sort(ranges.begin(), ranges.end());
+  return ranges;
+}
+
 // codecvt abandoned in c++17
 std::wstring GPT_Tokenizer::utf8_to_wstring(std::string const &src) {
   std::wstring_convert<std::codecvt_utf8<wchar_t>, wchar_t> converter;
@@ -65,6 +311,62 @@ void GPT_Tokenizer::unicode_to_bytes() {
   }
 }
 
+void GPT_Tokenizer::load_char_classes() {
+  letter_ranges = parse_unicode_ranges(unicode_letter_expr);
+  number_ranges = parse_unicode_ranges(unicode_number_expr);
+  // single-byte symbols
+  symbol_tokens.clear();
+  symbol_ids.clear();
+  for (int i = 0; i < 256; i++) {
+    get_symbol_id(std::string(1, (char)i));
+  }
+}
+
+GPT_Tokenizer::char_class GPT_Tokenizer::classify(uint32_t cp) const {
+  if (cp < 0x80) {
+    // std::wregex only treats ASCII characters as \s
+    if (cp == ' ' || (cp >= '\t' && cp <= '\r')) {
+      return CHAR_WHITESPACE;
+    }
+    if ((cp >= 'a' && cp <= 'z') || (cp >= 'A' && cp <= 'Z')) {
+      return CHAR_LETTER;
+    }
+    if (cp >= '0' && cp <= '9') {
+      return CHAR_NUMBER;
+    }
+    return CHAR_OTHER;
+  }
+  if (in_ranges(letter_ranges, cp)) {
+    return CHAR_LETTER;
+  }
+  if (in_ranges(number_ranges, cp)) {
+    return CHAR_NUMBER;
+  }
+  return CHAR_OTHER;
+}
+
+int32_t GPT_Tokenizer::get_symbol_id(std::string const &raw_bytes) {
+  auto it = symbol_ids.find(raw_bytes);
+  if (it != symbol_ids.end()) {
+    return it->second;
+  }
+  int32_t id = (int32_t)symbol_tokens.size();
+  std::string token;
+  for (char c : raw_bytes) {
+    token += wstring_to_utf8(std::wstring(1, bytes_encoder[(uint8_t)c]));
+  }
+  symbol_ids.insert({raw_bytes, id});
+  symbol_tokens.push_back(token);
+  return id;
+}
+
+void GPT_Tokenizer::load_symbol_vocab_ids() {
+  symbol_vocab_ids.resize(symbol_tokens.size());
+  for (size_t i = 0; i < symbol_tokens.size(); i++) {
+    symbol_vocab_ids[i] = convert_token_to_id(symbol_tokens[i]);
+  }
+}
+
 std::vector<std::string> GPT_Tokenizer::split(std::string const &s,
                                               std::regex rgx) {
   std::vector<std::string> elems;
@@ -127,6 +429,7 @@ void GPT_Tokenizer::load_vocab(std::string const &vocab_file) {
 
 void GPT_Tokenizer::load_merge(std::string const &merge_file) {
   bpe_ranks.reserve(60000);
+  merge_table.reserve(60000);
   std::ifstream file_handle(merge_file);
   assert(file_handle.good() && "file not exists");
   std::string line;
@@ -140,14 +443,25 @@ void GPT_Tokenizer::load_merge(std::string const &merge_file) {
     assert(bigrams.size() == 2 && "unk format");
     wbigram_pair curr(utf8_to_wstring(bigrams[0]), utf8_to_wstring(bigrams[1]));
     bpe_ranks.insert({curr, curr_idx});
+    std::string left, right;
+    for (wchar_t c : curr.first) {
+      left.push_back(bytes_decoder[c]);
+    }
+    for (wchar_t c : curr.second) {
+      right.push_back(bytes_decoder[c]);
+    }
+    int32_t left_id = get_symbol_id(left);
+    int32_t right_id = get_symbol_id(right);
+    int32_t merged_id = get_symbol_id(left + right);
+    merge_table.insert(left_id, right_id, curr_idx, merged_id);
     curr_idx++;
   }
 };
 
-std::vector<std::string> GPT_Tokenizer::bpe(std::wstring token) {
+std::vector<std::string> GPT_Tokenizer::legacy_bpe(std::wstring token) {
   // bpe use wstring
-  if (cache.find(token) != cache.end()) {
-    return cache[token];
+  if (legacy_cache.find(token) != legacy_cache.end()) {
+    return legacy_cache[token];
   }
   std::vector<std::wstring> wword;
   for (auto c : token) {
@@ -210,13 +524,14 @@ std::vector<std::string> GPT_Tokenizer::bpe(std::wstring token) {
   for (auto w : wword) {
     word.push_back(wstring_to_utf8(w));
   }
-  if (token.size() < cache_word_max_length && cache.size() < cache_max_size) {
-    cache.insert({token, word});
+  if (token.size() < cache_word_max_length &&
+      legacy_cache.size() < cache_max_size) {
+    legacy_cache.insert({token, word});
   }
   return word;
 };
 
-std::vector<std::string> GPT_Tokenizer::tokenize(std::string str) {
+std::vector<std::string> GPT_Tokenizer::legacy_tokenize(std::string str) {
   std::vector<std::string> bpe_tokens;
   std::wstring wstr = utf8_to_wstring(str);
   std::wsregex_iterator iter(wstr.begin(), wstr.end(), pat);
@@ -231,7 +546,7 @@ std::vector<std::string> GPT_Tokenizer::tokenize(std::string str) {
       }
     }
     if (token.length() > 0) {
-      decltype(bpe_tokens) curr_bpe_tokens = bpe(token);
+      decltype(bpe_tokens) curr_bpe_tokens = legacy_bpe(token);
       bpe_tokens.insert(
           bpe_tokens.end(), curr_bpe_tokens.begin(), curr_bpe_tokens.end());
     }
@@ -240,13 +555,195 @@ std::vector<std::string> GPT_Tokenizer::tokenize(std::string str) {
   return bpe_tokens;
 }
 
+// Returns the end of the pre-token starting at str[pos]. This is a hand-
+// written equivalent of matching the GPT-2 pattern
+//   's|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+
+// at pos, with the same letter/number classes as `pat`
+size_t GPT_Tokenizer::pre_tokenize_next(std::string const &str,
+                                        size_t pos) const {
+  size_t const n = str.size();
+  uint32_t cp;
+  size_t length = decode_utf8(str, pos, cp);
+  // contractions
+  if (cp == '\'' && pos + 1 < n) {
+    char c1 = str[pos + 1];
+    if (c1 == 's' || c1 == 't' || c1 == 'm' || c1 == 'd') {
+      return pos + 2;
+    }
+    if (pos + 2 < n) {
+      char c2 = str[pos + 2];
+      if ((c1 == 'r' && c2 == 'e') || (c1 == 'v' && c2 == 'e') ||
+          (c1 == 'l' && c2 == 'l')) {
+        return pos + 3;
+      }
+    }
+  }
+  char_class cls = classify(cp);
+  size_t end = pos + length;
+  // optional leading space followed by a letter, number or other run
+  if (cp == ' ' && end < n) {
+    uint32_t next_cp;
+    size_t next_length = decode_utf8(str, end, next_cp);
+    char_class next_cls = classify(next_cp);
+    if (next_cls != CHAR_WHITESPACE) {
+      cls = next_cls;
+      end += next_length;
+    }
+  }
+  if (cls != CHAR_WHITESPACE) {
+    while (end < n) {
+      size_t next_length = decode_utf8(str, end, cp);
+      if (classify(cp) != cls) {
+        break;
+      }
+      end += next_length;
+    }
+    return end;
+  }
+  // whitespace run: \s+(?!\S) leaves the last whitespace character to
+  // prefix the next pre-token, unless the run ends the string or consists of
+  // a single character (in which case \s+ matches it)
+  size_t last_start = pos;
+  while (end < n) {
+    size_t next_length = decode_utf8(str, end, cp);
+    if (classify(cp) != CHAR_WHITESPACE) {
+      return last_start > pos ? last_start : end;
+    }
+    last_start = end;
+    end += next_length;
+  }
+  return end;
+}
+
+void GPT_Tokenizer::bpe_symbols(char const *data,
+                                size_t length,
+                                std::vector<int32_t> &symbols) {
+  std::string word(data, length);
+  bool cacheable = length < cache_word_max_length;
+  if (cacheable && cache.lookup(word, symbols)) {
+    return;
+  }
+  // Symbols form a doubly-linked list over the bytes of the word; merge
+  // candidates are popped from a min-heap ordered by (rank, position), which
+  // applies merges in the same order as repeatedly merging the lowest-ranked
+  // pair from left to right. Stale candidates are skipped when popped
+  struct Symbol {
+    int32_t id;
+    int prev, next;
+  };
+  struct Candidate {
+    uint32_t rank;
+    int left;
+    int32_t left_id, right_id, merged_id;
+    bool operator<(Candidate const &other) const {
+      // std::priority_queue is a max-heap
+      if (rank != other.rank) {
+        return rank > other.rank;
+      }
+      return left > other.left;
+    }
+  };
+  std::vector<Symbol> word_symbols(length);
+  for (size_t i = 0; i < length; i++) {
+    word_symbols[i].id = (uint8_t)data[i];
+    word_symbols[i].prev = (int)i - 1;
+    word_symbols[i].next = (i + 1 < length) ? (int)i + 1 : -1;
+  }
+  std::priority_queue<Candidate> candidates;
+  auto push_candidate = [&](int left) {
+    if (left < 0 || word_symbols[left].next < 0) {
+      return;
+    }
+    int right = word_symbols[left].next;
+    BPEMergeTable::Entry const *e =
+        merge_table.find(word_symbols[left].id, word_symbols[right].id);
+    if (e != nullptr) {
+      Candidate c = {e->rank,
+                     left,
+                     word_symbols[left].id,
+                     word_symbols[right].id,
+                     e->merged_id};
+      candidates.push(c);
+    }
+  };
+  for (int i = 0; i + 1 < (int)length; i++) {
+    push_candidate(i);
+  }
+  while (!candidates.empty()) {
+    Candidate c = candidates.top();
+    candidates.pop();
+    Symbol &left = word_symbols[c.left];
+    if (left.id != c.left_id || left.next < 0 ||
+        word_symbols[left.next].id != c.right_id) {
+      continue;
+    }
+    int right = left.next;
+    left.id = c.merged_id;
+    left.next = word_symbols[right].next;
+    if (left.next >= 0) {
+      word_symbols[left.next].prev = c.left;
+    }
+    // mark the merged-away symbol as dead
+    word_symbols[right].id = -1;
+    push_candidate(left.prev);
+    push_candidate(c.left);
+  }
+  size_t first = symbols.size();
+  for (int i = 0; i >= 0; i = word_symbols[i].next) {
+    symbols.push_back(word_symbols[i].id);
+  }
+  if (cacheable) {
+    cache.insert(word, symbols.data() + first, symbols.size() - first);
+  }
+}
+
+std::vector<std::string> GPT_Tokenizer::bpe(std::wstring token) {
+  std::string raw_bytes;
+  for (wchar_t c : token) {
+    // use find() rather than operator[] so that concurrent calls never
+    // modify the map
+    auto it = bytes_decoder.find(c);
+    raw_bytes.push_back(it != bytes_decoder.end() ? it->second : '\0');
+  }
+  std::vector<int32_t> symbols;
+  if (raw_bytes.size() > 0) {
+    bpe_symbols(raw_bytes.data(), raw_bytes.size(), symbols);
+  }
+  std::vector<std::string> word;
+  for (int32_t id : symbols) {
+    word.push_back(symbol_tokens[id]);
+  }
+  return word;
+}
+
+void GPT_Tokenizer::tokenize_symbols(std::string const &str,
+                                     std::vector<int32_t> &symbols) {
+  size_t pos = 0;
+  while (pos < str.size()) {
+    size_t end = pre_tokenize_next(str, pos);
+    bpe_symbols(str.data() + pos, end - pos, symbols);
+    pos = end;
+  }
+}
+
+std::vector<std::string> GPT_Tokenizer::tokenize(std::string str) {
+  std::vector<int32_t> symbols;
+  tokenize_symbols(str, symbols);
+  std::vector<std::string> bpe_tokens;
+  bpe_tokens.reserve(symbols.size());
+  for (int32_t id : symbols) {
+    bpe_tokens.push_back(symbol_tokens[id]);
+  }
+  return bpe_tokens;
+}
+
 int32_t GPT_Tokenizer::convert_token_to_id(std::string token) {
   auto p = vocab.find(token);
   if (p != vocab.end()) {
-    return vocab[token];
-  } else {
-    return vocab[unk_token];
+    return p->second;
   }
+  p = vocab.find(unk_token);
+  return p != vocab.end() ? p->second : 0;
 }
 
 void GPT_Tokenizer::encode(std::string str,
@@ -263,18 +760,21 @@ void GPT_Tokenizer::encode(std::string str,
   mask_ids->reserve(max_length);
   // input_ids->push_back(vocab[bos_token]);
   // mask_ids->push_back(1);
-  auto tokens = tokenize(str);
-  for (auto t : tokens) {
+  std::vector<int32_t> symbols;
+  tokenize_symbols(str, symbols);
+  for (int32_t id : symbols) {
     if (input_ids->size() == max_length - 1) {
       break;
     }
-    input_ids->push_back(convert_token_to_id(t));
+    input_ids->push_back(symbol_vocab_ids[id]);
     mask_ids->push_back(1);
   }
   // input_ids->push_back(vocab[eos_token]);
   // mask_ids->push_back(1);
+  auto pad = vocab.find(pad_token);
+  int32_t pad_token_id = pad != vocab.end() ? pad->second : 0;
   while (input_ids->size() < max_length) {
-    input_ids->push_back(vocab[pad_token]);
+    input_ids->push_back(pad_token_id);
     mask_ids->push_back(0);
   }
   if (mode == OPT_TOKENIZER) {
@@ -318,7 +818,8 @@ std::string GPT_Tokenizer::decode(std::vector<int32_t> input_ids,
   std::wstring wstr = utf8_to_wstring(concatenated_tokens);
   std::string result;
   for (wchar_t ch : wstr) {
-    result += bytes_decoder[ch];
+    auto it = bytes_decoder.find(ch);
+    result += it != bytes_decoder.end() ? it->second : '\0';
   }
   return result;
 }
@@ -0,0 +1,73 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "flexflow/utils/gradient_buckets.h"
+#include <cassert>
+
+namespace FlexFlow {
+
+GradientBuckets::GradientBuckets(size_t _bucket_size)
+    : bucket_size(_bucket_size), next_bucket(0) {}
+
+int GradientBuckets::add_parameter(size_t group, size_t bytes) {
+  int param = param_buckets.size();
+  auto it = open_buckets.find(group);
+  if (it == open_buckets.end() ||
+      buckets[it->second].bytes + bytes > bucket_size) {
+    Bucket bucket;
+    bucket.group = group;
+    bucket.bytes = 0;
+    bucket.num_pending = 0;
+    buckets.push_back(bucket);
+    open_buckets[group] = buckets.size() - 1;
+  }
+  int b = open_buckets[group];
+  buckets[b].bytes += bytes;
+  buckets[b].params.push_back(param);
+  buckets[b].num_pending++;
+  param_buckets.push_back(b);
+  param_ready.push_back(false);
+  return param;
+}
+
+void GradientBuckets::reset() {
+  for (Bucket &bucket : buckets) {
+    bucket.num_pending = bucket.params.size();
+  }
+  param_ready.assign(param_ready.size(), false);
+  next_bucket = 0;
+}
+
+void GradientBuckets::mark_ready(int param, std::vector<int> &ready) {
+  assert(param >= 0 && param < (int)param_buckets.size());
+  // an operator may run backward more than once, e.g. when it is shared
+  if (param_ready[param]) {
+    return;
+  }
+  param_ready[param] = true;
+  buckets[param_buckets[param]].num_pending--;
+  while (next_bucket < (int)buckets.size() &&
+         buckets[next_bucket].num_pending == 0) {
+    ready.push_back(next_bucket++);
+  }
+}
+
+void GradientBuckets::release_remaining(std::vector<int> &ready) {
+  while (next_bucket < (int)buckets.size()) {
+    ready.push_back(next_bucket++);
+  }
+}
+
+}; // namespace FlexFlow
@@ -102,7 +102,7 @@ bool Edge::operator==(Edge const &rhs) const {
   return true;
 }
 
-SearchHelper::SearchHelper(FFModel *model) : model(model) {
+SearchHelper::SearchHelper(FFModel *model) : model(model), mem_config(1.0) {
   this->logger = std::unique_ptr<RecursiveLogger>(new RecursiveLogger("DP"));
 }
 
@@ -695,6 +695,7 @@ void Graph::remove_node(Node const &node, bool purge_edges) {
   }
   this->inEdges.erase(node);
   this->outEdges.erase(node);
+  this->recomputed_nodes.erase(node);
 }
 
 /*static*/
@@ -1165,7 +1166,7 @@ GraphCostResult GraphCostResult::invalid() {
 }
 
 GraphCostResultWithMemory GraphCostResultWithMemory::invalid() {
-  return {std::numeric_limits<float>::infinity(), MemoryUsage{}, {}};
+  return {std::numeric_limits<float>::infinity(), MemoryUsage{}, {}, {}};
 }
 
 float GraphCostResultWithMemory::get_multi_obj_cost() const {
@@ -1221,6 +1222,8 @@ GraphCostResultWithMemory sequence_cost<GraphCostResultWithMemory>(
   result.cost += second.cost;
   result.mem_cost += second.mem_cost;
   result.views.insert(second.views.cbegin(), second.views.cend());
+  result.recomputed.insert(second.recomputed.cbegin(),
+                           second.recomputed.cend());
   return result;
 }
 
@@ -1264,6 +1267,9 @@ GraphOptimizeResultWithMemory sequence_cost<GraphOptimizeResultWithMemory>(
 
   // New: Combine memory cost
   result.mem_cost = first.mem_cost + second.mem_cost;
+  result.recomputed.insert(first.recomputed.cbegin(), first.recomputed.cend());
+  result.recomputed.insert(second.recomputed.cbegin(),
+                           second.recomputed.cend());
 
   return result;
 }
@@ -1288,6 +1294,9 @@ GraphCostResultWithMemory parallel_cost<GraphCostResultWithMemory>(
   result.mem_cost = first.mem_cost + second.mem_cost;
   result.views.insert(first.views.cbegin(), first.views.cend());
   result.views.insert(second.views.cbegin(), second.views.cend());
+  result.recomputed.insert(first.recomputed.cbegin(), first.recomputed.cend());
+  result.recomputed.insert(second.recomputed.cbegin(),
+                           second.recomputed.cend());
 
   return result;
 }
@@ -1431,6 +1440,7 @@ GraphCostResultWithMemory
   return {std::numeric_limits<float>::infinity(),
           MemoryUsage(MemoryUsageType::GLOBAL,
                       std::numeric_limits<float>::infinity()),
+          {},
           {}};
 }
 
@@ -1447,7 +1457,7 @@ GraphCostResult SearchHelper::empty<GraphCostResult>() const {
 template <>
 GraphCostResultWithMemory
     SearchHelper::empty<GraphCostResultWithMemory>() const {
-  return {0.0f, MemoryUsage{}, {}};
+  return {0.0f, MemoryUsage{}, {}, {}};
 }
 
 template <typename T>
@@ -1584,10 +1594,30 @@ void SearchHelper::add_sink_node_costs<GraphCostResultWithMemory>(
     NodeAssignment const &sink,
     CostMetrics metrics,
     GraphCostResultWithMemory *result) const {
+  float run_time_cost =
+      metrics.forward_time + metrics.backward_time + metrics.sync_time;
   float op_total_mem_mb = ((float)(metrics.op_total_mem / 1e4)) / 1e2;
+  // Recomputing the outputs in the backward pass frees them between the two
+  // passes, at the price of running the forward pass of the operator again
+  Op const *op = sink.node.ptr;
+  if (this->model->config.computationMode == COMP_MODE_TRAINING &&
+      op->can_recompute_outputs()) {
+    size_t output_bytes = 0;
+    for (int i = 0; i < op->numOutputs; i++) {
+      output_bytes += op->outputs[i]->get_volume() *
+                      data_type_size(op->outputs[i]->data_type);
+    }
+    float output_mem_mb = ((float)(output_bytes / 1e4)) / 1e2;
+    if (should_recompute_outputs(
+            this->mem_config, metrics.forward_time, output_mem_mb)) {
+      run_time_cost += metrics.forward_time;
+      op_total_mem_mb -= output_mem_mb;
+      result->recomputed.insert(sink.node);
+    }
+  }
   this->add_operator_cost_with_memory(
       sink,
-      metrics.forward_time + metrics.backward_time + metrics.sync_time,
+      run_time_cost,
       MemoryUsage{MemoryUsageType::GLOBAL, op_total_mem_mb},
       result);
 }
@@ -1735,6 +1765,21 @@ T SearchHelper::graph_cost(Graph const *graph,
     metrics.op_total_mem = input_num_parts * metrics.inputs_memory +
                            output_num_parts * metrics.outputs_memory +
                            weight_num_parts * metrics.weights_memory;
+    // Optimizer states, which sharding spreads over the weight replicas
+    Optimizer const *optimizer = this->model->optimizer;
+    if (optimizer != nullptr &&
+        this->model->config.computationMode == COMP_MODE_TRAINING) {
+      for (int i = 0; i < op->numWeights; i++) {
+        if (op->weights[i] == nullptr) {
+          continue;
+        }
+        metrics.op_total_mem +=
+            optimizer_states_memory(op->weights[i]->get_volume(),
+                                    op->weights[i]->get_num_replicas(),
+                                    optimizer->num_states(),
+                                    optimizer->shard_states);
+      }
+    }
 
     this->logger->spew() << "  op_total_mem: " << metrics.op_total_mem;
     float op_total_mem_mb = (float)((metrics.op_total_mem) / 1e4) / 1e2;
@@ -2059,6 +2104,15 @@ bool is_valid_strategy(
     CostMetrics op_cost =
         cached_simulator->measure_operator_cost(view.first.ptr, view.second);
     float node_mem_as_mb = op_cost.total_memory_in_mb();
+    // The outputs of recomputed operators are not kept between the passes
+    if (curr_graph->recomputed_nodes.find(view.first) !=
+        curr_graph->recomputed_nodes.end()) {
+      Op const *op = view.first.ptr;
+      for (int i = 0; i < op->numOutputs; i++) {
+        size_t piece_size = op->outputs[i]->get_shape().get_piece_size();
+        node_mem_as_mb -= ((float)(piece_size / 1e4)) / 1e2;
+      }
+    }
 
     for (auto const d_id : view.second.device_ids()) {
       if (device_to_mem.find(d_id) == device_to_mem.end()) {
@@ -2299,6 +2353,7 @@ GraphOptimalViewSerialized
         sez.serialize(embed->num_entries);
         sez.serialize(embed->out_channels);
         sez.serialize(embed->aggr);
+        sez.serialize(embed->update_type);
         sez.serialize(embed->data_type);
         sez.serialize(strlen(embed->name));
         sez.serialize(embed->name, strlen(embed->name));
@@ -2458,6 +2513,7 @@ GraphOptimalViewSerialized
         op->serialize(sez);
       }
     }
+    sez.serialize(best_graph->recomputed_nodes.count(cur_node) > 0);
     sez.serialize((size_t)12345678); // safe guard for the end of an op
   }
   assert(node_idx == best_graph->inEdges.size());
@@ -2678,8 +2734,9 @@ void FFModel::deserialize_graph_optimal_view(
         break;
       }
       case OP_EMBEDDING: {
-        assert(num_inputs == 1);
+        assert(num_inputs == 1 || num_inputs == 2);
         AggrMode aggr;
+        EmbeddingUpdateType update_type;
         int num_entries, out_channels;
         size_t id, transformer_layer_id, deserialized_model_id;
         DataType data_type;
@@ -2690,6 +2747,7 @@ void FFModel::deserialize_graph_optimal_view(
         dez.deserialize(num_entries);
         dez.deserialize(out_channels);
         dez.deserialize(aggr);
+        dez.deserialize(update_type);
         dez.deserialize(data_type);
         size_t name_len;
         char name[MAX_OPNAME] = {0};
@@ -2698,12 +2756,14 @@ void FFModel::deserialize_graph_optimal_view(
 
         EmbeddingParams params;
         params.aggr = aggr;
+        params.update_type = update_type;
         params.num_entries = num_entries;
         params.out_channels = out_channels;
         params.layer_guid = layer_guid;
         params.data_type = data_type;
         strcpy(params.name, name);
-        node = get_or_create_node<Embedding>(inputs[0], params);
+        node = get_or_create_node<Embedding>(
+            {std::begin(inputs), std::begin(inputs) + num_inputs}, params);
         break;
       }
       case OP_EW_ADD:
@@ -3168,12 +3228,17 @@ void FFModel::deserialize_graph_optimal_view(
         assert(false && "Unsupported operator type");
       }
     }
+    bool recompute_outputs;
+    dez.deserialize(recompute_outputs);
     {
       size_t safecode;
       dez.deserialize(safecode);
       assert(safecode == 12345678);
     }
     assert(node.ptr != nullptr);
+    if (recompute_outputs) {
+      graph->recomputed_nodes.insert(node);
+    }
     guid_to_nodes[guid] = node;
     for (size_t i = 0; i < num_inputs; i++) {
       inedges[i].dstOp = node;
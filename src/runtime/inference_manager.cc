@@ -417,11 +417,21 @@ FutureMap InferenceManager::inference(FFModel *model,
   int batch_index = index % model->config.data_parallelism_degree;
   FutureMap fm;
   bool found_input_operator = false;
+  // With on-demand weight loading, the weights of each operator are loaded
+  // right before its first launch
+  FileDataLoader *lazy_loader = nullptr;
+  if (model_weights_loaders.find(model) != model_weights_loaders.end() &&
+      model_weights_loaders[model]->has_pending_weights()) {
+    lazy_loader = model_weights_loaders[model];
+  }
   for (size_t o = 0; o < model->operators.size(); o++) {
     Op *op = model->operators[o];
     if (op->op_type == OP_WEIGHT) {
       continue;
     }
+    if (lazy_loader != nullptr) {
+      lazy_loader->materialize_weights(model, op);
+    }
     if (op->op_type == OP_INPUT) {
       // FIXME: this is a hack, should be replace with an input ParallelTensor
       if (found_input_operator) {
@@ -462,6 +472,10 @@ FutureMap InferenceManager::inference(FFModel *model,
     }
     fm = op->inference(*model, bc, inputs, outputs);
   }
+  if (lazy_loader != nullptr && lazy_loader->has_pending_weights()) {
+    // load weights that are not consumed by any inference operator
+    lazy_loader->materialize_all_weights(model);
+  }
   return fm;
 };
 
@@ -54,7 +54,11 @@ void GlorotUniform::init(FFModel const *ff, const ParallelTensor p) {
                           TaskArgument(this, sizeof(GlorotUniform)));
     // regions[0]: p->region
     launcher.add_region_requirement(
-        RegionRequirement(p->region, WRITE_ONLY, EXCLUSIVE, p->region));
+        RegionRequirement(p->region,
+                          WRITE_ONLY,
+                          EXCLUSIVE,
+                          p->region,
+                          p->host_resident ? MAP_TO_ZC_MEMORY : 0));
     launcher.add_field(0, FID_DATA);
     runtime->execute_task(ctx, launcher);
   } else if (p->sync_type == ParameterSyncType::NCCL) {
@@ -70,8 +74,13 @@ void GlorotUniform::init(FFModel const *ff, const ParallelTensor p) {
                            false,
                            0,
                            p->machine_view.hash());
-    launcher.add_region_requirement(RegionRequirement(
-        p->part, 0 /*projection id*/, WRITE_ONLY, EXCLUSIVE, p->region));
+    launcher.add_region_requirement(
+        RegionRequirement(p->part,
+                          0 /*projection id*/,
+                          WRITE_ONLY,
+                          EXCLUSIVE,
+                          p->region,
+                          p->host_resident ? MAP_TO_ZC_MEMORY : 0));
     launcher.add_field(0, FID_DATA);
     runtime->execute_index_space(ctx, launcher);
   } else {
@@ -94,7 +103,11 @@ void ZeroInitializer::init(FFModel const *ff, const ParallelTensor p) {
                           TaskArgument(&meta, sizeof(ZeroInitMeta)));
     // regions[0]: p->region
     launcher.add_region_requirement(
-        RegionRequirement(p->region, WRITE_ONLY, EXCLUSIVE, p->region));
+        RegionRequirement(p->region,
+                          WRITE_ONLY,
+                          EXCLUSIVE,
+                          p->region,
+                          p->host_resident ? MAP_TO_ZC_MEMORY : 0));
     launcher.add_field(0, FID_DATA);
     runtime->execute_task(ctx, launcher);
   } else if (p->sync_type == ParameterSyncType::NCCL) {
@@ -112,8 +125,13 @@ void ZeroInitializer::init(FFModel const *ff, const ParallelTensor p) {
                            false,
                            0,
                            p->machine_view.hash());
-    launcher.add_region_requirement(RegionRequirement(
-        p->part, 0 /*projection id*/, WRITE_ONLY, EXCLUSIVE, p->region));
+    launcher.add_region_requirement(
+        RegionRequirement(p->part,
+                          0 /*projection id*/,
+                          WRITE_ONLY,
+                          EXCLUSIVE,
+                          p->region,
+                          p->host_resident ? MAP_TO_ZC_MEMORY : 0));
     launcher.add_field(0, FID_DATA);
     runtime->execute_index_space(ctx, launcher);
   } else {
@@ -185,7 +203,11 @@ void UniformInitializer::init(FFModel const *ff, const ParallelTensor p) {
                           TaskArgument(this, sizeof(UniformInitializer)));
     // regions[0]: p->region
     launcher.add_region_requirement(
-        RegionRequirement(p->region, WRITE_ONLY, EXCLUSIVE, p->region));
+        RegionRequirement(p->region,
+                          WRITE_ONLY,
+                          EXCLUSIVE,
+                          p->region,
+                          p->host_resident ? MAP_TO_ZC_MEMORY : 0));
     launcher.add_field(0, FID_DATA);
     runtime->execute_task(ctx, launcher);
   } else if (p->sync_type == ParameterSyncType::NCCL) {
@@ -200,8 +222,13 @@ void UniformInitializer::init(FFModel const *ff, const ParallelTensor p) {
                            false,
                            0,
                            p->machine_view.hash());
-    launcher.add_region_requirement(RegionRequirement(
-        p->part, 0 /*projection id*/, WRITE_ONLY, EXCLUSIVE, p->region));
+    launcher.add_region_requirement(
+        RegionRequirement(p->part,
+                          0 /*projection id*/,
+                          WRITE_ONLY,
+                          EXCLUSIVE,
+                          p->region,
+                          p->host_resident ? MAP_TO_ZC_MEMORY : 0));
     launcher.add_field(0, FID_DATA);
     runtime->execute_index_space(ctx, launcher);
   } else {
@@ -223,7 +250,11 @@ void NormInitializer::init(FFModel const *ff, const ParallelTensor p) {
                           TaskArgument(this, sizeof(NormInitializer)));
     // regions[0]: p->region
     launcher.add_region_requirement(
-        RegionRequirement(p->region, WRITE_ONLY, EXCLUSIVE, p->region));
+        RegionRequirement(p->region,
+                          WRITE_ONLY,
+                          EXCLUSIVE,
+                          p->region,
+                          p->host_resident ? MAP_TO_ZC_MEMORY : 0));
     launcher.add_field(0, FID_DATA);
     runtime->execute_task(ctx, launcher);
   } else if (p->sync_type == ParameterSyncType::NCCL) {
@@ -238,8 +269,13 @@ void NormInitializer::init(FFModel const *ff, const ParallelTensor p) {
                            false,
                            0,
                            p->machine_view.hash());
-    launcher.add_region_requirement(RegionRequirement(
-        p->part, 0 /*projection id*/, WRITE_ONLY, EXCLUSIVE, p->region));
+    launcher.add_region_requirement(
+        RegionRequirement(p->part,
+                          0 /*projection id*/,
+                          WRITE_ONLY,
+                          EXCLUSIVE,
+                          p->region,
+                          p->host_resident ? MAP_TO_ZC_MEMORY : 0));
     launcher.add_field(0, FID_DATA);
     runtime->execute_index_space(ctx, launcher);
   } else {
@@ -268,7 +304,11 @@ void ConstantInitializer::init(FFModel const *ff, const ParallelTensor p) {
                           TaskArgument(this, sizeof(ConstantInitializer)));
     // regions[0]: p->region
     launcher.add_region_requirement(
-        RegionRequirement(p->region, WRITE_ONLY, EXCLUSIVE, p->region));
+        RegionRequirement(p->region,
+                          WRITE_ONLY,
+                          EXCLUSIVE,
+                          p->region,
+                          p->host_resident ? MAP_TO_ZC_MEMORY : 0));
     launcher.add_field(0, FID_DATA);
     runtime->execute_task(ctx, launcher);
   } else if (p->sync_type == ParameterSyncType::NCCL) {
@@ -283,8 +323,13 @@ void ConstantInitializer::init(FFModel const *ff, const ParallelTensor p) {
                            false,
                            0,
                            p->machine_view.hash());
-    launcher.add_region_requirement(RegionRequirement(
-        p->part, 0 /*projection id*/, WRITE_ONLY, EXCLUSIVE, p->region));
+    launcher.add_region_requirement(
+        RegionRequirement(p->part,
+                          0 /*projection id*/,
+                          WRITE_ONLY,
+                          EXCLUSIVE,
+                          p->region,
+                          p->host_resident ? MAP_TO_ZC_MEMORY : 0));
     launcher.add_field(0, FID_DATA);
     runtime->execute_index_space(ctx, launcher);
   } else {
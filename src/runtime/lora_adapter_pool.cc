@@ -0,0 +1,125 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "flexflow/utils/lora_adapter_pool.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace FlexFlow {
+
+LoraAdapterPool::LoraAdapterPool(size_t _capacity, size_t _alignment)
+    : num_loads(0), num_evictions(0), num_compactions(0),
+      capacity(_capacity), alignment(_alignment), used_size(0) {
+  assert(alignment > 0);
+}
+
+LoraAdapterPool::BlockId LoraAdapterPool::add_block(size_t size) {
+  Block block;
+  // keep every block aligned
+  block.size = (size + alignment - 1) / alignment * alignment;
+  block.offset = NONE;
+  block.last_step = 0;
+  blocks.push_back(block);
+  return blocks.size() - 1;
+}
+
+size_t LoraAdapterPool::find_hole(size_t size) const {
+  size_t start = 0;
+  for (auto const &kv : resident) {
+    if (kv.first - start >= size) {
+      return start;
+    }
+    start = kv.first + blocks[kv.second].size;
+  }
+  return capacity - start >= size ? start : NONE;
+}
+
+void LoraAdapterPool::place(BlockId block, size_t offset, uint64_t step) {
+  Block &b = blocks[block];
+  b.offset = offset;
+  b.last_step = step;
+  resident[offset] = block;
+  lru.push_front(block);
+  b.lru_position = lru.begin();
+  used_size += b.size;
+}
+
+void LoraAdapterPool::evict(BlockId block) {
+  Block &b = blocks[block];
+  resident.erase(b.offset);
+  lru.erase(b.lru_position);
+  used_size -= b.size;
+  b.offset = NONE;
+  num_evictions++;
+}
+
+void LoraAdapterPool::compact(std::vector<Move> &moves) {
+  std::map<size_t, BlockId> compacted;
+  size_t next = 0;
+  for (auto const &kv : resident) {
+    Block &b = blocks[kv.second];
+    size_t src = kv.first;
+    // Copy in chunks no larger than the shift, so that a chunk never
+    // overlaps the part of the block that is still to be copied
+    size_t shift = src - next;
+    for (size_t done = 0; shift > 0 && done < b.size; done += shift) {
+      moves.push_back(
+          {src + done, next + done, std::min(shift, b.size - done)});
+    }
+    b.offset = next;
+    compacted[next] = kv.second;
+    next += b.size;
+  }
+  resident.swap(compacted);
+  num_compactions++;
+}
+
+size_t LoraAdapterPool::acquire(BlockId block,
+                                uint64_t step,
+                                bool &needs_load,
+                                std::vector<Move> &moves) {
+  assert(block >= 0 && block < (BlockId)blocks.size());
+  Block &b = blocks[block];
+  needs_load = false;
+  if (b.offset != NONE) {
+    assert(step >= b.last_step);
+    b.last_step = step;
+    lru.splice(lru.begin(), lru, b.lru_position);
+    return b.offset;
+  }
+  if (b.size > capacity) {
+    return NONE;
+  }
+  // Evict least recently used blocks until there is enough free space
+  while (capacity - used_size < b.size) {
+    if (lru.empty() || blocks[lru.back()].last_step >= step) {
+      return NONE;
+    }
+    evict(lru.back());
+  }
+  size_t offset = find_hole(b.size);
+  if (offset == NONE) {
+    compact(moves);
+    offset = find_hole(b.size);
+    assert(offset != NONE);
+  }
+  place(block, offset, step);
+  needs_load = true;
+  num_loads++;
+  return offset;
+}
+
+}; // namespace FlexFlow
@@ -0,0 +1,52 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "flexflow/utils/loss_scaler.h"
+
+#include <cassert>
+
+namespace FlexFlow {
+
+LossScaler::LossScaler(float init_scale,
+                       int _growth_interval,
+                       float _growth_factor,
+                       float _backoff_factor)
+    : scale(init_scale), growth_factor(_growth_factor),
+      backoff_factor(_backoff_factor), growth_interval(_growth_interval),
+      good_steps(0), found_overflow(false), num_steps(0),
+      num_skipped_steps(0) {
+  assert(scale > 0.0f);
+  assert(growth_interval > 0);
+  assert(growth_factor > 1.0f);
+  assert(backoff_factor > 0.0f && backoff_factor < 1.0f);
+}
+
+bool LossScaler::update(bool overflow) {
+  num_steps++;
+  found_overflow = overflow;
+  if (overflow) {
+    scale *= backoff_factor;
+    good_steps = 0;
+    num_skipped_steps++;
+    return false;
+  }
+  if (++good_steps == growth_interval) {
+    scale *= growth_factor;
+    good_steps = 0;
+  }
+  return true;
+}
+
+}; // namespace FlexFlow
@@ -17,6 +17,25 @@
 
 namespace FlexFlow {
 
+size_t optimizer_states_memory(size_t num_elements,
+                               int num_replicas,
+                               int num_states,
+                               bool sharded) {
+  assert(num_replicas > 0);
+  size_t bytes = num_elements * num_states * sizeof(float);
+  if (sharded) {
+    bytes = (bytes + num_replicas - 1) / num_replicas;
+  }
+  return bytes;
+}
+
+bool should_recompute_outputs(MemoryOptimConfig const &config,
+                              float forward_time,
+                              float output_mem_mb) {
+  float factor = config.run_time_cost_factor;
+  return factor * forward_time < (1 - factor) * output_mem_mb;
+}
+
 namespace PCG {
 
 std::string MemoryUsage::to_string() const {
@@ -214,6 +214,14 @@ bool Op::is_parallel_op() const {
   return false;
 }
 
+bool Op::updates_weights_in_backward() const {
+  return false;
+}
+
+bool Op::can_recompute_outputs() const {
+  return false;
+}
+
 bool Op::can_inplace_output() {
   return false;
 }
@@ -274,12 +282,14 @@ void Op::zero_grad(FFModel const &ff) {
   Runtime *runtime = ff.config.lg_hlr;
   Context ctx = ff.config.lg_ctx;
   ArgumentMap argmap;
+  // weights updated in the backward pass have no gradients
+  int const num_weight_grads = updates_weights_in_backward() ? 0 : numWeights;
   ZeroInitMeta meta;
   meta.op_ptr = this;
-  meta.num_regions = numWeights + numOutputs;
+  meta.num_regions = num_weight_grads + numOutputs;
   assert(meta.num_regions <= ZeroInitMeta::MAX_NUM_REGIONS);
   IndexSpace parallel_is = IndexSpace::NO_SPACE;
-  for (int i = 0; i < numWeights; i++) {
+  for (int i = 0; i < num_weight_grads; i++) {
     meta.data_types[i] = weights[i]->data_type;
     if (parallel_is == IndexSpace::NO_SPACE) {
       parallel_is = weights[i]->parallel_is;
@@ -288,7 +298,7 @@ void Op::zero_grad(FFModel const &ff) {
     }
   }
   for (int i = 0; i < numOutputs; i++) {
-    meta.data_types[i + numWeights] = outputs[i]->data_type;
+    meta.data_types[i + num_weight_grads] = outputs[i]->data_type;
     if (parallel_is == IndexSpace::NO_SPACE) {
       parallel_is = outputs[i]->parallel_is;
     } else {
@@ -303,7 +313,7 @@ void Op::zero_grad(FFModel const &ff) {
                          false /*must*/,
                          0 /*mapper_id*/,
                          outputs[0]->machine_view.hash());
-  for (int i = 0; i < numWeights; i++) {
+  for (int i = 0; i < num_weight_grads; i++) {
     launcher.add_region_requirement(RegionRequirement(weights[i]->part_grad,
                                                       0 /*projection id*/,
                                                       WRITE_ONLY,
@@ -321,7 +331,7 @@ void Op::zero_grad(FFModel const &ff) {
     // printf("zero_grad:output[%d]: region(%d,%d,%d)\n", i,
     // lr.get_index_space().get_id(), lr.get_field_space().get_id(),
     // lr.get_tree_id());
-    launcher.add_field(i + numWeights, FID_DATA);
+    launcher.add_field(i + num_weight_grads, FID_DATA);
   }
   runtime->execute_index_space(ctx, launcher);
 }
@@ -1543,6 +1553,8 @@ FFRuntime::FFRuntime(FFConfig &config) {
         config.enable_peft ? config.peft_activation_reserve_space_size : 0;
     info.peft_weight_reserve_space_size =
         config.enable_peft ? config.peft_weight_reserve_space_size : 0;
+    info.peft_adapter_pool_size =
+        config.enable_peft ? config.peft_adapter_pool_size : 0;
     info.quantization_type = config.quantization_type;
     info.allowTensorOpMathConversion = config.allow_tensor_op_math_conversion;
     argmap.set_point(*it, TaskArgument(&info, sizeof(FFInitInfo)));
@@ -2889,6 +2901,37 @@ void FFModel::forward(int seq_length) {
   for (size_t i = 0; i < operators.size(); i++) {
     operators[i]->forward(*this);
   }
+  if (config.computationMode == COMP_MODE_TRAINING) {
+    // The loss and metrics read the outputs of the final operator
+    Op *final_operator = get_final_operator();
+    for (Op *op : operators) {
+      if (op->recompute_outputs && op != final_operator) {
+        discard_outputs(op);
+        discarded_operators.insert(op);
+      }
+    }
+  }
+}
+
+void FFModel::discard_outputs(Op const *op) {
+  Context ctx = config.lg_ctx;
+  Runtime *runtime = config.lg_hlr;
+  for (int i = 0; i < op->numOutputs; i++) {
+    DiscardLauncher launcher(op->outputs[i]->region, op->outputs[i]->region);
+    launcher.add_field(FID_DATA);
+    runtime->discard_fields(ctx, launcher);
+  }
+}
+
+void FFModel::recompute_outputs(Op *op) {
+  discarded_operators.erase(op);
+  for (int i = 0; i < op->numInputs; i++) {
+    Op *producer = (Op *)op->inputs[i]->owner_op;
+    if (discarded_operators.find(producer) != discarded_operators.end()) {
+      recompute_outputs(producer);
+    }
+  }
+  op->forward(*this);
 }
 
 void FFModel::recompile_on_condition(RecompileState &r) {
@@ -2917,6 +2960,8 @@ void FFModel::backward(int seq_length) {
   assert(final_operator->numOutputs == 1);
   loss_op->backward(this, final_operator->outputs[0], parallel_label_tensor);
   // Perform backpropagation
+  gradient_buckets.reset();
+  std::vector<int> ready_buckets;
   // std::set<LogicalRegion> resetedInputGrads;
   for (int l = operators.size() - 1; l >= 0; l--) {
 #ifdef ENABLE_RESNET_INPUT_GRADIENT_OPTIMIZATION
@@ -2934,14 +2979,159 @@ void FFModel::backward(int seq_length) {
     // TODO: If operator serves for metrics and for further prop
     // if(l == metrics_input && metrics_input < (int)operators.size()-1)
     //  continue;
+    // Recompute the discarded outputs the backward pass reads: those of the
+    // operator itself and those of the operators producing its inputs
+    if (discarded_operators.find(operators[l]) != discarded_operators.end()) {
+      recompute_outputs(operators[l]);
+    }
+    for (int i = 0; i < operators[l]->numInputs; i++) {
+      Op *producer = (Op *)operators[l]->inputs[i]->owner_op;
+      if (discarded_operators.find(producer) != discarded_operators.end()) {
+        recompute_outputs(producer);
+      }
+    }
     operators[l]->backward(*this);
+    // No operator left reads the outputs again
+    if (operators[l]->recompute_outputs && operators[l] != final_operator) {
+      discard_outputs(operators[l]);
+    }
+    // All-reduce the buckets whose gradients are now all computed, while
+    // the remaining operators run backward
+    for (int i = 0; i < operators[l]->numWeights; i++) {
+      auto it = bucketed_parameter_ids.find(operators[l]->weights[i]);
+      if (it != bucketed_parameter_ids.end()) {
+        gradient_buckets.mark_ready(it->second, ready_buckets);
+      }
+    }
+    for (int bucket : ready_buckets) {
+      all_reduce_gradient_bucket(bucket);
+    }
+    ready_buckets.clear();
+  }
+  gradient_buckets.release_remaining(ready_buckets);
+  for (int bucket : ready_buckets) {
+    all_reduce_gradient_bucket(bucket);
+  }
+}
+
+#ifdef FF_USE_NCCL
+void FFModel::create_gradient_buckets() {
+  gradient_buckets = GradientBuckets(config.gradient_bucket_size);
+  bucketed_parameters.clear();
+  bucketed_parameter_ids.clear();
+  std::set<ParallelTensor> trained(parameters.begin(), parameters.end());
+  // one parameter of each set of devices that share all-reduces
+  std::vector<ParallelTensor> groups;
+  // in the order the backward pass computes the gradients
+  for (int l = operators.size() - 1; l >= 0; l--) {
+    for (int i = 0; i < operators[l]->numWeights; i++) {
+      ParallelTensor p = operators[l]->weights[i];
+      if (p->sync_type != ParameterSyncType::NCCL ||
+          trained.find(p) == trained.end() ||
+          p->owner_op->updates_weights_in_backward() ||
+          bucketed_parameter_ids.find(p) != bucketed_parameter_ids.end()) {
+        continue;
+      }
+      size_t group = 0;
+      while (group < groups.size() &&
+             (groups[group]->machine_view != p->machine_view ||
+              groups[group]->parallel_is != p->parallel_is)) {
+        group++;
+      }
+      if (group == groups.size()) {
+        groups.push_back(p);
+      }
+      bucketed_parameter_ids[p] = gradient_buckets.add_parameter(
+          group, p->get_shape().get_piece_size());
+      bucketed_parameters.push_back(p);
+    }
   }
+  optimizer->gradients_all_reduced = !bucketed_parameters.empty();
+  log_model.print("%zu gradients in %zu all-reduce buckets",
+                  gradient_buckets.num_parameters(),
+                  gradient_buckets.num_buckets());
+}
+#endif
+
+void FFModel::all_reduce_gradient_bucket(int bucket) {
+  Context ctx = config.lg_ctx;
+  Runtime *runtime = config.lg_hlr;
+  std::vector<int> const &ids = gradient_buckets.get_parameters(bucket);
+  ParallelTensor first = bucketed_parameters[ids[0]];
+  assert(first->parallel_is != IndexSpace::NO_SPACE);
+  // Parameters with the same machine view share NCCL communicators
+  ArgumentMap argmap;
+  Domain domain = runtime->get_index_space_domain(ctx, first->parallel_is);
+  switch (domain.get_dim()) {
+#define DIMFUNC(DIM)                                                           \
+  case DIM: {                                                                  \
+    Rect<DIM> rect = domain;                                                   \
+    int idx = 0;                                                               \
+    for (PointInRectIterator<DIM> it(rect); it(); it++) {                      \
+      OpMeta *mp = first->owner_op->meta[idx++];                               \
+      argmap.set_point(*it, TaskArgument(&mp, sizeof(OpMeta *)));              \
+    }                                                                          \
+    break;                                                                     \
+  }
+    LEGION_FOREACH_N(DIMFUNC)
+#undef DIMFUNC
+    default:
+      assert(false);
+  }
+  int num_gradients = ids.size();
+  IndexLauncher launcher(GRADIENT_ALLREDUCE_TASK_ID,
+                         first->parallel_is,
+                         TaskArgument(&num_gradients, sizeof(int)),
+                         argmap,
+                         Predicate::TRUE_PRED,
+                         false /*must_epoch*/,
+                         0 /*mapper_id*/,
+                         first->machine_view.hash());
+  for (int i = 0; i < num_gradients; i++) {
+    ParallelTensor p = bucketed_parameters[ids[i]];
+    launcher.add_region_requirement(RegionRequirement(p->part_grad,
+                                                      0 /*projection id*/,
+                                                      READ_WRITE,
+                                                      EXCLUSIVE,
+                                                      p->region_grad));
+    launcher.add_field(i, FID_DATA);
+  }
+  // Wait for the previously launched bucket, whatever its devices, so that
+  // the all-reduces on different communicators are never reordered. Its
+  // futures only order the launches and move no data.
+  if (last_bucket_all_reduce.exists()) {
+    for (Domain::DomainPointIterator it(last_bucket_domain); it; it++) {
+      launcher.add_future(last_bucket_all_reduce[*it]);
+    }
+  }
+  launcher.concurrent = true;
+  last_bucket_all_reduce = runtime->execute_index_space(ctx, launcher);
+  last_bucket_domain = domain;
 }
 
 void FFModel::update() {
   optimizer->next();
+  if (config.mixed_precision) {
+    // the update tasks skip the step if any gradient overflowed
+    loss_scaler = optimizer->unscale_gradients(loss_scaler);
+  }
+  std::vector<ParallelTensor> fused_parameters;
   for (size_t i = 0; i < parameters.size(); i++) {
-    optimizer->update(parameters[i]);
+    if (parameters[i]->owner_op->updates_weights_in_backward()) {
+      continue;
+    }
+    ParallelTensor p = optimizer->get_master_weight(parameters[i]);
+    if (config.fused_optimizer_update) {
+      fused_parameters.push_back(p);
+    } else {
+      optimizer->update(p);
+    }
+  }
+  if (!fused_parameters.empty()) {
+    optimizer->fused_update(fused_parameters);
+  }
+  if (config.mixed_precision) {
+    optimizer->copy_master_weights();
   }
 }
 
@@ -2978,6 +3168,15 @@ bool FFModel::apply_fusion(
         operators[l]->op_type == OP_WEIGHT) {
       continue;
     }
+    // the outputs of recomputed operators are discarded on their own
+    if (operators[l]->recompute_outputs) {
+      continue;
+    }
+    // the fused kernels do not read the lengths of ragged embedding bags
+    if (operators[l]->op_type == OP_EMBEDDING &&
+        operators[l]->numInputs > 1) {
+      continue;
+    }
     // don't fuse parallel op except allReduce since they have different
     // parallel_is in forward/backward
     if (operators[l]->is_parallel_op() &&
@@ -3019,6 +3218,14 @@ bool FFModel::apply_fusion(
           if (operators[i]->has_inplace_output()) {
             continue;
           }
+          // the outputs of recomputed operators are discarded on their own
+          if (operators[i]->recompute_outputs) {
+            continue;
+          }
+          if (operators[i]->op_type == OP_EMBEDDING &&
+              operators[i]->numInputs > 1) {
+            continue;
+          }
           // don't fuse input and weight operator since they don't involve any
           // forward/backward kernels
           if (operators[i]->op_type == OP_INPUT ||
@@ -3723,6 +3930,12 @@ void FFModel::compile(LossType loss_type,
       if (operators[l]->can_inplace_output()) {
         // Assume outputs[0] is inplace with inputs[0]
         assert(operators[l]->numOutputs == 1);
+        // Discarding the outputs of either operator would discard both
+        if (operators[l]->recompute_outputs ||
+            (operators[l]->inputs[0]->owner_op != NULL &&
+             operators[l]->inputs[0]->owner_op->recompute_outputs)) {
+          continue;
+        }
         if (operators[l]->inputs[0]->owner_op != NULL) {
           // int dim1 = operators[l]->outputs[0]->num_dims;
           // int dim2 = operators[l]->inputs[0]->num_dims;
@@ -3767,6 +3980,17 @@ void FFModel::compile(LossType loss_type,
     }
 
     op->map_output_tensors(*this);
+    if (config.computationMode == COMP_MODE_TRAINING &&
+        op->recompute_outputs && op != get_final_operator()) {
+      // forward() discards these outputs, let the mapper free their instances
+      bool discardable = true;
+      for (int i = 0; i < op->numOutputs; i++) {
+        runtime->attach_semantic_information(op->outputs[i]->region,
+                                             DISCARDABLE_SEMANTIC_TAG,
+                                             &discardable,
+                                             sizeof(bool));
+      }
+    }
     // for (int i = 0; i < op->numOutputs; i++) {
     //   // Output tensor
     //   map_tensor(op->outputs[i], op);
@@ -3919,6 +4143,11 @@ void FFModel::compile(LossType loss_type,
   if (config.computationMode == COMP_MODE_TRAINING) {
     // init optimizer
     assert(optimizer != NULL);
+    if (config.mixed_precision) {
+      optimizer->init_master_weights();
+      loss_scaler = Future::from_value<LossScaler>(
+          LossScaler(config.loss_scale, config.loss_scale_window));
+    }
     optimizer->init();
   }
 
@@ -3958,6 +4187,15 @@ void FFModel::compile(LossType loss_type,
       }
     }
   }
+  if (config.computationMode == COMP_MODE_TRAINING &&
+      config.gradient_bucket_size > 0) {
+    if (config.mixed_precision) {
+      // the bucket all-reduces only handle FP32 gradients
+      log_model.warning("mixed precision training ignores gradient buckets");
+    } else {
+      create_gradient_buckets();
+    }
+  }
 #endif
 }
 
@@ -4217,6 +4455,14 @@ void FFModel::zero_gradients(void) {
   }
 }
 
+void FFModel::flush_embedding_caches(void) {
+  for (size_t l = 0; l < operators.size(); l++) {
+    if (operators[l]->op_type == OP_EMBEDDING) {
+      ((Embedding *)operators[l])->flush_cache(*this);
+    }
+  }
+}
+
 void FFModel::print_layers(int id) {
   if (id == -1) {
     for (size_t i = 0; i < layers.size(); i++) {
@@ -4348,6 +4594,19 @@ struct DefaultConfig {
       (size_t)1 * 1024 * 1024 * 1024; // 1GB
   const static size_t peftWeightReserveSpaceSize =
       (size_t)1 * 1024 * 1024 * 1024; // 1GB
+  const static size_t peftAdapterPoolSize = 0;
+  const static bool peftTruncatedBackprop = false;
+  // On-demand weight loading fields
+  const static bool lazyWeightLoading = false;
+  const static int weightPrefetchDepth = 2;
+  // Speculative inference fields
+  const static bool adaptiveSpeculation = false;
+  // -1: use the maximum number of tokens per batch
+  const static int speculationTokenBudget = -1;
+  const static bool ngramSpeculation = false;
+  // Co-serving fields
+  constexpr static double coservingLatencySLO = 0;
+  const static int numTokenizerWorkers = 4;
   const static bool cpuOffload = false;
   const static bool onlyDataParallel = true;
   const static bool enableSampleParallel = true;
@@ -4362,6 +4621,16 @@ struct DefaultConfig {
   const static bool enable_control_replication = true;
   // The default python data loader type is 2 to enable control replication
   const static int python_data_loader_type = 2;
+  const static int dataShuffleSeed = -1;
+  const static int embeddingCPUThreads = 1;
+  const static int embeddingCacheRows = 0;
+  const static int embeddingCacheAdmitThreshold = 2;
+  const static bool fusedOptimizerUpdate = false;
+  const static size_t gradientBucketSize = 0;
+  const static bool mixedPrecision = false;
+  constexpr static float lossScale = 65536.0f;
+  const static int lossScaleWindow = 2000;
+  const static bool shardOptimizerStates = false;
 };
 
 FFConfig::FFConfig() {
@@ -4389,6 +4658,15 @@ FFConfig::FFConfig() {
   peft_activation_reserve_space_size =
       DefaultConfig::peftActivationReserveSpaceSize;
   peft_weight_reserve_space_size = DefaultConfig::peftWeightReserveSpaceSize;
+  peft_adapter_pool_size = DefaultConfig::peftAdapterPoolSize;
+  peft_truncated_backprop = DefaultConfig::peftTruncatedBackprop;
+  lazy_weight_loading = DefaultConfig::lazyWeightLoading;
+  weight_prefetch_depth = DefaultConfig::weightPrefetchDepth;
+  adaptive_speculation = DefaultConfig::adaptiveSpeculation;
+  speculation_token_budget = DefaultConfig::speculationTokenBudget;
+  ngram_speculation = DefaultConfig::ngramSpeculation;
+  coserving_latency_slo = DefaultConfig::coservingLatencySLO;
+  num_tokenizer_workers = DefaultConfig::numTokenizerWorkers;
   quantization_type = DT_NONE;
   only_data_parallel = DefaultConfig::onlyDataParallel;
   data_parallelism_degree = 1;
@@ -4404,6 +4682,16 @@ FFConfig::FFConfig() {
   simulator_max_num_segments = DefaultConfig::simulator_max_num_segments;
   enable_control_replication = DefaultConfig::enable_control_replication;
   python_data_loader_type = DefaultConfig::python_data_loader_type;
+  data_shuffle_seed = DefaultConfig::dataShuffleSeed;
+  embedding_cpu_threads = DefaultConfig::embeddingCPUThreads;
+  embedding_cache_rows = DefaultConfig::embeddingCacheRows;
+  embedding_cache_admit_threshold = DefaultConfig::embeddingCacheAdmitThreshold;
+  fused_optimizer_update = DefaultConfig::fusedOptimizerUpdate;
+  gradient_bucket_size = DefaultConfig::gradientBucketSize;
+  mixed_precision = DefaultConfig::mixedPrecision;
+  loss_scale = DefaultConfig::lossScale;
+  loss_scale_window = DefaultConfig::lossScaleWindow;
+  shard_optimizer_states = DefaultConfig::shardOptimizerStates;
   machine_model_file = "";
   import_strategy_file = "";
   export_strategy_file = "";
@@ -4527,6 +4815,54 @@ void FFConfig::parse_args(char **argv, int argc) {
       peft_weight_reserve_space_size = atoll(argv[++i]) * 1024 * 1024;
       continue;
     }
+    if (!strcmp(argv[i], "-peft-adapter-pool-size")) {
+      peft_adapter_pool_size = atoll(argv[++i]) * 1024 * 1024;
+      continue;
+    }
+    if ((!strcmp(argv[i], "--peft-truncated-backprop"))) {
+      peft_truncated_backprop = true;
+      continue;
+    }
+    if ((!strcmp(argv[i], "--lazy-weight-loading"))) {
+      lazy_weight_loading = true;
+      continue;
+    }
+    if (!strcmp(argv[i], "-weight-prefetch-depth")) {
+      weight_prefetch_depth = std::stoi(argv[++i]);
+      continue;
+    }
+    if (!strcmp(argv[i], "-tokenizer-workers")) {
+      num_tokenizer_workers = std::stoi(argv[++i]);
+      continue;
+    }
+    if ((!strcmp(argv[i], "--adaptive-speculation"))) {
+      adaptive_speculation = true;
+      continue;
+    }
+    if (!strcmp(argv[i], "-speculation-token-budget")) {
+      speculation_token_budget = std::stoi(argv[++i]);
+      continue;
+    }
+    if (!strcmp(argv[i], "-speculation-stats-file")) {
+      speculation_stats_file = std::string(argv[++i]);
+      continue;
+    }
+    if ((!strcmp(argv[i], "--ngram-speculation"))) {
+      ngram_speculation = true;
+      continue;
+    }
+    if (!strcmp(argv[i], "-ngram-corpus")) {
+      ngram_corpus_file = std::string(argv[++i]);
+      continue;
+    }
+    if (!strcmp(argv[i], "-coserving-latency-slo")) {
+      coserving_latency_slo = std::stod(argv[++i]);
+      continue;
+    }
+    if (!strcmp(argv[i], "-coserving-log-file")) {
+      coserving_log_file = std::string(argv[++i]);
+      continue;
+    }
     if ((!strcmp(argv[i], "--only-data-parallel"))) {
       only_data_parallel = true;
       continue;
@@ -4652,6 +4988,46 @@ void FFConfig::parse_args(char **argv, int argc) {
       python_data_loader_type = atoi(argv[++i]);
       continue;
     }
+    if (!strcmp(argv[i], "--data-shuffle-seed")) {
+      data_shuffle_seed = atoi(argv[++i]);
+      continue;
+    }
+    if (!strcmp(argv[i], "--embedding-cpu-threads")) {
+      embedding_cpu_threads = atoi(argv[++i]);
+      continue;
+    }
+    if (!strcmp(argv[i], "--embedding-cache-rows")) {
+      embedding_cache_rows = atoi(argv[++i]);
+      continue;
+    }
+    if (!strcmp(argv[i], "--embedding-cache-admit")) {
+      embedding_cache_admit_threshold = atoi(argv[++i]);
+      continue;
+    }
+    if (!strcmp(argv[i], "--fused-optimizer-update")) {
+      fused_optimizer_update = true;
+      continue;
+    }
+    if (!strcmp(argv[i], "--gradient-bucket-size")) {
+      gradient_bucket_size = atoll(argv[++i]) * 1024 * 1024;
+      continue;
+    }
+    if (!strcmp(argv[i], "--mixed-precision")) {
+      mixed_precision = true;
+      continue;
+    }
+    if (!strcmp(argv[i], "--loss-scale")) {
+      loss_scale = atof(argv[++i]);
+      continue;
+    }
+    if (!strcmp(argv[i], "--loss-scale-window")) {
+      loss_scale_window = atoi(argv[++i]);
+      continue;
+    }
+    if (!strcmp(argv[i], "--shard-optimizer-states")) {
+      shard_optimizer_states = true;
+      continue;
+    }
     if (!strcmp(argv[i], "--substitution-json")) {
       substitution_json_path = std::string(argv[++i]);
       continue;
@@ -4738,6 +5114,25 @@ void register_flexflow_internal_tasks(Runtime *runtime,
           registrar);
     }
   }
+  // RequestManager plan_next_batch
+  {
+    TaskVariantRegistrar registrar(RM_PLAN_NEXT_BATCH_TASK_ID,
+                                   "RequestManager Plan Next Batch");
+    registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
+    registrar.set_leaf();
+    if (pre_register) {
+      Runtime::preregister_task_variant<BatchConfig,
+                                        RequestManager::plan_next_batch_task>(
+          registrar, "RequestManager Plan Next Batch Task");
+    } else {
+      if (enable_control_replication) {
+        registrar.global_registration = false;
+      }
+      runtime->register_task_variant<BatchConfig,
+                                     RequestManager::plan_next_batch_task>(
+          registrar);
+    }
+  }
   // RequestManager prepare_next_batch
   {
     TaskVariantRegistrar registrar(RM_PREPARE_NEXT_BATCH_TASK_ID,
@@ -5215,21 +5610,50 @@ void register_flexflow_internal_tasks(Runtime *runtime,
       runtime->register_task_variant<Embedding::backward_task>(registrar);
     }
   }
+  {
+    TaskVariantRegistrar registrar(EMBED_CACHE_FLUSH_TASK_ID,
+                                   "Embedding Cache Flush");
+    registrar.add_constraint(ProcessorConstraint(Processor::TOC_PROC));
+    registrar.set_leaf();
+    if (pre_register) {
+      Runtime::preregister_task_variant<Embedding::flush_cache_task>(
+          registrar, "Embedding Cache Flush Task");
+    } else {
+      if (enable_control_replication) {
+        registrar.global_registration = false;
+      }
+      runtime->register_task_variant<Embedding::flush_cache_task>(registrar);
+    }
+  }
   // Embedding task CPU
-  /* {
+  {
     TaskVariantRegistrar registrar(EMBED_FWD_TASK_ID, "Embedding Forward");
     registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
     registrar.set_leaf();
-    Runtime::preregister_task_variant<Embedding::forward_task_cpu>(
-        registrar, "Embedding Forward Task");
+    if (pre_register) {
+      Runtime::preregister_task_variant<Embedding::forward_task_cpu>(
+          registrar, "Embedding Forward CPU Task");
+    } else {
+      if (enable_control_replication) {
+        registrar.global_registration = false;
+      }
+      runtime->register_task_variant<Embedding::forward_task_cpu>(registrar);
+    }
   }
   {
     TaskVariantRegistrar registrar(EMBED_BWD_TASK_ID, "Embedding Backward");
     registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
     registrar.set_leaf();
-    Runtime::preregister_task_variant<Embedding::backward_task_cpu>(
-        registrar, "Embedding Backward Task");
-  }*/
+    if (pre_register) {
+      Runtime::preregister_task_variant<Embedding::backward_task_cpu>(
+          registrar, "Embedding Backward CPU Task");
+    } else {
+      if (enable_control_replication) {
+        registrar.global_registration = false;
+      }
+      runtime->register_task_variant<Embedding::backward_task_cpu>(registrar);
+    }
+  }
   // Gather task
   {
     TaskVariantRegistrar registrar(GATHER_INIT_TASK_ID, "Gather Init");
@@ -7456,6 +7880,71 @@ void register_flexflow_internal_tasks(Runtime *runtime,
           registrar, 111 /*variant ID*/);
     }
   }
+  {
+    TaskVariantRegistrar registrar(SGD_UPD_FUSED_PS_TASK_ID,
+                                   "SGD Fused Parameter Server Update");
+    registrar.add_constraint(ProcessorConstraint(Processor::TOC_PROC));
+    registrar.set_leaf();
+    if (pre_register) {
+      Runtime::preregister_task_variant<SGDOptimizer::fused_ps_update_task>(
+          registrar, "SGD Fused Parameter Server Update Task");
+    } else {
+      if (enable_control_replication) {
+        registrar.global_registration = false;
+      }
+      runtime->register_task_variant<SGDOptimizer::fused_ps_update_task>(
+          registrar);
+    }
+  }
+  {
+    TaskVariantRegistrar registrar(SGD_UPD_FUSED_PS_TASK_ID,
+                                   "SGD Fused Parameter Server Update");
+    registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
+    registrar.set_leaf();
+    if (pre_register) {
+      Runtime::preregister_task_variant<SGDOptimizer::fused_ps_update_task_cpu>(
+          registrar, "SGD Fused Parameter Server Update CPU Task");
+    } else {
+      if (enable_control_replication) {
+        registrar.global_registration = false;
+      }
+      runtime->register_task_variant<SGDOptimizer::fused_ps_update_task_cpu>(
+          registrar);
+    }
+  }
+  {
+    TaskVariantRegistrar registrar(ADAM_UPD_FUSED_PS_TASK_ID,
+                                   "Adam Fused Parameter Server Update");
+    registrar.add_constraint(ProcessorConstraint(Processor::TOC_PROC));
+    registrar.set_leaf();
+    if (pre_register) {
+      Runtime::preregister_task_variant<AdamOptimizer::fused_ps_update_task>(
+          registrar, "Adam Fused Parameter Server Update Task");
+    } else {
+      if (enable_control_replication) {
+        registrar.global_registration = false;
+      }
+      runtime->register_task_variant<AdamOptimizer::fused_ps_update_task>(
+          registrar);
+    }
+  }
+  {
+    TaskVariantRegistrar registrar(ADAM_UPD_FUSED_PS_TASK_ID,
+                                   "Adam Fused Parameter Server Update");
+    registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
+    registrar.set_leaf();
+    if (pre_register) {
+      Runtime::preregister_task_variant<
+          AdamOptimizer::fused_ps_update_task_cpu>(
+          registrar, "Adam Fused Parameter Server Update CPU Task");
+    } else {
+      if (enable_control_replication) {
+        registrar.global_registration = false;
+      }
+      runtime->register_task_variant<AdamOptimizer::fused_ps_update_task_cpu>(
+          registrar);
+    }
+  }
 #ifdef FF_USE_NCCL
   {
     TaskVariantRegistrar registrar(SGD_UPD_NCCL_TASK_ID, "SGD NCCL Update");
@@ -7488,7 +7977,110 @@ void register_flexflow_internal_tasks(Runtime *runtime,
           registrar, 111 /*variant ID*/);
     }
   }
+  {
+    TaskVariantRegistrar registrar(SGD_UPD_FUSED_NCCL_TASK_ID,
+                                   "SGD Fused NCCL Update");
+    registrar.add_constraint(ProcessorConstraint(Processor::TOC_PROC));
+    registrar.set_leaf();
+    registrar.set_concurrent();
+    if (pre_register) {
+      Runtime::preregister_task_variant<SGDOptimizer::fused_nccl_update_task>(
+          registrar, "SGD Fused NCCL Update Task");
+    } else {
+      if (enable_control_replication) {
+        registrar.global_registration = false;
+      }
+      runtime->register_task_variant<SGDOptimizer::fused_nccl_update_task>(
+          registrar);
+    }
+  }
+  {
+    TaskVariantRegistrar registrar(ADAM_UPD_FUSED_NCCL_TASK_ID,
+                                   "Adam Fused NCCL Update");
+    registrar.add_constraint(ProcessorConstraint(Processor::TOC_PROC));
+    registrar.set_leaf();
+    registrar.set_concurrent();
+    if (pre_register) {
+      Runtime::preregister_task_variant<AdamOptimizer::fused_nccl_update_task>(
+          registrar, "Adam Fused NCCL Update Task");
+    } else {
+      if (enable_control_replication) {
+        registrar.global_registration = false;
+      }
+      runtime->register_task_variant<AdamOptimizer::fused_nccl_update_task>(
+          registrar);
+    }
+  }
+  {
+    TaskVariantRegistrar registrar(GRADIENT_ALLREDUCE_TASK_ID,
+                                   "Gradient All-Reduce");
+    registrar.add_constraint(ProcessorConstraint(Processor::TOC_PROC));
+    registrar.set_leaf();
+    registrar.set_concurrent();
+    if (pre_register) {
+      Runtime::preregister_task_variant<Optimizer::nccl_all_reduce_task>(
+          registrar, "Gradient All-Reduce Task");
+    } else {
+      if (enable_control_replication) {
+        registrar.global_registration = false;
+      }
+      runtime->register_task_variant<Optimizer::nccl_all_reduce_task>(
+          registrar);
+    }
+  }
 #endif
+  // Mixed precision
+  {
+    TaskVariantRegistrar registrar(AMP_UNSCALE_GRAD_TASK_ID,
+                                   "Unscale Gradients");
+    registrar.add_constraint(ProcessorConstraint(Processor::TOC_PROC));
+    registrar.set_leaf();
+    if (pre_register) {
+      Runtime::preregister_task_variant<bool,
+                                        Optimizer::unscale_gradients_task>(
+          registrar, "Unscale Gradients Task");
+    } else {
+      if (enable_control_replication) {
+        registrar.global_registration = false;
+      }
+      runtime->register_task_variant<bool, Optimizer::unscale_gradients_task>(
+          registrar);
+    }
+  }
+  {
+    TaskVariantRegistrar registrar(AMP_UPDATE_LOSS_SCALE_TASK_ID,
+                                   "Update Loss Scale");
+    registrar.add_constraint(ProcessorConstraint(Processor::LOC_PROC));
+    registrar.set_leaf();
+    if (pre_register) {
+      Runtime::preregister_task_variant<LossScaler,
+                                        Optimizer::update_loss_scale_task>(
+          registrar, "Update Loss Scale Task");
+    } else {
+      if (enable_control_replication) {
+        registrar.global_registration = false;
+      }
+      runtime->register_task_variant<LossScaler,
+                                     Optimizer::update_loss_scale_task>(
+          registrar);
+    }
+  }
+  {
+    TaskVariantRegistrar registrar(AMP_CONVERT_WEIGHT_TASK_ID,
+                                   "Convert Master Weight");
+    registrar.add_constraint(ProcessorConstraint(Processor::TOC_PROC));
+    registrar.set_leaf();
+    if (pre_register) {
+      Runtime::preregister_task_variant<Optimizer::convert_weight_task>(
+          registrar, "Convert Master Weight Task");
+    } else {
+      if (enable_control_replication) {
+        registrar.global_registration = false;
+      }
+      runtime->register_task_variant<Optimizer::convert_weight_task>(
+          registrar);
+    }
+  }
   // Initializer
   {
     TaskVariantRegistrar registrar(ZERO_INIT_TASK_ID, "Zero Init");
@@ -204,7 +204,9 @@ FFHandler
         .wait();
     void *ptr = workspaceInst.pointer_untyped(0, sizeof(char));
     handle.peft_weight_allocator =
-        new PEFTWeightAllocator(ptr, info->peft_weight_reserve_space_size);
+        new PEFTWeightAllocator(ptr,
+                                info->peft_weight_reserve_space_size,
+                                info->peft_adapter_pool_size);
   } else {
     handle.peft_weight_allocator = nullptr;
   }
@@ -0,0 +1,176 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "flexflow/utils/multi_tensor_update.h"
+#include <cassert>
+#include <cmath>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FF_MULTI_TENSOR_X86
+#endif
+
+namespace FlexFlow {
+namespace MultiTensorUpdate {
+
+namespace {
+
+// Sum of the replicas of gradient i, plus weight decay
+inline float
+    gradient(MultiTensorEntry const &t, float weight_decay, size_t i) {
+  float gt = t.w_grad[i];
+  for (int r = 1; r < t.num_replicas; r++) {
+    gt += t.w_grad[r * t.size + i];
+  }
+  return gt + weight_decay * t.w[i];
+}
+
+// Updates elements [begin, t.size) of t
+void sgd_scalar(SGDParams const &p, MultiTensorEntry const &t, size_t begin) {
+  for (size_t i = begin; i < t.size; i++) {
+    float gt = gradient(t, p.weight_decay, i);
+    if (p.momentum > 0.0f) {
+      t.v[i] = t.v[i] * p.momentum + gt;
+      gt = p.nesterov ? gt + p.momentum * t.v[i] : t.v[i];
+    }
+    t.w[i] -= p.lr * gt;
+  }
+}
+
+void adam_scalar(AdamParams const &p,
+                 MultiTensorEntry const &t,
+                 size_t begin) {
+  for (size_t i = begin; i < t.size; i++) {
+    float gt = gradient(t, p.weight_decay, i);
+    float mt = p.beta1 * t.m[i] + (1 - p.beta1) * gt;
+    float vt = p.beta2 * t.v[i] + (1 - p.beta2) * gt * gt;
+    t.m[i] = mt;
+    t.v[i] = vt;
+    t.w[i] -= p.alpha_t * mt / (std::sqrt(vt) + p.epsilon);
+  }
+}
+
+#ifdef FF_MULTI_TENSOR_X86
+bool has_avx2() {
+  static bool const supported =
+      __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  return supported;
+}
+
+// Returns the sum of the replicas of gradients [i, i + 8), plus weight decay
+__attribute__((target("avx2,fma"))) inline __m256
+    gradient_avx2(MultiTensorEntry const &t, __m256 wd, __m256 w, size_t i) {
+  __m256 gt = _mm256_loadu_ps(t.w_grad + i);
+  for (int r = 1; r < t.num_replicas; r++) {
+    gt = _mm256_add_ps(gt, _mm256_loadu_ps(t.w_grad + r * t.size + i));
+  }
+  return _mm256_fmadd_ps(wd, w, gt);
+}
+
+// Returns the number of elements updated, a multiple of 8
+__attribute__((target("avx2,fma"))) size_t
+    sgd_avx2(SGDParams const &p, MultiTensorEntry const &t) {
+  __m256 const lr = _mm256_set1_ps(p.lr);
+  __m256 const wd = _mm256_set1_ps(p.weight_decay);
+  __m256 const momentum = _mm256_set1_ps(p.momentum);
+  size_t i = 0;
+  for (; i + 8 <= t.size; i += 8) {
+    __m256 w = _mm256_loadu_ps(t.w + i);
+    __m256 gt = gradient_avx2(t, wd, w, i);
+    if (p.momentum > 0.0f) {
+      __m256 v = _mm256_fmadd_ps(_mm256_loadu_ps(t.v + i), momentum, gt);
+      _mm256_storeu_ps(t.v + i, v);
+      gt = p.nesterov ? _mm256_fmadd_ps(momentum, v, gt) : v;
+    }
+    _mm256_storeu_ps(t.w + i, _mm256_fnmadd_ps(lr, gt, w));
+  }
+  return i;
+}
+
+__attribute__((target("avx2,fma"))) size_t
+    adam_avx2(AdamParams const &p, MultiTensorEntry const &t) {
+  __m256 const alpha_t = _mm256_set1_ps(p.alpha_t);
+  __m256 const beta1 = _mm256_set1_ps(p.beta1);
+  __m256 const beta2 = _mm256_set1_ps(p.beta2);
+  __m256 const one_minus_beta1 = _mm256_set1_ps(1 - p.beta1);
+  __m256 const one_minus_beta2 = _mm256_set1_ps(1 - p.beta2);
+  __m256 const wd = _mm256_set1_ps(p.weight_decay);
+  __m256 const epsilon = _mm256_set1_ps(p.epsilon);
+  size_t i = 0;
+  for (; i + 8 <= t.size; i += 8) {
+    __m256 w = _mm256_loadu_ps(t.w + i);
+    __m256 gt = gradient_avx2(t, wd, w, i);
+    __m256 mt = _mm256_fmadd_ps(beta1,
+                                _mm256_loadu_ps(t.m + i),
+                                _mm256_mul_ps(one_minus_beta1, gt));
+    __m256 vt = _mm256_fmadd_ps(beta2,
+                                _mm256_loadu_ps(t.v + i),
+                                _mm256_mul_ps(one_minus_beta2,
+                                              _mm256_mul_ps(gt, gt)));
+    _mm256_storeu_ps(t.m + i, mt);
+    _mm256_storeu_ps(t.v + i, vt);
+    __m256 step =
+        _mm256_div_ps(mt, _mm256_add_ps(_mm256_sqrt_ps(vt), epsilon));
+    _mm256_storeu_ps(t.w + i, _mm256_fnmadd_ps(alpha_t, step, w));
+  }
+  return i;
+}
+#endif
+
+} // namespace
+
+void sgd_cpu(SGDParams const &params,
+             MultiTensorEntry const *tensors,
+             int num_tensors,
+             bool vectorize) {
+  for (int k = 0; k < num_tensors; k++) {
+    MultiTensorEntry const &t = tensors[k];
+    if (t.size == 0) {
+      continue;
+    }
+    assert(t.num_replicas >= 1);
+    assert(params.momentum <= 0.0f || t.v != nullptr);
+    size_t done = 0;
+#ifdef FF_MULTI_TENSOR_X86
+    if (vectorize && has_avx2()) {
+      done = sgd_avx2(params, t);
+    }
+#endif
+    sgd_scalar(params, t, done);
+  }
+}
+
+void adam_cpu(AdamParams const &params,
+              MultiTensorEntry const *tensors,
+              int num_tensors,
+              bool vectorize) {
+  for (int k = 0; k < num_tensors; k++) {
+    MultiTensorEntry const &t = tensors[k];
+    if (t.size == 0) {
+      continue;
+    }
+    assert(t.num_replicas >= 1);
+    assert(t.v != nullptr && t.m != nullptr);
+    size_t done = 0;
+#ifdef FF_MULTI_TENSOR_X86
+    if (vectorize && has_avx2()) {
+      done = adam_avx2(params, t);
+    }
+#endif
+    adam_scalar(params, t, done);
+  }
+}
+
+} // namespace MultiTensorUpdate
+}; // namespace FlexFlow
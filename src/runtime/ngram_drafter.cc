@@ -0,0 +1,332 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "flexflow/ngram_drafter.h"
+
+#include <algorithm>
+#include <cassert>
+#include <queue>
+
+namespace FlexFlow {
+
+NgramIndex::NgramIndex(int _min_order, int _max_order)
+    : min_order(_min_order), max_order(_max_order), table(1024, Slot{0, 0}),
+      num_keys(0) {
+  assert(min_order > 0 && min_order <= max_order);
+  prev.resize(max_order - min_order + 1);
+}
+
+/*static*/
+uint64_t NgramIndex::hash(TokenId const *ngram, int n) {
+  uint64_t h = 0x9E3779B97F4A7C15ULL * n;
+  for (int i = 0; i < n; i++) {
+    h ^= (uint32_t)ngram[i] + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2);
+  }
+  // splitmix64 finalizer, since the low bits select the table slot
+  h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+  h ^= h >> 31;
+  return h == 0 ? 1 : h;
+}
+
+NgramIndex::Slot &NgramIndex::find_slot(uint64_t key) {
+  size_t mask = table.size() - 1;
+  size_t i = key & mask;
+  while (table[i].key != 0 && table[i].key != key) {
+    i = (i + 1) & mask;
+  }
+  return table[i];
+}
+
+NgramIndex::Slot const *NgramIndex::find_slot(uint64_t key) const {
+  size_t mask = table.size() - 1;
+  for (size_t i = key & mask;; i = (i + 1) & mask) {
+    if (table[i].key == key) {
+      return &table[i];
+    }
+    if (table[i].key == 0) {
+      return nullptr;
+    }
+  }
+}
+
+void NgramIndex::grow_table() {
+  std::vector<Slot> old_table(table.size() * 2, Slot{0, 0});
+  old_table.swap(table);
+  for (Slot const &slot : old_table) {
+    if (slot.key != 0) {
+      find_slot(slot.key) = slot;
+    }
+  }
+}
+
+void NgramIndex::reserve(size_t num_new_tokens) {
+  size_t num = tokens.size() + num_new_tokens;
+  tokens.reserve(num);
+  for (auto &p : prev) {
+    p.reserve(num);
+  }
+  // keep the load factor below 1/2 even if every n-gram is distinct
+  while (table.size() < 2 * num * prev.size()) {
+    grow_table();
+  }
+}
+
+void NgramIndex::start_document() {
+  document_starts.push_back(tokens.size());
+}
+
+void NgramIndex::append(TokenId token) {
+  if (document_starts.empty()) {
+    start_document();
+  }
+  assert(tokens.size() < NONE && "NgramIndex supports up to 2^32-1 tokens");
+  tokens.push_back(token);
+  uint32_t end = tokens.size() - 1;
+  size_t document_length = tokens.size() - document_starts.back();
+  for (int n = min_order; n <= max_order; n++) {
+    int i = n - min_order;
+    if (document_length < (size_t)n) {
+      prev[i].push_back(NONE);
+      continue;
+    }
+    if (2 * (num_keys + 1) > table.size()) {
+      grow_table();
+    }
+    uint64_t key = hash(&tokens[end + 1 - n], n);
+    Slot &slot = find_slot(key);
+    if (slot.key == 0) {
+      slot.key = key;
+      num_keys++;
+      prev[i].push_back(NONE);
+    } else {
+      prev[i].push_back(slot.end);
+    }
+    slot.end = end;
+  }
+}
+
+void NgramIndex::add_document(TokenId const *document, size_t length) {
+  start_document();
+  for (size_t i = 0; i < length; i++) {
+    append(document[i]);
+  }
+}
+
+size_t NgramIndex::continuation_length(size_t pos) const {
+  assert(pos < tokens.size());
+  auto next_start =
+      std::upper_bound(document_starts.begin(), document_starts.end(), pos);
+  size_t document_end =
+      next_start == document_starts.end() ? tokens.size() : *next_start;
+  return document_end - pos;
+}
+
+void NgramIndex::lookup(TokenId const *ngram,
+                        int n,
+                        size_t max_results,
+                        std::vector<size_t> &positions) const {
+  if (n < min_order || n > max_order || max_results == 0) {
+    return;
+  }
+  int i = n - min_order;
+  Slot const *slot = find_slot(hash(ngram, n));
+  if (slot == nullptr) {
+    return;
+  }
+  size_t found = 0;
+  for (uint32_t end = slot->end; end != NONE && found < max_results;
+       end = prev[i][end]) {
+    // skip hash collisions
+    if (!std::equal(ngram, ngram + n, tokens.begin() + (end + 1 - n))) {
+      continue;
+    }
+    // skip occurrences at the end of their document
+    if (continuation_length(end) > 1) {
+      positions.push_back(end + 1);
+      found++;
+    }
+  }
+}
+
+NgramDrafter::NgramDrafter() : NgramDrafter(Config()) {}
+
+NgramDrafter::NgramDrafter(Config const &_config) : config(_config) {
+  assert(config.min_order > 0 && config.min_order <= config.max_order);
+  assert(config.max_matches > 0 && config.max_width > 0);
+  assert(config.max_tokens > 0);
+}
+
+void NgramDrafter::set_corpus(std::shared_ptr<NgramIndex const> _corpus) {
+  corpus = _corpus;
+}
+
+std::shared_ptr<NgramIndex> NgramDrafter::build_corpus(
+    std::vector<std::vector<TokenId>> const &documents) const {
+  std::shared_ptr<NgramIndex> index =
+      std::make_shared<NgramIndex>(config.min_order, config.max_order);
+  size_t num_tokens = 0;
+  for (auto const &document : documents) {
+    num_tokens += document.size();
+  }
+  index->reserve(num_tokens);
+  for (auto const &document : documents) {
+    index->add_document(document.data(), document.size());
+  }
+  return index;
+}
+
+void NgramDrafter::remove_request(RequestGuid guid) {
+  request_indices.erase(guid);
+}
+
+std::vector<std::pair<NgramDrafter::TokenId, int>>
+    NgramDrafter::propose(RequestGuid guid,
+                          std::vector<TokenId> const &context,
+                          int max_depth,
+                          int max_width) {
+  std::unique_ptr<NgramIndex> &index = request_indices[guid];
+  if (!index || index->num_tokens() > context.size()) {
+    index.reset(new NgramIndex(config.min_order, config.max_order));
+  }
+  for (size_t i = index->num_tokens(); i < context.size(); i++) {
+    index->append(context[i]);
+  }
+  std::vector<std::pair<TokenId, int>> tree;
+  max_width = std::min(max_width, config.max_width);
+  if (max_depth <= 0 || max_width <= 0) {
+    return tree;
+  }
+
+  // Collect the continuations of the longest suffixes of context, weighting
+  // each match by its length and source
+  struct Match {
+    NgramIndex const *index;
+    size_t pos;
+    double weight;
+  };
+  std::vector<Match> matches;
+  std::vector<size_t> positions;
+  std::pair<NgramIndex const *, double> sources[] = {
+      {index.get(), 1.0}, {corpus.get(), config.corpus_weight}};
+  int max_order = std::min(config.max_order, (int)context.size());
+  for (int n = max_order;
+       n >= config.min_order && matches.size() < (size_t)config.max_matches;
+       n--) {
+    TokenId const *suffix = context.data() + context.size() - n;
+    for (auto const &source : sources) {
+      if (source.first == nullptr) {
+        continue;
+      }
+      positions.clear();
+      source.first->lookup(
+          suffix, n, config.max_matches - matches.size(), positions);
+      for (size_t pos : positions) {
+        bool seen = false;
+        for (Match const &m : matches) {
+          seen |= (m.index == source.first && m.pos == pos);
+        }
+        if (!seen) {
+          matches.push_back({source.first, pos, source.second * n});
+        }
+      }
+    }
+  }
+  if (matches.empty()) {
+    return tree;
+  }
+
+  // Merge the continuations into a trie, scoring each node by the total
+  // weight of the matches through it
+  struct Node {
+    TokenId token;
+    int depth;
+    double score;
+    std::vector<int> children;
+  };
+  std::vector<Node> nodes(1, Node{-1, 0, 0, {}});
+  for (Match const &m : matches) {
+    int cur = 0;
+    size_t length =
+        std::min((size_t)max_depth, m.index->continuation_length(m.pos));
+    for (size_t k = 0; k < length; k++) {
+      TokenId token = m.index->token(m.pos + k);
+      int next = -1;
+      for (int child : nodes[cur].children) {
+        if (nodes[child].token == token) {
+          next = child;
+          break;
+        }
+      }
+      if (next < 0) {
+        next = nodes.size();
+        nodes.push_back(Node{token, nodes[cur].depth + 1, 0, {}});
+        nodes[cur].children.push_back(next);
+      }
+      nodes[next].score += m.weight;
+      cur = next;
+    }
+  }
+
+  // Scores never increase from a node to its children, so picking nodes in
+  // order of decreasing score yields a tree; earlier (more recent) matches
+  // break ties
+  auto better = [&](int a, int b) {
+    return nodes[a].score > nodes[b].score ||
+           (nodes[a].score == nodes[b].score && a < b);
+  };
+  auto worse = [&](int a, int b) { return better(b, a); };
+  std::priority_queue<int, std::vector<int>, decltype(worse)> frontier(worse);
+  std::vector<std::vector<int>> selected(nodes.size());
+  for (int child : nodes[0].children) {
+    frontier.push(child);
+  }
+  std::vector<int> parent(nodes.size(), -1);
+  for (size_t i = 0; i < nodes.size(); i++) {
+    for (int child : nodes[i].children) {
+      parent[child] = i;
+    }
+  }
+  int num_selected = 0;
+  while (!frontier.empty() && num_selected < config.max_tokens) {
+    int node = frontier.top();
+    frontier.pop();
+    std::vector<int> &siblings = selected[parent[node]];
+    if (siblings.size() >= (size_t)max_width) {
+      continue;
+    }
+    siblings.push_back(node);
+    num_selected++;
+    for (int child : nodes[node].children) {
+      frontier.push(child);
+    }
+  }
+
+  // Serialize the selected nodes in DFS order, best children first
+  std::vector<int> stack(1, 0);
+  while (!stack.empty()) {
+    int node = stack.back();
+    stack.pop_back();
+    if (node != 0) {
+      tree.push_back(std::make_pair(nodes[node].token, nodes[node].depth));
+    }
+    std::vector<int> &children = selected[node];
+    std::sort(children.begin(), children.end(), worse);
+    stack.insert(stack.end(), children.begin(), children.end());
+  }
+  return tree;
+}
+
+}; // namespace FlexFlow
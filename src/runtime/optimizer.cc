@@ -14,7 +14,9 @@
  */
 
 #include "flexflow/optimizer.h"
+#include "flexflow/accessor.h"
 #include "flexflow/model.h"
+#include <algorithm>
 
 namespace FlexFlow {
 
@@ -22,6 +24,29 @@ using namespace Legion;
 
 Optimizer::Optimizer(FFModel const *_model) : model(_model) {}
 
+#ifdef FF_USE_NCCL
+void Optimizer::nccl_all_reduce_task(Task const *task,
+                                     std::vector<PhysicalRegion> const &regions,
+                                     Context ctx,
+                                     Runtime *runtime) {
+  int num_gradients = *((int *)task->args);
+  OpMeta const *meta = *((OpMeta **)task->local_args);
+  assert((int)regions.size() == num_gradients);
+  std::vector<MultiTensorEntry> gradients;
+  for (int i = 0; i < num_gradients; i++) {
+    GenericTensorAccessorW grad = helperGetGenericTensorAccessorRW(
+        DT_FLOAT, regions[i], task->regions[i], FID_DATA, ctx, runtime);
+    MultiTensorEntry t;
+    t.w_grad = grad.get_float_ptr();
+    t.w = t.v = t.m = nullptr;
+    t.size = grad.domain.get_volume();
+    t.num_replicas = 1;
+    gradients.push_back(t);
+  }
+  nccl_all_reduce_task_gpu(meta, gradients);
+}
+#endif
+
 ParallelTensor create_replica_parameter(FFModel const *model,
                                         const ParallelTensor p) {
   Context ctx = model->config.lg_ctx;
@@ -42,6 +67,418 @@ ParallelTensor create_replica_parameter(FFModel const *model,
   return v;
 }
 
+// Creates an optimizer state of NCCL parameter p that keeps, on each of the
+// replicas p is all-reduced across, the state of a slice of one replica of
+// the weights. The state is a flat region of equal shards, one per point of
+// the parallel index space, whatever the shape of p.
+ParallelTensor create_sharded_state(FFModel const *model,
+                                    const ParallelTensor p) {
+  Context ctx = model->config.lg_ctx;
+  Runtime *runtime = model->config.lg_hlr;
+  assert(p->sync_type == ParameterSyncType::NCCL);
+  assert(p->data_type == DT_FLOAT);
+  size_t num_replicas =
+      runtime->get_index_space_domain(ctx, p->parallel_is).get_volume();
+  size_t volume =
+      runtime->get_index_space_domain(ctx, p->region.get_index_space())
+          .get_volume();
+  assert(volume % num_replicas == 0);
+  size_t shard = (volume / num_replicas + num_replicas - 1) / num_replicas;
+  ParallelTensor v = new ParallelTensorBase(*p);
+  v->region_grad = LogicalRegion::NO_REGION;
+  v->part_grad = LogicalPartition::NO_PART;
+  FieldSpace fs = runtime->create_field_space(ctx);
+  FieldAllocator allocator = runtime->create_field_allocator(ctx, fs);
+  allocator.allocate_field(sizeof(float), FID_DATA);
+  Rect<1> rect(0, num_replicas * shard - 1);
+  IndexSpace is = runtime->create_index_space(ctx, rect);
+  v->region = runtime->create_logical_region(ctx, is, fs);
+  IndexPartition ip = runtime->create_equal_partition(ctx, is, p->parallel_is);
+  v->part = runtime->get_logical_partition(ctx, v->region, ip);
+  return v;
+}
+
+// Groups the parameters one fused update can handle: they share a sync
+// type, a machine view and a parallel index space, so that their parts live
+// on the same devices
+std::vector<std::vector<ParallelTensor>>
+    group_parameters(std::vector<ParallelTensor> const &params) {
+  std::vector<std::vector<ParallelTensor>> groups;
+  for (ParallelTensor p : params) {
+    auto it = std::find_if(
+        groups.begin(),
+        groups.end(),
+        [&](std::vector<ParallelTensor> const &group) {
+          ParallelTensor q = group[0];
+          return q->sync_type == p->sync_type &&
+                 q->machine_view == p->machine_view &&
+                 q->parallel_is == p->parallel_is;
+        });
+    if (it == groups.end()) {
+      groups.push_back({p});
+    } else {
+      it->push_back(p);
+    }
+  }
+  return groups;
+}
+
+// Mixed precision update tasks take the loss scaler, to skip the steps whose
+// gradients overflowed
+template <typename Launcher>
+void add_loss_scaler(FFModel const *model, Launcher &launcher) {
+  if (model->config.mixed_precision) {
+    launcher.add_future(model->loss_scaler);
+  }
+}
+
+bool skip_step(Task const *task) {
+  return !task->futures.empty() &&
+         Future(task->futures[0]).get_result<LossScaler>().skip_step();
+}
+
+// Launches the fused update of a group of parameters. The regions of the
+// task hold, for each parameter in turn, its gradient, its weight and its
+// entry in each map of optimizer states.
+void launch_fused_update(
+    FFModel const *model,
+    TaskID ps_task_id,
+    TaskID nccl_task_id,
+    TaskArgument const &arg,
+    std::vector<ParallelTensor> const &group,
+    std::vector<std::map<LogicalRegion, ParallelTensor> const *> const
+        &states) {
+  Context ctx = model->config.lg_ctx;
+  Runtime *runtime = model->config.lg_hlr;
+  ParallelTensor first = group[0];
+  for (ParallelTensor p : group) {
+    assert(p->owner_op != NULL);
+    for (auto const *values : states) {
+      assert(values->find(p->region) != values->end());
+    }
+  }
+  if (first->sync_type == ParameterSyncType::PS) {
+    TaskLauncher launcher(ps_task_id,
+                          arg,
+                          Predicate::TRUE_PRED,
+                          0 /*mapper_id*/,
+                          first->machine_view.hash());
+    int idx = 0;
+    for (ParallelTensor p : group) {
+      launcher.add_region_requirement(RegionRequirement(
+          p->region_grad, READ_ONLY, EXCLUSIVE, p->region_grad));
+      launcher.add_field(idx++, FID_DATA);
+      launcher.add_region_requirement(
+          RegionRequirement(p->region, READ_WRITE, EXCLUSIVE, p->region));
+      launcher.add_field(idx++, FID_DATA);
+      for (auto const *values : states) {
+        ParallelTensor state = values->at(p->region);
+        launcher.add_region_requirement(RegionRequirement(
+            state->region, READ_WRITE, EXCLUSIVE, state->region));
+        launcher.add_field(idx++, FID_DATA);
+      }
+    }
+    add_loss_scaler(model, launcher);
+    runtime->execute_task(ctx, launcher);
+    // Send the parameters back to all worker devices, as update() does
+    ArgumentMap argmap;
+    IndexLauncher index_launcher(PS_PREFETCH_TASK_ID,
+                                 first->parallel_is,
+                                 TaskArgument(NULL, 0),
+                                 argmap,
+                                 Predicate::TRUE_PRED,
+                                 false /*must*/,
+                                 0 /*mapper_id*/,
+                                 first->machine_view.hash());
+    for (size_t i = 0; i < group.size(); i++) {
+      index_launcher.add_region_requirement(
+          RegionRequirement(group[i]->part,
+                            0 /*projection*/,
+                            READ_ONLY,
+                            EXCLUSIVE,
+                            group[i]->region));
+      index_launcher.add_field(i, FID_DATA);
+    }
+    runtime->execute_index_space(ctx, index_launcher);
+  } else if (first->sync_type == ParameterSyncType::NCCL) {
+    assert(first->parallel_is != IndexSpace::NO_SPACE);
+    // Parameters with the same machine view share NCCL communicators, so
+    // the metas of the first owner serve the whole group
+    ArgumentMap argmap;
+    Domain domain = runtime->get_index_space_domain(ctx, first->parallel_is);
+    switch (domain.get_dim()) {
+#define DIMFUNC(DIM)                                                           \
+  case DIM: {                                                                  \
+    Rect<DIM> rect = domain;                                                   \
+    int idx = 0;                                                               \
+    for (PointInRectIterator<DIM> it(rect); it(); it++) {                      \
+      OpMeta *mp = first->owner_op->meta[idx++];                               \
+      argmap.set_point(*it, TaskArgument(&mp, sizeof(OpMeta *)));              \
+    }                                                                          \
+    break;                                                                     \
+  }
+      LEGION_FOREACH_N(DIMFUNC)
+#undef DIMFUNC
+      default:
+        assert(false);
+    }
+    IndexLauncher launcher(nccl_task_id,
+                           first->parallel_is,
+                           arg,
+                           argmap,
+                           Predicate::TRUE_PRED,
+                           false /*must_epoch*/,
+                           0 /*mapper_id*/,
+                           first->machine_view.hash());
+    int idx = 0;
+    for (ParallelTensor p : group) {
+      launcher.add_region_requirement(RegionRequirement(p->part_grad,
+                                                        0 /*projection id*/,
+                                                        READ_ONLY,
+                                                        EXCLUSIVE,
+                                                        p->region_grad));
+      launcher.add_field(idx++, FID_DATA);
+      launcher.add_region_requirement(RegionRequirement(
+          p->part, 0 /*projection id*/, READ_WRITE, EXCLUSIVE, p->region));
+      launcher.add_field(idx++, FID_DATA);
+      for (auto const *values : states) {
+        ParallelTensor state = values->at(p->region);
+        launcher.add_region_requirement(RegionRequirement(state->part,
+                                                          0 /*projection id*/,
+                                                          READ_WRITE,
+                                                          EXCLUSIVE,
+                                                          state->region));
+        launcher.add_field(idx++, FID_DATA);
+      }
+    }
+    add_loss_scaler(model, launcher);
+    launcher.concurrent = true;
+    runtime->execute_index_space(ctx, launcher);
+    runtime->issue_execution_fence(ctx);
+  } else {
+    assert(false);
+  }
+}
+
+// Builds the flat parameter table of a fused update task from the regions
+// launch_fused_update() adds. The first optimizer state of each parameter
+// goes to MultiTensorEntry::v and the second to MultiTensorEntry::m.
+std::vector<MultiTensorEntry>
+    get_multi_tensor_table(Task const *task,
+                           std::vector<PhysicalRegion> const &regions,
+                           Context ctx,
+                           Runtime *runtime,
+                           int num_states) {
+  assert(num_states <= 2);
+  size_t const stride = 2 + num_states;
+  assert(regions.size() == task->regions.size());
+  assert(regions.size() % stride == 0);
+  std::vector<MultiTensorEntry> tensors;
+  for (size_t i = 0; i < regions.size(); i += stride) {
+    GenericTensorAccessorR w_grad = helperGetGenericTensorAccessorRO(
+        DT_FLOAT, regions[i], task->regions[i], FID_DATA, ctx, runtime);
+    GenericTensorAccessorW w = helperGetGenericTensorAccessorRW(
+        DT_FLOAT, regions[i + 1], task->regions[i + 1], FID_DATA, ctx, runtime);
+    MultiTensorEntry t;
+    t.w_grad = w_grad.get_float_ptr();
+    t.w = w.get_float_ptr();
+    t.v = t.m = nullptr;
+    t.size = w.domain.get_volume();
+    assert(w_grad.domain.get_volume() % t.size == 0);
+    t.num_replicas = w_grad.domain.get_volume() / t.size;
+    for (int j = 0; j < num_states; j++) {
+      GenericTensorAccessorW state =
+          helperGetGenericTensorAccessorRW(DT_FLOAT,
+                                           regions[i + 2 + j],
+                                           task->regions[i + 2 + j],
+                                           FID_DATA,
+                                           ctx,
+                                           runtime);
+      assert(state.domain == w.domain);
+      (j == 0 ? t.v : t.m) = state.get_float_ptr();
+    }
+    tensors.push_back(t);
+  }
+  return tensors;
+}
+
+// Converts every part of src into the type of dst on the devices of dst
+void launch_convert_weight(FFModel const *model,
+                           const ParallelTensor src,
+                           const ParallelTensor dst) {
+  Context ctx = model->config.lg_ctx;
+  Runtime *runtime = model->config.lg_hlr;
+  assert(src->parallel_is == dst->parallel_is);
+  DataType types[2] = {src->data_type, dst->data_type};
+  ArgumentMap argmap;
+  IndexLauncher launcher(AMP_CONVERT_WEIGHT_TASK_ID,
+                         dst->parallel_is,
+                         TaskArgument(types, sizeof(types)),
+                         argmap,
+                         Predicate::TRUE_PRED,
+                         false /*must*/,
+                         0 /*mapper_id*/,
+                         dst->machine_view.hash());
+  launcher.add_region_requirement(RegionRequirement(
+      src->part, 0 /*projection id*/, READ_ONLY, EXCLUSIVE, src->region));
+  launcher.add_field(0, FID_DATA);
+  launcher.add_region_requirement(RegionRequirement(
+      dst->part, 0 /*projection id*/, WRITE_ONLY, EXCLUSIVE, dst->region));
+  launcher.add_field(1, FID_DATA);
+  runtime->execute_index_space(ctx, launcher);
+}
+
+void Optimizer::init_master_weights() {
+  Context ctx = model->config.lg_ctx;
+  Runtime *runtime = model->config.lg_hlr;
+  FieldSpace fs = runtime->create_field_space(ctx);
+  FieldAllocator allocator = runtime->create_field_allocator(ctx, fs);
+  allocator.allocate_field(sizeof(float), FID_DATA);
+  for (ParallelTensor p : model->parameters) {
+    if (p->owner_op->updates_weights_in_backward()) {
+      // such an op would apply the scaled gradient
+      fprintf(stderr,
+              "Mixed precision training does not support %s, which "
+              "updates its weights in its backward pass\n",
+              p->owner_op->name);
+      assert(false);
+    }
+    if (p->data_type != DT_HALF) {
+      continue;
+    }
+    ParallelTensor master = new ParallelTensorBase(*p);
+    master->data_type = DT_FLOAT;
+    master->region = runtime->create_logical_region(
+        ctx, p->region.get_index_space(), fs);
+    master->part = runtime->get_logical_partition(
+        ctx, master->region, p->part.get_index_partition());
+    master->region_grad = runtime->create_logical_region(
+        ctx, p->region_grad.get_index_space(), fs);
+    master->part_grad = runtime->get_logical_partition(
+        ctx, master->region_grad, p->part_grad.get_index_partition());
+    launch_convert_weight(model, p, master);
+    master_weights[p->region] = master;
+  }
+}
+
+ParallelTensor Optimizer::get_master_weight(const ParallelTensor p) const {
+  auto it = master_weights.find(p->region);
+  return it == master_weights.end() ? p : it->second;
+}
+
+Future Optimizer::unscale_gradients(Future const &loss_scaler) {
+  Context ctx = model->config.lg_ctx;
+  Runtime *runtime = model->config.lg_hlr;
+  TaskLauncher update_launcher(AMP_UPDATE_LOSS_SCALE_TASK_ID,
+                               TaskArgument(NULL, 0));
+  update_launcher.add_future(loss_scaler);
+  for (ParallelTensor p : model->parameters) {
+    ParallelTensor master = get_master_weight(p);
+    ArgumentMap argmap;
+    IndexLauncher launcher(AMP_UNSCALE_GRAD_TASK_ID,
+                           p->parallel_is,
+                           TaskArgument(NULL, 0),
+                           argmap,
+                           Predicate::TRUE_PRED,
+                           false /*must*/,
+                           0 /*mapper_id*/,
+                           p->machine_view.hash());
+    launcher.add_future(loss_scaler);
+    if (master == p) {
+      // FP32 gradients are unscaled in place
+      launcher.add_region_requirement(RegionRequirement(p->part_grad,
+                                                        0 /*projection id*/,
+                                                        READ_WRITE,
+                                                        EXCLUSIVE,
+                                                        p->region_grad));
+      launcher.add_field(0, FID_DATA);
+    } else {
+      launcher.add_region_requirement(RegionRequirement(p->part_grad,
+                                                        0 /*projection id*/,
+                                                        READ_ONLY,
+                                                        EXCLUSIVE,
+                                                        p->region_grad));
+      launcher.add_field(0, FID_DATA);
+      launcher.add_region_requirement(
+          RegionRequirement(master->part_grad,
+                            0 /*projection id*/,
+                            WRITE_ONLY,
+                            EXCLUSIVE,
+                            master->region_grad));
+      launcher.add_field(1, FID_DATA);
+    }
+    FutureMap overflows = runtime->execute_index_space(ctx, launcher);
+    Domain domain = runtime->get_index_space_domain(ctx, p->parallel_is);
+    for (Domain::DomainPointIterator it(domain); it; it++) {
+      update_launcher.add_future(overflows[*it]);
+    }
+  }
+  return runtime->execute_task(ctx, update_launcher);
+}
+
+void Optimizer::copy_master_weights() {
+  for (ParallelTensor p : model->parameters) {
+    ParallelTensor master = get_master_weight(p);
+    if (master != p) {
+      launch_convert_weight(model, master, p);
+    }
+  }
+}
+
+bool Optimizer::unscale_gradients_task(
+    Task const *task,
+    std::vector<PhysicalRegion> const &regions,
+    Context ctx,
+    Runtime *runtime) {
+  assert(task->futures.size() == 1);
+  LossScaler scaler = Future(task->futures[0]).get_result<LossScaler>();
+  assert(regions.size() == task->regions.size());
+  if (regions.size() == 1) {
+    GenericTensorAccessorW grad = helperGetGenericTensorAccessorRW(
+        DT_FLOAT, regions[0], task->regions[0], FID_DATA, ctx, runtime);
+    return unscale_gradients_task_gpu(
+        grad, grad, scaler.get_inverse_scale());
+  }
+  assert(regions.size() == 2);
+  GenericTensorAccessorR grad = helperGetGenericTensorAccessorRO(
+      DT_HALF, regions[0], task->regions[0], FID_DATA, ctx, runtime);
+  GenericTensorAccessorW master_grad = helperGetGenericTensorAccessorWO(
+      DT_FLOAT, regions[1], task->regions[1], FID_DATA, ctx, runtime);
+  assert(grad.domain == master_grad.domain);
+  return unscale_gradients_task_gpu(
+      grad, master_grad, scaler.get_inverse_scale());
+}
+
+LossScaler Optimizer::update_loss_scale_task(
+    Task const *task,
+    std::vector<PhysicalRegion> const &regions,
+    Context ctx,
+    Runtime *runtime) {
+  assert(task->futures.size() >= 1);
+  LossScaler scaler = Future(task->futures[0]).get_result<LossScaler>();
+  bool overflow = false;
+  for (size_t i = 1; i < task->futures.size(); i++) {
+    overflow |= Future(task->futures[i]).get_result<bool>();
+  }
+  scaler.update(overflow);
+  return scaler;
+}
+
+void Optimizer::convert_weight_task(Task const *task,
+                                    std::vector<PhysicalRegion> const &regions,
+                                    Context ctx,
+                                    Runtime *runtime) {
+  assert(regions.size() == 2);
+  assert(task->regions.size() == 2);
+  DataType const *types = (DataType const *)task->args;
+  GenericTensorAccessorR src = helperGetGenericTensorAccessorRO(
+      types[0], regions[0], task->regions[0], FID_DATA, ctx, runtime);
+  GenericTensorAccessorW dst = helperGetGenericTensorAccessorWO(
+      types[1], regions[1], task->regions[1], FID_DATA, ctx, runtime);
+  assert(src.domain == dst.domain);
+  convert_weight_task_gpu(src, dst);
+}
+
 SGDOptimizer::SGDOptimizer(FFModel const *_model,
                            double _lr,
                            double _momentum,
@@ -56,6 +493,12 @@ void SGDOptimizer::init(void) {
   Initializer *initializer = new ZeroInitializer();
   for (size_t i = 0; i < model->parameters.size(); i++) {
     ParallelTensor p = model->parameters[i];
+    // no optimizer state for weights their op updates in its backward pass
+    if (p->owner_op->updates_weights_in_backward()) {
+      continue;
+    }
+    // the states of half precision weights follow their FP32 master copy
+    p = get_master_weight(p);
     Domain domain =
         runtime->get_index_space_domain(ctx, p->region.get_index_space());
     switch (domain.get_dim()) {
@@ -85,6 +528,10 @@ void SGDOptimizer::init(void) {
   delete initializer;
 }
 
+int SGDOptimizer::num_states(void) const {
+  return momentum > 0.0f ? 1 : 0;
+}
+
 void SGDOptimizer::next(void) {}
 
 void SGDOptimizer::update(const ParallelTensor p) {
@@ -115,6 +562,7 @@ void SGDOptimizer::update(const ParallelTensor p) {
                             v_values[p->region]->region));
       launcher.add_field(2, FID_DATA);
     }
+    add_loss_scaler(model, launcher);
     runtime->execute_task(ctx, launcher);
     // Parameter prefetching optimizations to reduce comm. overhead
     // Directly send the parameters back to all worker devices after SGD
@@ -188,6 +636,7 @@ void SGDOptimizer::update(const ParallelTensor p) {
     // MustEpochLauncher must_epoch_launcher;
     // must_epoch_launcher.add_index_task(launcher);
     launcher.concurrent = true;
+    add_loss_scaler(model, launcher);
     FutureMap fm = runtime->execute_index_space(ctx, launcher);
     // runtime->execute_must_epoch(ctx, must_epoch_launcher);
     runtime->issue_execution_fence(ctx);
@@ -196,11 +645,38 @@ void SGDOptimizer::update(const ParallelTensor p) {
   }
 }
 
+void SGDOptimizer::fused_update(std::vector<ParallelTensor> const &params) {
+  std::vector<std::map<LogicalRegion, ParallelTensor> const *> states;
+  if (momentum > 0.0f) {
+    states.push_back(&v_values);
+  }
+  for (auto const &group : group_parameters(params)) {
+    for (ParallelTensor p : group) {
+      // As in update(), the owner of a weight cannot be FusedOp
+      assert(p->sync_type != ParameterSyncType::NCCL ||
+             p->owner_op->op_type != OP_FUSED);
+    }
+    launch_fused_update(model,
+                        SGD_UPD_FUSED_PS_TASK_ID,
+                        SGD_UPD_FUSED_NCCL_TASK_ID,
+                        TaskArgument(this, sizeof(SGDOptimizer)),
+                        group,
+                        states);
+  }
+}
+
+MultiTensorUpdate::SGDParams SGDOptimizer::get_update_params() const {
+  return {(float)lr, (float)weight_decay, (float)momentum, nesterov};
+}
+
 void SGDOptimizer::ps_update_task(Task const *task,
                                   std::vector<PhysicalRegion> const &regions,
                                   Context ctx,
                                   Runtime *runtime) {
   SGDOptimizer const *op = (SGDOptimizer *)task->args;
+  if (skip_step(task)) {
+    return;
+  }
   if (op->momentum > 0.0f) {
     assert(regions.size() == 3);
     assert(task->regions.size() == 3);
@@ -256,12 +732,44 @@ void SGDOptimizer::ps_update_task(Task const *task,
   ps_update_task_gpu(op, w_grad_ptr, size, num_replicas, w_ptr, v_ptr);
 }
 
+void SGDOptimizer::fused_ps_update_task(
+    Task const *task,
+    std::vector<PhysicalRegion> const &regions,
+    Context ctx,
+    Runtime *runtime) {
+  SGDOptimizer const *op = (SGDOptimizer *)task->args;
+  if (skip_step(task)) {
+    return;
+  }
+  std::vector<MultiTensorEntry> tensors = get_multi_tensor_table(
+      task, regions, ctx, runtime, op->momentum > 0.0f ? 1 : 0);
+  fused_update_task_gpu(op, nullptr /*meta*/, tensors);
+}
+
+void SGDOptimizer::fused_ps_update_task_cpu(
+    Task const *task,
+    std::vector<PhysicalRegion> const &regions,
+    Context ctx,
+    Runtime *runtime) {
+  SGDOptimizer const *op = (SGDOptimizer *)task->args;
+  if (skip_step(task)) {
+    return;
+  }
+  std::vector<MultiTensorEntry> tensors = get_multi_tensor_table(
+      task, regions, ctx, runtime, op->momentum > 0.0f ? 1 : 0);
+  MultiTensorUpdate::sgd_cpu(
+      op->get_update_params(), tensors.data(), tensors.size());
+}
+
 #ifdef FF_USE_NCCL
 void SGDOptimizer::nccl_update_task(Task const *task,
                                     std::vector<PhysicalRegion> const &regions,
                                     Context ctx,
                                     Runtime *runtime) {
   SGDOptimizer const *op = (SGDOptimizer *)task->args;
+  if (skip_step(task)) {
+    return;
+  }
   OpMeta const *meta = *((OpMeta **)task->local_args);
   // FFHandler handler = *((FFHandler*) task->local_args);
   if (op->momentum > 0.0f) {
@@ -313,6 +821,26 @@ void SGDOptimizer::nccl_update_task(Task const *task,
 
   nccl_update_task_gpu(op, meta, w_grad_ptr, size, w_ptr, v_ptr);
 }
+
+void SGDOptimizer::fused_nccl_update_task(
+    Task const *task,
+    std::vector<PhysicalRegion> const &regions,
+    Context ctx,
+    Runtime *runtime) {
+  SGDOptimizer const *op = (SGDOptimizer *)task->args;
+  if (skip_step(task)) {
+    return;
+  }
+  OpMeta const *meta = *((OpMeta **)task->local_args);
+  std::vector<MultiTensorEntry> tensors = get_multi_tensor_table(
+      task, regions, ctx, runtime, op->momentum > 0.0f ? 1 : 0);
+  for (MultiTensorEntry const &t : tensors) {
+    assert(t.num_replicas == 1);
+  }
+  // no meta skips the all-reduce of gradients FFModel already all-reduced
+  fused_update_task_gpu(
+      op, op->gradients_all_reduced ? nullptr : meta, tensors);
+}
 #endif
 
 // ------------------------------------------------------------------
@@ -327,7 +855,9 @@ AdamOptimizer::AdamOptimizer(FFModel const *_model,
                              double _epsilon)
     : Optimizer(_model), alpha(_alpha), beta1(_beta1), beta2(_beta2),
       weight_decay(_weight_decay), epsilon(_epsilon), alpha_t(_alpha),
-      beta1_t(1.0f), beta2_t(1.0f) {}
+      beta1_t(1.0f), beta2_t(1.0f) {
+  shard_states = model->config.shard_optimizer_states;
+}
 
 void AdamOptimizer::init(void) {
   Context ctx = model->config.lg_ctx;
@@ -335,6 +865,12 @@ void AdamOptimizer::init(void) {
   Initializer *initializer = new ZeroInitializer();
   for (size_t i = 0; i < model->parameters.size(); i++) {
     ParallelTensor p = model->parameters[i];
+    // no optimizer state for weights their op updates in its backward pass
+    if (p->owner_op->updates_weights_in_backward()) {
+      continue;
+    }
+    // the states of half precision weights follow their FP32 master copy
+    p = get_master_weight(p);
     Domain domain =
         runtime->get_index_space_domain(ctx, p->region.get_index_space());
     switch (domain.get_dim()) {
@@ -348,8 +884,13 @@ void AdamOptimizer::init(void) {
       case 3:
       case 4:
       case 5: {
-        v_values[p->region] = create_replica_parameter(model, p);
-        m_values[p->region] = create_replica_parameter(model, p);
+        if (shard_states && p->sync_type == ParameterSyncType::NCCL) {
+          v_values[p->region] = create_sharded_state(model, p);
+          m_values[p->region] = create_sharded_state(model, p);
+        } else {
+          v_values[p->region] = create_replica_parameter(model, p);
+          m_values[p->region] = create_replica_parameter(model, p);
+        }
         initializer->init(model, v_values[p->region]);
         initializer->init(model, m_values[p->region]);
         break;
@@ -364,6 +905,10 @@ void AdamOptimizer::init(void) {
   delete initializer;
 }
 
+int AdamOptimizer::num_states(void) const {
+  return 2;
+}
+
 void AdamOptimizer::set_weight_decay(double _weight_decay) {
   weight_decay = _weight_decay;
 }
@@ -409,6 +954,7 @@ void AdamOptimizer::update(const ParallelTensor p) {
                           EXCLUSIVE,
                           m_values[p->region]->region));
     launcher.add_field(3, FID_DATA);
+    add_loss_scaler(model, launcher);
     runtime->execute_task(ctx, launcher);
     // Parameter prefetching optimizations to reduce comm. overhead
     // Directly send the parameters back to all worker devices after SGD
@@ -484,6 +1030,7 @@ void AdamOptimizer::update(const ParallelTensor p) {
     // MustEpochLauncher must_epoch_launcher;
     // must_epoch_launcher.add_index_task(launcher);
     launcher.concurrent = true;
+    add_loss_scaler(model, launcher);
     FutureMap fm = runtime->execute_index_space(ctx, launcher);
     // runtime->execute_must_epoch(ctx, must_epoch_launcher);
     runtime->issue_execution_fence(ctx);
@@ -492,6 +1039,32 @@ void AdamOptimizer::update(const ParallelTensor p) {
   }
 }
 
+void AdamOptimizer::fused_update(std::vector<ParallelTensor> const &params) {
+  for (auto const &group : group_parameters(params)) {
+    // The multi-tensor kernels update whole replicas of the weights
+    if (shard_states && group[0]->sync_type == ParameterSyncType::NCCL) {
+      for (ParallelTensor p : group) {
+        update(p);
+      }
+      continue;
+    }
+    launch_fused_update(model,
+                        ADAM_UPD_FUSED_PS_TASK_ID,
+                        ADAM_UPD_FUSED_NCCL_TASK_ID,
+                        TaskArgument(this, sizeof(AdamOptimizer)),
+                        group,
+                        {&v_values, &m_values});
+  }
+}
+
+MultiTensorUpdate::AdamParams AdamOptimizer::get_update_params() const {
+  return {(float)alpha_t,
+          (float)beta1,
+          (float)beta2,
+          (float)weight_decay,
+          (float)epsilon};
+}
+
 void AdamOptimizer::ps_update_task(Task const *task,
                                    std::vector<PhysicalRegion> const &regions,
                                    Context ctx,
@@ -499,6 +1072,9 @@ void AdamOptimizer::ps_update_task(Task const *task,
   assert(regions.size() == 4);
   assert(task->regions.size() == 4);
   AdamOptimizer const *op = (AdamOptimizer *)task->args;
+  if (skip_step(task)) {
+    return;
+  }
   Domain domain = runtime->get_index_space_domain(
       ctx, task->regions[1].region.get_index_space());
   float const *w_grad_ptr = NULL;
@@ -547,6 +1123,35 @@ void AdamOptimizer::ps_update_task(Task const *task,
   ps_update_task_gpu(op, w_grad_ptr, size, num_replicas, w_ptr, v_ptr, m_ptr);
 }
 
+void AdamOptimizer::fused_ps_update_task(
+    Task const *task,
+    std::vector<PhysicalRegion> const &regions,
+    Context ctx,
+    Runtime *runtime) {
+  AdamOptimizer const *op = (AdamOptimizer *)task->args;
+  if (skip_step(task)) {
+    return;
+  }
+  std::vector<MultiTensorEntry> tensors =
+      get_multi_tensor_table(task, regions, ctx, runtime, 2 /*num_states*/);
+  fused_update_task_gpu(op, nullptr /*meta*/, tensors);
+}
+
+void AdamOptimizer::fused_ps_update_task_cpu(
+    Task const *task,
+    std::vector<PhysicalRegion> const &regions,
+    Context ctx,
+    Runtime *runtime) {
+  AdamOptimizer const *op = (AdamOptimizer *)task->args;
+  if (skip_step(task)) {
+    return;
+  }
+  std::vector<MultiTensorEntry> tensors =
+      get_multi_tensor_table(task, regions, ctx, runtime, 2 /*num_states*/);
+  MultiTensorUpdate::adam_cpu(
+      op->get_update_params(), tensors.data(), tensors.size());
+}
+
 #ifdef FF_USE_NCCL
 void AdamOptimizer::nccl_update_task(Task const *task,
                                      std::vector<PhysicalRegion> const &regions,
@@ -555,7 +1160,32 @@ void AdamOptimizer::nccl_update_task(Task const *task,
   assert(regions.size() == 4);
   assert(task->regions.size() == 4);
   AdamOptimizer const *op = (AdamOptimizer *)task->args;
+  if (skip_step(task)) {
+    return;
+  }
   OpMeta const *meta = *((OpMeta **)task->local_args);
+  if (op->shard_states) {
+    // the moments are flat shards, see create_sharded_state
+    GenericTensorAccessorR w_grad = helperGetGenericTensorAccessorRO(
+        DT_FLOAT, regions[0], task->regions[0], FID_DATA, ctx, runtime);
+    GenericTensorAccessorW w = helperGetGenericTensorAccessorRW(
+        DT_FLOAT, regions[1], task->regions[1], FID_DATA, ctx, runtime);
+    GenericTensorAccessorW v = helperGetGenericTensorAccessorRW(
+        DT_FLOAT, regions[2], task->regions[2], FID_DATA, ctx, runtime);
+    GenericTensorAccessorW m = helperGetGenericTensorAccessorRW(
+        DT_FLOAT, regions[3], task->regions[3], FID_DATA, ctx, runtime);
+    assert(w_grad.domain == w.domain);
+    assert(v.domain == m.domain);
+    sharded_nccl_update_task_gpu(op,
+                                 meta,
+                                 w_grad.get_float_ptr(),
+                                 w.domain.get_volume(),
+                                 w.get_float_ptr(),
+                                 v.get_float_ptr(),
+                                 m.get_float_ptr(),
+                                 v.domain.get_volume());
+    return;
+  }
   // FFHandler handler = *((FFHandler*) task->local_args);
   Domain domain = runtime->get_index_space_domain(
       ctx, task->regions[1].region.get_index_space());
@@ -605,6 +1235,26 @@ void AdamOptimizer::nccl_update_task(Task const *task,
 
   nccl_update_task_gpu(op, meta, w_grad_ptr, size, w_ptr, v_ptr, m_ptr);
 }
+
+void AdamOptimizer::fused_nccl_update_task(
+    Task const *task,
+    std::vector<PhysicalRegion> const &regions,
+    Context ctx,
+    Runtime *runtime) {
+  AdamOptimizer const *op = (AdamOptimizer *)task->args;
+  if (skip_step(task)) {
+    return;
+  }
+  OpMeta const *meta = *((OpMeta **)task->local_args);
+  std::vector<MultiTensorEntry> tensors =
+      get_multi_tensor_table(task, regions, ctx, runtime, 2 /*num_states*/);
+  for (MultiTensorEntry const &t : tensors) {
+    assert(t.num_replicas == 1);
+  }
+  // no meta skips the all-reduce of gradients FFModel already all-reduced
+  fused_update_task_gpu(
+      op, op->gradients_all_reduced ? nullptr : meta, tensors);
+}
 #endif
 
 }; // namespace FlexFlow
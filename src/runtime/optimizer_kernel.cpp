@@ -96,13 +96,16 @@ __host__ void SGDOptimizer::nccl_update_task_gpu(SGDOptimizer const *op,
   // fprintf(stderr, "weight(%p) Before ncclAllReduce...\n", w_grad_ptr);
   hipStream_t stream;
   checkCUDA(get_legion_stream(&stream));
-  checkNCCL(ncclAllReduce(w_grad_ptr,
-                          (float *)w_grad_ptr,
-                          size,
-                          ncclFloat,
-                          ncclSum,
-                          meta->handle.ncclComm,
-                          stream));
+  // The gradients are already summed if FFModel all-reduced them in buckets
+  if (!op->gradients_all_reduced) {
+    checkNCCL(ncclAllReduce(w_grad_ptr,
+                            (float *)w_grad_ptr,
+                            size,
+                            ncclFloat,
+                            ncclSum,
+                            meta->handle.ncclComm,
+                            stream));
+  }
   // fprintf(stderr, "weight(%p) After ncclAllReduce...\n", w_grad_ptr);
 
   // Step 2: SGD update
@@ -218,13 +221,16 @@ __host__ void AdamOptimizer::nccl_update_task_gpu(AdamOptimizer const *op,
   // Use NCCL to sync gradients
   hipStream_t stream;
   checkCUDA(get_legion_stream(&stream));
-  checkNCCL(ncclAllReduce(w_grad_ptr,
-                          (float *)w_grad_ptr,
-                          size,
-                          ncclFloat,
-                          ncclSum,
-                          meta->handle.ncclComm,
-                          stream));
+  // The gradients are already summed if FFModel all-reduced them in buckets
+  if (!op->gradients_all_reduced) {
+    checkNCCL(ncclAllReduce(w_grad_ptr,
+                            (float *)w_grad_ptr,
+                            size,
+                            ncclFloat,
+                            ncclSum,
+                            meta->handle.ncclComm,
+                            stream));
+  }
   // fprintf(stderr, "alpha = %.8lf alpha_t = %.8lf decay = %.8lf\n",
   //         op->alpha, op->alpha_t, op->weight_decay);
   //  Step 2: Adam update
@@ -245,6 +251,295 @@ __host__ void AdamOptimizer::nccl_update_task_gpu(AdamOptimizer const *op,
                      w_ptr);
   // checkCUDA(hipDeviceSynchronize());
 }
+
+__host__ void
+    AdamOptimizer::sharded_nccl_update_task_gpu(AdamOptimizer const *op,
+                                                OpMeta const *meta,
+                                                float const *w_grad_ptr,
+                                                size_t size,
+                                                float *w_ptr,
+                                                float *v_ptr,
+                                                float *m_ptr,
+                                                size_t shard) {
+  hipStream_t stream;
+  checkCUDA(get_legion_stream(&stream));
+  int rank, num_ranks;
+  checkNCCL(ncclCommUserRank(meta->handle.ncclComm, &rank));
+  checkNCCL(ncclCommCount(meta->handle.ncclComm, &num_ranks));
+  assert(shard * num_ranks >= size);
+  // The slices are uneven when size is not a multiple of num_ranks, so the
+  // reduce-scatter is a group of reduces to the owner of each slice
+  if (!op->gradients_all_reduced) {
+    checkNCCL(ncclGroupStart());
+    for (int r = 0; r < num_ranks; r++) {
+      size_t offset = std::min(r * shard, size);
+      checkNCCL(ncclReduce(w_grad_ptr + offset,
+                           (float *)w_grad_ptr + offset,
+                           std::min(shard, size - offset),
+                           ncclFloat,
+                           ncclSum,
+                           r,
+                           meta->handle.ncclComm,
+                           stream));
+    }
+    checkNCCL(ncclGroupEnd());
+  }
+  size_t offset = std::min(rank * shard, size);
+  size_t count = std::min(shard, size - offset);
+  if (count > 0) {
+    hipLaunchKernelGGL(HIP_KERNEL_NAME(adam_update),
+                       GET_BLOCKS(count),
+                       CUDA_NUM_THREADS,
+                       0,
+                       stream,
+                       count,
+                       op->alpha_t,
+                       op->beta1,
+                       op->beta2,
+                       op->weight_decay,
+                       op->epsilon,
+                       w_grad_ptr + offset,
+                       m_ptr,
+                       v_ptr,
+                       w_ptr + offset);
+  }
+  // All-gather the updated slices
+  checkNCCL(ncclGroupStart());
+  for (int r = 0; r < num_ranks; r++) {
+    size_t offset = std::min(r * shard, size);
+    checkNCCL(ncclBroadcast(w_ptr + offset,
+                            w_ptr + offset,
+                            std::min(shard, size - offset),
+                            ncclFloat,
+                            r,
+                            meta->handle.ncclComm,
+                            stream));
+  }
+  checkNCCL(ncclGroupEnd());
+}
+#endif
+
+// ==================================================================
+//                     Fused multi-tensor updates
+// ==================================================================
+// The flat parameter table of one launch, passed by value as a kernel
+// argument so that no copy to the device is needed
+struct MultiTensorTable {
+  MultiTensorEntry entries[MultiTensorUpdate::MAX_TENSORS_PER_LAUNCH];
+};
+
+// Blocks each tensor of a launch gets; larger tensors are strided over them
+int const MULTI_TENSOR_BLOCKS = 512;
+
+__device__ inline float multi_tensor_gradient(MultiTensorEntry const &t,
+                                              float weight_decay,
+                                              size_t i) {
+  float gt = t.w_grad[i];
+  for (int r = 1; r < t.num_replicas; r++) {
+    gt += t.w_grad[r * t.size + i];
+  }
+  return gt + weight_decay * t.w[i];
+}
+
+// blockIdx.y selects the tensor
+__global__ void sgd_multi_tensor_update(MultiTensorTable table,
+                                        MultiTensorUpdate::SGDParams p) {
+  MultiTensorEntry const &t = table.entries[blockIdx.y];
+  CUDA_KERNEL_LOOP(i, (Legion::coord_t)t.size) {
+    float gt = multi_tensor_gradient(t, p.weight_decay, i);
+    if (p.momentum > 0.0f) {
+      t.v[i] = t.v[i] * p.momentum + gt;
+      gt = p.nesterov ? gt + p.momentum * t.v[i] : t.v[i];
+    }
+    t.w[i] -= p.lr * gt;
+  }
+}
+
+__global__ void adam_multi_tensor_update(MultiTensorTable table,
+                                         MultiTensorUpdate::AdamParams p) {
+  MultiTensorEntry const &t = table.entries[blockIdx.y];
+  CUDA_KERNEL_LOOP(i, (Legion::coord_t)t.size) {
+    float gt = multi_tensor_gradient(t, p.weight_decay, i);
+    float mt = p.beta1 * t.m[i] + (1 - p.beta1) * gt;
+    float vt = p.beta2 * t.v[i] + (1 - p.beta2) * gt * gt;
+    t.m[i] = mt;
+    t.v[i] = vt;
+    t.w[i] -= p.alpha_t * mt / (sqrt(vt) + p.epsilon);
+  }
+}
+
+#ifdef FF_USE_NCCL
+// Sums the gradients of all devices with one NCCL group
+void all_reduce_gradients(OpMeta const *meta,
+                          std::vector<MultiTensorEntry> const &tensors,
+                          hipStream_t stream) {
+  checkNCCL(ncclGroupStart());
+  for (MultiTensorEntry const &t : tensors) {
+    checkNCCL(ncclAllReduce(t.w_grad,
+                            (float *)t.w_grad,
+                            t.size,
+                            ncclFloat,
+                            ncclSum,
+                            meta->handle.ncclComm,
+                            stream));
+  }
+  checkNCCL(ncclGroupEnd());
+}
+
+__host__ void Optimizer::nccl_all_reduce_task_gpu(
+    OpMeta const *meta, std::vector<MultiTensorEntry> const &gradients) {
+  hipStream_t stream;
+  checkCUDA(get_legion_stream(&stream));
+  all_reduce_gradients(meta, gradients, stream);
+}
+#endif
+
+// All-reduces the gradients if meta is given, then runs kernel on up to
+// MAX_TENSORS_PER_LAUNCH tensors at a time
+template <typename Params>
+void multi_tensor_update(void (*kernel)(MultiTensorTable, Params),
+                         Params const &params,
+                         OpMeta const *meta,
+                         std::vector<MultiTensorEntry> const &tensors) {
+  hipStream_t stream;
+  checkCUDA(get_legion_stream(&stream));
+#ifdef FF_USE_NCCL
+  if (meta != nullptr) {
+    all_reduce_gradients(meta, tensors, stream);
+  }
+#else
+  assert(meta == nullptr);
 #endif
+  int const max_tensors = MultiTensorUpdate::MAX_TENSORS_PER_LAUNCH;
+  for (size_t start = 0; start < tensors.size(); start += max_tensors) {
+    MultiTensorTable table;
+    int num_tensors = std::min(tensors.size() - start, (size_t)max_tensors);
+    size_t max_size = 0;
+    for (int i = 0; i < num_tensors; i++) {
+      table.entries[i] = tensors[start + i];
+      max_size = std::max(max_size, table.entries[i].size);
+    }
+    if (max_size == 0) {
+      continue;
+    }
+    dim3 num_blocks(std::min(GET_BLOCKS(max_size), MULTI_TENSOR_BLOCKS),
+                    num_tensors);
+    hipLaunchKernelGGL(
+        kernel, num_blocks, CUDA_NUM_THREADS, 0, stream, table, params);
+  }
+}
+
+__host__ void SGDOptimizer::fused_update_task_gpu(
+    SGDOptimizer const *op,
+    OpMeta const *meta,
+    std::vector<MultiTensorEntry> const &tensors) {
+  multi_tensor_update(
+      sgd_multi_tensor_update, op->get_update_params(), meta, tensors);
+}
+
+__host__ void AdamOptimizer::fused_update_task_gpu(
+    AdamOptimizer const *op,
+    OpMeta const *meta,
+    std::vector<MultiTensorEntry> const &tensors) {
+  multi_tensor_update(
+      adam_multi_tensor_update, op->get_update_params(), meta, tensors);
+}
+
+
+template <typename DT>
+__global__ void unscale_gradients(DT const *grad,
+                                  float *master_grad,
+                                  size_t size,
+                                  float inverse_scale,
+                                  int *overflow) {
+  CUDA_KERNEL_LOOP(i, size) {
+    float g = (float)grad[i] * inverse_scale;
+    if (!isfinite(g)) {
+      *overflow = 1;
+    }
+    master_grad[i] = g;
+  }
+}
+
+template <typename SRC, typename DST>
+__global__ void convert_weight(SRC const *src, DST *dst, size_t size) {
+  CUDA_KERNEL_LOOP(i, size) {
+    dst[i] = (DST)src[i];
+  }
+}
+
+__host__ bool Optimizer::unscale_gradients_task_gpu(
+    GenericTensorAccessorR const &grad,
+    GenericTensorAccessorW const &master_grad,
+    float inverse_scale) {
+  hipStream_t stream;
+  checkCUDA(get_legion_stream(&stream));
+  size_t size = master_grad.domain.get_volume();
+  int *overflow;
+  checkCUDA(hipMalloc(&overflow, sizeof(int)));
+  checkCUDA(hipMemsetAsync(overflow, 0, sizeof(int), stream));
+  if (grad.data_type == DT_HALF) {
+    hipLaunchKernelGGL(unscale_gradients<half>,
+                       GET_BLOCKS(size),
+                       CUDA_NUM_THREADS,
+                       0,
+                       stream,
+                       grad.get_half_ptr(),
+                       master_grad.get_float_ptr(),
+                       size,
+                       inverse_scale,
+                       overflow);
+  } else {
+    assert(grad.data_type == DT_FLOAT);
+    hipLaunchKernelGGL(unscale_gradients<float>,
+                       GET_BLOCKS(size),
+                       CUDA_NUM_THREADS,
+                       0,
+                       stream,
+                       grad.get_float_ptr(),
+                       master_grad.get_float_ptr(),
+                       size,
+                       inverse_scale,
+                       overflow);
+  }
+  int found_overflow = 0;
+  checkCUDA(hipMemcpyAsync(&found_overflow,
+                            overflow,
+                            sizeof(int),
+                            hipMemcpyDeviceToHost,
+                            stream));
+  checkCUDA(hipStreamSynchronize(stream));
+  checkCUDA(hipFree(overflow));
+  return found_overflow != 0;
+}
+
+__host__ void
+    Optimizer::convert_weight_task_gpu(GenericTensorAccessorR const &src,
+                                       GenericTensorAccessorW const &dst) {
+  hipStream_t stream;
+  checkCUDA(get_legion_stream(&stream));
+  size_t size = dst.domain.get_volume();
+  if (src.data_type == DT_HALF && dst.data_type == DT_FLOAT) {
+    hipLaunchKernelGGL((convert_weight<half, float>),
+                       GET_BLOCKS(size),
+                       CUDA_NUM_THREADS,
+                       0,
+                       stream,
+                       src.get_half_ptr(),
+                       dst.get_float_ptr(),
+                       size);
+  } else if (src.data_type == DT_FLOAT && dst.data_type == DT_HALF) {
+    hipLaunchKernelGGL((convert_weight<float, half>),
+                       GET_BLOCKS(size),
+                       CUDA_NUM_THREADS,
+                       0,
+                       stream,
+                       src.get_float_ptr(),
+                       dst.get_half_ptr(),
+                       size);
+  } else {
+    assert(false);
+  }
+}
 
 }; // namespace FlexFlow
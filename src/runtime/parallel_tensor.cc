@@ -207,6 +207,7 @@ ParallelTensorBase::ParallelTensorBase(ParallelTensorBase const &rhs) {
   sync_type = rhs.sync_type;
   initializer = rhs.initializer;
   create_gradients = rhs.create_gradients;
+  host_resident = rhs.host_resident;
 }
 
 void ParallelTensorBase::inline_map(FFConfig &config) {
@@ -0,0 +1,188 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "flexflow/utils/peft_checkpoint_writer.h"
+#include "legion.h"
+
+#include <cassert>
+#include <filesystem>
+#include <fstream>
+
+namespace FlexFlow {
+
+Legion::Logger log_peft_ckpt("PEFTCheckpoint");
+
+namespace fs = std::filesystem;
+
+// Keep a few staging buffers around for the next checkpoint
+static size_t const MAX_FREE_BUFFERS = 64;
+
+PEFTCheckpointWriter::PEFTCheckpointWriter()
+    : num_writing(0), terminating(false) {
+  writer = std::thread(&PEFTCheckpointWriter::write_loop, this);
+}
+
+PEFTCheckpointWriter::~PEFTCheckpointWriter() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    terminating = true;
+  }
+  job_available.notify_all();
+  writer.join();
+}
+
+/*static*/
+PEFTCheckpointWriter *PEFTCheckpointWriter::get_checkpoint_writer() {
+  // Destroyed at exit, after the queued files are written
+  static PEFTCheckpointWriter checkpoint_writer;
+  return &checkpoint_writer;
+}
+
+std::vector<char> PEFTCheckpointWriter::get_staging_buffer(size_t size) {
+  std::vector<char> buffer;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!free_buffers.empty()) {
+      buffer.swap(free_buffers.back());
+      free_buffers.pop_back();
+    }
+  }
+  buffer.resize(size);
+  return buffer;
+}
+
+void PEFTCheckpointWriter::write(std::string const &filepath,
+                                 std::vector<char> &&data) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    jobs.push_back({filepath, std::move(data)});
+  }
+  job_available.notify_one();
+}
+
+void PEFTCheckpointWriter::flush() {
+  std::unique_lock<std::mutex> lock(mutex);
+  jobs_done.wait(lock, [this] { return jobs.empty() && num_writing == 0; });
+}
+
+void PEFTCheckpointWriter::write_loop() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    job_available.wait(lock, [this] { return terminating || !jobs.empty(); });
+    if (jobs.empty()) {
+      // only terminate once all queued files are written
+      break;
+    }
+    Job job = std::move(jobs.front());
+    jobs.pop_front();
+    num_writing++;
+    lock.unlock();
+
+    write_file(job);
+
+    lock.lock();
+    if (free_buffers.size() < MAX_FREE_BUFFERS) {
+      free_buffers.push_back(std::move(job.data));
+    }
+    num_writing--;
+    if (jobs.empty() && num_writing == 0) {
+      jobs_done.notify_all();
+    }
+  }
+}
+
+void PEFTCheckpointWriter::write_file(Job const &job) {
+  // A failed write loses this checkpoint file only: the server keeps running
+  // and the previous checkpoint stays complete
+  std::error_code ec;
+  fs::path filepath(job.filepath);
+  if (filepath.has_parent_path()) {
+    fs::create_directories(filepath.parent_path(), ec);
+    if (ec) {
+      log_peft_ckpt.error("Could not create directory %s: %s",
+                          filepath.parent_path().c_str(),
+                          ec.message().c_str());
+      return;
+    }
+  }
+  std::string tmp_filepath = job.filepath + ".tmp";
+  std::ofstream out(tmp_filepath, std::ios::binary);
+  if (out.good()) {
+    out.write(job.data.data(), job.data.size());
+    out.close();
+  }
+  if (!out.good()) {
+    log_peft_ckpt.error("Could not write %zu bytes to %s",
+                        job.data.size(),
+                        tmp_filepath.c_str());
+    fs::remove(tmp_filepath, ec);
+    return;
+  }
+  fs::rename(tmp_filepath, filepath, ec);
+  if (ec) {
+    log_peft_ckpt.error("Could not rename %s to %s: %s",
+                        tmp_filepath.c_str(),
+                        job.filepath.c_str(),
+                        ec.message().c_str());
+    fs::remove(tmp_filepath, ec);
+  }
+}
+
+bool is_peft_checkpoint_step(int training_step,
+                             int gradient_accumulation_steps,
+                             int checkpoint_interval) {
+  assert(gradient_accumulation_steps > 0);
+  if (checkpoint_interval <= 0 || training_step < gradient_accumulation_steps) {
+    return false;
+  }
+  return training_step / checkpoint_interval >
+         (training_step - gradient_accumulation_steps) / checkpoint_interval;
+}
+
+int find_latest_peft_checkpoint(
+    std::string const &checkpoints_folder,
+    std::vector<std::string> const &expected_files) {
+  std::string const prefix = "step_";
+  int latest_step = -1;
+  if (!fs::is_directory(checkpoints_folder)) {
+    return latest_step;
+  }
+  for (auto const &entry : fs::directory_iterator(checkpoints_folder)) {
+    std::string name = entry.path().filename().string();
+    if (!entry.is_directory() || name.compare(0, prefix.size(), prefix) != 0 ||
+        name.size() == prefix.size() ||
+        name.find_first_not_of("0123456789", prefix.size()) !=
+            std::string::npos) {
+      continue;
+    }
+    int step = std::stoi(name.substr(prefix.size()));
+    if (step <= latest_step) {
+      continue;
+    }
+    bool complete = true;
+    for (std::string const &file : expected_files) {
+      if (!fs::is_regular_file(entry.path() / file)) {
+        complete = false;
+        break;
+      }
+    }
+    if (complete) {
+      latest_step = step;
+    }
+  }
+  return latest_step;
+}
+
+}; // namespace FlexFlow
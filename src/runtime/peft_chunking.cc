@@ -0,0 +1,88 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "flexflow/utils/peft_chunking.h"
+#include <algorithm>
+#include <cassert>
+
+namespace FlexFlow {
+
+PeftChunk get_next_peft_chunk(int entry_length,
+                              int num_fwd_tokens,
+                              int num_bwd_tokens,
+                              int num_free_tokens,
+                              bool truncated_backprop) {
+  assert(entry_length > 0);
+  assert(num_fwd_tokens >= 0 && num_fwd_tokens <= entry_length);
+  assert(num_bwd_tokens >= 0 && num_bwd_tokens < entry_length);
+  PeftChunk chunk;
+  if (num_free_tokens <= 0) {
+    return chunk;
+  }
+  if (truncated_backprop) {
+    // the chunks run their forward and backward passes in order
+    assert(num_bwd_tokens == num_fwd_tokens);
+    chunk.first_token_depth = num_fwd_tokens;
+    chunk.num_tokens = std::min(entry_length - num_fwd_tokens, num_free_tokens);
+    chunk.bwd = true;
+    chunk.first_bwd_chunk = chunk.first_token_depth == 0;
+    chunk.last_bwd_chunk =
+        chunk.first_token_depth + chunk.num_tokens == entry_length;
+  } else if (num_bwd_tokens == 0) {
+    // fill the KV cache until the rest of the entry fits in the batch, then
+    // run the backward pass of the last chunk
+    chunk.first_token_depth = num_fwd_tokens;
+    chunk.num_tokens = std::min(entry_length - num_fwd_tokens, num_free_tokens);
+    chunk.bwd = chunk.first_token_depth + chunk.num_tokens == entry_length;
+    chunk.first_bwd_chunk = chunk.bwd;
+    chunk.last_bwd_chunk = chunk.bwd && chunk.first_token_depth == 0;
+  } else {
+    // recompute the chunk before the ones that ran their backward pass
+    assert(num_fwd_tokens == entry_length);
+    int chunk_end = entry_length - num_bwd_tokens;
+    chunk.num_tokens = std::min(chunk_end, num_free_tokens);
+    chunk.first_token_depth = chunk_end - chunk.num_tokens;
+    chunk.bwd = true;
+    chunk.last_bwd_chunk = chunk.first_token_depth == 0;
+  }
+  return chunk;
+}
+
+int get_peft_chunk_labels(int const *tokens,
+                          int num_tokens,
+                          int next_token_id,
+                          int *labels) {
+  assert(num_tokens > 0);
+  // shift labels by 1 position to the left (ignore first token label)
+  for (int j = 0; j < num_tokens - 1; j++) {
+    labels[j] = tokens[j + 1];
+  }
+  if (next_token_id < 0) {
+    return num_tokens - 1;
+  }
+  labels[num_tokens - 1] = next_token_id;
+  return num_tokens;
+}
+
+float get_peft_loss_scale(int entry_length, int num_tokens) {
+  entry_length = std::max(entry_length, num_tokens);
+  if (entry_length <= 1) {
+    // no token of the entry has a label
+    return 0.0f;
+  }
+  return 1.0f / (entry_length - 1);
+}
+
+}; // namespace FlexFlow
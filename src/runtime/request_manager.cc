@@ -17,6 +17,8 @@
 #include "flexflow/ops/fused.h"
 #include "flexflow/ops/lora_linear.h"
 #include "flexflow/parallel_ops/parallel_op.h"
+#include "flexflow/utils/peft_checkpoint_writer.h"
+#include "flexflow/utils/peft_chunking.h"
 // #include "flexflow/tokenizers.h"
 #include <bitset>
 #include <filesystem>
@@ -75,31 +77,78 @@ std::ostream &operator<<(std::ostream &os, Request const &req) {
   os << "  completed_training_steps: " << req.completed_training_steps << "\n";
   os << "  gradient_accumulation_steps: " << req.gradient_accumulation_steps
      << "\n";
+  os << "  checkpoint_interval: " << req.checkpoint_interval << "\n";
   os << "  max_training_steps: " << req.max_training_steps << "\n";
   os << "  dataset_filepath: " << req.dataset_filepath << "\n";
-  os << "  dataset: [";
-  for (auto const &pair : req.dataset) {
-    os << "[";
-    for (auto const &token : pair.first) {
-      os << token << " ";
-    }
-    os << "], [";
-    for (auto const &token : pair.second) {
-      os << token << " ";
+  if (req.tokenized_dataset) {
+    os << "  dataset: <" << req.get_dataset_size() << " pre-tokenized entries>"
+       << "\n";
+  } else {
+    os << "  dataset: [";
+    for (auto const &pair : req.dataset) {
+      os << "[";
+      for (auto const &token : pair.first) {
+        os << token << " ";
+      }
+      os << "], [";
+      for (auto const &token : pair.second) {
+        os << token << " ";
+      }
+      os << "] ";
     }
-    os << "] ";
+    os << "]\n";
   }
-  os << "]\n";
   os << "}\n";
   return os;
 }
 
+size_t Request::get_dataset_size() const {
+  if (tokenized_dataset) {
+    return tokenized_dataset->size();
+  }
+  return dataset.size();
+}
+
+size_t Request::get_dataset_input_length(size_t entry) const {
+  if (tokenized_dataset) {
+    return tokenized_dataset->input(entry).size +
+           (dataset_bos_token_id >= 0 ? 1 : 0);
+  }
+  return dataset[entry].first.size();
+}
+
+size_t Request::get_dataset_output_length(size_t entry) const {
+  if (tokenized_dataset) {
+    return tokenized_dataset->output(entry).size;
+  }
+  return dataset[entry].second.size();
+}
+
+BatchConfig::TokenId Request::get_dataset_input_token(size_t entry,
+                                                      size_t pos) const {
+  if (tokenized_dataset) {
+    if (dataset_bos_token_id >= 0) {
+      if (pos == 0) {
+        return dataset_bos_token_id;
+      }
+      pos--;
+    }
+    return tokenized_dataset->input(entry)[pos];
+  }
+  return dataset[entry].first[pos];
+}
+
 bool RequestManager::inference_finished = false;
 
 RequestManager::RequestManager()
-    : request_manager_status(INITIALIZED), verbose(false),
-      next_available_guid(1000000), num_processed_requests(0),
-      total_request_run_time(0.0f) {
+    : request_manager_status(INITIALIZED),
+      next_speculation_depth(BeamSearchBatchConfig::MAX_BEAM_DEPTH),
+      num_tokenizer_workers(4), verbose(false), next_available_guid(1000000),
+      token_trees(BatchConfig::MAX_NUM_REQUESTS,
+                  BatchConfig::MAX_SPEC_TREE_TOKEN_NUM),
+      committed_tokens(BatchConfig::MAX_NUM_REQUESTS),
+      ssm_token_tree(1, BatchConfig::MAX_SPEC_TREE_TOKEN_NUM),
+      num_processed_requests(0), total_request_run_time(0.0f) {
   // The following config parameters are set
   // during ffmodel.compile()
   // Initialize them to -1 to make sure no one
@@ -162,6 +211,20 @@ int RequestManager::get_max_sequence_length() {
   return max_sequence_length;
 }
 
+int RequestManager::get_spec_infer_tree_width(RequestGuid guid,
+                                              int ssm_decoding_steps) {
+  int tree_width = spec_infer_tree_width.size() > ssm_decoding_steps
+                       ? spec_infer_tree_width[ssm_decoding_steps]
+                       : 1;
+  if (adaptive_speculation && tree_width > 1) {
+    auto it = speculation_plans.find(guid);
+    if (it != speculation_plans.end()) {
+      tree_width = std::min(tree_width, it->second.width);
+    }
+  }
+  return tree_width;
+}
+
 void RequestManager::push_spec_infer_tree_width(int tree_width) {
   assert(tree_width <= BeamSearchBatchConfig::MAX_BEAM_WIDTH);
   spec_infer_tree_width.emplace_back(tree_width);
@@ -171,6 +234,12 @@ void RequestManager::set_enable_peft_finetuning(bool enable_peft_finetuning_) {
   enable_peft_finetuning = enable_peft_finetuning_;
 }
 
+void RequestManager::set_resumed_training_steps(
+    PEFTModelID const &peft_model_id, int training_steps) {
+  assert(training_steps >= 0);
+  resumed_training_steps[peft_model_id] = training_steps;
+}
+
 void RequestManager::set_inference_finished(bool finished) {
   inference_finished = finished;
 }
@@ -183,6 +252,9 @@ void RequestManager::register_tokenizer(ModelType type,
   this->bos_token_id = bos_token_id;
   this->eos_token_id = eos_token_id;
   std::filesystem::path tokenizer_folder(path);
+  // Each tokenizer worker needs its own tokenizer instance, so we keep the
+  // loaded blobs around and create the instances from them
+  assert(tokenizer_pool == nullptr && "The tokenizer is already in use");
 
   if (model_type == ModelType::LLAMA) {
     std::filesystem::path tokenizer_model_path;
@@ -194,8 +266,10 @@ void RequestManager::register_tokenizer(ModelType type,
     }
     if (std::filesystem::exists(tokenizer_model_path)) {
       // load from tokenizer.model
-      this->tokenizer_ = Tokenizer::FromBlobSentencePiece(
-          LoadBytesFromFile(tokenizer_model_path.string()));
+      std::string blob = LoadBytesFromFile(tokenizer_model_path.string());
+      tokenizer_factory = [blob]() {
+        return Tokenizer::FromBlobSentencePiece(blob);
+      };
     } else {
       // load from tokenizer.json
       std::filesystem::path tokenizer_json_path =
@@ -205,8 +279,8 @@ void RequestManager::register_tokenizer(ModelType type,
                   << std::endl;
         assert(false);
       }
-      this->tokenizer_ = Tokenizer::FromBlobJSON(
-          LoadBytesFromFile(tokenizer_json_path.string()));
+      std::string blob = LoadBytesFromFile(tokenizer_json_path.string());
+      tokenizer_factory = [blob]() { return Tokenizer::FromBlobJSON(blob); };
     }
   } else if (model_type == ModelType::OPT) {
     std::filesystem::path vocab_file = tokenizer_folder / "vocab.json";
@@ -222,15 +296,37 @@ void RequestManager::register_tokenizer(ModelType type,
     std::string merges = LoadBytesFromFile(merges_file.string());
     std::string added_tokens = LoadBytesFromFile(added_tokens_file.string());
 
-    this->tokenizer_ =
-        Tokenizer::FromBlobByteLevelBPE(vocab, merges, added_tokens);
+    tokenizer_factory = [vocab, merges, added_tokens]() {
+      return Tokenizer::FromBlobByteLevelBPE(vocab, merges, added_tokens);
+    };
   } else if (model_type == ModelType::FALCON ||
              model_type == ModelType::STARCODER ||
              model_type == ModelType::MPT) {
     std::string falcon_tokenizer_path = join_path({path, "tokenizer.json"});
-    this->tokenizer_ =
-        Tokenizer::FromBlobJSON(LoadBytesFromFile(falcon_tokenizer_path));
+    std::string blob = LoadBytesFromFile(falcon_tokenizer_path);
+    tokenizer_factory = [blob]() { return Tokenizer::FromBlobJSON(blob); };
   }
+  assert(tokenizer_factory && "Unsupported model type");
+  this->tokenizer_ = tokenizer_factory();
+}
+
+void RequestManager::set_num_tokenizer_workers(int num_workers) {
+  assert(num_workers > 0);
+  const std::lock_guard<std::mutex> lock(tokenizer_pool_mutex);
+  assert(tokenizer_pool == nullptr &&
+         "The number of tokenizer workers must be set before the tokenizer "
+         "is first used");
+  num_tokenizer_workers = num_workers;
+}
+
+TokenizerPool *RequestManager::get_tokenizer_pool() {
+  const std::lock_guard<std::mutex> lock(tokenizer_pool_mutex);
+  if (tokenizer_pool == nullptr) {
+    assert(tokenizer_factory && "No tokenizer registered");
+    tokenizer_pool = std::make_unique<TokenizerPool>(tokenizer_factory,
+                                                     num_tokenizer_workers);
+  }
+  return tokenizer_pool.get();
 }
 
 void RequestManager::register_output_filepath(
@@ -256,14 +352,67 @@ size_t RequestManager::get_num_ssms() {
 
 RequestManager::RequestGuid
     RequestManager::register_new_request(Request const &request_) {
-  const std::lock_guard<std::mutex> lock(request_queue_mutex);
+  std::vector<TokenId> prompt_tokens;
+  if (request_.benchmarking_tokens < 0) {
+    if (request_.prompt.empty() && !request_.tokens.empty()) {
+      // pre-tokenized prompt
+      prompt_tokens = request_.tokens;
+    } else {
+      prompt_tokens =
+          get_tokenizer_pool()->encode_async(request_.prompt).get();
+    }
+  }
+  return register_tokenized_request(request_, prompt_tokens);
+}
+
+std::vector<RequestManager::RequestGuid> RequestManager::register_new_requests(
+    std::vector<Request> const &requests) {
+  double start_time = Realm::Clock::current_time_in_microseconds();
+  // Tokenize all prompts in parallel before taking the request queue lock
+  std::vector<std::string> prompts;
+  auto is_pretokenized = [](Request const &request) {
+    return request.prompt.empty() && !request.tokens.empty();
+  };
+  for (Request const &request : requests) {
+    if (request.benchmarking_tokens < 0 && !is_pretokenized(request)) {
+      prompts.push_back(request.prompt);
+    }
+  }
+  std::vector<std::vector<TokenId>> prompt_tokens;
+  if (!prompts.empty()) {
+    prompt_tokens = get_tokenizer_pool()->encode_batch(prompts);
+  }
+  std::vector<RequestGuid> guids;
+  size_t prompt_idx = 0;
+  for (Request const &request : requests) {
+    if (request.benchmarking_tokens < 0 && is_pretokenized(request)) {
+      guids.push_back(register_tokenized_request(request, request.tokens));
+    } else if (request.benchmarking_tokens < 0) {
+      guids.push_back(
+          register_tokenized_request(request, prompt_tokens[prompt_idx++]));
+    } else {
+      guids.push_back(
+          register_tokenized_request(request, std::vector<TokenId>()));
+    }
+  }
+  double elapsed_time =
+      Realm::Clock::current_time_in_microseconds() - start_time;
+  log_req_mgr.print("Registered %zu requests in %.1lf ms (%.1lf requests/s)",
+                    requests.size(),
+                    elapsed_time / 1e3,
+                    requests.size() / (elapsed_time / 1e6));
+  return guids;
+}
+
+RequestManager::RequestGuid RequestManager::register_tokenized_request(
+    Request const &request_, std::vector<TokenId> const &prompt_tokens) {
   // Add a new request
   Request request;
   request.status = Request::PENDING;
-  request.guid = next_available_guid++;
   request.max_sequence_length = request_.max_sequence_length;
   request.peft_model_id = request_.peft_model_id;
   request.warmup = request_.warmup;
+  request.speculation_class = request_.speculation_class;
   if (bos_token_id >= 0 && model_type != ModelType::FALCON) {
     request.tokens.push_back(bos_token_id);
   }
@@ -274,41 +423,49 @@ RequestManager::RequestGuid
                           request_.benchmarking_tokens,
                           15); // insert random number
   } else {
-    std::vector<int32_t> tokens = this->tokenizer_->Encode(request_.prompt);
-    if (tokens.size() >= get_max_sequence_length()) {
+    if (prompt_tokens.size() >= get_max_sequence_length()) {
       std::cout << "Warning: too many tokens in prompt, only load up to "
                 << get_max_sequence_length() << " tokens, but got "
-                << tokens.size() << ".\n";
+                << prompt_tokens.size() << ".\n";
       return INVALID_GUID;
     }
-    for (int i = 0; i < tokens.size(); i++) {
-      std::cout << "[" << i << "]" << tokens.at(i) << "\n";
-    }
-    request.tokens.insert(request.tokens.end(), tokens.begin(), tokens.end());
+    request.tokens.insert(
+        request.tokens.end(), prompt_tokens.begin(), prompt_tokens.end());
   }
 
   request.initial_len = request.tokens.size();
 
-  if (get_num_ssms() == 0) {
-    std::cout << "No small speculative model registered, using incremental "
-                 "decoding."
-              << std::endl;
-  } else {
-    std::cout << "Num of SSMs: " << get_num_ssms() << std::endl;
+  if (get_num_ssms() > 0) {
     for (int i = 0; i < get_num_ssms(); i++) {
       BeamTree beam_tree = BeamTree{};
       request.beam_trees.push_back(beam_tree);
     }
   }
 
-  pending_infr_request_queue.push(request);
-  all_requests[request.guid] = request;
+  GenerationResult gr;
+  gr.input_text = request_.prompt;
+  gr.input_tokens = request.tokens;
+  gr.output_text = request_.prompt;
+  gr.output_tokens = request.tokens;
+
+  ProfileInfo profile_info;
+  profile_info.registration_time = Realm::Clock::current_time_in_microseconds();
+
   {
-    const std::lock_guard<std::mutex> lock(request_to_promise_mutex);
-    request_to_promise[request.guid] = new std::promise<void>();
+    const std::lock_guard<std::mutex> lock(request_queue_mutex);
+    request.guid = next_available_guid++;
+    gr.guid = request.guid;
+    {
+      const std::lock_guard<std::mutex> lock(request_to_promise_mutex);
+      request_to_promise[request.guid] = new std::promise<void>();
+    }
+    pending_infr_request_queue.push(request);
+    all_requests[request.guid] = request;
+    request_generation_results[request.guid] = gr;
+    profiling_requests[request.guid] = profile_info;
   }
 
-  {
+  if (verbose) {
     std::string output = "New request tokens:";
     output = "[" + std::to_string(request.guid) + "]" + output;
     for (int i = 0; i < request.tokens.size(); i++) {
@@ -317,35 +474,29 @@ RequestManager::RequestGuid
     log_req_mgr.print("%s", output.c_str());
   }
 
-  GenerationResult gr;
-  gr.guid = request.guid;
-  gr.input_text = request_.prompt;
-  gr.input_tokens = request.tokens;
-  gr.output_text = request_.prompt;
-  gr.output_tokens = request.tokens;
-  request_generation_results[request.guid] = gr;
-
-  ProfileInfo profile_info;
-  profile_info.registration_time = Realm::Clock::current_time_in_microseconds();
-  profiling_requests[request.guid] = profile_info;
-
   return request.guid;
 }
 
 RequestManager::RequestGuid
     RequestManager::register_new_peft_request(Request const &request_) {
   assert(enable_peft_finetuning && "PEFT finetuning is not enabled");
-  const std::lock_guard<std::mutex> lock(request_queue_mutex);
   // Add a new request
   Request request;
   request.status = Request::PENDING;
-  request.guid = next_available_guid++;
   request.initial_len = 0;
   request.max_sequence_length = request_.max_sequence_length;
   request.peft_model_id = request_.peft_model_id;
   request.req_type = RequestType::REQ_FINETUNING;
   request.completed_training_steps = 0;
+  if (resumed_training_steps.find(request.peft_model_id) !=
+      resumed_training_steps.end()) {
+    // continue the step count, and so the dataset position, of the
+    // checkpoint the adapter was loaded from
+    request.completed_training_steps =
+        resumed_training_steps[request.peft_model_id];
+  }
   request.gradient_accumulation_steps = request_.gradient_accumulation_steps;
+  request.checkpoint_interval = request_.checkpoint_interval;
   request.max_training_steps = request_.max_training_steps;
   request.dataset_filepath = request_.dataset_filepath;
   request.warmup = request_.warmup;
@@ -364,6 +515,27 @@ RequestManager::RequestGuid
                         request_.benchmarking_tokens - (int)bos_added,
                         15); // insert random number
     request.dataset.push_back(std::make_pair(input_tokens, output_tokens));
+  } else if (TokenDataset::is_token_dataset(request.dataset_filepath)) {
+    // Pre-tokenized dataset: map the file and read entries in place rather
+    // than tokenizing and copying every sample
+    request.tokenized_dataset =
+        std::make_shared<TokenDataset>(request.dataset_filepath);
+    if (bos_token_id >= 0 && model_type != ModelType::FALCON) {
+      request.dataset_bos_token_id = bos_token_id;
+    }
+    size_t max_length = request.tokenized_dataset->max_entry_length() +
+                        (request.dataset_bos_token_id >= 0 ? 1 : 0);
+    if (max_length > get_max_sequence_length()) {
+      std::cout << "Warning: too many tokens in sample, only load up to "
+                << get_max_sequence_length() << " tokens, but got "
+                << max_length << ".\n";
+      return INVALID_GUID;
+    }
+    log_req_mgr.print("Mapped pre-tokenized dataset %s (%zu entries, %zu "
+                      "tokens)",
+                      request.dataset_filepath.c_str(),
+                      request.tokenized_dataset->size(),
+                      request.tokenized_dataset->get_num_tokens());
   } else {
     using json = nlohmann::json;
     std::ifstream file_handle(request.dataset_filepath);
@@ -373,16 +545,18 @@ RequestManager::RequestGuid
                                     /*allow_exceptions */ true,
                                     /*ignore_comments */ true);
 
+    std::vector<std::string> texts;
     for (auto &prompt : dataset_json) {
-      std::string text = prompt.get<std::string>();
-      std::string output_text("");
-      std::vector<int32_t> input_tokens;
-      input_tokens = this->tokenizer_->Encode(text);
+      texts.push_back(prompt.get<std::string>());
+    }
+    std::vector<std::vector<int32_t>> dataset_tokens =
+        get_tokenizer_pool()->encode_batch(texts);
+    std::vector<int32_t> output_tokens =
+        get_tokenizer_pool()->encode_async(std::string("")).get();
+    for (auto &input_tokens : dataset_tokens) {
       if (bos_token_id >= 0 && model_type != ModelType::FALCON) {
         input_tokens.insert(input_tokens.begin(), bos_token_id);
       }
-      std::vector<int32_t> output_tokens =
-          this->tokenizer_->Encode(output_text);
       if (input_tokens.size() + output_tokens.size() >
           get_max_sequence_length()) {
         std::cout << "Warning: too many tokens in sample, only load up to "
@@ -396,13 +570,15 @@ RequestManager::RequestGuid
   }
 
   if (request.gradient_accumulation_steps == -1) {
-    request.gradient_accumulation_steps = request.dataset.size();
+    request.gradient_accumulation_steps = request.get_dataset_size();
   }
   assert(request.gradient_accumulation_steps > 0 &&
          "Invalid gradient accumulation steps");
   assert(request.gradient_accumulation_steps <= request.max_training_steps &&
          "Gradient accumulation steps should be less than or equal to max "
          "training steps");
+  assert(request.completed_training_steps < request.max_training_steps &&
+         "The checkpoint to resume from already completed max training steps");
 
   // Currently don't support speculative inference for PEFT
   assert(get_num_ssms() == 0);
@@ -418,14 +594,26 @@ RequestManager::RequestGuid
     }
   }
 
-  pending_peft_request_queue.push(request);
-  all_requests[request.guid] = request;
+  GenerationResult gr;
+  ProfileInfo profile_info;
+  profile_info.registration_time = Realm::Clock::current_time_in_microseconds();
   {
-    const std::lock_guard<std::mutex> lock(request_to_promise_mutex);
-    request_to_promise[request.guid] = new std::promise<void>();
+    const std::lock_guard<std::mutex> lock(request_queue_mutex);
+    request.guid = next_available_guid++;
+    gr.guid = request.guid;
+    {
+      const std::lock_guard<std::mutex> lock(request_to_promise_mutex);
+      request_to_promise[request.guid] = new std::promise<void>();
+    }
+    pending_peft_request_queue.push(request);
+    all_requests[request.guid] = request;
+    request_generation_results[request.guid] = gr;
+    profiling_requests[request.guid] = profile_info;
   }
 
-  for (size_t r = 0; r < request.dataset.size(); r++) {
+  for (size_t r = 0;
+       verbose && !request.tokenized_dataset && r < request.dataset.size();
+       r++) {
     std::string input = "[" + std::to_string(r) + "] input:";
     std::string output = "[" + std::to_string(r) + "] output:";
     for (size_t i = 0; i < request.dataset[r].first.size(); i++) {
@@ -438,18 +626,6 @@ RequestManager::RequestGuid
     log_req_mgr.print("%s", output.c_str());
   }
 
-  GenerationResult gr;
-  gr.guid = request.guid;
-  // gr.input_text = prompt;
-  // gr.input_tokens = request.tokens;
-  // gr.output_text = prompt;
-  // gr.output_tokens = request.tokens;
-  request_generation_results[request.guid] = gr;
-
-  ProfileInfo profile_info;
-  profile_info.registration_time = Realm::Clock::current_time_in_microseconds();
-  profiling_requests[request.guid] = profile_info;
-
   return request.guid;
 }
 
@@ -491,13 +667,30 @@ BatchConfigFuture
                                        Context ctx,
                                        Runtime *runtime) {
   RequestManager *rm = this;
+  // The plan only depends on the previous batch config, so Legion runs it
+  // while the previous batch executes; only the patch waits for its result
+  TaskLauncher plan_launcher(RM_PLAN_NEXT_BATCH_TASK_ID,
+                             TaskArgument(&rm, sizeof(RequestManager *)));
+  plan_launcher.add_future(old_bc);
+  BatchConfigFuture plan = runtime->execute_task(ctx, plan_launcher);
   TaskLauncher launcher(RM_PREPARE_NEXT_BATCH_TASK_ID,
                         TaskArgument(&rm, sizeof(RequestManager *)));
   launcher.add_future(old_bc);
   launcher.add_future(result);
+  launcher.add_future(plan);
   return runtime->execute_task(ctx, launcher);
 }
 
+BatchConfig RequestManager::plan_next_batch_task(
+    Task const *task,
+    std::vector<PhysicalRegion> const &regions,
+    Context ctx,
+    Runtime *runtime) {
+  RequestManager *rm = *((RequestManager **)task->args);
+  BatchConfig const *bc = BatchConfig::from_future(task->futures[0]);
+  return rm->plan_next_batch(*bc);
+}
+
 BatchConfig RequestManager::prepare_next_batch_task(
     Task const *task,
     std::vector<PhysicalRegion> const &regions,
@@ -507,7 +700,9 @@ BatchConfig RequestManager::prepare_next_batch_task(
   BatchConfig const *bc = BatchConfig::from_future(task->futures[0]);
   InferenceResult const &result =
       Future(task->futures[1]).get_result<InferenceResult>();
-  return rm->prepare_next_batch(*bc, result);
+  BatchConfig new_bc = *BatchConfig::from_future(task->futures[2]);
+  rm->patch_next_batch(*bc, result, new_bc);
+  return new_bc;
 }
 
 bool RequestManager::check_inf_req_completion(BatchConfig const &old_bc,
@@ -566,36 +761,55 @@ void RequestManager::check_batch(BatchConfig const &old_bc,
   }
 }
 
+void RequestManager::complete_inf_request(BatchConfig const &old_bc, int i) {
+  Request &request = all_requests[old_bc.requestsInfo[i].request_guid];
+  request.status = Request::COMPLETED;
+  log_req_mgr.print("[Done] guid(%zu) final_length(%zu)",
+                    old_bc.requestsInfo[i].request_guid,
+                    request.tokens.size());
+  num_processed_requests++;
+  ProfileInfo profile_info = profiling_requests[request.guid];
+  profile_info.finish_time = Realm::Clock::current_time_in_microseconds();
+  total_request_run_time += profile_info.finish_time - profile_info.start_time;
+  profiling_requests[request.guid] = profile_info;
+  log_req_mgr.print("[%s] guid(%zu) llm_decoding_steps(%d) start(%.1lf) "
+                    "finish(%.1lf) latency(%.1lf) ttft(%.1lf)",
+                    request.warmup ? "Warmup" : "Profile",
+                    request.guid,
+                    profile_info.llm_decoding_steps,
+                    profile_info.start_time,
+                    profile_info.finish_time,
+                    profile_info.finish_time - profile_info.start_time,
+                    profile_info.first_token_time -
+                        profile_info.registration_time);
+  std::ostringstream profile_line;
+  profile_line << "[" << (request.warmup ? "Warmup" : "Profile") << "] guid("
+               << request.guid << ") llm_decoding_steps("
+               << profile_info.llm_decoding_steps << ") latency("
+               << std::fixed << std::setprecision(3)
+               << (profile_info.finish_time - profile_info.start_time)
+               << ") ttft(" << std::fixed << std::setprecision(3)
+               << (profile_info.first_token_time -
+                   profile_info.registration_time)
+               << ")\n";
+  // The request is detokenized on the tokenizer pool, which also updates the
+  // generation result and wakes up waiting callers
+  publish_generation_result(request.guid,
+                            request.tokens,
+                            profile_line.str(),
+                            request.benchmarking_tokens <= 0);
+}
+
 BatchConfig RequestManager::prepare_next_batch(BatchConfig const &old_bc,
                                                InferenceResult const &result) {
-  const std::lock_guard<std::mutex> lock(request_queue_mutex);
-  // Step 1: append result from previous iteration to request's tokens
-  for (int i = 0; i < old_bc.num_active_tokens(); i++) {
-    size_t guid =
-        old_bc.requestsInfo[old_bc.tokensInfo[i].request_index].request_guid;
-    Request &request = all_requests[guid];
-    if (request.req_type == RequestType::REQ_FINETUNING) {
-      continue;
-    }
-    if (old_bc.tokensInfo[i].abs_depth_in_request + 1 < request.tokens.size()) {
-      // This is a prompt token
-      continue;
-    } else {
-      // This is a decoding token
-      assert(old_bc.tokensInfo[i].abs_depth_in_request + 1 ==
-             request.tokens.size());
-      if (!profiling_requests[guid].first_token_time_set) {
-        profiling_requests[guid].first_token_time =
-            Realm::Clock::current_time_in_microseconds();
-        profiling_requests[guid].first_token_time_set = true;
-      }
-      log_req_mgr.print("Output token is: %d", result.token_ids[i]);
-      request.tokens.push_back(result.token_ids[i]);
-      // std::string output = this->tokenizer_->Decode(request.tokens);
-      // log_req_mgr.print("Output: %s", output.c_str());
-    }
-  }
+  BatchConfig new_bc = plan_next_batch(old_bc);
+  patch_next_batch(old_bc, result, new_bc);
+  return new_bc;
+}
 
+BatchConfig RequestManager::plan_next_batch(BatchConfig const &old_bc) {
+  const std::lock_guard<std::mutex> lock(request_queue_mutex);
+  double plan_start = Realm::Clock::current_time_in_microseconds();
   int num_generation_tokens = 0;
   int num_active_req = -1;
 
@@ -604,10 +818,29 @@ BatchConfig RequestManager::prepare_next_batch(BatchConfig const &old_bc,
   int inference_batch_size =
       BatchConfig::max_requests_per_batch() - (int)enable_peft_finetuning;
 
+  // The tokens sampled from old_bc are not known yet. A request samples a
+  // token if old_bc reached the end of its tokens; requests that reach their
+  // maximum length with that token are left out of the next batch here,
+  // while requests that sample EOS are removed by patch_next_batch.
+  std::vector<bool> continues(inference_batch_size, false);
+  for (int i = 0; i < inference_batch_size; i++) {
+    if (old_bc.request_completed[i]) {
+      continue;
+    }
+    Request const &request =
+        all_requests[old_bc.requestsInfo[i].request_guid];
+    int processed_tokens = old_bc.requestsInfo[i].first_token_depth_in_request +
+                           old_bc.requestsInfo[i].num_tokens_in_batch;
+    assert(processed_tokens <= request.tokens.size());
+    size_t length =
+        request.tokens.size() + (processed_tokens == request.tokens.size());
+    continues[i] = length < old_bc.requestsInfo[i].max_sequence_length;
+  }
+
   // Step 2: prepare the next batch for existing inference requests
   BatchConfig new_bc;
   for (int i = 0; i < inference_batch_size; i++) {
-    if (old_bc.request_completed[i]) {
+    if (old_bc.request_completed[i] || !continues[i]) {
       // no need to carry over tokens to new batch for this request
       continue;
     } else {
@@ -619,139 +852,75 @@ BatchConfig RequestManager::prepare_next_batch(BatchConfig const &old_bc,
       int processed_tokens =
           old_bc.requestsInfo[i].first_token_depth_in_request +
           old_bc.requestsInfo[i].num_tokens_in_batch;
-      assert(processed_tokens < request.tokens.size());
-      bool request_completed = check_inf_req_completion(old_bc, i);
-      if (request_completed) {
-        std::string output = this->tokenizer_->Decode(request.tokens);
-        // Unlike Huggingface, the sentencepiece C++ library automatically
-        // removes the BOS token
-        if (model_type == ModelType::LLAMA &&
-            request.tokens.at(0) == bos_token_id) {
-          output = "<s> " + output;
-        }
-        {
-          // update generation result
-          GenerationResult &gr = request_generation_results[request.guid];
-          assert(gr.guid == request.guid);
-          gr.output_tokens = request.tokens;
-          gr.output_text = output;
-        }
-        request.status = Request::COMPLETED;
-        trigger_request_completion_future(request.guid);
-        log_req_mgr.print("[Done] guid(%zu) final_length(%zu)",
-                          old_bc.requestsInfo[i].request_guid,
-                          request.tokens.size());
-        log_req_mgr.print("Final output: %s", output.c_str());
-        num_processed_requests++;
-        ProfileInfo profile_info = profiling_requests[request.guid];
-        profile_info.finish_time = Realm::Clock::current_time_in_microseconds();
-        total_request_run_time +=
-            profile_info.finish_time - profile_info.start_time;
-        profiling_requests[request.guid] = profile_info;
-        log_req_mgr.print("[%s] guid(%zu) llm_decoding_steps(%d) start(%.1lf) "
-                          "finish(%.1lf) latency(%.1lf) ttft(%.1lf)",
-                          request.warmup ? "Warmup" : "Profile",
-                          request.guid,
-                          profile_info.llm_decoding_steps,
-                          profile_info.start_time,
-                          profile_info.finish_time,
-                          profile_info.finish_time - profile_info.start_time,
-                          profile_info.first_token_time -
-                              profile_info.registration_time);
-        // Write output to file if needed:
-        if (!output_filepath.empty()) {
-          std::ofstream outputFile(output_filepath, std::ios::app);
-          if (outputFile.is_open()) {
-            outputFile << "[" << (request.warmup ? "Warmup" : "Profile")
-                       << "] guid(" << request.guid << ") llm_decoding_steps("
-                       << profile_info.llm_decoding_steps << ") latency("
-                       << std::fixed << std::setprecision(3)
-                       << (profile_info.finish_time - profile_info.start_time)
-                       << ") ttft(" << std::fixed << std::setprecision(3)
-                       << (profile_info.first_token_time -
-                           profile_info.registration_time)
-                       << ")\n";
-            if (request.benchmarking_tokens <= 0) {
-              outputFile << "token IDs: ";
-              for (int i = 0; i < request.tokens.size(); i++) {
-                outputFile << request.tokens[i];
-                if (i < request.tokens.size() - 1) {
-                  outputFile << ",";
-                }
-              }
-              outputFile << std::endl;
-              outputFile << output;
-            }
-            outputFile.close();
-          } else {
-            std::cout << "Unable to open the output file: " << output_filepath
-                      << std::endl;
-            assert(false);
-          }
-        }
+      new_bc.request_completed[i] = false;
+      new_bc.requestsInfo[i].first_token_depth_in_request = processed_tokens;
+      new_bc.requestsInfo[i].first_token_offset_in_batch = new_bc.num_tokens;
+      new_bc.requestsInfo[i].request_guid = old_bc.requestsInfo[i].request_guid;
+      new_bc.requestsInfo[i].peft_model_id =
+          old_bc.requestsInfo[i].peft_model_id;
+      new_bc.requestsInfo[i].peft_bwd = old_bc.requestsInfo[i].peft_bwd;
+      new_bc.requestsInfo[i].max_sequence_length =
+          old_bc.requestsInfo[i].max_sequence_length;
+      num_active_req++;
+      new_bc.requestsInfo[num_active_req].batch_config_request_id = i;
+      if (processed_tokens == request.tokens.size()) {
+        // Incremental phase
+        new_bc.requestsInfo[i].num_tokens_in_batch = 1;
+        num_generation_tokens++;
+        new_bc.requestsInfo[i].prompt_phase = false;
       } else {
-        new_bc.request_completed[i] = false;
-        new_bc.requestsInfo[i].first_token_depth_in_request = processed_tokens;
-        new_bc.requestsInfo[i].first_token_offset_in_batch = new_bc.num_tokens;
-        new_bc.requestsInfo[i].request_guid =
-            old_bc.requestsInfo[i].request_guid;
-        new_bc.requestsInfo[i].peft_model_id =
-            old_bc.requestsInfo[i].peft_model_id;
-        new_bc.requestsInfo[i].peft_bwd = old_bc.requestsInfo[i].peft_bwd;
-        new_bc.requestsInfo[i].max_sequence_length =
-            old_bc.requestsInfo[i].max_sequence_length;
-        num_active_req++;
-        new_bc.requestsInfo[num_active_req].batch_config_request_id = i;
-        if (new_bc.requestsInfo[i].first_token_depth_in_request + 1 ==
-            request.tokens.size()) {
-          // Incremental phase
-          new_bc.requestsInfo[i].num_tokens_in_batch = 1;
-          num_generation_tokens++;
-          new_bc.requestsInfo[i].prompt_phase = false;
-        } else {
-          // Prompt phase
-          assert(old_bc.requestsInfo[i].prompt_phase == true);
-          int space_for_incr_dec_requests = 0;
-          // If the prompt can't fit in the batch, compute how much space we
-          // need to leave out for incomplete requests in decoding phase at
-          // higher indices.
-          for (int ii = i + 1; ii < inference_batch_size; ii++) {
-            if (old_bc.request_completed[ii]) {
-              continue;
-            }
-            Request &old_request =
-                all_requests[old_bc.requestsInfo[ii].request_guid];
-            bool req_completed = check_inf_req_completion(old_bc, ii);
-            if (!req_completed) {
-              space_for_incr_dec_requests++;
-            }
+        // Prompt phase
+        assert(old_bc.requestsInfo[i].prompt_phase == true);
+        int space_for_incr_dec_requests = 0;
+        // If the prompt can't fit in the batch, compute how much space we
+        // need to leave out for incomplete requests in decoding phase at
+        // higher indices.
+        for (int ii = i + 1; ii < inference_batch_size; ii++) {
+          if (!old_bc.request_completed[ii] && continues[ii]) {
+            space_for_incr_dec_requests++;
           }
-          new_bc.requestsInfo[i].num_tokens_in_batch =
-              std::min(get_max_tokens_per_batch() - new_bc.num_tokens -
-                           space_for_incr_dec_requests,
-                       (int)request.tokens.size() -
-                           new_bc.requestsInfo[i].first_token_depth_in_request);
-          new_bc.requestsInfo[i].prompt_phase = true;
-        }
-        for (int j = 0; j < new_bc.requestsInfo[i].num_tokens_in_batch; j++) {
-          int depth = new_bc.requestsInfo[i].first_token_depth_in_request + j;
-          new_bc.tokensInfo[new_bc.num_tokens].request_index = i;
-          new_bc.tokensInfo[new_bc.num_tokens].abs_depth_in_request = depth;
-          assert(depth < request.tokens.size());
-          new_bc.tokensInfo[new_bc.num_tokens].token_id = request.tokens[depth];
-          new_bc.num_tokens++;
         }
-        // Update profiling
-        profiling_requests[new_bc.requestsInfo[i].request_guid]
-            .llm_decoding_steps++;
+        new_bc.requestsInfo[i].num_tokens_in_batch =
+            std::min(get_max_tokens_per_batch() - new_bc.num_tokens -
+                         space_for_incr_dec_requests,
+                     (int)request.tokens.size() - processed_tokens);
+        new_bc.requestsInfo[i].prompt_phase = true;
       }
+      for (int j = 0; j < new_bc.requestsInfo[i].num_tokens_in_batch; j++) {
+        int depth = new_bc.requestsInfo[i].first_token_depth_in_request + j;
+        new_bc.tokensInfo[new_bc.num_tokens].request_index = i;
+        new_bc.tokensInfo[new_bc.num_tokens].abs_depth_in_request = depth;
+        assert(depth <= request.tokens.size());
+        // the token sampled from old_bc is filled in by patch_next_batch
+        new_bc.tokensInfo[new_bc.num_tokens].token_id =
+            depth < request.tokens.size() ? request.tokens[depth] : -1;
+        new_bc.num_tokens++;
+      }
+      // Update profiling
+      profiling_requests[new_bc.requestsInfo[i].request_guid]
+          .llm_decoding_steps++;
     }
   }
   new_bc.num_generation_tokens = num_generation_tokens;
 
-  // Step 3: add new inference requests to the next batch if there is space
+  // Step 3: add new inference requests to the next batch if there is space.
+  // Requests that use the same adapter go to neighbouring slots, so that
+  // their tokens are contiguous in later batches and LoRA layers can process
+  // them with one GEMM per adapter.
+  std::vector<bool> free_slots(inference_batch_size);
+  std::vector<size_t> slot_adapters(inference_batch_size);
   for (int i = 0; i < inference_batch_size; i++) {
-    if (new_bc.request_completed[i]) {
+    free_slots[i] = new_bc.request_completed[i];
+    slot_adapters[i] = new_bc.requestsInfo[i].peft_model_id.id;
+  }
+  for (int n = 0; n < inference_batch_size; n++) {
+    int i = pending_infr_request_queue.empty()
+                ? -1
+                : choose_adapter_slot(
+                      free_slots,
+                      slot_adapters,
+                      pending_infr_request_queue.front().peft_model_id.id);
+    if (i >= 0) {
       if (!pending_infr_request_queue.empty() &&
           new_bc.num_tokens < get_max_tokens_per_batch()) {
         Request new_request = pending_infr_request_queue.front();
@@ -770,6 +939,8 @@ BatchConfig RequestManager::prepare_next_batch(BatchConfig const &old_bc,
         new_bc.requestsInfo[i].peft_model_id = new_request.peft_model_id;
         new_bc.requestsInfo[i].peft_bwd = false;
         new_bc.request_completed[i] = false;
+        free_slots[i] = false;
+        slot_adapters[i] = new_request.peft_model_id.id;
         new_bc.requestsInfo[i].prompt_phase = true;
         num_active_req++;
         new_bc.requestsInfo[num_active_req].batch_config_request_id = i;
@@ -801,82 +972,40 @@ BatchConfig RequestManager::prepare_next_batch(BatchConfig const &old_bc,
     assert(request.req_type == RequestType::REQ_FINETUNING &&
            "Found misplaced inference request");
 
-    request.finetuning_losses.push_back(result.finetuning_loss);
-
-    request.dataset_entry_processed_tokens +=
-        old_bc.requestsInfo[inference_batch_size].num_tokens_in_batch;
-    request.processed_finetuning_tokens +=
-        old_bc.requestsInfo[inference_batch_size].num_tokens_in_batch;
-    request.finetuning_tokens_per_batch.push_back(
-        old_bc.requestsInfo[inference_batch_size].num_tokens_in_batch);
+    BatchConfig::PerRequestInfo const &chunk_info =
+        old_bc.requestsInfo[inference_batch_size];
+    int num_chunk_tokens = chunk_info.num_tokens_in_batch;
+    // chunks that recompute their activations are already in the KV cache
+    request.dataset_entry_processed_tokens =
+        std::max(request.dataset_entry_processed_tokens,
+                 chunk_info.first_token_depth_in_request + num_chunk_tokens);
+    if (chunk_info.peft_bwd) {
+      request.dataset_entry_bwd_tokens += num_chunk_tokens;
+    }
+    request.processed_finetuning_tokens += num_chunk_tokens;
+    request.finetuning_tokens_per_batch.push_back(num_chunk_tokens);
     int dataset_entry =
-        request.completed_training_steps % request.dataset.size();
-    if (old_bc.requestsInfo[inference_batch_size].first_token_depth_in_request +
-            old_bc.requestsInfo[inference_batch_size].num_tokens_in_batch ==
-        request.dataset[dataset_entry].first.size()) {
+        request.completed_training_steps % request.get_dataset_size();
+    if (request.dataset_entry_bwd_tokens ==
+        request.get_dataset_input_length(dataset_entry)) {
       // completed the current dataset entry
       assert(request.dataset_entry_processed_tokens ==
-             request.dataset[dataset_entry].first.size());
+             request.get_dataset_input_length(dataset_entry));
       request.completed_training_steps += 1;
       request.dataset_entry_processed_tokens = 0;
+      request.dataset_entry_bwd_tokens = 0;
     }
 
     assert(request.completed_training_steps <= request.max_training_steps);
     if (request.completed_training_steps == request.max_training_steps ||
         inference_finished) {
-      // check if the fine tuning request has completed
+      // the request is published once the loss of its last batch is known
       request.status = Request::COMPLETED;
-
-      GenerationResult &gr = request_generation_results[request.guid];
-      assert(gr.guid == request.guid);
-      gr.finetuning_losses = request.finetuning_losses;
-      trigger_request_completion_future(request.guid);
-      num_processed_requests++;
-
-      ProfileInfo profile_info = profiling_requests[request.guid];
-      profile_info.finish_time = Realm::Clock::current_time_in_microseconds();
-      total_request_run_time +=
-          profile_info.finish_time - profile_info.start_time;
-      profiling_requests[request.guid] = profile_info;
-      log_req_mgr.print("[%s] guid(%zu) completed_training_steps(%d) "
-                        "processed_finetuning_tokens(%lu) latency(%.1lf)",
-                        request.warmup ? "Warmup" : "Finetuning",
-                        request.guid,
-                        request.completed_training_steps,
-                        request.processed_finetuning_tokens,
-                        profile_info.finish_time - profile_info.start_time);
-      if (!output_filepath.empty()) {
-        std::ofstream outputFile(output_filepath, std::ios::app);
-        if (outputFile.is_open()) {
-          std::string tokens_str = "[";
-          for (size_t i = 0; i < request.finetuning_tokens_per_batch.size();
-               i++) {
-            tokens_str +=
-                std::to_string(request.finetuning_tokens_per_batch[i]);
-            if (i != request.finetuning_tokens_per_batch.size() - 1) {
-              tokens_str += ", ";
-            }
-          }
-          tokens_str += "]";
-          outputFile << "[" << (request.warmup ? "Warmup" : "Finetuning")
-                     << "] guid(" << request.guid
-                     << ") completed_training_steps("
-                     << request.completed_training_steps
-                     << ") processed_finetuning_tokens("
-                     << request.processed_finetuning_tokens << ") latency("
-                     << std::fixed << std::setprecision(3)
-                     << (profile_info.finish_time - profile_info.start_time)
-                     << ") tokens_per_batch(" << tokens_str << ")\n";
-          outputFile.close();
-        } else {
-          std::cout << "Unable to open the output file: " << output_filepath
-                    << std::endl;
-          assert(false);
-        }
-      }
     }
   }
 
+  int finetuning_token_budget = get_finetuning_token_budget(new_bc);
+
   // Step 4: add PEFT bwd requests, if there is additional space
   while (pending_peft_request_queue.size() > 0) {
     Request &request = pending_peft_request_queue.front();
@@ -893,7 +1022,7 @@ BatchConfig RequestManager::prepare_next_batch(BatchConfig const &old_bc,
   if (pending_peft_request_queue.size() > 0 && !inference_finished) {
     Request &request = pending_peft_request_queue.front();
     assert(request.req_type = RequestType::REQ_FINETUNING);
-    assert(request.dataset.size() > 0);
+    assert(request.get_dataset_size() > 0);
     // update status and training steps
     Request &all_req_handle = all_requests[request.guid];
     assert(all_req_handle.req_type = RequestType::REQ_FINETUNING);
@@ -903,9 +1032,10 @@ BatchConfig RequestManager::prepare_next_batch(BatchConfig const &old_bc,
         all_req_handle.processed_finetuning_tokens;
     request.status = all_req_handle.status;
     int dataset_entry =
-        request.completed_training_steps % request.dataset.size();
+        request.completed_training_steps % request.get_dataset_size();
     request.dataset_entry_processed_tokens =
         all_req_handle.dataset_entry_processed_tokens;
+    request.dataset_entry_bwd_tokens = all_req_handle.dataset_entry_bwd_tokens;
     request.gradient_accumulation_steps =
         all_req_handle.gradient_accumulation_steps;
 
@@ -913,13 +1043,23 @@ BatchConfig RequestManager::prepare_next_batch(BatchConfig const &old_bc,
     assert(request.max_training_steps > 0 &&
            request.completed_training_steps < request.max_training_steps);
     assert(request.dataset_entry_processed_tokens <=
-           request.dataset[dataset_entry].first.size());
-
-    int num_peft_tokens =
-        min((int)request.dataset[dataset_entry].first.size() -
-                request.dataset_entry_processed_tokens,
-            get_max_tokens_per_batch() - new_bc.num_active_infr_tokens());
-    int num_peft_label_tokens = request.dataset[dataset_entry].second.size();
+           request.get_dataset_input_length(dataset_entry));
+
+    int entry_length = request.get_dataset_input_length(dataset_entry);
+    int num_free_tokens =
+        get_max_tokens_per_batch() - new_bc.num_active_infr_tokens();
+    if (coserving_controller.is_enabled()) {
+      num_free_tokens = min(num_free_tokens, finetuning_token_budget);
+    }
+    PeftChunk chunk =
+        get_next_peft_chunk(entry_length,
+                            request.dataset_entry_processed_tokens,
+                            request.dataset_entry_bwd_tokens,
+                            num_free_tokens,
+                            peft_truncated_backprop);
+    int num_peft_tokens = chunk.num_tokens;
+    int num_peft_label_tokens =
+        request.get_dataset_output_length(dataset_entry);
     assert(num_peft_label_tokens == 0);
 
     if (num_peft_tokens > 0) {
@@ -927,7 +1067,7 @@ BatchConfig RequestManager::prepare_next_batch(BatchConfig const &old_bc,
       // request info
       new_bc.request_completed[inference_batch_size] = false;
       new_bc.requestsInfo[inference_batch_size].first_token_depth_in_request =
-          request.dataset_entry_processed_tokens;
+          chunk.first_token_depth;
       new_bc.requestsInfo[inference_batch_size].first_token_offset_in_batch =
           new_bc.num_active_infr_tokens();
       new_bc.requestsInfo[inference_batch_size].num_tokens_in_batch =
@@ -937,27 +1077,175 @@ BatchConfig RequestManager::prepare_next_batch(BatchConfig const &old_bc,
       new_bc.requestsInfo[inference_batch_size].request_guid = request.guid;
       new_bc.requestsInfo[inference_batch_size].peft_model_id =
           request.peft_model_id;
-      new_bc.requestsInfo[inference_batch_size].peft_bwd = true;
-      set_optimizer_tasks(
-          new_bc.requestsInfo[inference_batch_size].optimizer_tasks,
-          request.max_training_steps,
-          request.completed_training_steps,
-          request.gradient_accumulation_steps);
+      // Entries that do not fit in the batch are split into chunks that
+      // attend to the earlier chunks through the KV cache, so only the
+      // activations of the current chunk are kept. A chunk that only fills
+      // the KV cache runs like a prompt chunk of an inference request.
+      new_bc.requestsInfo[inference_batch_size].peft_bwd = chunk.bwd;
+      new_bc.requestsInfo[inference_batch_size].prompt_phase = !chunk.bwd;
+      int chunk_end = chunk.first_token_depth + num_peft_tokens;
+      new_bc.requestsInfo[inference_batch_size].peft_entry_length =
+          entry_length;
+      new_bc.requestsInfo[inference_batch_size].peft_next_token_id =
+          chunk_end == entry_length
+              ? -1
+              : request.get_dataset_input_token(dataset_entry, chunk_end);
+      new_bc.requestsInfo[inference_batch_size].peft_truncated_bwd =
+          peft_truncated_backprop;
+      if (chunk.bwd) {
+        set_optimizer_tasks(
+            new_bc.requestsInfo[inference_batch_size].optimizer_tasks,
+            request.max_training_steps,
+            request.completed_training_steps,
+            request.gradient_accumulation_steps,
+            request.checkpoint_interval,
+            chunk.first_bwd_chunk,
+            chunk.last_bwd_chunk);
+      }
       // tokens info
-      for (size_t i = request.dataset_entry_processed_tokens;
-           i < request.dataset_entry_processed_tokens + num_peft_tokens;
-           i++) {
+      for (int i = chunk.first_token_depth; i < chunk_end; i++) {
         new_bc.tokensInfo[new_bc.num_tokens].token_id =
-            request.dataset[dataset_entry].first[i];
+            request.get_dataset_input_token(dataset_entry, i);
         new_bc.tokensInfo[new_bc.num_tokens].request_index =
             inference_batch_size;
         new_bc.tokensInfo[new_bc.num_tokens].abs_depth_in_request = i;
         new_bc.num_tokens++;
-        new_bc.num_peft_tokens++;
+        new_bc.num_peft_tokens += chunk.bwd;
+      }
+    }
+  }
+  log_req_mgr.debug("planned batch in %.1lf us",
+                    Realm::Clock::current_time_in_microseconds() - plan_start);
+  return new_bc;
+}
+
+void RequestManager::patch_next_batch(BatchConfig const &old_bc,
+                                      InferenceResult const &result,
+                                      BatchConfig &new_bc) {
+  const std::lock_guard<std::mutex> lock(request_queue_mutex);
+  // Everything below is on the critical path between two batches
+  double patch_start = Realm::Clock::current_time_in_microseconds();
+  // Step 1: append result from previous iteration to request's tokens
+  for (int i = 0; i < old_bc.num_active_tokens(); i++) {
+    size_t guid =
+        old_bc.requestsInfo[old_bc.tokensInfo[i].request_index].request_guid;
+    Request &request = all_requests[guid];
+    if (request.req_type == RequestType::REQ_FINETUNING) {
+      continue;
+    }
+    if (old_bc.tokensInfo[i].abs_depth_in_request + 1 < request.tokens.size()) {
+      // This is a prompt token
+      continue;
+    } else {
+      // This is a decoding token
+      assert(old_bc.tokensInfo[i].abs_depth_in_request + 1 ==
+             request.tokens.size());
+      if (!profiling_requests[guid].first_token_time_set) {
+        profiling_requests[guid].first_token_time =
+            Realm::Clock::current_time_in_microseconds();
+        profiling_requests[guid].first_token_time_set = true;
+      }
+      log_req_mgr.print("Output token is: %d", result.token_ids[i]);
+      request.tokens.push_back(result.token_ids[i]);
+      // std::string output = this->tokenizer_->Decode(request.tokens);
+      // log_req_mgr.print("Output: %s", output.c_str());
+    }
+  }
+
+  int inference_batch_size =
+      BatchConfig::max_requests_per_batch() - (int)enable_peft_finetuning;
+
+  // Step 2: complete the requests that finished in old_bc, and fill in the
+  // tokens sampled for the others
+  for (int i = 0; i < inference_batch_size; i++) {
+    if (old_bc.request_completed[i]) {
+      continue;
+    }
+    RequestGuid guid = old_bc.requestsInfo[i].request_guid;
+    Request &request = all_requests[guid];
+    bool planned = !new_bc.request_completed[i] &&
+                   new_bc.requestsInfo[i].request_guid == guid;
+    if (check_inf_req_completion(old_bc, i)) {
+      complete_inf_request(old_bc, i);
+      if (planned) {
+        // The request sampled EOS, or its prompt ends with EOS, so remove
+        // the decoding token or the next prompt chunk planned for it. Its
+        // slot is reused by the next plan.
+        new_bc.remove_request(i);
+        profiling_requests[guid].llm_decoding_steps--;
+      }
+      continue;
+    }
+    assert(planned && "Planned batch lost an unfinished request");
+    if (!new_bc.requestsInfo[i].prompt_phase) {
+      int offset = new_bc.requestsInfo[i].first_token_offset_in_batch;
+      int depth = new_bc.tokensInfo[offset].abs_depth_in_request;
+      assert(depth + 1 == request.tokens.size());
+      new_bc.tokensInfo[offset].token_id = request.tokens[depth];
+    }
+  }
+
+  if (enable_peft_finetuning &&
+      !old_bc.request_completed[inference_batch_size]) {
+    Request &request =
+        all_requests[old_bc.requestsInfo[inference_batch_size].request_guid];
+    // chunks that only fill the KV cache have no loss
+    if (old_bc.requestsInfo[inference_batch_size].peft_bwd) {
+      request.finetuning_losses.push_back(result.finetuning_loss);
+    }
+    // plan_next_batch marks the request completed after its last batch
+    if (request.status == Request::COMPLETED) {
+      GenerationResult &gr = request_generation_results[request.guid];
+      assert(gr.guid == request.guid);
+      gr.finetuning_losses = request.finetuning_losses;
+      trigger_request_completion_future(request.guid);
+      num_processed_requests++;
+
+      ProfileInfo profile_info = profiling_requests[request.guid];
+      profile_info.finish_time = Realm::Clock::current_time_in_microseconds();
+      total_request_run_time +=
+          profile_info.finish_time - profile_info.start_time;
+      profiling_requests[request.guid] = profile_info;
+      log_req_mgr.print("[%s] guid(%zu) completed_training_steps(%d) "
+                        "processed_finetuning_tokens(%lu) latency(%.1lf)",
+                        request.warmup ? "Warmup" : "Finetuning",
+                        request.guid,
+                        request.completed_training_steps,
+                        request.processed_finetuning_tokens,
+                        profile_info.finish_time - profile_info.start_time);
+      if (!output_filepath.empty()) {
+        std::ofstream outputFile(output_filepath, std::ios::app);
+        if (outputFile.is_open()) {
+          std::string tokens_str = "[";
+          for (size_t i = 0; i < request.finetuning_tokens_per_batch.size();
+               i++) {
+            tokens_str +=
+                std::to_string(request.finetuning_tokens_per_batch[i]);
+            if (i != request.finetuning_tokens_per_batch.size() - 1) {
+              tokens_str += ", ";
+            }
+          }
+          tokens_str += "]";
+          outputFile << "[" << (request.warmup ? "Warmup" : "Finetuning")
+                     << "] guid(" << request.guid
+                     << ") completed_training_steps("
+                     << request.completed_training_steps
+                     << ") processed_finetuning_tokens("
+                     << request.processed_finetuning_tokens << ") latency("
+                     << std::fixed << std::setprecision(3)
+                     << (profile_info.finish_time - profile_info.start_time)
+                     << ") tokens_per_batch(" << tokens_str << ")\n";
+          outputFile.close();
+        } else {
+          std::cout << "Unable to open the output file: " << output_filepath
+                    << std::endl;
+          assert(false);
+        }
       }
     }
   }
-  return new_bc;
+  log_req_mgr.debug("patched batch in %.1lf us",
+                    Realm::Clock::current_time_in_microseconds() - patch_start);
 }
 
 /* ----- Speculative Inference Specific functions ----- */
@@ -967,6 +1255,7 @@ BeamSearchBatchConfigFuture RequestManager::prepare_next_batch_init(
     TreeVerifyBatchConfigFuture const &old_bc,
     InferenceResultFuture const &result,
     int model_id,
+    int max_speculation_depth,
     Context ctx,
     Runtime *runtime) {
 
@@ -976,6 +1265,7 @@ BeamSearchBatchConfigFuture RequestManager::prepare_next_batch_init(
   launcher.add_future(old_bc);
   launcher.add_future(result);
   launcher.add_future(Future::from_value<int>(model_id));
+  launcher.add_future(Future::from_value<int>(max_speculation_depth));
   return runtime->execute_task(ctx, launcher);
 }
 
@@ -990,14 +1280,19 @@ BeamSearchBatchConfig RequestManager::prepare_next_batch_init_task(
   InferenceResult const &result =
       Future(task->futures[1]).get_result<InferenceResult>();
   int model_id = Future(task->futures[2]).get_result<int>();
-  return rm->prepare_next_batch_init(bc, result, model_id);
+  int max_speculation_depth = Future(task->futures[3]).get_result<int>();
+  return rm->prepare_next_batch_init(
+      bc, result, model_id, max_speculation_depth);
 }
 
 BeamSearchBatchConfig
     RequestManager::prepare_next_batch_init(TreeVerifyBatchConfig const &old_bc,
                                             InferenceResult const &result,
-                                            int model_id) {
+                                            int model_id,
+                                            int max_speculation_depth) {
   const std::lock_guard<std::mutex> lock(request_queue_mutex);
+  assert(max_speculation_depth > 0 &&
+         max_speculation_depth <= BeamSearchBatchConfig::MAX_BEAM_DEPTH);
   if (verbose) {
     std::cout << "\n############### prepare_next_batch_init ###############\n";
   }
@@ -1021,17 +1316,13 @@ BeamSearchBatchConfig
     std::cout << "[ " << guid << " ]" << std::endl;
 
     // Verify this: get verified tokens from result
-    std::vector<std::pair<BatchConfig::TokenId, int>> tree_outputs =
-        std::vector<std::pair<BatchConfig::TokenId, int>>();
+    tree_outputs.clear();
+    int first_result_index = -1;
 
     assert(old_bc.num_tokens > 0);
 
     // reset committed_tokens
-    if (committed_tokens.count(guid) == 0) {
-      committed_tokens[guid] = {};
-    } else {
-      committed_tokens[guid].clear();
-    }
+    committed_tokens[i].clear();
 
     // iterate through all the tokens that belong to request i
     int root_abs_depth = request.tokens.size() - 1;
@@ -1042,27 +1333,24 @@ BeamSearchBatchConfig
       int token_id = result.token_ids[result_index];
 
       if (request.status == Request::PENDING) {
-        committed_tokens[guid].emplace_back(abs_depth, result_index);
+        committed_tokens[i].emplace_back(abs_depth, result_index);
       } else if (abs_depth >= root_abs_depth) {
-        tree_outputs.emplace_back(token_id, abs_depth + 1);
-        // std::cout << "committred tokens push: " << abs_depth
-        //           << " ,result index: " << result_index << "\n";
-        committed_tokens[guid].emplace_back(abs_depth, result_index);
+        // the root and tree tokens of request i, in the order of its tree
+        if (first_result_index < 0) {
+          first_result_index = result_index;
+        }
+        assert(tree_outputs.size() < token_trees.size(i) &&
+               abs_depth == token_trees.depth(i, tree_outputs.size()));
+        tree_outputs.push_back(token_id);
 
         if (verbose) {
           std::cout << "Index within old batch: " << result_index << std::endl;
           printf("  Input: [%d] %d ---> [%d] %d \n",
                  abs_depth,
                  old_bc.tokensInfo[result_index].token_id,
-                 tree_outputs.back().second,
+                 abs_depth + 1,
                  token_id);
         }
-        // std::cout << "Index within old batch: " << result_index << std::endl;
-        // printf("  Input: [%d] %d ---> [%d] %d \n",
-        //        abs_depth,
-        //        old_bc.tokensInfo[result_index].token_id,
-        //        tree_outputs.back().second,
-        //        token_id);
       }
       result_index++;
     }
@@ -1070,10 +1358,19 @@ BeamSearchBatchConfig
     if (request.status == Request::RUNNING) {
 
       std::vector<std::pair<BatchConfig::TokenId, int>> verified_tokens =
-          traverse_verify_tree(guid, dfs_tree_inputs.at(guid), tree_outputs);
+          traverse_verify_tree(i, tree_outputs, first_result_index);
 
       log_req_mgr.print("Number of Verified Tokens = %zu",
                         verified_tokens.size());
+      // All verified tokens but the last (which the LLM generated itself)
+      // are accepted speculated tokens
+      auto plan = speculation_plans.find(guid);
+      if (plan != speculation_plans.end()) {
+        speculation_controller.record(guid,
+                                      request.speculation_class,
+                                      plan->second.depth,
+                                      (int)verified_tokens.size() - 1);
+      }
       // check if the request is finished
       if (verified_tokens.size() + request.tokens.size() >=
           request.max_sequence_length) {
@@ -1086,23 +1383,7 @@ BeamSearchBatchConfig
         log_req_mgr.print("[Done] guid(%zu) with final length(%zu)",
                           request.guid,
                           request.tokens.size());
-        std::string output = this->tokenizer_->Decode(request.tokens);
-        // Unlike Huggingface, the sentencepiece C++ library automatically
-        // removes the BOS token
-        if (model_type == ModelType::LLAMA &&
-            request.tokens.at(0) == bos_token_id) {
-          output = "<s> " + output;
-        }
-        {
-          // update generation result
-          GenerationResult &gr = request_generation_results[request.guid];
-          assert(gr.guid == request.guid);
-          gr.output_tokens = request.tokens;
-          gr.output_text = output;
-        }
         request.status = Request::COMPLETED;
-        trigger_request_completion_future(request.guid);
-        log_req_mgr.print("Final output: %s", output.c_str());
 
         new_bc.request_completed[i] = true;
         new_bc.request_running[i] = false;
@@ -1123,41 +1404,24 @@ BeamSearchBatchConfig
             profile_info.start_time,
             profile_info.finish_time,
             profile_info.finish_time - profile_info.start_time);
-
-        // Write output to file if needed:
-        if (!output_filepath.empty()) {
-          std::ofstream outputFile(output_filepath, std::ios::app);
-          if (outputFile.is_open()) {
-            outputFile << "[Profile] guid(" << request.guid
-                       << ") llm_decoding_steps("
-                       << profile_info.llm_decoding_steps << ") latency("
-                       << std::fixed << std::setprecision(3)
-                       << (profile_info.finish_time - profile_info.start_time)
-                       << ")\n";
-            // outputFile << "end-to-end latency: " << std::fixed
-            //            << std::setprecision(3) << total_request_run_time
-            //            << std::endl;
-            // outputFile << "num decoding steps: "
-            //            << profile_info.llm_decoding_steps << std::endl;
-            outputFile << "token IDs: ";
-            for (int i = 0; i < request.tokens.size(); i++) {
-              outputFile << request.tokens[i];
-              if (i < request.tokens.size() - 1) {
-                outputFile << ",";
-              }
-            }
-            outputFile << std::endl;
-            outputFile << output;
-            outputFile.close();
-          } else {
-            std::cout << "Unable to open the output file: " << output_filepath
-                      << std::endl;
-            assert(false);
-          }
-        }
+        std::ostringstream profile_line;
+        profile_line << "[Profile] guid(" << request.guid
+                     << ") llm_decoding_steps("
+                     << profile_info.llm_decoding_steps << ") latency("
+                     << std::fixed << std::setprecision(3)
+                     << (profile_info.finish_time - profile_info.start_time)
+                     << ")\n";
+        publish_generation_result(
+            request.guid, request.tokens, profile_line.str(), true);
 
         // delete the old input tree from cache
-        dfs_tree_inputs.erase(request.guid);
+        token_trees.clear(i);
+        committed_tokens[i].clear();
+        speculation_plans.erase(request.guid);
+        speculation_controller.remove_request(request.guid);
+        if (ngram_drafter != nullptr) {
+          ngram_drafter->remove_request(request.guid);
+        }
 
       } else { // Request not finished, pass verified_tokens to next iteration
 
@@ -1186,13 +1450,13 @@ BeamSearchBatchConfig
         profiling_requests[request.guid].ssm_decoding_steps = 0;
         new_bc.requestsInfo[i].prompt_phase = true;
 
+        // beam_size and max_depth are revised by plan_speculation when
+        // adaptive speculation is enabled
         int ssm_decoding_steps = 0;
         new_bc.beamRequestsInfo[i].beam_size =
-            spec_infer_tree_width.size() > ssm_decoding_steps
-                ? spec_infer_tree_width[ssm_decoding_steps]
-                : 1;
+            get_spec_infer_tree_width(request.guid, ssm_decoding_steps);
         new_bc.beamRequestsInfo[i].max_depth =
-            std::min(new_max_depth, BeamSearchBatchConfig::MAX_BEAM_DEPTH);
+            std::min(new_max_depth, max_speculation_depth);
         for (int j = 0;
              j < BeamSearchBatchConfig::MAX_SPECULATIVE_TREE_BRANCHES;
              j++) {
@@ -1230,14 +1494,16 @@ BeamSearchBatchConfig
           }
         }
 
-        std::string output = this->tokenizer_->Decode(request.tokens);
-        // Unlike Huggingface, the sentencepiece C++ library automatically
-        // removes the BOS token
-        if (model_type == ModelType::LLAMA &&
-            request.tokens.at(0) == bos_token_id) {
-          output = "<s> " + output;
+        if (verbose) {
+          std::string output = this->tokenizer_->Decode(request.tokens);
+          // Unlike Huggingface, the sentencepiece C++ library automatically
+          // removes the BOS token
+          if (model_type == ModelType::LLAMA &&
+              request.tokens.at(0) == bos_token_id) {
+            output = "<s> " + output;
+          }
+          log_req_mgr.print("Output: %s", output.c_str());
         }
-        log_req_mgr.print("Output: %s", output.c_str());
       }
 
     } else if (request.status == Request::PENDING) {
@@ -1264,9 +1530,7 @@ BeamSearchBatchConfig
       int ssm_decoding_steps =
           profiling_requests[request.guid].ssm_decoding_steps;
       new_bc.beamRequestsInfo[i].beam_size =
-          spec_infer_tree_width.size() > ssm_decoding_steps
-              ? spec_infer_tree_width[ssm_decoding_steps]
-              : 1;
+          get_spec_infer_tree_width(request.guid, ssm_decoding_steps);
       new_bc.beamRequestsInfo[i].max_depth = 0;
       for (int j = 0; j < BeamSearchBatchConfig::MAX_SPECULATIVE_TREE_BRANCHES;
            j++) {
@@ -1279,23 +1543,29 @@ BeamSearchBatchConfig
       new_bc.sub_requests[i] = 1;
 
       // Token Info
-      std::string output = this->tokenizer_->Decode(request.tokens);
-      // Unlike Huggingface, the sentencepiece C++ library automatically removes
-      // the BOS token
-      if (model_type == ModelType::LLAMA &&
-          request.tokens.at(0) == bos_token_id) {
-        output = "<s> " + output;
+      if (verbose) {
+        std::string output = this->tokenizer_->Decode(request.tokens);
+        // Unlike Huggingface, the sentencepiece C++ library automatically
+        // removes the BOS token
+        if (model_type == ModelType::LLAMA &&
+            request.tokens.at(0) == bos_token_id) {
+          output = "<s> " + output;
+        }
+        log_req_mgr.print("Output: %s", output.c_str());
       }
-      log_req_mgr.print("Output: %s", output.c_str());
     } else {
       assert(false);
     }
   }
 
   // Step 2: Initialize new request
+  // A new request's prompt is processed by the SSMs in the steps of this
+  // batch, so only admit new requests when all steps are run
+  bool admit_new_requests =
+      max_speculation_depth == BeamSearchBatchConfig::MAX_BEAM_DEPTH;
   for (int i = 0; i < BeamSearchBatchConfig::max_requests_per_batch(); i++) {
     if (new_bc.request_completed[i]) {
-      if (!pending_infr_request_queue.empty() &&
+      if (admit_new_requests && !pending_infr_request_queue.empty() &&
           new_bc.num_tokens < get_max_tokens_per_batch()) {
         Request new_request = pending_infr_request_queue.front();
         pending_infr_request_queue.pop();
@@ -1321,12 +1591,10 @@ BeamSearchBatchConfig
             profiling_requests[new_request.guid].ssm_decoding_steps;
 
         new_bc.beamRequestsInfo[i].beam_size =
-            spec_infer_tree_width.size() > ssm_decoding_steps
-                ? spec_infer_tree_width[ssm_decoding_steps]
-                : 1;
+            get_spec_infer_tree_width(new_request.guid, ssm_decoding_steps);
         new_bc.beamRequestsInfo[i].current_depth = 1;
         new_bc.beamRequestsInfo[i].max_depth =
-            std::min(BeamSearchBatchConfig::MAX_BEAM_DEPTH,
+            std::min(max_speculation_depth,
                      get_max_tokens_per_batch() -
                          new_bc.requestsInfo[i].num_tokens_in_batch - 1);
         for (int j = 0;
@@ -1377,6 +1645,11 @@ BeamSearchBatchConfig
         all_requests[new_request.guid].status = Request::PENDING;
         all_requests[new_request.guid].ssm_cache_size =
             new_bc.requestsInfo[i].num_tokens_in_batch;
+        if (get_num_ssms() == 0) {
+          // no SSM loads the rest of the prompt when drafting from n-grams
+          all_requests[new_request.guid].ssm_cache_size =
+              new_request.initial_len;
+        }
         new_bc.request_running[i] = false;
         std::cout << "SSM KV Cache Size init: "
                   << all_requests[new_request.guid].ssm_cache_size << std::endl;
@@ -1395,6 +1668,7 @@ BeamSearchBatchConfig
     }
   }
   new_bc.num_generation_tokens = num_generation_tokens;
+  plan_speculation(new_bc, max_speculation_depth);
 
   if (verbose) {
     std::cout << "prepare_next_batch_init OLD vs NEW batchconfigs below:"
@@ -1405,10 +1679,124 @@ BeamSearchBatchConfig
   return new_bc;
 }
 
+void RequestManager::configure_speculation(FFConfig const &config) {
+  adaptive_speculation = config.adaptive_speculation;
+  speculation_token_budget = config.speculation_token_budget;
+  speculation_stats_file = config.speculation_stats_file;
+  speculation_controller.set_max_depth(BeamSearchBatchConfig::MAX_BEAM_DEPTH);
+  // The static tree widths bound where and how wide adaptive trees branch
+  int branch_layer = 0, max_width = 1;
+  for (size_t i = 0; i < spec_infer_tree_width.size(); i++) {
+    if (spec_infer_tree_width[i] > max_width) {
+      branch_layer = i;
+      max_width = spec_infer_tree_width[i];
+    }
+  }
+  speculation_controller.set_branching(branch_layer, max_width);
+  if (adaptive_speculation) {
+    log_req_mgr.print("Adaptive speculation enabled (verify token budget %d, "
+                      "max tree width %d)",
+                      speculation_token_budget > 0 ? speculation_token_budget
+                                                   : get_max_tokens_per_batch(),
+                      max_width);
+  }
+}
+
+void RequestManager::configure_coserving(FFConfig const &config) {
+  if (!enable_peft_finetuning || config.coserving_latency_slo <= 0) {
+    return;
+  }
+  coserving_controller.set_latency_slo(config.coserving_latency_slo * 1000);
+  if (!config.coserving_log_file.empty()) {
+    coserving_log.open(config.coserving_log_file);
+    if (coserving_log.is_open()) {
+      coserving_controller.set_log(&coserving_log);
+    } else {
+      std::cout << "Unable to open the co-serving log file: "
+                << config.coserving_log_file << std::endl;
+    }
+  }
+  log_req_mgr.print("Co-serving latency SLO %.3lf ms",
+                    config.coserving_latency_slo);
+}
+
+int RequestManager::get_finetuning_token_budget(BatchConfig const &new_bc) {
+  if (!coserving_controller.is_enabled()) {
+    return get_max_tokens_per_batch();
+  }
+  // Each batch is planned once the previous one was launched, so the time
+  // between two plans is the latency of one decoding step
+  double now = Realm::Clock::current_time_in_microseconds();
+  CoServingController::Observation observation;
+  observation.iteration_latency_us =
+      last_batch_time > 0 ? now - last_batch_time : 0;
+  observation.queue_depth = pending_infr_request_queue.size();
+  observation.inference_tokens = new_bc.num_active_infr_tokens();
+  observation.max_tokens_per_batch = get_max_tokens_per_batch();
+  last_batch_time = now;
+  return coserving_controller.update(observation);
+}
+
+void RequestManager::plan_speculation(BeamSearchBatchConfig &new_bc,
+                                      int max_speculation_depth) {
+  // Running requests build a token tree in this batch
+  std::vector<int> batch_indices;
+  std::vector<std::pair<RequestGuid, std::string>> requests;
+  for (int i = 0; i < BeamSearchBatchConfig::max_requests_per_batch(); i++) {
+    if (new_bc.request_completed[i] || !new_bc.request_running[i]) {
+      continue;
+    }
+    RequestGuid guid = new_bc.requestsInfo[i].request_guid;
+    batch_indices.push_back(i);
+    requests.push_back(
+        std::make_pair(guid, all_requests[guid].speculation_class));
+  }
+  if (requests.empty()) {
+    next_speculation_depth = BeamSearchBatchConfig::MAX_BEAM_DEPTH;
+    return;
+  }
+  if (!adaptive_speculation) {
+    // only remember the tree depths, so that acceptance statistics are
+    // still collected
+    for (size_t k = 0; k < requests.size(); k++) {
+      int i = batch_indices[k];
+      SpeculationController::Plan plan = {
+          new_bc.beamRequestsInfo[i].max_depth,
+          new_bc.beamRequestsInfo[i].beam_size};
+      speculation_plans[requests[k].first] = plan;
+    }
+    return;
+  }
+  int token_budget = speculation_token_budget > 0 ? speculation_token_budget
+                                                  : get_max_tokens_per_batch();
+  // Every running request takes part in the SSM steps, so it speculates
+  // at least one token even when the budget is exhausted
+  token_budget =
+      std::max(token_budget - new_bc.num_tokens, (int)requests.size());
+  std::vector<SpeculationController::Plan> plans =
+      speculation_controller.plan(requests, token_budget);
+  int deepest = 1;
+  for (size_t k = 0; k < requests.size(); k++) {
+    int i = batch_indices[k];
+    deepest = std::max(deepest, plans[k].depth);
+    // never exceed the depth allowed by the sequence length or by the number
+    // of SSM steps that will run for this batch
+    SpeculationController::Plan plan = {
+        std::min(plans[k].depth, new_bc.beamRequestsInfo[i].max_depth),
+        plans[k].width};
+    speculation_plans[requests[k].first] = plan;
+    new_bc.beamRequestsInfo[i].max_depth = plan.depth;
+    new_bc.beamRequestsInfo[i].beam_size =
+        get_spec_infer_tree_width(requests[k].first, 0);
+  }
+  next_speculation_depth = deepest;
+}
+
 /***** Beam Search Phase *****/
 BeamSearchBatchConfigFuture RequestManager::prepare_next_batch_beam(
     BeamSearchBatchConfigFuture const &old_bc,
     BeamInferenceResultFuture const &result,
+    int model_id,
     Context ctx,
     Runtime *runtime) {
 
@@ -1417,6 +1805,7 @@ BeamSearchBatchConfigFuture RequestManager::prepare_next_batch_beam(
                         TaskArgument(&rm, sizeof(RequestManager *)));
   launcher.add_future(old_bc);
   launcher.add_future(result);
+  launcher.add_future(Future::from_value<int>(model_id));
   return runtime->execute_task(ctx, launcher);
 }
 
@@ -1430,6 +1819,15 @@ BeamSearchBatchConfig RequestManager::prepare_next_batch_beam_task(
       Future(task->futures[0]).get_result<BeamSearchBatchConfig>();
   BeamInferenceResult const &result =
       Future(task->futures[1]).get_result<BeamInferenceResult>();
+  int model_id = Future(task->futures[2]).get_result<int>();
+  if (bc.model_id != model_id) {
+    // The first step of every SSM starts from the batch prepared by
+    // prepare_next_batch_init; tag it with the SSM whose beam trees the
+    // result is stored in
+    BeamSearchBatchConfig ssm_bc = bc;
+    ssm_bc.model_id = model_id;
+    return rm->prepare_next_batch_beam(ssm_bc, result);
+  }
   return rm->prepare_next_batch_beam(bc, result);
 }
 
@@ -1493,13 +1891,12 @@ BeamSearchBatchConfig
       // why is sub_requests has max_requests_per_batch() * MAX_BEAM_WIDTH
       // entries?
       // update the parentid, accumalated_probs, depth, and token_ids
-      int ssm_decoding_steps =
-          profiling_requests[request.guid].ssm_decoding_steps;
+      // The profiled steps count the steps of all SSMs, whose batches are
+      // interleaved, so the tree width follows this SSM's own depth
+      int ssm_decoding_steps = old_bc.beamRequestsInfo[i].current_depth;
 
       new_bc.beamRequestsInfo[i].beam_size =
-          spec_infer_tree_width.size() > ssm_decoding_steps
-              ? spec_infer_tree_width[ssm_decoding_steps]
-              : 1;
+          get_spec_infer_tree_width(request.guid, ssm_decoding_steps);
 
       new_bc.beamRequestsInfo[i].max_depth =
           old_bc.beamRequestsInfo[i].max_depth;
@@ -1789,18 +2186,33 @@ TreeVerifyBatchConfig RequestManager::prepare_next_batch_verify(
     if (request.status == Request::RUNNING) {
       new_bc.request_running[i] = true;
 
-      // Get the dfs tree
-      std::vector<std::vector<std::pair<BatchConfig::TokenId, int>>>
-          all_dfs_trees;
-
-      for (int j = 0; j < old_batches.size(); j++) {
-        std::vector<std::pair<BatchConfig::TokenId, int>> new_tree =
-            traverse_beam_tree(old_batches.at(j), i, request.tokens.size() - 1);
-        all_dfs_trees.push_back(new_tree);
+      // Get the token tree
+      if (ngram_drafter != nullptr) {
+        draft_token_tree(request,
+                         i,
+                         old_batches.at(0).beamRequestsInfo[i].max_depth,
+                         new_bc.causalMask[i]);
+      } else {
+        traverse_beam_tree(
+            old_batches.at(0), i, request.tokens.size() - 1, token_trees, i);
+        for (int j = 1; j < old_batches.size(); j++) {
+          traverse_beam_tree(old_batches.at(j),
+                             i,
+                             request.tokens.size() - 1,
+                             ssm_token_tree,
+                             0);
+          token_trees.merge(i, ssm_token_tree, 0);
+        }
+        if (old_batches.size() == 1) {
+          // copy bitmask to verify batchconfig
+          memcpy(&(new_bc.causalMask[i]),
+                 &(old_batches.at(0).causalMask[i]),
+                 sizeof(BatchConfig::BitMask));
+        } else {
+          // the merged tree is no longer laid out like the SSMs' trees
+          set_token_tree_mask(i, new_bc.causalMask[i]);
+        }
       }
-      assert(all_dfs_trees.size() == old_batches.size());
-      std::vector<std::pair<BatchConfig::TokenId, int>> dfs_tree_inputs =
-          merge_dfs_trees(all_dfs_trees, request.tokens.size() - 1, guid);
 
       if (verbose) {
         std::cout << "Request Tokens Size: " << request.tokens.size()
@@ -1812,7 +2224,7 @@ TreeVerifyBatchConfig RequestManager::prepare_next_batch_verify(
 
       // Normal Request Info
       new_bc.requestsInfo[i].first_token_depth_in_request =
-          dfs_tree_inputs.front().second;
+          token_trees.depth(i, 0);
       new_bc.requestsInfo[i].first_token_offset_in_batch = new_bc.num_tokens;
       new_bc.requestsInfo[i].request_guid =
           old_batches.at(0).requestsInfo[i].request_guid;
@@ -1820,43 +2232,27 @@ TreeVerifyBatchConfig RequestManager::prepare_next_batch_verify(
           old_batches.at(0).requestsInfo[i].max_sequence_length;
       new_bc.requestsInfo[num_active_req].batch_config_request_id = i;
 
-      // copy bitmask to verify batchconfig
-      memcpy(&(new_bc.causalMask[i]),
-             &(old_batches.at(0).causalMask[i]),
-             sizeof(BatchConfig::BitMask));
       // TODO: Check this
       new_bc.requestsInfo[i].num_tokens_in_batch = 0;
       new_bc.request_completed[i] = false;
 
-      // std::cout << "dfs_tree_inputs: " << dfs_tree_inputs.size() << ", "
-      //           << new_bc.causalMask[i].tree_size << ", "
-      //           << new_bc.causalMask[i].non_tree_cache_size << "\n";
-      // std::cout << "mask: " << std::bitset<64>(new_bc.causalMask[i].mask[0])
-      //           << "\n";
-
       // Committed Tokens
-      if (committed_tokens.find(guid) != committed_tokens.end()) {
-        for (int j = 0; j < committed_tokens.at(guid).size(); j++) {
-          // if (j < committed_tokens.at(guid).size()) {
-
-          auto committed_token = committed_tokens.at(guid).at(j);
-          new_bc.committed_tokens[new_bc.num_tokens_to_commit].token_index =
-              committed_token.second;
-          new_bc.committed_tokens[new_bc.num_tokens_to_commit].request_index =
-              i;
-          new_bc.committed_tokens[new_bc.num_tokens_to_commit].token_depth =
-              committed_token.first;
-          if (verbose) {
-            std::cout << new_bc.num_tokens_to_commit
-                      << "- committed_token.token_depth: "
-                      << committed_token.first
-                      << ", token_index: " << committed_token.second
-                      << std::endl;
-          }
-          new_bc.num_tokens_to_commit++;
-          request.llm_cache_size++;
-          // }
+      for (int j = 0; j < committed_tokens[i].size(); j++) {
+        auto committed_token = committed_tokens[i][j];
+        new_bc.committed_tokens[new_bc.num_tokens_to_commit].token_index =
+            committed_token.second;
+        new_bc.committed_tokens[new_bc.num_tokens_to_commit].request_index = i;
+        new_bc.committed_tokens[new_bc.num_tokens_to_commit].token_depth =
+            committed_token.first;
+        if (verbose) {
+          std::cout << new_bc.num_tokens_to_commit
+                    << "- committed_token.token_depth: "
+                    << committed_token.first
+                    << ", token_index: " << committed_token.second
+                    << std::endl;
         }
+        new_bc.num_tokens_to_commit++;
+        request.llm_cache_size++;
       }
       if (verbose) {
         std::cout << "new_bc.num_tokens_to_commit: "
@@ -1882,24 +2278,24 @@ TreeVerifyBatchConfig RequestManager::prepare_next_batch_verify(
           request.tokens.size() - 1;
 
       bool cutLayer = false;
-      // Add Tokens from the DFS Tree to the next batch
-      for (int j = 1; j < dfs_tree_inputs.size(); j++) {
-        auto token = dfs_tree_inputs.at(j);
+      // Add Tokens from the token tree to the next batch
+      int tree_size = token_trees.size(i);
+      for (int j = 1; j < tree_size; j++) {
         if (verbose) {
-          std::cout << "[" << j << "] Token: " << token.first
-                    << ", Depth:" << token.second << std::endl;
+          std::cout << "[" << j << "] Token: " << token_trees.token(i, j)
+                    << ", Depth:" << token_trees.depth(i, j) << std::endl;
         }
         // Normal Token Info
         new_bc.tokensInfo[new_bc.num_tokens].request_index = i;
-        new_bc.tokensInfo[new_bc.num_tokens].token_id = token.first;
+        new_bc.tokensInfo[new_bc.num_tokens].token_id = token_trees.token(i, j);
         new_bc.tokensInfo[new_bc.num_tokens].abs_depth_in_request =
-            token.second;
+            token_trees.depth(i, j);
 
         new_bc.num_tokens++;
         new_bc.requestsInfo[i].num_tokens_in_batch++;
 
         if (new_bc.num_tokens == get_max_verify_tokens_per_batch() &&
-            (j != dfs_tree_inputs.size() - 1)) {
+            (j != tree_size - 1)) {
           cutLayer = true;
           break;
         }
@@ -1931,9 +2327,9 @@ TreeVerifyBatchConfig RequestManager::prepare_next_batch_verify(
       }
 
       // Commit all tokens from the last loading batch
-      if (committed_tokens.find(guid) != committed_tokens.end()) {
-        for (int j = 0; j < committed_tokens.at(guid).size(); j++) {
-          auto token = committed_tokens.at(guid).at(j);
+      if (!committed_tokens[i].empty()) {
+        for (int j = 0; j < committed_tokens[i].size(); j++) {
+          auto token = committed_tokens[i][j];
           new_bc.committed_tokens[new_bc.num_tokens_to_commit].token_index =
               token.second;
           new_bc.committed_tokens[new_bc.num_tokens_to_commit].request_index =
@@ -2006,9 +2402,8 @@ TreeVerifyBatchConfig RequestManager::prepare_next_batch_verify(
           //           std::endl;
           new_bc.requestsInfo[i].prompt_phase = true;
 
-          dfs_tree_inputs[guid] =
-              std::vector<std::pair<BatchConfig::TokenId, int>>{std::make_pair(
-                  request.tokens.back(), request.tokens.size() - 1)};
+          token_trees.reset(
+              i, request.tokens.back(), request.tokens.size() - 1);
         }
       } else { // launch the request into running phase after loading all prompt
         if (get_max_verify_tokens_per_batch() - new_bc.num_tokens > 0) {
@@ -2029,9 +2424,8 @@ TreeVerifyBatchConfig RequestManager::prepare_next_batch_verify(
           //           std::endl;
 
           new_bc.requestsInfo[i].prompt_phase = true;
-          dfs_tree_inputs[guid] =
-              std::vector<std::pair<BatchConfig::TokenId, int>>{std::make_pair(
-                  request.tokens.back(), request.tokens.size() - 1)};
+          token_trees.reset(
+              i, request.tokens.back(), request.tokens.size() - 1);
         }
       }
 
@@ -2411,168 +2805,53 @@ bool PreOrder(
 
 std::vector<std::pair<BatchConfig::TokenId, int>>
     RequestManager::traverse_verify_tree(
-        size_t guid,
-        std::vector<std::pair<BatchConfig::TokenId, int>> const
-            &inputSerializedTree,
-        std::vector<std::pair<BatchConfig::TokenId, int>> const
-            &outputSerializedTree) {
-  std::vector<std::pair<BeamSearchBatchConfig::TokenId, int>> verifiedTree;
-  // verifiedTree.push_back(inputSerializedTree.at(0));
-  std::vector<std::pair<int, int>> new_committed_tokens =
-      std::vector<std::pair<int, int>>();
-
-  log_req_mgr.print("Input tree size (%zu) Output tree size (%zu)",
-                    inputSerializedTree.size(),
-                    outputSerializedTree.size());
-  { // Input tree
+        int request_index,
+        std::vector<BatchConfig::TokenId> const &outputs,
+        int first_result_index) {
+  int tree_size = token_trees.size(request_index);
+  log_req_mgr.print("Input tree size (%d) Output tree size (%zu)",
+                    tree_size,
+                    outputs.size());
+  // It's safe to have more tree tokens than outputs, when the verify batch
+  // could not fit the whole tree
+  assert(tree_size >= outputs.size());
+  if (verbose) {
     std::ostringstream oss;
-    // inputSerializedTree is the dfs_tree_inputs_map[guid] array og (token id,
-    // depth) pairs
-    for (auto const &pair : inputSerializedTree) {
-      oss << " " << pair.second << ":" << pair.first;
-      // log_req_mgr.print("(%d, %d)", pair.first, pair.second);
+    for (int j = 0; j < tree_size; j++) {
+      oss << " " << token_trees.depth(request_index, j) << ":"
+          << token_trees.token(request_index, j);
     }
     log_req_mgr.print("Input tree:%s", oss.str().c_str());
   }
-  { // Output tree
-    // log_req_mgr.print("========Output============");
-    // outputSerializedTree is an array of (token id, depth + 1) pairs
-    std::ostringstream oss;
-    for (auto const &pair : outputSerializedTree) {
-      // log_req_mgr.print("(%d, %d)", pair.first, pair.second);
-      oss << " " << pair.second << ":" << pair.first;
-    }
-    log_req_mgr.print("Output tree:%s", oss.str().c_str());
-  }
-  {
-    // log_req_mgr.print("========Committed============");
-    //  committed_tokens[guid] is an array of (depth, result_index) pairs for
-    //  the given request
-    std::ostringstream oss;
-    for (auto const &pair : committed_tokens.at(guid)) {
-      // log_req_mgr.print("(%d, %d)", pair.first, pair.second);
-      oss << " " << pair.second << ":" << pair.first;
-    }
-    log_req_mgr.print("Committed tokens:%s", oss.str().c_str());
-  }
-
-  // It's safe to have inputSerializedTree.size() > outputSerializedTree.size()
-  // In this case the inputSeriedTree ends with padding 0s
-  assert(inputSerializedTree.size() >= outputSerializedTree.size());
-
-  int *treeLayers = new int[inputSerializedTree.size()];
-  int node_num = 1;
-  int layer_num = 0;
-  for (int token_id = 0; token_id < inputSerializedTree.size(); token_id++) {
-    if (token_id == (inputSerializedTree.size() - 1) ||
-        inputSerializedTree.at(token_id + 1).second !=
-            inputSerializedTree.at(token_id).second) {
-      treeLayers[layer_num] = node_num;
-      layer_num += 1;
-      node_num = 1;
-    } else {
-      node_num++;
-    }
-  }
-
-  // to avoid branch switch when same tokens in input tree.
-  // todo, only checked for N->1->1->1 cases
-
-  bool findFirst = false;
-  layer_num = -1;
-  int first_layer_slot = 0;
-  int first_layer_slot_total = 0;
-  int processed_whole_layer_tokens = 0;
-
-  for (int i = 0; i < outputSerializedTree.size(); i++) {
-    auto input = inputSerializedTree.at(i);
-    auto output = outputSerializedTree.at(i);
-
-    if (i == 0 || inputSerializedTree.at(i - 1).second !=
-                      inputSerializedTree.at(i).second) {
-      layer_num += 1;
-      processed_whole_layer_tokens += i == 0 ? 0 : treeLayers[layer_num - 1];
-    }
-
-    if (i == 0) {
-      verifiedTree.push_back(output);
-
-      new_committed_tokens.push_back(std::make_pair(
-          input.second,
-          committed_tokens.at(guid).at(i).second)); // <input_abs_depth,
-                                                    // input_index_in_batch>
-      // std::cout << committed_tokens.at(guid).at(i).first << ", "
-      //           << committed_tokens.at(guid).at(i).second << std::endl;
-      // std::cout << input.first << ", " << input.second << std::endl;
-
-      assert(committed_tokens.at(guid).at(i).first == input.second);
-      continue;
-    }
-
-    if (input.first == verifiedTree.back().first &&
-        input.second == verifiedTree.back().second) {
-      if (findFirst) {
-        // must in this branch.
-        int layer_slot = i - processed_whole_layer_tokens;
-        int layer_slot_total = treeLayers[layer_num];
-        if (first_layer_slot == layer_slot) {
-          verifiedTree.push_back(output);
-          new_committed_tokens.push_back(std::make_pair(
-              input.second, committed_tokens.at(guid).at(i).second));
-          // at this point, you'll not go other branches
-          // std::cout << "verify tree push back: " << output.first
-          //           << ", tree size is: " << verifiedTree.size()
-          //           << ", ??: " << input.first << ", " << input.second <<
-          //           "\n";
-
-        } else {
-          printf("not correct slot\n");
-        }
-      } else {
-        verifiedTree.push_back(output);
-        first_layer_slot = i - processed_whole_layer_tokens;
-        first_layer_slot_total = treeLayers[layer_num];
-        findFirst = true;
-        new_committed_tokens.push_back(std::make_pair(
-            input.second,
-            committed_tokens.at(guid).at(i).second)); // <input_abs_depth,
-                                                      // input_index_in_batch>
-        // at this point, you'll not go other branches
-        // std::cout << "verify tree push back: " << output.first
-        //           << ", tree size is: " << verifiedTree.size()
-        //           << ", ??: " << input.first << ", " << input.second << "\n";
-      }
 
-      assert(committed_tokens.at(guid).at(i).first == input.second);
-    }
+  // The LLM's output for an accepted token is the next token of the request
+  token_trees.verify(
+      request_index, outputs.data(), outputs.size(), accepted_nodes);
+  std::vector<std::pair<BeamSearchBatchConfig::TokenId, int>> verifiedTree;
+  verifiedTree.reserve(accepted_nodes.size());
+  committed_tokens[request_index].clear();
+  for (int node : accepted_nodes) {
+    int depth = token_trees.depth(request_index, node);
+    verifiedTree.push_back(std::make_pair(outputs[node], depth + 1));
+    // <input_abs_depth, input_index_in_batch>
+    committed_tokens[request_index].emplace_back(depth,
+                                                 first_result_index + node);
   }
-  committed_tokens[guid] = new_committed_tokens;
-  {
-    // log_req_mgr.print("========Verified============");
+  if (verbose) {
     std::ostringstream oss;
     for (auto const &pair : verifiedTree) {
-      // log_req_mgr.print("(%d, %d)", pair.first, pair.second);
       oss << " " << pair.second << ":" << pair.first;
     }
     log_req_mgr.print("Verified:%s", oss.str().c_str());
   }
-  {
-    // log_req_mgr.print("========New Committed============");
-    std::ostringstream oss;
-    for (auto const &pair : committed_tokens.at(guid)) {
-      // log_req_mgr.print("(%d, %d)", pair.first, pair.second);
-      oss << " " << pair.second << ":" << pair.first;
-    }
-    log_req_mgr.print("New committed:%s", oss.str().c_str());
-  }
-
   return verifiedTree;
 }
 
-std::vector<std::pair<BatchConfig::TokenId, int>>
-    RequestManager::traverse_beam_tree(BeamSearchBatchConfig const &old_bc,
-                                       int request_index,
-                                       int first_token_depth_in_request) {
+void RequestManager::traverse_beam_tree(BeamSearchBatchConfig const &old_bc,
+                                        int request_index,
+                                        int first_token_depth_in_request,
+                                        TokenTreeArena &trees,
+                                        int tree_index) {
   if (verbose) {
     std::cout << "[Traverse Beam Tree] request_index: " << request_index
               << "\n";
@@ -2587,123 +2866,131 @@ std::vector<std::pair<BatchConfig::TokenId, int>>
   }
 
   auto guid = old_bc.requestsInfo[request_index].request_guid;
-  Request &request = all_requests[guid];
-  // std::cout << "request.beam_trees.size(): " << request.beam_trees.size()
-  //           << std::endl;
-  BeamTree tree = request.beam_trees.at(old_bc.model_id);
+  BeamTree const &tree = all_requests[guid].beam_trees.at(old_bc.model_id);
+
+  // The tree is stored layer by layer, like the SSM's causal mask. The mask
+  // (see appendBitMask) splits the nodes of a layer into equal groups, one
+  // per node of the previous layer, in order; group k are the children of
+  // node k.
+  assert(tree.treeLayers[0].nodes_num_this_layer == 1);
+  trees.reset(tree_index,
+              tree.treeLayers[0].tokens[0],
+              first_token_depth_in_request,
+              tree.treeLayers[0].probs[0]);
+  int layer_start = 0;
+  for (int i = 1; i <= old_bc.beamRequestsInfo[request_index].max_depth; i++) {
+    int num_parents = tree.treeLayers[i - 1].nodes_num_this_layer;
+    int num_nodes = tree.treeLayers[i].nodes_num_this_layer;
+    if (num_nodes == 0) {
+      break;
+    }
+    int group_size = std::max(num_nodes / num_parents, 1);
+    int next_layer_start = trees.size(tree_index);
+    for (int j = 0; j < num_nodes; j++) {
+      int parent = layer_start + std::min(j / group_size, num_parents - 1);
+      int node = trees.add_node(tree_index,
+                                parent,
+                                tree.treeLayers[i].tokens[j],
+                                tree.treeLayers[i].probs[j]);
+      assert(node != TokenTreeArena::NONE);
+    }
+    layer_start = next_layer_start;
+  }
 
-  // std::cout << "print beam tree: "
-  //           << "\n";
-  std::vector<std::pair<BatchConfig::TokenId, int>> serializedTree;
-  for (int i = 0; i <= old_bc.beamRequestsInfo[request_index].max_depth; i++) {
-    // std::cout << "tree layer: " << i
-    //           << ", num_nodes: " << tree.treeLayers[i].nodes_num_this_layer
-    //           << "\n";
-    // push tokens into tree
-    for (int j = 0; j < tree.treeLayers[i].nodes_num_this_layer; j++) {
-      // std::cout << "token: " << tree.treeLayers[i].tokens[j] << "\n";
-      serializedTree.push_back(std::make_pair(tree.treeLayers[i].tokens[j], i));
-    }
-  }
-  // token, index
-  // todo make this one global for different stages
-
-  // PreOrder(tree,
-  //          old_bc.beamRequestsInfo[request_index].max_depth,
-  //          0,
-  //          old_bc.beamRequestsInfo[request_index].beam_size,
-  //          0,
-  //          serializedTree,
-  //          verbose);
-
-  // print it
   if (verbose) {
     std::cout << "Print serialized tree: size:" << request_index
-              << serializedTree.size() << "\n";
-  }
-  for (int k = 0; k < serializedTree.size(); k++) {
-    serializedTree.at(k).second += first_token_depth_in_request;
-    if (verbose) {
-      std::cout << "token id: " << serializedTree.at(k).first
-                << ", depth: " << serializedTree.at(k).second << "\n";
+              << trees.size(tree_index) << "\n";
+    for (int k = 0; k < trees.size(tree_index); k++) {
+      std::cout << "token id: " << trees.token(tree_index, k)
+                << ", depth: " << trees.depth(tree_index, k) << "\n";
     }
   }
-
-  // if (dfs_tree_inputs.find(old_bc.requestsInfo[request_index].request_guid)
-  // !=
-  //     dfs_tree_inputs.end()) {
-  //   dfs_tree_inputs[old_bc.requestsInfo[request_index].request_guid] =
-  //       serializedTree;
-  // } else {
-  //   dfs_tree_inputs.insert(std::make_pair(
-  //       old_bc.requestsInfo[request_index].request_guid, serializedTree));
-  // }
-
-  return serializedTree;
-  // }
 }
 
-std::vector<std::pair<BatchConfig::TokenId, int>>
-    RequestManager::merge_dfs_trees(
-        std::vector<std::vector<std::pair<BatchConfig::TokenId, int>>>
-            input_trees,
-        int root_depth,
-        RequestGuid guid) {
-  assert(input_trees.size() == 1 && "currently using one ssm");
-  dfs_tree_inputs[guid] = input_trees.at(0);
-  return input_trees.at(0);
-
-  std::vector<std::pair<BatchConfig::TokenId, int>> merged_tree;
-
-  std::unordered_map<int, std::set<int>> childrens;
-  std::unordered_map<int, int> curr_path;
-
-  // convert <token_id, depth> pair to an integer
-  auto root = input_trees.at(0).at(0);
-  int root_id = root.first * 10000 + root.second;
-
-  for (int i = 0; i < input_trees.size(); i++) {
-    auto tree = input_trees.at(i);
-    // all trees should have the same root
-    assert(tree.at(0) == root);
-
-    for (auto const &pair : tree) {
-      int id = pair.first * 10000 + pair.second; // current node
-      curr_path[pair.second] = id;               // log node in current search
-
-      if (childrens.find(id) == childrens.end()) {
-        // init empty set
-        childrens[id] = std::set<int>();
-      }
-
-      if (pair.second > root_depth) {
-        int parent_id = curr_path[pair.second - 1];
-        childrens[parent_id].insert(id);
-      }
-    }
+void RequestManager::configure_ngram_drafter(FFConfig const &config) {
+  if (!config.ngram_speculation) {
+    return;
   }
-
-  std::stack<int> q;
-  q.push(root_id);
-
-  while (!q.empty()) {
-    int curr = q.top();
-    q.pop();
-    merged_tree.push_back(std::make_pair(curr / 10000, curr % 10000));
-    for (int child : childrens[curr]) {
-      q.push(child);
+  NgramDrafter::Config drafter_config;
+  // draft trees no larger than the ones built by the SSMs
+  drafter_config.max_width =
+      BeamSearchBatchConfig::MAX_SPECULATIVE_TREE_BRANCHES;
+  drafter_config.max_tokens =
+      BeamSearchBatchConfig::MAX_BEAM_DEPTH * drafter_config.max_width;
+  ngram_drafter.reset(new NgramDrafter(drafter_config));
+  if (!config.ngram_corpus_file.empty()) {
+    // Each entry (input followed by output) of a pre-tokenized dataset is a
+    // document of the shared corpus
+    TokenDataset dataset(config.ngram_corpus_file);
+    std::shared_ptr<NgramIndex> corpus = std::make_shared<NgramIndex>(
+        drafter_config.min_order, drafter_config.max_order);
+    corpus->reserve(dataset.get_num_tokens());
+    for (size_t i = 0; i < dataset.size(); i++) {
+      corpus->start_document();
+      for (TokenDataset::TokenSpan span :
+           {dataset.input(i), dataset.output(i)}) {
+        for (size_t j = 0; j < span.size; j++) {
+          corpus->append(span[j]);
+        }
+      }
     }
+    ngram_drafter->set_corpus(corpus);
+    log_req_mgr.print("Indexed %zu tokens of n-gram corpus %s",
+                      corpus->num_tokens(),
+                      config.ngram_corpus_file.c_str());
   }
+}
 
-  if (verbose) {
-    for (auto &pair : merged_tree) {
-      std::cout << pair.first << ", depth: " << pair.second << std::endl;
+void RequestManager::draft_token_tree(Request const &request,
+                                      int request_index,
+                                      int max_depth,
+                                      BatchConfig::BitMask &bitmask) {
+  int root_depth = request.tokens.size() - 1;
+  std::vector<std::pair<BatchConfig::TokenId, int>> draft =
+      ngram_drafter->propose(request.guid,
+                             request.tokens,
+                             max_depth,
+                             ngram_drafter->get_config().max_width);
+  assert(draft.size() < BatchConfig::MAX_SPEC_TREE_TOKEN_NUM);
+
+  // The draft is in DFS order, so the parent of a token is the last token
+  // one level above it
+  token_trees.reset(request_index, request.tokens.back(), root_depth);
+  int path[BeamSearchBatchConfig::MAX_BEAM_DEPTH + 1] = {0};
+  int depth = 0;
+  for (auto const &token : draft) {
+    assert(token.second >= 1 && token.second <= max_depth &&
+           max_depth <= BeamSearchBatchConfig::MAX_BEAM_DEPTH);
+    int parent = path[token.second - 1];
+    path[token.second] =
+        token_trees.add_node(request_index, parent, token.first);
+    depth = std::max(depth, token.second);
+  }
+  set_token_tree_mask(request_index, bitmask);
+
+  // Acceptance statistics are recorded against the depth actually drafted
+  auto plan = speculation_plans.find(request.guid);
+  if (plan != speculation_plans.end()) {
+    if (depth > 0) {
+      plan->second.depth = depth;
+    } else {
+      speculation_plans.erase(plan);
     }
   }
+}
 
-  dfs_tree_inputs[guid] = merged_tree;
-
-  return merged_tree;
+void RequestManager::set_token_tree_mask(int request_index,
+                                         BatchConfig::BitMask &bitmask) {
+  // The tree starts with the last committed token. Token j of the tree may
+  // attend to token k iff k is j or one of its ancestors, i.e. bit j of
+  // mask[k] is set
+  int tree_size = token_trees.size(request_index);
+  bitmask = BatchConfig::BitMask();
+  bitmask.non_tree_cache_size = token_trees.depth(request_index, 0);
+  bitmask.prompt_size = 1;
+  bitmask.tree_size = tree_size;
+  bitmask.this_layer_size = tree_size;
+  token_trees.ancestor_masks(request_index, bitmask.mask);
 }
 
 std::vector<GenerationResult>
@@ -2712,20 +2999,27 @@ std::vector<GenerationResult>
   // reset inference_finished flag
   rm->set_inference_finished(false);
   std::vector<RequestManager::RequestGuid> inf_guids, peft_guids;
+  std::vector<Request> inf_requests;
   for (int i = 0; i < requests.size(); i++) {
-    RequestManager::RequestGuid guid;
     if (requests.at(i).req_type == RequestType::REQ_INFERENCE) {
-      guid = rm->register_new_request(requests.at(i));
-      if (guid != RequestManager::INVALID_GUID) {
-        inf_guids.push_back(guid);
-      }
+      inf_requests.push_back(requests.at(i));
     } else {
-      guid = rm->register_new_peft_request(requests.at(i));
+      RequestManager::RequestGuid guid =
+          rm->register_new_peft_request(requests.at(i));
       if (guid != RequestManager::INVALID_GUID) {
         peft_guids.push_back(guid);
       }
     }
   }
+  // Inference prompts are tokenized in parallel by the tokenizer pool
+  if (!inf_requests.empty()) {
+    for (RequestManager::RequestGuid guid :
+         rm->register_new_requests(inf_requests)) {
+      if (guid != RequestManager::INVALID_GUID) {
+        inf_guids.push_back(guid);
+      }
+    }
+  }
   std::vector<GenerationResult> results;
   for (int i = 0; i < inf_guids.size(); i++) {
     results.push_back(rm->get_generation_result(inf_guids[i]));
@@ -2742,6 +3036,13 @@ std::vector<GenerationResult>
 void RequestManager::start_background_server(FFModel *model) {
   assert(request_manager_status == INITIALIZED);
   request_manager_status = SERVING;
+  {
+    const std::lock_guard<std::mutex> lock(tokenizer_pool_mutex);
+    if (tokenizer_pool == nullptr) {
+      assert(model->config.num_tokenizer_workers > 0);
+      num_tokenizer_workers = model->config.num_tokenizer_workers;
+    }
+  }
   // Start background task
   Runtime *runtime = Runtime::get_runtime();
   Context ctx = Runtime::get_context();
@@ -2800,11 +3101,11 @@ void RequestManager::background_serving_task(
   print_timestamped_message(
       "###PEFT DEBUGGING### Updated models' configuration.");
 
-  if (rm->get_num_ssms() == 0) {
+  if (rm->get_num_ssms() == 0 && !llm->config.ngram_speculation) {
     // No SSMs: perform incremental decoding
     rm->serve_incr_decoding(llm);
   } else {
-    // Registered SSMs: perform speculative inference
+    // Registered SSMs or n-gram drafting: perform speculative inference
     rm->serve_spec_infer(llm);
   }
 
@@ -2837,6 +3138,19 @@ bool is_peft_operator_type(OperatorType type) {
   }
 }
 
+void RequestManager::load_model_weights(FFModel *model) {
+  InferenceManager *im = InferenceManager::get_inference_manager();
+  FileDataLoader *loader = im->model_weights_loaders[model];
+  if (model->config.lazy_weight_loading) {
+    // Only record the weights here; each operator's weights are loaded right
+    // before its first launch, so serving can start before all layers are
+    // resident
+    loader->register_weights(model, model->config.weight_prefetch_depth);
+  } else {
+    loader->load_weights(model);
+  }
+}
+
 /*static*/
 void RequestManager::serve_incr_decoding(FFModel *llm) {
 
@@ -2857,9 +3171,11 @@ void RequestManager::serve_incr_decoding(FFModel *llm) {
   assert(im->model_weights_loaders.find(llm) !=
          im->model_weights_loaders.end());
   // Load model weights
-  im->model_weights_loaders[llm]->load_weights(llm);
+  load_model_weights(llm);
   // init operators
   im->init_operators_inference(llm);
+  configure_coserving(llm->config);
+  peft_truncated_backprop = llm->config.peft_truncated_backprop;
   // Legion futures for inc_decoding and spec_infer
   BatchConfigFuture last_bcf;
   InferenceResultFuture last_irf;
@@ -2919,7 +3235,7 @@ void RequestManager::serve_spec_infer(FFModel *llm) {
     assert(im->model_weights_loaders.find(llm) !=
            im->model_weights_loaders.end());
     // Load model weights
-    im->model_weights_loaders[llm]->load_weights(llm);
+    load_model_weights(llm);
     // init operators
     im->init_operators_inference(llm);
   }
@@ -2927,14 +3243,17 @@ void RequestManager::serve_spec_infer(FFModel *llm) {
     // Compile the i-th ssm
     FFModel *ssm = get_ssm_model(i);
     im->compile_model_and_allocate_buffer(ssm);
-    assert(im->model_weights_loaders.find(llm) !=
+    assert(im->model_weights_loaders.find(ssm) !=
            im->model_weights_loaders.end());
     // Load model weights
-    im->model_weights_loaders[ssm]->load_weights(ssm);
+    load_model_weights(ssm);
     // init operators
     im->init_operators_inference(ssm);
   }
 
+  configure_speculation(llm->config);
+  configure_ngram_drafter(llm->config);
+
   std::queue<std::pair<TreeVerifyBatchConfigFuture, InferenceResultFuture>>
       batch_pipeline;
   // Legion futures for inc_decoding and spec_infer
@@ -2966,24 +3285,41 @@ void RequestManager::serve_spec_infer(FFModel *llm) {
       }
     }
     auto const &next_batch = batch_pipeline.back();
-    BeamSearchBatchConfigFuture beam_bcf = prepare_next_batch_init(
-        next_batch.first, next_batch.second, 0, ctx, runtime);
-    std::vector<BeamSearchBatchConfigFuture> beam_bcf_vec(get_num_ssms());
-    for (size_t ssm_id = 0; ssm_id < get_num_ssms(); ssm_id++) {
-      beam_bcf_vec[ssm_id] = beam_bcf;
+    // With adaptive speculation, only run as many SSM steps as the deepest
+    // tree planned for an earlier batch, unless new requests are waiting
+    // to be admitted. Planning runs inside prepare_next_batch_init, which
+    // has not executed yet when the next one is launched, so with pipelined
+    // iterations this depth lags one or more batches behind. Each request's
+    // planned depth is still clamped to the number of steps that run.
+    int num_ssm_steps = BeamSearchBatchConfig::MAX_BEAM_DEPTH;
+    if (adaptive_speculation && get_num_ssms() > 0) {
+      const std::lock_guard<std::mutex> lock(request_queue_mutex);
+      if (pending_infr_request_queue.empty()) {
+        num_ssm_steps = next_speculation_depth;
+      }
     }
-    runtime->begin_trace(ctx, 12345 /*trace_id*/);
-
-    for (size_t i = 0; i < get_num_ssms(); i++) {
-      for (int depth = 0; depth < BeamSearchBatchConfig::MAX_BEAM_DEPTH;
-           depth++) {
-        beam_bcf = beam_bcf_vec[i];
-
+    BeamSearchBatchConfigFuture beam_bcf = prepare_next_batch_init(
+        next_batch.first, next_batch.second, 0, num_ssm_steps, ctx, runtime);
+    // Without SSMs, token trees are drafted from n-grams by
+    // prepare_next_batch_verify, using the batch prepared by init
+    std::vector<BeamSearchBatchConfigFuture> beam_bcf_vec(
+        std::max(get_num_ssms(), (size_t)1), beam_bcf);
+    // Each number of SSM steps launches a different sequence of tasks, and
+    // thus needs its own trace
+    int trace_id =
+        12345 + 10 * (BeamSearchBatchConfig::MAX_BEAM_DEPTH - num_ssm_steps);
+    runtime->begin_trace(ctx, trace_id);
+
+    // The SSMs draft independently of each other. Launch their steps depth
+    // by depth, so that one SSM's step runs while the next batch of another
+    // SSM is prepared, instead of waiting for each SSM to finish its tree
+    for (int depth = 0; depth < num_ssm_steps; depth++) {
+      for (size_t i = 0; i < get_num_ssms(); i++) {
         FutureMap fm = im->inference(get_ssm_model(i), 0, beam_bcf_vec[i]);
         assert(fm.get_future_map_domain().get_volume() == 1);
         BeamInferenceResultFuture beam_irf = fm.get_future(0);
         beam_bcf_vec[i] =
-            prepare_next_batch_beam(beam_bcf_vec[i], beam_irf, ctx, runtime);
+            prepare_next_batch_beam(beam_bcf_vec[i], beam_irf, i, ctx, runtime);
       }
     }
     // Token Tree Verification
@@ -2997,7 +3333,18 @@ void RequestManager::serve_spec_infer(FFModel *llm) {
       last_tree_bcf = tree_bcf;
       last_tree_irf = tree_irf;
     }
-    runtime->end_trace(ctx, 12345 /*trace_id*/);
+    runtime->end_trace(ctx, trace_id);
+  }
+
+  if (!speculation_stats_file.empty()) {
+    const std::lock_guard<std::mutex> lock(request_queue_mutex);
+    std::ofstream stats_file(speculation_stats_file);
+    if (stats_file.is_open()) {
+      speculation_controller.export_stats(stats_file);
+    } else {
+      std::cout << "Unable to open the speculation stats file: "
+                << speculation_stats_file << std::endl;
+    }
   }
 }
 
@@ -3009,6 +3356,66 @@ void RequestManager::trigger_request_completion_future(
   request_to_promise[guid]->set_value();
 }
 
+void RequestManager::publish_generation_result(
+    RequestGuid guid,
+    std::vector<TokenId> const &tokens,
+    std::string const &profile_line,
+    bool write_tokens_to_file) {
+  get_tokenizer_pool()->submit([this,
+                                guid,
+                                tokens,
+                                profile_line,
+                                write_tokens_to_file](Tokenizer *tokenizer) {
+    std::string output;
+    try {
+      output = tokenizer->Decode(tokens);
+    } catch (std::exception const &e) {
+      // still complete the request, so that its callers do not wait forever
+      log_req_mgr.error(
+          "Failed to decode the output of request %zu: %s", guid, e.what());
+    }
+    // Unlike Huggingface, the sentencepiece C++ library automatically
+    // removes the BOS token
+    if (model_type == ModelType::LLAMA && tokens.at(0) == bos_token_id) {
+      output = "<s> " + output;
+    }
+    {
+      // update generation result
+      const std::lock_guard<std::mutex> lock(request_queue_mutex);
+      GenerationResult &gr = request_generation_results[guid];
+      assert(gr.guid == guid);
+      gr.output_tokens = tokens;
+      gr.output_text = output;
+    }
+    log_req_mgr.print("Final output: %s", output.c_str());
+    // Write output to file if needed:
+    if (!output_filepath.empty()) {
+      const std::lock_guard<std::mutex> lock(output_file_mutex);
+      std::ofstream outputFile(output_filepath, std::ios::app);
+      if (outputFile.is_open()) {
+        outputFile << profile_line;
+        if (write_tokens_to_file) {
+          outputFile << "token IDs: ";
+          for (int i = 0; i < tokens.size(); i++) {
+            outputFile << tokens[i];
+            if (i < tokens.size() - 1) {
+              outputFile << ",";
+            }
+          }
+          outputFile << std::endl;
+          outputFile << output;
+        }
+        outputFile.close();
+      } else {
+        std::cout << "Unable to open the output file: " << output_filepath
+                  << std::endl;
+        assert(false);
+      }
+    }
+    trigger_request_completion_future(guid);
+  });
+}
+
 /*static*/
 void RequestManager::terminate_background_server_at_exit() {
   RequestManager *rm = RequestManager::get_request_manager();
@@ -3022,6 +3429,12 @@ void RequestManager::terminate_background_server() {
     Runtime *runtime = Runtime::get_runtime();
     Context ctx = Runtime::get_context();
     background_server_handler.get_void_result();
+    // Finish writing the checkpoints queued so far (files queued later are
+    // written before the process exits)
+    PEFTCheckpointWriter::get_checkpoint_writer()->flush();
+    if (coserving_log.is_open()) {
+      coserving_log.close();
+    }
   }
 }
 
@@ -0,0 +1,137 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "flexflow/utils/row_sparse_gradient.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+namespace FlexFlow {
+
+template <typename TI>
+void RowSparseGradient::build(TI const *indices,
+                              int const *lengths,
+                              int num_bags,
+                              float const *output_grad,
+                              int64_t num_rows,
+                              int _block_size,
+                              AggrMode aggr) {
+  assert(aggr == AGGR_MODE_SUM || aggr == AGGR_MODE_AVG);
+  block_size = _block_size;
+  keys.clear();
+  entry_bags.clear();
+  for (int b = 0; b < num_bags; b++) {
+    for (int i = 0; i < lengths[b]; i++) {
+      int64_t idx = indices[keys.size()];
+      assert(idx >= 0 && idx < num_rows);
+      keys.push_back(idx);
+      entry_bags.push_back(b);
+    }
+  }
+  size_t num_entries = keys.size();
+  entries.resize(num_entries);
+  for (size_t i = 0; i < num_entries; i++) {
+    entries[i] = i;
+  }
+  sorted_keys.resize(num_entries);
+  sorted_entries.resize(num_entries);
+  // LSD radix sort of (index, entry) pairs, one byte per pass. Each pass is
+  // stable, so the entries of a row stay in batch order.
+  uint64_t max_key = num_rows > 0 ? num_rows - 1 : 0;
+  for (int shift = 0; shift < 64 && (max_key >> shift) != 0; shift += 8) {
+    size_t counts[257] = {0};
+    for (size_t i = 0; i < num_entries; i++) {
+      counts[((keys[i] >> shift) & 0xff) + 1]++;
+    }
+    for (int d = 0; d < 256; d++) {
+      counts[d + 1] += counts[d];
+    }
+    for (size_t i = 0; i < num_entries; i++) {
+      size_t pos = counts[(keys[i] >> shift) & 0xff]++;
+      sorted_keys[pos] = keys[i];
+      sorted_entries[pos] = entries[i];
+    }
+    keys.swap(sorted_keys);
+    entries.swap(sorted_entries);
+  }
+
+  rows.clear();
+  values.clear();
+  for (size_t start = 0, end = 0; start < num_entries; start = end) {
+    rows.push_back(keys[start]);
+    values.resize(rows.size() * block_size, 0.0f);
+    float *vp = values.data() + (rows.size() - 1) * block_size;
+    for (end = start; end < num_entries && keys[end] == keys[start]; end++) {
+      int b = entry_bags[entries[end]];
+      float scale = aggr == AGGR_MODE_AVG ? 1.0f / lengths[b] : 1.0f;
+      float const *gp = output_grad + (size_t)b * block_size;
+      for (int j = 0; j < block_size; j++) {
+        vp[j] += scale * gp[j];
+      }
+    }
+  }
+}
+
+void RowSparseGradient::apply_sgd(float lr,
+                                  float weight_decay,
+                                  float *weight) const {
+  for (size_t i = 0; i < rows.size(); i++) {
+    float *wp = weight + rows[i] * block_size;
+    float const *gp = row_values(i);
+    for (int j = 0; j < block_size; j++) {
+      wp[j] -= lr * (gp[j] + weight_decay * wp[j]);
+    }
+  }
+}
+
+void RowSparseGradient::apply_rowwise_adagrad(float lr,
+                                              float weight_decay,
+                                              float epsilon,
+                                              float *weight,
+                                              float *state) const {
+  std::vector<float> g(block_size);
+  for (size_t i = 0; i < rows.size(); i++) {
+    float *wp = weight + rows[i] * block_size;
+    float const *gp = row_values(i);
+    float sum = 0.0f;
+    for (int j = 0; j < block_size; j++) {
+      g[j] = gp[j] + weight_decay * wp[j];
+      sum += g[j] * g[j];
+    }
+    state[rows[i]] += sum / block_size;
+    float step = lr / (std::sqrt(state[rows[i]]) + epsilon);
+    for (int j = 0; j < block_size; j++) {
+      wp[j] -= step * g[j];
+    }
+  }
+}
+
+template void RowSparseGradient::build<int32_t>(int32_t const *indices,
+                                                int const *lengths,
+                                                int num_bags,
+                                                float const *output_grad,
+                                                int64_t num_rows,
+                                                int block_size,
+                                                AggrMode aggr);
+template void RowSparseGradient::build<int64_t>(int64_t const *indices,
+                                                int const *lengths,
+                                                int num_bags,
+                                                float const *output_grad,
+                                                int64_t num_rows,
+                                                int block_size,
+                                                AggrMode aggr);
+
+}; // namespace FlexFlow
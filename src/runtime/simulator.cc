@@ -794,6 +794,48 @@ float Simulator::default_estimate_sync_cost(
   }
 }
 
+#ifdef FF_USE_NCCL
+float Simulator::estimate_weight_sync_time(Op const *op,
+                                           ParallelConfig const &pc,
+                                           int weight_idx) {
+  size_t element_size =
+      data_type_size(DT_FLOAT); // assume all weights have float elements
+  float sync_time = 0.0f;
+  std::set<int> synched;
+  for (int firstId = 0; firstId < pc.num_parts(); firstId++) {
+    if (synched.find(firstId) == synched.end()) {
+      synched.insert(firstId);
+      Domain firstR = op->get_weight_tensor_shape(pc, weight_idx, firstId);
+      Device *firstDevice = machine->get_gpu(pc.device_ids[firstId]);
+      float nccl_time = 0.0f;
+      for (int nextId = firstId + 1; nextId < pc.num_parts(); nextId++) {
+        Domain nextR = op->get_weight_tensor_shape(pc, weight_idx, nextId);
+        if (firstR.intersection(nextR).get_volume() > 0) {
+          // Assert all or nothing:
+          // The two weights must be fully overlapped or not at all
+          assert(firstR == nextR);
+          assert(synched.find(nextId) == synched.end());
+          synched.insert(nextId);
+          Device *nextDevice = machine->get_gpu(pc.device_ids[nextId]);
+          // Compute the bandwidth between firstDevice/nextDevice
+          float bandwidth = 0.0f;
+          if (firstDevice->node_id == nextDevice->node_id) {
+            bandwidth = machine->get_intra_node_gpu_bandwidth();
+          } else {
+            bandwidth = machine->get_inter_node_gpu_bandwidth();
+          }
+          nccl_time = std::max(nccl_time,
+                               2 * (float)firstR.get_volume() * element_size /
+                                   bandwidth);
+        }
+      }
+      sync_time += nccl_time;
+    }
+  }
+  return sync_time;
+}
+#endif
+
 float Simulator::simulate_runtime(
     FFModel const *model,
     std::map<Op const *, ParallelConfig> const &global,
@@ -1016,6 +1058,9 @@ float Simulator::simulate_runtime(
   // Step 5: perform simulation
   float sim_time = 0.0f;
   std::map<Device *, float> device_times;
+  // when each backward task finishes, to start the all-reduces of their
+  // gradients
+  std::unordered_map<SimTask *, float> backward_end_times;
   size_t idx = 0;
   DotFile<SimTask *> taskGraph;
   bool export_taskgraph = (export_file_name != "");
@@ -1054,6 +1099,9 @@ float Simulator::simulate_runtime(
     if (end_time > sim_time) {
       sim_time = end_time;
     }
+    if (cur_task->type == SimTask::TASK_BACKWARD) {
+      backward_end_times[cur_task] = end_time;
+    }
     for (size_t i = 0; i < cur_task->next_tasks.size(); i++) {
       SimTask *next = cur_task->next_tasks[i];
       if (export_taskgraph) {
@@ -1073,7 +1121,52 @@ float Simulator::simulate_runtime(
   // Assert all tasks were processed
   assert(idx == task_manager->global_task_id);
 #ifdef FF_USE_NCCL
-  if (comp_mode == COMP_MODE_TRAINING) {
+  if (comp_mode == COMP_MODE_TRAINING &&
+      model->config.gradient_bucket_size > 0 &&
+      !model->config.mixed_precision) {
+    // Gradients are all-reduced in buckets while the backward pass runs (see
+    // FFModel::create_gradient_buckets). A bucket starts once its gradients
+    // are ready and the previous bucket, on any devices, finishes.
+    GradientBuckets buckets(model->config.gradient_bucket_size);
+    std::vector<float> sync_times, ready_times;
+    for (int l = model->operators.size() - 1; l >= 0; l--) {
+      Op const *op = model->operators[l];
+      ParallelConfig pc = global.find(op)->second;
+      float backward_end = 0.0f;
+      size_t group = 0;
+      for (int j = 0; j < pc.num_parts(); j++) {
+        SimTask *backT = task_manager->get_backward_task(op, j);
+        backward_end = std::max(backward_end, backward_end_times.at(backT));
+        hash_combine(group, pc.device_ids[j]);
+      }
+      for (int j = 0; j < op->numWeights; j++) {
+        float sync_time = estimate_weight_sync_time(op, pc, j);
+        if (sync_time == 0.0f) {
+          // the weight is not replicated
+          continue;
+        }
+        Domain weightR = op->get_weight_tensor_shape(pc, j, 0);
+        buckets.add_parameter(group, weightR.get_volume() * sizeof(float));
+        sync_times.push_back(sync_time);
+        ready_times.push_back(backward_end);
+      }
+    }
+    std::vector<float> bucket_ready(buckets.num_buckets(), 0.0f);
+    std::vector<float> bucket_time(buckets.num_buckets(), 0.0f);
+    for (size_t p = 0; p < buckets.num_parameters(); p++) {
+      int b = buckets.get_bucket(p);
+      bucket_ready[b] = std::max(bucket_ready[b], ready_times[p]);
+      bucket_time[b] += sync_times[p];
+    }
+    float sync_end = 0.0f;
+    for (size_t b = 0; b < buckets.num_buckets(); b++) {
+      sync_end = std::max(sync_end, bucket_ready[b]) + bucket_time[b];
+      sim_time = std::max(sim_time, sync_end);
+    }
+    log_ps_sim.debug("%zu all-reduce buckets, sim time: %fms",
+                     buckets.num_buckets(),
+                     sim_time);
+  } else if (comp_mode == COMP_MODE_TRAINING) {
     std::unordered_set<Op const *> possible_syncs(model->operators.begin(),
                                                   model->operators.end());
     std::unordered_map<Op const *, std::unique_ptr<OpSyncTask>> tasks;
@@ -1121,49 +1214,13 @@ float Simulator::simulate_runtime(
         OpSyncTask *task = tasks.at(to_run).get();
         Op const *op = to_run;
         ParallelConfig pc = global.find(op)->second;
-        size_t element_size =
-            data_type_size(DT_FLOAT); // assume all weights have float elements
 
         for (int j = 0; j < pc.num_parts(); j++) {
           available_devices[pc.device_ids[j]] = false;
         }
 
         for (int j = 0; j < op->numWeights; j++) {
-          std::set<int> synched;
-          for (int firstId = 0; firstId < pc.num_parts(); firstId++) {
-            if (synched.find(firstId) == synched.end()) {
-              synched.insert(firstId);
-              Domain firstR = op->get_weight_tensor_shape(pc, j, firstId);
-              Device *firstDevice = machine->get_gpu(pc.device_ids[firstId]);
-              float nccl_time = 0.0f;
-              for (int nextId = firstId + 1; nextId < pc.num_parts();
-                   nextId++) {
-                Domain nextR = op->get_weight_tensor_shape(pc, j, nextId);
-                if (firstR.intersection(nextR).get_volume() > 0) {
-                  // Assert all or nothing:
-                  // The two weights must be fully overlapped or not at all
-                  assert(firstR == nextR);
-                  assert(synched.find(nextId) == synched.end());
-                  synched.insert(nextId);
-                  Device *nextDevice = machine->get_gpu(pc.device_ids[nextId]);
-                  // Compute the bandwidth between firstDevice/nextDevice
-                  float bandwidth = 0.0f;
-                  if (firstDevice->node_id == nextDevice->node_id) {
-                    bandwidth = machine->get_intra_node_gpu_bandwidth();
-                  } else {
-                    bandwidth = machine->get_inter_node_gpu_bandwidth();
-                  }
-                  // printf("[NCCL Time] Op(%s) Weight(%d) firstId(%d)
-                  // nextId(%d): volume is %f\n", op->name, j, firstId, nextId,
-                  // (float)firstR.get_volume());
-                  nccl_time = std::max(nccl_time,
-                                       2 * (float)firstR.get_volume() *
-                                           element_size / bandwidth);
-                }
-              }
-              sync_run_time += nccl_time;
-            }
-          }
+          sync_run_time += estimate_weight_sync_time(op, pc, j);
         }
 
         task->finish_time = sync_sim_time + sync_run_time;
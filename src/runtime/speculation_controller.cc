@@ -0,0 +1,242 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "flexflow/speculation_controller.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <nlohmann/json.hpp>
+
+namespace FlexFlow {
+
+SpeculationController::SpeculationController()
+    : max_depth(8), branch_layer(0), max_width(1), min_token_gain(0.1),
+      prior_acceptance(0.6), decay(0.9), prior_weight(4.0) {}
+
+void SpeculationController::set_max_depth(int _max_depth) {
+  assert(_max_depth > 0);
+  max_depth = _max_depth;
+}
+
+void SpeculationController::set_branching(int _branch_layer, int _max_width) {
+  assert(_branch_layer >= 0);
+  assert(_max_width > 0);
+  branch_layer = _branch_layer;
+  max_width = _max_width;
+}
+
+void SpeculationController::set_min_token_gain(double _min_token_gain) {
+  assert(_min_token_gain >= 0);
+  min_token_gain = _min_token_gain;
+}
+
+void SpeculationController::set_prior_acceptance(double _prior_acceptance) {
+  assert(_prior_acceptance > 0 && _prior_acceptance < 1);
+  prior_acceptance = _prior_acceptance;
+}
+
+void SpeculationController::set_decay(double _decay) {
+  assert(_decay > 0 && _decay <= 1);
+  decay = _decay;
+}
+
+void SpeculationController::update(Counts &counts,
+                                   int depth,
+                                   int accepted) const {
+  counts.accepted = decay * counts.accepted + accepted;
+  counts.rejected = decay * counts.rejected + (accepted < depth ? 1 : 0);
+}
+
+double SpeculationController::estimate(Counts const &counts,
+                                       double prior) const {
+  // Maximum-likelihood estimate of a geometric acceptance probability,
+  // smoothed towards the prior with prior_weight pseudo-observations
+  double alpha = (counts.accepted + prior_weight * prior) /
+                 (counts.accepted + counts.rejected + prior_weight);
+  return std::min(0.99, std::max(0.01, alpha));
+}
+
+void SpeculationController::record(RequestGuid guid,
+                                   std::string const &request_class,
+                                   int depth,
+                                   int accepted) {
+  assert(depth >= 0 && accepted >= 0);
+  accepted = std::min(accepted, depth);
+  update(request_stats[guid], depth, accepted);
+  for (ClassStats *stats : {&class_stats[request_class], &global_stats}) {
+    update(stats->counts, depth, accepted);
+    if (stats->histogram.size() <= (size_t)depth) {
+      stats->histogram.resize(depth + 1);
+    }
+    std::vector<size_t> &lengths = stats->histogram[depth];
+    if (lengths.size() <= (size_t)accepted) {
+      lengths.resize(depth + 1, 0);
+    }
+    lengths[accepted]++;
+  }
+}
+
+void SpeculationController::remove_request(RequestGuid guid) {
+  request_stats.erase(guid);
+}
+
+double SpeculationController::class_acceptance_rate(
+    std::string const &request_class) const {
+  auto it = class_stats.find(request_class);
+  if (it == class_stats.end()) {
+    return estimate(global_stats.counts, prior_acceptance);
+  }
+  return estimate(it->second.counts,
+                  estimate(global_stats.counts, prior_acceptance));
+}
+
+double SpeculationController::get_acceptance_rate(
+    RequestGuid guid, std::string const &request_class) const {
+  double class_rate = class_acceptance_rate(request_class);
+  auto it = request_stats.find(guid);
+  if (it == request_stats.end()) {
+    return class_rate;
+  }
+  return estimate(it->second, class_rate);
+}
+
+int SpeculationController::tree_size(int depth, int width) const {
+  int chain = std::min(branch_layer, depth);
+  return chain + width * (depth - chain);
+}
+
+double SpeculationController::expected_accepted_tokens(double alpha,
+                                                       int depth,
+                                                       int width) const {
+  double expected = 0, prob = 1;
+  for (int layer = 0; layer < depth; layer++) {
+    if (layer == branch_layer && width > 1) {
+      prob *= 1 - std::pow(1 - alpha, width);
+    } else {
+      prob *= alpha;
+    }
+    expected += prob;
+  }
+  return expected;
+}
+
+SpeculationController::Plan
+    SpeculationController::best_plan(double alpha, double lambda) const {
+  Plan best = {1, 1};
+  double best_score = expected_accepted_tokens(alpha, 1, 1) - lambda;
+  for (int depth = 1; depth <= max_depth; depth++) {
+    int widths = depth > branch_layer ? max_width : 1;
+    for (int width = 1; width <= widths; width++) {
+      double score = expected_accepted_tokens(alpha, depth, width) -
+                     lambda * tree_size(depth, width);
+      // ties go to the smaller tree
+      if (score > best_score + 1e-12) {
+        best_score = score;
+        best.depth = depth;
+        best.width = width;
+      }
+    }
+  }
+  return best;
+}
+
+std::vector<SpeculationController::Plan> SpeculationController::plan(
+    std::vector<std::pair<RequestGuid, std::string>> const &requests,
+    int token_budget) const {
+  std::vector<double> alphas;
+  for (auto const &request : requests) {
+    alphas.push_back(get_acceptance_rate(request.first, request.second));
+  }
+  if (token_budget < (int)requests.size()) {
+    // Not every request can speculate a token: spend the budget on the
+    // requests most likely to have it accepted, the others get depth 0
+    std::vector<size_t> order(requests.size());
+    for (size_t k = 0; k < order.size(); k++) {
+      order[k] = k;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      return alphas[a] > alphas[b];
+    });
+    std::vector<Plan> plans(requests.size(), Plan{0, 1});
+    for (int k = 0; k < token_budget; k++) {
+      plans[order[k]] = Plan{1, 1};
+    }
+    return plans;
+  }
+  // Each request independently maximizes its expected accepted tokens minus
+  // lambda per speculated token; search for the smallest lambda (no lower
+  // than min_token_gain) whose plans fit in the budget
+  auto plans_for = [&](double lambda, int &total) {
+    std::vector<Plan> plans;
+    total = 0;
+    for (double alpha : alphas) {
+      plans.push_back(best_plan(alpha, lambda));
+      total += tree_size(plans.back().depth, plans.back().width);
+    }
+    return plans;
+  };
+  int total = 0;
+  std::vector<Plan> plans = plans_for(min_token_gain, total);
+  if (total <= token_budget) {
+    return plans;
+  }
+  // With lambda >= 1 no token is worth speculating beyond the first one
+  double lo = min_token_gain, hi = 1.0;
+  std::vector<Plan> feasible = plans_for(hi, total);
+  for (int iter = 0; iter < 30; iter++) {
+    double mid = 0.5 * (lo + hi);
+    std::vector<Plan> mid_plans = plans_for(mid, total);
+    if (total <= token_budget) {
+      hi = mid;
+      feasible = mid_plans;
+    } else {
+      lo = mid;
+    }
+  }
+  return feasible;
+}
+
+void SpeculationController::export_stats(std::ostream &os) const {
+  using json = nlohmann::json;
+  auto to_json = [&](ClassStats const &stats, double acceptance_rate) {
+    json j;
+    j["acceptance_rate"] = acceptance_rate;
+    json histogram = json::object();
+    for (size_t depth = 0; depth < stats.histogram.size(); depth++) {
+      if (!stats.histogram[depth].empty()) {
+        histogram[std::to_string(depth)] = stats.histogram[depth];
+      }
+    }
+    // histogram[depth][a] is the number of trees of that depth in which a
+    // speculated tokens were accepted
+    j["accepted_tokens_histogram"] = histogram;
+    return j;
+  };
+  json j;
+  j["max_depth"] = max_depth;
+  j["branch_layer"] = branch_layer;
+  j["max_width"] = max_width;
+  j["overall"] =
+      to_json(global_stats, estimate(global_stats.counts, prior_acceptance));
+  json classes = json::object();
+  for (auto const &it : class_stats) {
+    classes[it.first] = to_json(it.second, class_acceptance_rate(it.first));
+  }
+  j["classes"] = classes;
+  os << j.dump(2) << std::endl;
+}
+
+}; // namespace FlexFlow
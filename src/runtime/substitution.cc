@@ -2035,6 +2035,13 @@ void GraphSearchHelper::graph_optimize_with_memory(
   settings.remove_trailing_parallel_ops = true;
   settings.simplify_parallel_ops = true;
   best_graph->simplify(settings);
+  for (Node const &node : optimal.recomputed) {
+    if (best_graph->inEdges.find(node) != best_graph->inEdges.end()) {
+      best_graph->recomputed_nodes.insert(node);
+    }
+  }
+  std::cout << "Operators recomputed in backward: "
+            << best_graph->recomputed_nodes.size() << std::endl;
 
   // Get the real optimal machine views.
   std::unordered_map<Node, MachineView> duplicated_optimal_views =
@@ -2096,6 +2103,7 @@ static void graph_log_representation(Graph const *graph,
 void GraphSearchHelper::update_mem_optim_config(
     MemoryOptimConfig const &new_config) {
   mem_config = new_config;
+  model->search->mem_config = new_config;
 }
 
 void GraphSearchHelper::find_rewrite_matches(
@@ -2502,6 +2510,7 @@ GraphOptimizeResultWithMemory
   result.cost = gcr.cost;
   result.views = gcr.views;
   result.mem_cost = gcr.mem_cost;
+  result.recomputed = gcr.recomputed;
   return result;
 }
 
@@ -3689,7 +3698,8 @@ bool FFModel::convert_graph_to_operators(
         break;
       }
       case OP_EMBEDDING: {
-        new_op = new Embedding(*this, *(Embedding *)node.ptr, inputs[0], true);
+        new_op = new Embedding(
+            *this, *(Embedding *)node.ptr, {inputs, inputs + num_inputs}, true);
         break;
       }
       case OP_EW_ADD:
@@ -3864,6 +3874,9 @@ bool FFModel::convert_graph_to_operators(
     for (int i = 0; i < new_op->numWeights; i++) {
       new_op->weights[i]->machine_view = view;
     }
+    new_op->recompute_outputs =
+        graph->recomputed_nodes.find(node) != graph->recomputed_nodes.end();
+    assert(!new_op->recompute_outputs || new_op->can_recompute_outputs());
     node_to_op[node] = new_op;
     operators.push_back(new_op);
     // Decrease the todos
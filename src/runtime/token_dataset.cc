@@ -0,0 +1,155 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "flexflow/utils/token_dataset.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace FlexFlow {
+
+char const TokenDataset::MAGIC[8] = {'F', 'F', 'T', 'O', 'K', 'D', 'S', '\0'};
+
+TokenDataset::TokenDataset(std::string const &_filepath)
+    : filepath(_filepath), fd(-1), mapped(nullptr), mapped_size(0),
+      num_entries(0), num_tokens(0), offsets(nullptr), tokens(nullptr) {
+  fd = open(filepath.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "Unable to open token dataset " << filepath << std::endl;
+    assert(false);
+  }
+  struct stat st;
+  int ret = fstat(fd, &st);
+  assert(ret == 0);
+  mapped_size = st.st_size;
+  assert(mapped_size >= sizeof(Header) && "Token dataset file is truncated");
+  mapped = mmap(nullptr, mapped_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  assert(mapped != MAP_FAILED);
+
+  Header const *header = static_cast<Header const *>(mapped);
+  assert(memcmp(header->magic, MAGIC, sizeof(MAGIC)) == 0 &&
+         "Not a token dataset file");
+  if (header->version != VERSION) {
+    std::cerr << "Unsupported token dataset version " << header->version
+              << " in " << filepath << " (expected " << VERSION << ")"
+              << std::endl;
+    assert(false);
+  }
+  num_entries = header->num_entries;
+  num_tokens = header->num_tokens;
+  assert(header->offsets_offset % sizeof(uint64_t) == 0);
+  assert(header->tokens_offset % sizeof(int32_t) == 0);
+  assert(header->offsets_offset + (2 * num_entries + 1) * sizeof(uint64_t) <=
+         header->tokens_offset);
+  assert(header->tokens_offset + num_tokens * sizeof(int32_t) <= mapped_size &&
+         "Token dataset file is truncated");
+  char const *base = static_cast<char const *>(mapped);
+  offsets = reinterpret_cast<uint64_t const *>(base + header->offsets_offset);
+  tokens = reinterpret_cast<int32_t const *>(base + header->tokens_offset);
+  assert(offsets[2 * num_entries] == num_tokens);
+  // Entries are usually consumed in order
+  madvise(mapped, mapped_size, MADV_SEQUENTIAL);
+}
+
+TokenDataset::~TokenDataset() {
+  if (mapped != nullptr) {
+    munmap(mapped, mapped_size);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+/*static*/
+bool TokenDataset::is_token_dataset(std::string const &filepath) {
+  std::ifstream file_handle(filepath, std::ios::binary);
+  char magic[sizeof(MAGIC)];
+  if (!file_handle.read(magic, sizeof(magic))) {
+    return false;
+  }
+  return memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+/*static*/
+void TokenDataset::write(
+    std::string const &filepath,
+    std::vector<std::pair<std::vector<int32_t>, std::vector<int32_t>>> const
+        &entries) {
+  std::vector<uint64_t> entry_offsets;
+  entry_offsets.reserve(2 * entries.size() + 1);
+  uint64_t total_tokens = 0;
+  entry_offsets.push_back(0);
+  for (auto const &entry : entries) {
+    total_tokens += entry.first.size();
+    entry_offsets.push_back(total_tokens);
+    total_tokens += entry.second.size();
+    entry_offsets.push_back(total_tokens);
+  }
+  Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = VERSION;
+  header.header_size = sizeof(Header);
+  header.num_entries = entries.size();
+  header.num_tokens = total_tokens;
+  header.offsets_offset = sizeof(Header);
+  header.tokens_offset =
+      header.offsets_offset + entry_offsets.size() * sizeof(uint64_t);
+
+  std::ofstream out(filepath, std::ios::binary | std::ios::trunc);
+  assert(out.good() && "Unable to create token dataset file");
+  out.write(reinterpret_cast<char const *>(&header), sizeof(header));
+  out.write(reinterpret_cast<char const *>(entry_offsets.data()),
+            entry_offsets.size() * sizeof(uint64_t));
+  for (auto const &entry : entries) {
+    out.write(reinterpret_cast<char const *>(entry.first.data()),
+              entry.first.size() * sizeof(int32_t));
+    out.write(reinterpret_cast<char const *>(entry.second.data()),
+              entry.second.size() * sizeof(int32_t));
+  }
+  assert(out.good() && "Failed to write token dataset file");
+}
+
+TokenDataset::TokenSpan TokenDataset::input(size_t entry) const {
+  assert(entry < num_entries);
+  TokenSpan span = {tokens + offsets[2 * entry],
+                    (size_t)(offsets[2 * entry + 1] - offsets[2 * entry])};
+  return span;
+}
+
+TokenDataset::TokenSpan TokenDataset::output(size_t entry) const {
+  assert(entry < num_entries);
+  TokenSpan span = {tokens + offsets[2 * entry + 1],
+                    (size_t)(offsets[2 * entry + 2] - offsets[2 * entry + 1])};
+  return span;
+}
+
+size_t TokenDataset::max_entry_length() const {
+  size_t max_length = 0;
+  for (size_t i = 0; i < num_entries; i++) {
+    max_length =
+        std::max(max_length, (size_t)(offsets[2 * i + 2] - offsets[2 * i]));
+  }
+  return max_length;
+}
+
+}; // namespace FlexFlow
@@ -0,0 +1,152 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "flexflow/token_tree.h"
+
+#include <cassert>
+
+namespace FlexFlow {
+
+TokenTreeArena::TokenTreeArena(int _max_trees, int _max_nodes)
+    : max_trees(_max_trees), max_nodes(_max_nodes), sizes(_max_trees, 0) {
+  assert(max_trees > 0 && max_nodes > 0);
+  size_t num_nodes = (size_t)max_trees * max_nodes;
+  tokens.resize(num_nodes);
+  depths.resize(num_nodes);
+  parents.resize(num_nodes);
+  probs.resize(num_nodes);
+  first_children.resize(num_nodes);
+  last_children.resize(num_nodes);
+  next_siblings.resize(num_nodes);
+  merge_map.resize(max_nodes);
+}
+
+void TokenTreeArena::reset(int tree, TokenId token, int depth, float prob) {
+  assert(tree >= 0 && tree < max_trees);
+  size_t i = index(tree, 0);
+  tokens[i] = token;
+  depths[i] = depth;
+  parents[i] = NONE;
+  probs[i] = prob;
+  first_children[i] = last_children[i] = next_siblings[i] = NONE;
+  sizes[tree] = 1;
+}
+
+int TokenTreeArena::add_node(int tree,
+                             int parent,
+                             TokenId token,
+                             float prob) {
+  assert(parent >= 0 && parent < sizes[tree]);
+  int node = sizes[tree];
+  if (node == max_nodes) {
+    return NONE;
+  }
+  size_t i = index(tree, node), p = index(tree, parent);
+  tokens[i] = token;
+  depths[i] = depths[p] + 1;
+  parents[i] = parent;
+  probs[i] = prob;
+  first_children[i] = last_children[i] = next_siblings[i] = NONE;
+  if (first_children[p] == NONE) {
+    first_children[p] = node;
+  } else {
+    next_siblings[index(tree, last_children[p])] = node;
+  }
+  last_children[p] = node;
+  sizes[tree]++;
+  return node;
+}
+
+int TokenTreeArena::find_child(int tree, int parent, TokenId token) const {
+  for (int child = first_child(tree, parent); child != NONE;
+       child = next_sibling(tree, child)) {
+    if (tokens[index(tree, child)] == token) {
+      return child;
+    }
+  }
+  return NONE;
+}
+
+int TokenTreeArena::merge(int tree,
+                          TokenTreeArena const &other,
+                          int other_tree) {
+  int other_size = other.size(other_tree);
+  if (other_size == 0) {
+    return 0;
+  }
+  assert(sizes[tree] > 0 && other_size <= max_nodes);
+  assert(token(tree, 0) == other.token(other_tree, 0) &&
+         depth(tree, 0) == other.depth(other_tree, 0) &&
+         "merged trees must have the same root");
+  int dropped = 0;
+  merge_map[0] = 0;
+  // parents come before their children, so one pass maps every node
+  for (int node = 1; node < other_size; node++) {
+    int parent = merge_map[other.parent(other_tree, node)];
+    if (parent == NONE) {
+      merge_map[node] = NONE;
+      dropped++;
+      continue;
+    }
+    TokenId token = other.token(other_tree, node);
+    int mapped = find_child(tree, parent, token);
+    if (mapped == NONE) {
+      mapped = add_node(tree, parent, token, other.prob(other_tree, node));
+      dropped += (mapped == NONE);
+    }
+    merge_map[node] = mapped;
+  }
+  return dropped;
+}
+
+void TokenTreeArena::verify(int tree,
+                            TokenId const *outputs,
+                            int num_outputs,
+                            std::vector<int> &accepted) const {
+  accepted.clear();
+  if (sizes[tree] == 0 || num_outputs <= 0) {
+    return;
+  }
+  int node = 0;
+  accepted.push_back(node);
+  while (true) {
+    // children are stored in increasing index order
+    int next = first_child(tree, node);
+    while (next != NONE && next < num_outputs &&
+           tokens[index(tree, next)] != outputs[node]) {
+      next = next_sibling(tree, next);
+    }
+    if (next == NONE || next >= num_outputs) {
+      return;
+    }
+    node = next;
+    accepted.push_back(node);
+  }
+}
+
+void TokenTreeArena::ancestor_masks(int tree,
+                                    unsigned long long *masks) const {
+  assert(sizes[tree] <= 64 && "masks have 64 bits");
+  for (int node = 0; node < sizes[tree]; node++) {
+    masks[node] = 0;
+  }
+  for (int node = 0; node < sizes[tree]; node++) {
+    for (int k = node; k != NONE; k = parent(tree, k)) {
+      masks[k] |= 1ULL << node;
+    }
+  }
+}
+
+}; // namespace FlexFlow
@@ -0,0 +1,164 @@
+/* Copyright 2023 CMU, Stanford, Facebook, LANL
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "flexflow/tokenizer_pool.h"
+#include <cassert>
+
+namespace FlexFlow {
+
+TokenizerPool::TokenizerPool(TokenizerFactory const &factory, int num_workers)
+    : stopping(false) {
+  assert(num_workers > 0);
+  for (int i = 0; i < num_workers; i++) {
+    tokenizers.push_back(factory());
+  }
+  for (int i = 0; i < num_workers; i++) {
+    workers.emplace_back(&TokenizerPool::worker_loop, this, i);
+  }
+}
+
+TokenizerPool::~TokenizerPool() {
+  {
+    std::lock_guard<std::mutex> lock(work_mutex);
+    stopping = true;
+  }
+  work_cv.notify_all();
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+int TokenizerPool::get_num_workers() const {
+  return (int)workers.size();
+}
+
+void TokenizerPool::worker_loop(int worker_id) {
+  Tokenizer *tokenizer = tokenizers[worker_id].get();
+  while (true) {
+    Work work;
+    {
+      std::unique_lock<std::mutex> lock(work_mutex);
+      work_cv.wait(lock, [this] { return stopping || !pending_work.empty(); });
+      // drain the remaining work before exiting
+      if (pending_work.empty()) {
+        return;
+      }
+      work = std::move(pending_work.front());
+      pending_work.pop_front();
+    }
+    work(tokenizer);
+  }
+}
+
+/*static*/
+void TokenizerPool::wait_for_chunks(std::vector<std::future<void>> &chunks) {
+  // The chunks write into the caller's results, so all of them must finish
+  // before the first error is rethrown
+  for (auto &chunk : chunks) {
+    chunk.wait();
+  }
+  for (auto &chunk : chunks) {
+    chunk.get();
+  }
+}
+
+void TokenizerPool::submit(Work work) {
+  {
+    std::lock_guard<std::mutex> lock(work_mutex);
+    assert(!stopping);
+    pending_work.push_back(std::move(work));
+  }
+  work_cv.notify_one();
+}
+
+std::future<std::vector<int32_t>>
+    TokenizerPool::encode_async(std::string const &text) {
+  auto promise = std::make_shared<std::promise<std::vector<int32_t>>>();
+  std::future<std::vector<int32_t>> future = promise->get_future();
+  submit([promise, text](Tokenizer *tokenizer) {
+    try {
+      promise->set_value(tokenizer->Encode(text));
+    } catch (...) {
+      promise->set_exception(std::current_exception());
+    }
+  });
+  return future;
+}
+
+std::future<std::string>
+    TokenizerPool::decode_async(std::vector<int32_t> const &tokens) {
+  auto promise = std::make_shared<std::promise<std::string>>();
+  std::future<std::string> future = promise->get_future();
+  submit([promise, tokens](Tokenizer *tokenizer) {
+    try {
+      promise->set_value(tokenizer->Decode(tokens));
+    } catch (...) {
+      promise->set_exception(std::current_exception());
+    }
+  });
+  return future;
+}
+
+std::vector<std::vector<int32_t>>
+    TokenizerPool::encode_batch(std::vector<std::string> const &texts) {
+  std::vector<std::vector<int32_t>> results(texts.size());
+  size_t num_chunks = std::min(texts.size(), workers.size());
+  std::vector<std::future<void>> chunks_done;
+  for (size_t c = 0; c < num_chunks; c++) {
+    size_t begin = texts.size() * c / num_chunks;
+    size_t end = texts.size() * (c + 1) / num_chunks;
+    auto promise = std::make_shared<std::promise<void>>();
+    chunks_done.push_back(promise->get_future());
+    submit([promise, &texts, &results, begin, end](Tokenizer *tokenizer) {
+      try {
+        for (size_t i = begin; i < end; i++) {
+          results[i] = tokenizer->Encode(texts[i]);
+        }
+        promise->set_value();
+      } catch (...) {
+        promise->set_exception(std::current_exception());
+      }
+    });
+  }
+  wait_for_chunks(chunks_done);
+  return results;
+}
+
+std::vector<std::string> TokenizerPool::decode_batch(
+    std::vector<std::vector<int32_t>> const &token_lists) {
+  std::vector<std::string> results(token_lists.size());
+  size_t num_chunks = std::min(token_lists.size(), workers.size());
+  std::vector<std::future<void>> chunks_done;
+  for (size_t c = 0; c < num_chunks; c++) {
+    size_t begin = token_lists.size() * c / num_chunks;
+    size_t end = token_lists.size() * (c + 1) / num_chunks;
+    auto promise = std::make_shared<std::promise<void>>();
+    chunks_done.push_back(promise->get_future());
+    submit([promise, &token_lists, &results, begin, end](Tokenizer *tokenizer) {
+      try {
+        for (size_t i = begin; i < end; i++) {
+          results[i] = tokenizer->Decode(token_lists[i]);
+        }
+        promise->set_value();
+      } catch (...) {
+        promise->set_exception(std::current_exception());
+      }
+    });
+  }
+  wait_for_chunks(chunks_done);
+  return results;
+}
+
+}; // namespace FlexFlow
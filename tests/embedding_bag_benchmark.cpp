@@ -0,0 +1,140 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures the CPU embedding-bag forward and backward passes of
+// Kernels::EmbeddingBagCPU for each instruction set and thread count
+// against the single-threaded scalar path, on multi-hot bags of random
+// lengths drawn from a table larger than the caches.
+//
+// Build with:
+//   g++ -std=c++17 -O2 -I../include -pthread -o embedding_bag_benchmark \
+//       embedding_bag_benchmark.cpp ../src/ops/kernels/embedding_bag_cpu.cc
+
+#include <flexflow/ops/kernels/embedding_bag_cpu.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace FlexFlow;
+using namespace FlexFlow::Kernels::EmbeddingBagCPU;
+
+// Returns the mean time of one call of f in milliseconds
+double time_ms(int iterations, std::function<void()> const &f) {
+  f();
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    f();
+  }
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / iterations;
+}
+
+int main(int argc, char *argv[]) {
+  int64_t num_rows = argc > 1 ? atoll(argv[1]) : 1000000;
+  int num_bags = argc > 2 ? atoi(argv[2]) : 2048;
+  int mean_length = argc > 3 ? atoi(argv[3]) : 32;
+  int max_threads = argc > 4 ? atoi(argv[4])
+                             : (int)std::thread::hardware_concurrency();
+  int const iterations = 10;
+
+  std::mt19937_64 gen(0);
+  std::vector<int> lengths(num_bags);
+  std::vector<int64_t> indices;
+  for (int b = 0; b < num_bags; b++) {
+    lengths[b] = 1 + gen() % (2 * mean_length - 1);
+    for (int i = 0; i < lengths[b]; i++) {
+      indices.push_back(gen() % num_rows);
+    }
+  }
+  std::vector<int32_t> indices32(indices.begin(), indices.end());
+  printf("%lld rows, %d bags, %zu indices, best instruction set %s\n",
+         (long long)num_rows,
+         num_bags,
+         indices.size(),
+         isa_name(ISA_AUTO));
+
+  for (int block_size : {32, 64, 100, 128, 256}) {
+    std::vector<float> weight(num_rows * block_size, 0.5f);
+    std::vector<float> output(num_bags * block_size);
+    std::vector<float> weight_grad(num_rows * block_size, 0.0f);
+    double scalar_fwd = 0, scalar_bwd = 0;
+    for (Isa isa : {ISA_SCALAR, ISA_AVX2, ISA_AVX512}) {
+      if (isa > best_isa()) {
+        continue;
+      }
+      for (int threads = 1; threads <= max_threads; threads *= 2) {
+        double fwd = time_ms(iterations, [&] {
+          forward(indices.data(),
+                  lengths.data(),
+                  num_bags,
+                  weight.data(),
+                  num_rows,
+                  block_size,
+                  AGGR_MODE_SUM,
+                  output.data(),
+                  threads,
+                  isa);
+        });
+        double fwd32 = time_ms(iterations, [&] {
+          forward(indices32.data(),
+                  lengths.data(),
+                  num_bags,
+                  weight.data(),
+                  num_rows,
+                  block_size,
+                  AGGR_MODE_AVG,
+                  output.data(),
+                  threads,
+                  isa);
+        });
+        double bwd = time_ms(iterations, [&] {
+          backward(indices.data(),
+                   lengths.data(),
+                   num_bags,
+                   output.data(),
+                   num_rows,
+                   block_size,
+                   AGGR_MODE_SUM,
+                   weight_grad.data(),
+                   threads,
+                   isa);
+        });
+        if (isa == ISA_SCALAR && threads == 1) {
+          scalar_fwd = fwd;
+          scalar_bwd = bwd;
+        }
+        double gbytes = indices.size() * block_size * sizeof(float) / 1e9;
+        printf("block %3d %-6s %2d thread(s): forward %7.3f ms (%5.1f GB/s, "
+               "%4.1fx), int32 avg %7.3f ms, backward %7.3f ms (%4.1fx)\n",
+               block_size,
+               isa_name(isa),
+               threads,
+               fwd,
+               gbytes / (fwd / 1e3),
+               scalar_fwd / fwd,
+               fwd32,
+               bwd,
+               scalar_bwd / bwd);
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,140 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Compares the throughput of GPT_Tokenizer::tokenize against the
+// std::regex-based GPT_Tokenizer::legacy_tokenize on the inputs used by
+// gpt_tokenizer.cpp, and checks that both produce the same tokens. It then
+// tokenizes the same inputs from several threads sharing one tokenizer (and
+// thus one BPE word cache), and checks the results again.
+
+#include <flexflow/gpt_tokenizer.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+
+static void print_cache_stats(GPT_Tokenizer const &tokenizer) {
+  BPEWordCache::Stats stats = tokenizer.get_cache_stats();
+  uint64_t lookups = stats.hits + stats.misses;
+  printf("  BPE cache: %zu entries, %.2f/%.2f MB, hit rate %.2f%%, %llu "
+         "evictions\n",
+         stats.num_entries,
+         stats.bytes / (1024.0 * 1024.0),
+         stats.capacity_bytes / (1024.0 * 1024.0),
+         lookups > 0 ? 100.0 * stats.hits / lookups : 0.0,
+         (unsigned long long)stats.evictions);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2 || (strcmp(argv[1], "gpt-2") && strcmp(argv[1], "opt"))) {
+    fprintf(stderr,
+            "Usage: %s <gpt-2|opt> [input file] [num threads]\n",
+            argv[0]);
+    return 1;
+  }
+  tokenizer_mode mode =
+      strcmp(argv[1], "gpt-2") == 0 ? GPT2_TOKENIZER : OPT_TOKENIZER;
+  std::string vocab_file = mode == GPT2_TOKENIZER ? "./gpt2_bpe/vocab.bpe"
+                                                  : "opt_bpe/gpt2-merges.txt";
+  std::string merge_file = mode == GPT2_TOKENIZER ? "./gpt2_bpe/encoder.json"
+                                                  : "opt_bpe/gpt2-vocab.json";
+  std::string input_file =
+      argc > 2 ? argv[2] : "./wikitext-103-raw/wiki.valid.raw";
+  int num_threads = argc > 3 ? atoi(argv[3]) : 4;
+
+  std::string line;
+  std::vector<std::string> lines;
+  std::ifstream infile(input_file);
+  if (!infile) {
+    std::cout << "Error opening input file" << std::endl;
+    return -1;
+  }
+  size_t total_bytes = 0;
+  while (std::getline(infile, line)) {
+    total_bytes += line.size();
+    lines.push_back(line);
+  }
+
+  // Use separate tokenizers so that neither benefits from the other's cache
+  GPT_Tokenizer legacy_tokenizer(mode, merge_file, vocab_file);
+  GPT_Tokenizer tokenizer(mode, merge_file, vocab_file);
+
+  auto run = [&](bool legacy, std::vector<std::vector<std::string>> &out) {
+    auto start = std::chrono::steady_clock::now();
+    for (auto const &l : lines) {
+      out.push_back(legacy ? legacy_tokenizer.legacy_tokenize(l)
+                           : tokenizer.tokenize(l));
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(end - start).count();
+  };
+  std::vector<std::vector<std::string>> legacy_tokens, tokens;
+  double legacy_time = run(true, legacy_tokens);
+  double time = run(false, tokens);
+
+  size_t mismatches = 0;
+  for (size_t i = 0; i < lines.size(); i++) {
+    if (legacy_tokens[i] != tokens[i]) {
+      if (mismatches == 0) {
+        std::cout << "First mismatch at line " << i << ": " << lines[i]
+                  << std::endl;
+      }
+      mismatches++;
+    }
+  }
+  double mb = total_bytes / (1024.0 * 1024.0);
+  printf("input: %zu lines, %.2f MB\n", lines.size(), mb);
+  printf("legacy_tokenize: %.3f s, %.2f MB/s\n", legacy_time, mb / legacy_time);
+  printf("tokenize:        %.3f s, %.2f MB/s (%.1fx)\n",
+         time,
+         mb / time,
+         legacy_time / time);
+  print_cache_stats(tokenizer);
+
+  // Tokenize interleaved lines from several threads on a cold, shared cache
+  GPT_Tokenizer shared_tokenizer(mode, merge_file, vocab_file);
+  std::vector<std::vector<std::string>> concurrent_tokens(lines.size());
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; t++) {
+    threads.emplace_back([&, t]() {
+      for (size_t i = t; i < lines.size(); i += num_threads) {
+        concurrent_tokens[i] = shared_tokenizer.tokenize(lines[i]);
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  double concurrent_time = std::chrono::duration<double>(
+                               std::chrono::steady_clock::now() - start)
+                               .count();
+  printf("tokenize (%d threads): %.3f s, %.2f MB/s\n",
+         num_threads,
+         concurrent_time,
+         mb / concurrent_time);
+  print_cache_stats(shared_tokenizer);
+  for (size_t i = 0; i < lines.size(); i++) {
+    if (legacy_tokens[i] != concurrent_tokens[i]) {
+      if (mismatches == 0) {
+        std::cout << "First concurrent mismatch at line " << i << ": "
+                  << lines[i] << std::endl;
+      }
+      mismatches++;
+    }
+  }
+  printf("mismatched lines: %zu\n", mismatches);
+  return mismatches == 0 ? 0 : 1;
+}
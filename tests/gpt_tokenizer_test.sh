@@ -3,7 +3,7 @@ set -x
 set -e
 
 cleanup() {
-	rm -rf wikitext-103-raw-v1.zip wikitext-103-raw gpt2_bpe opt_bpe gpt_tokenizer pytokenizer.py bpe.py hf_tokenizer.py 
+	rm -rf wikitext-103-raw-v1.zip wikitext-103-raw gpt2_bpe opt_bpe gpt_tokenizer pytokenizer.py bpe.py hf_tokenizer.py gpt_tokenizer_benchmark
 }
 
 # Cd into directory holding this script
@@ -15,6 +15,8 @@ cleanup
 # Compile the FlexFlow C++ tokenizer stand-alone
 g++ -std=c++11 -I../deps/json/include -I../include -o gpt_tokenizer gpt_tokenizer.cpp ../src/runtime/gpt_tokenizer.cc
 chmod +x gpt_tokenizer
+g++ -std=c++11 -O2 -pthread -I../deps/json/include -I../include -o gpt_tokenizer_benchmark gpt_tokenizer_benchmark.cpp ../src/runtime/gpt_tokenizer.cc
+chmod +x gpt_tokenizer_benchmark
 
 # Download and inflate wikitext dataset
 wget https://s3.amazonaws.com/research.metamind.io/wikitext/wikitext-103-raw-v1.zip
@@ -36,6 +38,7 @@ chmod +x bpe.py
 
 # Run the FlexFlow C++ tokenizer (standard GPT-2)
 ./gpt_tokenizer gpt-2
+./gpt_tokenizer_benchmark gpt-2
 
 # Run the minGPT tokenizer
 cat << EOF > pytokenizer.py
@@ -74,6 +77,7 @@ wget -O opt_bpe/gpt2-merges.txt https://raw.githubusercontent.com/facebookresear
 
 # Run the FlexFlow C++ tokenizer (OPT)
 ./gpt_tokenizer opt
+./gpt_tokenizer_benchmark opt
 
 # Run the Huggingface tokenizer
 pip3 install transformers
@@ -0,0 +1,157 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures the latency of NgramDrafter::propose per request and decoding
+// step. Requests decode a synthetic "ground truth" output that copies spans
+// from their prompt and from a shared corpus, so the benchmark also reports
+// how many proposed tokens a verifier would accept per step.
+//
+// Build with:
+//   g++ -std=c++17 -O2 -I../include -o ngram_drafter_benchmark \
+//       ngram_drafter_benchmark.cpp ../src/runtime/ngram_drafter.cc
+
+#include <flexflow/ngram_drafter.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+using namespace FlexFlow;
+
+int main(int argc, char *argv[]) {
+  int num_requests = argc > 1 ? atoi(argv[1]) : 64;
+  int prompt_length = argc > 2 ? atoi(argv[2]) : 2048;
+  int output_length = argc > 3 ? atoi(argv[3]) : 256;
+  size_t corpus_documents = argc > 4 ? atoi(argv[4]) : 2000;
+  int const vocab_size = 32000, document_length = 1000, max_depth = 8;
+
+  std::mt19937 gen(0);
+  std::uniform_int_distribution<int> token(0, vocab_size - 1);
+  std::uniform_int_distribution<int> span(4, 32);
+  std::uniform_real_distribution<double> coin(0, 1);
+
+  std::vector<std::vector<int>> corpus(corpus_documents);
+  for (auto &document : corpus) {
+    for (int i = 0; i < document_length; i++) {
+      document.push_back(token(gen));
+    }
+  }
+  // Appends n tokens that are either fresh or copied from source
+  auto extend = [&](std::vector<int> &sequence,
+                    std::vector<int> const &source,
+                    size_t n,
+                    double copy_prob) {
+    size_t target = sequence.size() + n;
+    while (sequence.size() < target) {
+      if (coin(gen) < copy_prob && source.size() > 32) {
+        size_t start = gen() % (source.size() - 32);
+        sequence.insert(sequence.end(),
+                        source.begin() + start,
+                        source.begin() + start + span(gen));
+      } else {
+        sequence.push_back(token(gen));
+      }
+    }
+    sequence.resize(target);
+  };
+
+  NgramDrafter drafter;
+  auto start = std::chrono::steady_clock::now();
+  drafter.set_corpus(drafter.build_corpus(corpus));
+  double build_time = std::chrono::duration<double>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+  printf("corpus: %zu documents, %zu tokens, indexed in %.3f s\n",
+         corpus.size(),
+         corpus.size() * document_length,
+         build_time);
+
+  // The first proposal of a request also indexes its prompt
+  std::vector<double> latencies, first_latencies;
+  size_t steps = 0, accepted = 0, proposed = 0;
+  for (int r = 0; r < num_requests; r++) {
+    std::vector<int> sequence;
+    extend(sequence, corpus[gen() % corpus.size()], prompt_length, 0.3);
+    std::vector<int> prompt = sequence;
+    // outputs copy from the prompt (e.g. code edits) and from the corpus
+    extend(sequence, prompt, output_length / 2, 0.5);
+    extend(sequence, corpus[gen() % corpus.size()], output_length / 2, 0.3);
+
+    std::vector<int> context(prompt);
+    while (context.size() < sequence.size()) {
+      auto step_start = std::chrono::steady_clock::now();
+      std::vector<std::pair<int, int>> tree =
+          drafter.propose(r, context, max_depth, 3);
+      double latency = std::chrono::duration<double, std::micro>(
+                           std::chrono::steady_clock::now() - step_start)
+                           .count();
+      if (context.size() == prompt.size()) {
+        first_latencies.push_back(latency);
+      } else {
+        latencies.push_back(latency);
+      }
+      // accept the longest path of the tree that matches the ground truth
+      int matched = 0;
+      for (auto const &node : tree) {
+        if (node.second <= matched) {
+          // left the subtree of the last accepted token
+          break;
+        }
+        size_t pos = context.size() + matched;
+        if (node.second == matched + 1 && pos < sequence.size() &&
+            node.first == sequence[pos]) {
+          matched++;
+        }
+      }
+      size_t advance =
+          std::min((size_t)matched + 1, sequence.size() - context.size());
+      context.insert(context.end(),
+                     sequence.begin() + context.size(),
+                     sequence.begin() + context.size() + advance);
+      steps++;
+      accepted += matched;
+      proposed += tree.size();
+    }
+    drafter.remove_request(r);
+  }
+
+  std::sort(latencies.begin(), latencies.end());
+  double total = 0, first_total = 0;
+  for (double l : latencies) {
+    total += l;
+  }
+  for (double l : first_latencies) {
+    first_total += l;
+  }
+  printf("requests: %d, prompt: %d tokens, output: %d tokens\n",
+         num_requests,
+         prompt_length,
+         output_length);
+  printf("propose latency (us): mean %.2f, p50 %.2f, p99 %.2f, max %.2f\n",
+         total / latencies.size(),
+         latencies[latencies.size() / 2],
+         latencies[latencies.size() * 99 / 100],
+         latencies.back());
+  printf("first propose latency (us): mean %.2f\n",
+         first_total / first_latencies.size());
+  printf("steps: %zu, proposed tokens/step: %.2f, accepted tokens/step: "
+         "%.2f\n",
+         steps,
+         (double)proposed / steps,
+         (double)accepted / steps);
+  return 0;
+}
@@ -0,0 +1,342 @@
+/* Copyright 2023 CMU, Facebook, LANL, MIT, NVIDIA, and Stanford (alphabetical)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures the host time of the token tree bookkeeping of one spec-infer
+// step (building the trees of all requests from their SSM beam layers,
+// merging the trees of two SSMs, collecting the tokens to commit and
+// verifying the trees against the LLM's outputs) with TokenTreeArena, and
+// with the per-request vectors and hash maps RequestManager used before.
+//
+// Build with:
+//   g++ -std=c++17 -O2 -I../include -o token_tree_benchmark \
+//       token_tree_benchmark.cpp ../src/runtime/token_tree.cc
+
+#include <flexflow/token_tree.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <set>
+#include <sstream>
+#include <stack>
+#include <unordered_map>
+
+using namespace FlexFlow;
+
+int const MAX_LAYERS = 16, MAX_WIDTH = 16;
+
+// Layer-by-layer tree of an SSM, like BeamTree
+struct LayeredTree {
+  struct Layer {
+    int tokens[MAX_WIDTH];
+    float probs[MAX_WIDTH];
+    int num_nodes;
+  };
+  Layer layers[MAX_LAYERS + 1];
+};
+
+using Pairs = std::vector<std::pair<int, int>>;
+
+// The previous bookkeeping: trees and committed tokens are vectors of
+// (token, depth) and (depth, batch index) pairs in maps keyed by request
+struct LegacyBookkeeping {
+  std::unordered_map<size_t, Pairs> dfs_tree_inputs;
+  std::unordered_map<size_t, Pairs> committed_tokens;
+  std::ostringstream log;
+
+  Pairs serialize(LayeredTree const &tree, int depth, int root_depth) {
+    LayeredTree copy = tree;
+    Pairs serialized;
+    for (int i = 0; i <= depth; i++) {
+      for (int j = 0; j < copy.layers[i].num_nodes; j++) {
+        serialized.push_back(
+            std::make_pair(copy.layers[i].tokens[j], root_depth + i));
+      }
+    }
+    return serialized;
+  }
+
+  Pairs merge(std::vector<Pairs> input_trees, int root_depth, size_t guid) {
+    Pairs merged_tree;
+    std::unordered_map<int, std::set<int>> childrens;
+    std::unordered_map<int, int> curr_path;
+    auto root = input_trees.at(0).at(0);
+    int root_id = root.first * 10000 + root.second;
+    for (auto const &tree : input_trees) {
+      for (auto const &pair : tree) {
+        int id = pair.first * 10000 + pair.second;
+        curr_path[pair.second] = id;
+        if (childrens.find(id) == childrens.end()) {
+          childrens[id] = std::set<int>();
+        }
+        if (pair.second > root_depth) {
+          childrens[curr_path[pair.second - 1]].insert(id);
+        }
+      }
+    }
+    std::stack<int> q;
+    q.push(root_id);
+    while (!q.empty()) {
+      int curr = q.top();
+      q.pop();
+      merged_tree.push_back(std::make_pair(curr / 10000, curr % 10000));
+      for (int child : childrens[curr]) {
+        q.push(child);
+      }
+    }
+    dfs_tree_inputs[guid] = merged_tree;
+    return merged_tree;
+  }
+
+  Pairs verify(size_t guid, Pairs const &input, Pairs const &output) {
+    Pairs const *logged[] = {&input, &output, &committed_tokens.at(guid)};
+    for (Pairs const *tree : logged) {
+      std::ostringstream oss;
+      for (auto const &pair : *tree) {
+        oss << " " << pair.second << ":" << pair.first;
+      }
+      log << oss.str();
+    }
+    int *tree_layers = new int[input.size()];
+    int node_num = 1, layer_num = 0;
+    for (size_t k = 0; k < input.size(); k++) {
+      if (k == input.size() - 1 || input[k + 1].second != input[k].second) {
+        tree_layers[layer_num++] = node_num;
+        node_num = 1;
+      } else {
+        node_num++;
+      }
+    }
+    Pairs verified, new_committed_tokens;
+    bool find_first = false;
+    int first_layer_slot = 0, processed = 0;
+    layer_num = -1;
+    for (size_t k = 0; k < output.size(); k++) {
+      if (k == 0 || input[k - 1].second != input[k].second) {
+        layer_num++;
+        processed += k == 0 ? 0 : tree_layers[layer_num - 1];
+      }
+      if (k == 0 || (input[k] == verified.back() &&
+                     (!find_first || first_layer_slot == k - processed))) {
+        if (k > 0 && !find_first) {
+          find_first = true;
+          first_layer_slot = k - processed;
+        }
+        verified.push_back(output[k]);
+        new_committed_tokens.push_back(std::make_pair(
+            input[k].second, committed_tokens.at(guid).at(k).second));
+      }
+    }
+    delete[] tree_layers;
+    committed_tokens[guid] = new_committed_tokens;
+    return verified;
+  }
+};
+
+// The LLM's output after each node of a tree: the next token of truth if the
+// path from the root to the node is a prefix of truth, and 0 otherwise
+std::vector<int> llm_outputs(std::vector<int> const &tokens,
+                             std::vector<int> const &parents,
+                             std::vector<int> const &truth) {
+  size_t n = tokens.size();
+  std::vector<int> depths(n, 0), outputs(n, 0);
+  std::vector<bool> on_path(n, true);
+  for (size_t k = 1; k < n; k++) {
+    depths[k] = depths[parents[k]] + 1;
+    on_path[k] = on_path[parents[k]] && depths[k] <= (int)truth.size() &&
+                 tokens[k] == truth[depths[k] - 1];
+  }
+  for (size_t k = 0; k < n; k++) {
+    if (on_path[k] && depths[k] < (int)truth.size()) {
+      outputs[k] = truth[depths[k]];
+    }
+  }
+  return outputs;
+}
+
+int main(int argc, char *argv[]) {
+  int num_requests = argc > 1 ? atoi(argv[1]) : 64;
+  int tree_depth = argc > 2 ? atoi(argv[2]) : 9;
+  int tree_width = argc > 3 ? atoi(argv[3]) : 7;
+  int num_steps = argc > 4 ? atoi(argv[4]) : 2000;
+  int const root_depth = 1000;
+  int const tree_size = 1 + tree_depth * tree_width;
+  if (tree_depth > MAX_LAYERS || tree_width > MAX_WIDTH || tree_size > 64) {
+    fprintf(stderr,
+            "trees must have at most %d layers of %d nodes and 64 nodes in "
+            "total\n",
+            MAX_LAYERS,
+            MAX_WIDTH);
+    return 1;
+  }
+
+  // Two SSMs propose trees of tree_width chains each. The LLM accepts a
+  // random prefix of one chain of the first SSM.
+  std::mt19937 gen(0);
+  std::vector<LayeredTree> ssm_trees[2];
+  std::vector<std::vector<int>> truths(num_requests);
+  for (int r = 0; r < num_requests; r++) {
+    for (auto &trees : ssm_trees) {
+      LayeredTree tree;
+      tree.layers[0].tokens[0] = 1;
+      tree.layers[0].num_nodes = 1;
+      for (int i = 1; i <= tree_depth; i++) {
+        tree.layers[i].num_nodes = tree_width;
+        for (int j = 0; j < tree_width; j++) {
+          tree.layers[i].tokens[j] = 2 + gen() % 1000;
+          tree.layers[i].probs[j] = 0.5f;
+        }
+      }
+      trees.push_back(tree);
+    }
+    int chain = gen() % tree_width, accepted = gen() % (tree_depth + 1);
+    for (int i = 1; i <= accepted; i++) {
+      truths[r].push_back(ssm_trees[0][r].layers[i].tokens[chain]);
+    }
+    truths[r].push_back(0);
+  }
+
+  for (int ssms = 1; ssms <= 2; ssms++) {
+    // Previous bookkeeping. Layer j of a serialized tree is split into equal
+    // groups of children of the nodes of layer j - 1, and merged trees are in
+    // DFS order.
+    LegacyBookkeeping legacy;
+    auto build_legacy = [&](int r) -> Pairs const & {
+      size_t guid = 1000000 + r;
+      std::vector<Pairs> all_trees;
+      for (int s = 0; s < ssms; s++) {
+        all_trees.push_back(
+            legacy.serialize(ssm_trees[s][r], tree_depth, root_depth));
+      }
+      if (ssms == 1) {
+        legacy.dfs_tree_inputs[guid] = all_trees[0];
+      } else {
+        legacy.merge(all_trees, root_depth, guid);
+      }
+      return legacy.dfs_tree_inputs.at(guid);
+    };
+    std::vector<std::vector<int>> legacy_outputs(num_requests);
+    for (int r = 0; r < num_requests; r++) {
+      Pairs const &tree = build_legacy(r);
+      std::vector<int> tokens, parents(1, 0), last_at_depth(tree_depth + 1);
+      for (size_t k = 0; k < tree.size(); k++) {
+        int depth = tree[k].second - root_depth;
+        tokens.push_back(tree[k].first);
+        if (k > 0) {
+          if (ssms == 1) {
+            parents.push_back(depth == 1 ? 0 : k - tree_width);
+          } else {
+            parents.push_back(last_at_depth[depth - 1]);
+          }
+        }
+        last_at_depth[depth] = k;
+      }
+      legacy_outputs[r] = llm_outputs(tokens, parents, truths[r]);
+    }
+    size_t legacy_accepted = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int step = 0; step < num_steps; step++) {
+      for (int r = 0; r < num_requests; r++) {
+        size_t guid = 1000000 + r;
+        Pairs const &tree = build_legacy(r);
+        Pairs tree_outputs;
+        legacy.committed_tokens[guid].clear();
+        for (size_t k = 0; k < tree.size(); k++) {
+          tree_outputs.emplace_back(legacy_outputs[r][k], tree[k].second + 1);
+          legacy.committed_tokens[guid].emplace_back(tree[k].second, k);
+        }
+        legacy_accepted += legacy.verify(guid, tree, tree_outputs).size() - 1;
+      }
+      legacy.log.str("");
+    }
+    double legacy_step = std::chrono::duration<double, std::micro>(
+                             std::chrono::steady_clock::now() - start)
+                             .count() /
+                         num_steps;
+
+    TokenTreeArena trees(num_requests, 64), ssm_tree(1, 64);
+    std::vector<std::vector<std::pair<int, int>>> committed_tokens(
+        num_requests);
+    std::vector<int> accepted;
+    auto build_arena = [&](int r) {
+      for (int s = 0; s < ssms; s++) {
+        LayeredTree const &tree = ssm_trees[s][r];
+        TokenTreeArena &target = s == 0 ? trees : ssm_tree;
+        int t = s == 0 ? r : 0;
+        target.reset(t, tree.layers[0].tokens[0], root_depth);
+        for (int i = 1, layer_start = 0; i <= tree_depth; i++) {
+          int group_size =
+              tree.layers[i].num_nodes / tree.layers[i - 1].num_nodes;
+          for (int j = 0; j < tree.layers[i].num_nodes; j++) {
+            target.add_node(t,
+                            layer_start + j / group_size,
+                            tree.layers[i].tokens[j],
+                            tree.layers[i].probs[j]);
+          }
+          layer_start += tree.layers[i - 1].num_nodes;
+        }
+        if (s > 0) {
+          trees.merge(r, ssm_tree, 0);
+        }
+      }
+    };
+    std::vector<std::vector<int>> arena_outputs(num_requests);
+    for (int r = 0; r < num_requests; r++) {
+      build_arena(r);
+      std::vector<int> tokens, parents;
+      for (int k = 0; k < trees.size(r); k++) {
+        tokens.push_back(trees.token(r, k));
+        parents.push_back(std::max(trees.parent(r, k), 0));
+      }
+      arena_outputs[r] = llm_outputs(tokens, parents, truths[r]);
+    }
+    size_t arena_accepted = 0;
+    start = std::chrono::steady_clock::now();
+    for (int step = 0; step < num_steps; step++) {
+      for (int r = 0; r < num_requests; r++) {
+        build_arena(r);
+        trees.verify(r, arena_outputs[r].data(), trees.size(r), accepted);
+        committed_tokens[r].clear();
+        for (int node : accepted) {
+          committed_tokens[r].emplace_back(trees.depth(r, node), node);
+        }
+        arena_accepted += accepted.size() - 1;
+      }
+    }
+    double arena_step = std::chrono::duration<double, std::micro>(
+                            std::chrono::steady_clock::now() - start)
+                            .count() /
+                        num_steps;
+
+    size_t ideal = 0;
+    for (auto const &truth : truths) {
+      ideal += truth.size() - 1;
+    }
+    printf("%d SSM(s), %d requests x %d-token trees: legacy %.1f us/step, "
+           "arena %.1f us/step (%.1fx faster)\n",
+           ssms,
+           num_requests,
+           tree_size,
+           legacy_step,
+           arena_step,
+           legacy_step / arena_step);
+    printf("  accepted tokens/step: legacy %.1f, arena %.1f, correct %zu\n",
+           (double)legacy_accepted / num_steps,
+           (double)arena_accepted / num_steps,
+           ideal);
+  }
+  return 0;
+}
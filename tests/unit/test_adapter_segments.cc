@@ -0,0 +1,45 @@
+#include "flexflow/utils/adapter_segments.h"
+#include "gtest/gtest.h"
+
+using namespace FlexFlow;
+
+TEST(adapter_segments, group) {
+  // {adapter, request, offset, tokens, exclusive}, in slot order
+  std::vector<AdapterRequest> requests = {{1, 0, 0, 1, false},
+                                          {1, 1, 1, 1, false},
+                                          {2, 2, 2, 1, false},
+                                          {1, 3, 3, 1, false},
+                                          {1, 5, 12, 8, false},
+                                          {1, 4, 4, 8, false},
+                                          {1, 6, 20, 4, true},
+                                          {1, 7, 30, 2, false}};
+  std::vector<AdapterSegment> segments;
+  group_adapter_segments(requests, segments);
+  ASSERT_EQ(segments.size(), 5);
+  EXPECT_EQ(segments[0].request_index, 0);
+  EXPECT_EQ(segments[0].num_tokens, 2);
+  EXPECT_EQ(segments[1].adapter, 2);
+  // requests 3, 4 and 5 are contiguous once sorted by offset
+  EXPECT_EQ(segments[2].request_index, 3);
+  EXPECT_EQ(segments[2].first_token_offset, 3);
+  EXPECT_EQ(segments[2].num_tokens, 17);
+  // exclusive requests are never merged
+  EXPECT_EQ(segments[3].request_index, 6);
+  EXPECT_EQ(segments[3].num_tokens, 4);
+  EXPECT_EQ(segments[4].request_index, 7);
+}
+
+TEST(adapter_segments, choose_slot) {
+  std::vector<bool> free_slots = {false, true, true, false, true};
+  std::vector<size_t> slot_adapters = {1, 0, 0, 2, 0};
+  // after a request with the same adapter
+  EXPECT_EQ(choose_adapter_slot(free_slots, slot_adapters, 1), 1);
+  EXPECT_EQ(choose_adapter_slot(free_slots, slot_adapters, 2), 4);
+  // before a request with the same adapter
+  free_slots[4] = false;
+  slot_adapters[4] = 1;
+  EXPECT_EQ(choose_adapter_slot(free_slots, slot_adapters, 2), 2);
+  // otherwise the first free slot
+  EXPECT_EQ(choose_adapter_slot(free_slots, slot_adapters, 3), 1);
+  EXPECT_EQ(choose_adapter_slot({false, false}, {1, 1}, 1), -1);
+}
@@ -0,0 +1,76 @@
+#include "flexflow/batch_config.h"
+#include "flexflow/request_manager.h"
+#include "gtest/gtest.h"
+
+using namespace FlexFlow;
+
+namespace {
+
+// Appends a request with num_tokens tokens in slot i, as plan_next_batch does
+void add_request(BatchConfig &bc,
+                 int i,
+                 int num_tokens,
+                 bool prompt_phase,
+                 bool peft_bwd = false) {
+  bc.request_completed[i] = false;
+  bc.requestsInfo[i].first_token_depth_in_request = prompt_phase ? 8 : 20;
+  bc.requestsInfo[i].first_token_offset_in_batch = bc.num_tokens;
+  bc.requestsInfo[i].num_tokens_in_batch = num_tokens;
+  bc.requestsInfo[i].request_guid = 1000 + i;
+  bc.requestsInfo[i].prompt_phase = prompt_phase;
+  bc.requestsInfo[i].peft_bwd = peft_bwd;
+  for (int j = 0; j < num_tokens; j++) {
+    bc.tokensInfo[bc.num_tokens].request_index = i;
+    bc.tokensInfo[bc.num_tokens].abs_depth_in_request =
+        bc.requestsInfo[i].first_token_depth_in_request + j;
+    bc.tokensInfo[bc.num_tokens].token_id = 100 * i + j;
+    bc.num_tokens++;
+  }
+  if (!prompt_phase && !peft_bwd) {
+    bc.num_generation_tokens += num_tokens;
+  }
+}
+
+} // namespace
+
+TEST(batch_config, remove_planned_request) {
+  RequestManager::get_request_manager()->set_max_requests_per_batch(4);
+  // Planned batch: slot 1 continues a prompt whose last token is EOS, so
+  // patch_next_batch completes it and removes its whole prompt chunk
+  BatchConfig bc;
+  add_request(bc, 0, 1, false);
+  add_request(bc, 1, 5, true);
+  add_request(bc, 2, 1, false);
+  add_request(bc, 3, 3, false, true /*peft_bwd*/);
+  for (int r = 0; r < 3; r++) {
+    bc.requestsInfo[r].batch_config_request_id = r;
+  }
+  ASSERT_EQ(bc.num_tokens, 10);
+
+  bc.remove_request(1);
+  EXPECT_TRUE(bc.request_completed[1]);
+  EXPECT_EQ(bc.num_tokens, 5);
+  EXPECT_EQ(bc.num_generation_tokens, 2);
+  EXPECT_EQ(bc.requestsInfo[0].first_token_offset_in_batch, 0);
+  EXPECT_EQ(bc.requestsInfo[2].first_token_offset_in_batch, 1);
+  EXPECT_EQ(bc.requestsInfo[3].first_token_offset_in_batch, 2);
+  EXPECT_EQ(bc.requestsInfo[0].batch_config_request_id, 0);
+  EXPECT_EQ(bc.requestsInfo[1].batch_config_request_id, 2);
+  // the tokens of the other requests follow their offsets
+  for (int r : {0, 2, 3}) {
+    for (int j = 0; j < bc.requestsInfo[r].num_tokens_in_batch; j++) {
+      int t = bc.requestsInfo[r].first_token_offset_in_batch + j;
+      EXPECT_EQ(bc.tokensInfo[t].request_index, r);
+      EXPECT_EQ(bc.tokensInfo[t].token_id, 100 * r + j);
+    }
+  }
+
+  // a request that sampled EOS loses its decoding token
+  bc.remove_request(0);
+  EXPECT_EQ(bc.num_tokens, 4);
+  EXPECT_EQ(bc.num_generation_tokens, 1);
+  EXPECT_EQ(bc.requestsInfo[2].first_token_offset_in_batch, 0);
+  EXPECT_EQ(bc.requestsInfo[3].first_token_offset_in_batch, 1);
+  EXPECT_EQ(bc.requestsInfo[0].batch_config_request_id, 2);
+  EXPECT_EQ(bc.tokensInfo[0].token_id, 200);
+}
@@ -0,0 +1,80 @@
+#include "flexflow/coserving_controller.h"
+#include "gtest/gtest.h"
+#include <sstream>
+
+using namespace FlexFlow;
+
+namespace {
+CoServingController::Observation
+    observe(double latency_us, int queue_depth, int inference_tokens) {
+  CoServingController::Observation observation;
+  observation.iteration_latency_us = latency_us;
+  observation.queue_depth = queue_depth;
+  observation.inference_tokens = inference_tokens;
+  observation.max_tokens_per_batch = 128;
+  return observation;
+}
+} // namespace
+
+TEST(coserving_controller, backs_off_and_recovers) {
+  CoServingController controller;
+  controller.set_latency_slo(100);
+  controller.set_increase_step(8);
+  controller.set_smoothing(1);
+  // idle: finetuning takes the whole batch
+  EXPECT_EQ(controller.update(observe(0, 0, 0)), 128);
+  // the SLO is at risk (above 90us)
+  EXPECT_EQ(controller.update(observe(95, 0, 32)), 64);
+  EXPECT_EQ(controller.update(observe(120, 0, 32)), 32);
+  // queued inference requests hold the budget
+  EXPECT_EQ(controller.update(observe(50, 3, 32)), 32);
+  // spare capacity is soaked up additively
+  EXPECT_EQ(controller.update(observe(50, 0, 32)), 40);
+  EXPECT_EQ(controller.update(observe(50, 0, 32)), 48);
+}
+
+TEST(coserving_controller, min_tokens_and_smoothing) {
+  CoServingController controller;
+  controller.set_latency_slo(100);
+  controller.set_min_finetuning_tokens(4);
+  controller.set_smoothing(0.5);
+  EXPECT_EQ(controller.get_finetuning_budget(), 4);
+  controller.update(observe(80, 0, 16));
+  // (80 + 200) / 2 = 140
+  EXPECT_EQ(controller.update(observe(200, 0, 16)), 10);
+  EXPECT_DOUBLE_EQ(controller.get_smoothed_latency(), 140);
+  for (int i = 0; i < 8; i++) {
+    controller.update(observe(200, 0, 16));
+  }
+  EXPECT_EQ(controller.get_finetuning_budget(), 4);
+}
+
+TEST(coserving_controller, replay) {
+  std::stringstream log;
+  CoServingController controller;
+  controller.set_latency_slo(100);
+  controller.set_log(&log);
+  std::vector<int> decisions;
+  double latencies[] = {0, 60, 70, 95, 99, 40, 40, 30, 120, 50};
+  for (int i = 0; i < 10; i++) {
+    decisions.push_back(controller.update(observe(latencies[i], i % 3, 16)));
+  }
+  std::vector<int> recorded, replayed;
+  CoServingController same;
+  same.set_latency_slo(100);
+  same.replay(log, recorded, replayed);
+  EXPECT_EQ(recorded, decisions);
+  EXPECT_EQ(replayed, decisions);
+
+  // a looser SLO never backs off on the same trace
+  log.clear();
+  log.seekg(0);
+  recorded.clear();
+  replayed.clear();
+  CoServingController loose;
+  loose.set_latency_slo(1000);
+  loose.replay(log, recorded, replayed);
+  for (size_t i = 0; i < replayed.size(); i++) {
+    EXPECT_GE(replayed[i], recorded[i]);
+  }
+}
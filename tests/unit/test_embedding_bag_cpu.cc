@@ -0,0 +1,173 @@
+#include "flexflow/ops/kernels/embedding_bag_cpu.h"
+#include "gtest/gtest.h"
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace FlexFlow;
+using namespace FlexFlow::Kernels::EmbeddingBagCPU;
+
+namespace {
+
+struct Problem {
+  int num_rows, block_size;
+  std::vector<float> weight;
+  std::vector<int> lengths;
+  std::vector<int64_t> indices;
+
+  Problem(int _num_rows, int _block_size, int num_bags, int seed)
+      : num_rows(_num_rows), block_size(_block_size) {
+    std::mt19937 gen(seed);
+    std::uniform_real_distribution<float> value(-1.0f, 1.0f);
+    for (int i = 0; i < num_rows * block_size; i++) {
+      weight.push_back(value(gen));
+    }
+    for (int b = 0; b < num_bags; b++) {
+      // includes empty bags
+      lengths.push_back(gen() % 6);
+      for (int i = 0; i < lengths.back(); i++) {
+        indices.push_back(gen() % num_rows);
+      }
+    }
+  }
+};
+
+} // namespace
+
+TEST(embedding_bag_cpu, forward_matches_reference) {
+  for (int block_size : {1, 7, 16, 40, 100, 128}) {
+    Problem p(50, block_size, 33, block_size);
+    std::vector<int32_t> indices32(p.indices.begin(), p.indices.end());
+    int num_bags = p.lengths.size();
+    for (AggrMode aggr : {AGGR_MODE_SUM, AGGR_MODE_AVG}) {
+      std::vector<float> expected(num_bags * block_size, 0.0f);
+      size_t i = 0;
+      for (int b = 0; b < num_bags; b++) {
+        for (int k = 0; k < p.lengths[b]; k++, i++) {
+          for (int j = 0; j < block_size; j++) {
+            float v = p.weight[p.indices[i] * block_size + j];
+            expected[b * block_size + j] +=
+                aggr == AGGR_MODE_AVG ? v / p.lengths[b] : v;
+          }
+        }
+      }
+      for (Isa isa : {ISA_SCALAR, ISA_AVX2, ISA_AVX512}) {
+        for (int threads : {1, 3}) {
+          std::vector<float> out(num_bags * block_size, -1.0f);
+          forward(p.indices.data(),
+                  p.lengths.data(),
+                  num_bags,
+                  p.weight.data(),
+                  p.num_rows,
+                  block_size,
+                  aggr,
+                  out.data(),
+                  threads,
+                  isa);
+          for (size_t k = 0; k < out.size(); k++) {
+            ASSERT_NEAR(out[k], expected[k], 1e-5) << isa_name(isa);
+          }
+          std::vector<float> out32(num_bags * block_size, -1.0f);
+          forward(indices32.data(),
+                  p.lengths.data(),
+                  num_bags,
+                  p.weight.data(),
+                  p.num_rows,
+                  block_size,
+                  aggr,
+                  out32.data(),
+                  threads,
+                  isa);
+          EXPECT_EQ(out, out32);
+        }
+      }
+    }
+  }
+}
+
+TEST(embedding_bag_cpu, backward_matches_reference) {
+  for (int block_size : {3, 24, 130}) {
+    Problem p(20, block_size, 40, block_size);
+    int num_bags = p.lengths.size();
+    std::vector<float> grad;
+    for (int k = 0; k < num_bags * block_size; k++) {
+      grad.push_back(0.01f * (k % 97) - 0.5f);
+    }
+    std::vector<float> expected(p.num_rows * block_size, 1.0f);
+    size_t i = 0;
+    for (int b = 0; b < num_bags; b++) {
+      for (int k = 0; k < p.lengths[b]; k++, i++) {
+        for (int j = 0; j < block_size; j++) {
+          expected[p.indices[i] * block_size + j] +=
+              grad[b * block_size + j] / p.lengths[b];
+        }
+      }
+    }
+    for (Isa isa : {ISA_SCALAR, ISA_AVX2, ISA_AVX512}) {
+      std::vector<float> single;
+      for (int threads : {1, 4}) {
+        // gradients accumulate into the existing values
+        std::vector<float> weight_grad(p.num_rows * block_size, 1.0f);
+        backward(p.indices.data(),
+                 p.lengths.data(),
+                 num_bags,
+                 grad.data(),
+                 p.num_rows,
+                 block_size,
+                 AGGR_MODE_AVG,
+                 weight_grad.data(),
+                 threads,
+                 isa);
+        for (size_t k = 0; k < weight_grad.size(); k++) {
+          ASSERT_NEAR(weight_grad[k], expected[k], 1e-4) << isa_name(isa);
+        }
+        // the result does not depend on the number of threads
+        if (threads == 1) {
+          single = weight_grad;
+        } else {
+          EXPECT_EQ(weight_grad, single);
+        }
+      }
+    }
+  }
+}
+
+TEST(embedding_bag_cpu, concurrent_callers_share_workers) {
+  Problem p(64, 40, 200, 5);
+  int num_bags = p.lengths.size();
+  std::vector<float> expected(num_bags * p.block_size);
+  forward(p.indices.data(),
+          p.lengths.data(),
+          num_bags,
+          p.weight.data(),
+          p.num_rows,
+          p.block_size,
+          AGGR_MODE_SUM,
+          expected.data());
+  // callers on several threads, e.g. the CPU tasks of different shards,
+  // queue their work on the same pool
+  std::vector<std::vector<float>> outs(4);
+  std::vector<std::thread> callers;
+  for (int c = 0; c < (int)outs.size(); c++) {
+    callers.emplace_back([&, c] {
+      for (int iter = 0; iter < 20; iter++) {
+        outs[c].assign(num_bags * p.block_size, -1.0f);
+        forward(p.indices.data(),
+                p.lengths.data(),
+                num_bags,
+                p.weight.data(),
+                p.num_rows,
+                p.block_size,
+                AGGR_MODE_SUM,
+                outs[c].data(),
+                3);
+      }
+    });
+  }
+  for (auto &caller : callers) {
+    caller.join();
+  }
+  for (auto const &out : outs) {
+    EXPECT_EQ(out, expected);
+  }
+}
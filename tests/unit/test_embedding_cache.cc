@@ -0,0 +1,106 @@
+#include "flexflow/utils/embedding_cache.h"
+#include "gtest/gtest.h"
+#include <random>
+
+using namespace FlexFlow;
+
+TEST(embedding_cache, admission) {
+  EmbeddingCache cache(100, 2, 2);
+  std::vector<EmbeddingCache::Transfer> loads, writebacks;
+  int slots[3];
+
+  // rows seen once are not admitted but still get a slot for the batch
+  int64_t first[] = {5, 7, 5};
+  cache.lookup(first, 3, false, slots, loads, writebacks);
+  EXPECT_FALSE(cache.is_cached(5));
+  EXPECT_EQ(slots[0], slots[2]);
+  EXPECT_GE(slots[1], cache.get_num_slots());
+  EXPECT_EQ(loads.size(), 2);
+  EXPECT_EQ(cache.get_transient_rows().size(), 2);
+  EXPECT_EQ(cache.num_misses, 3);
+
+  // both rows are admitted by their second batch
+  loads.clear();
+  int64_t second[] = {7, 5};
+  cache.lookup(second, 2, false, slots, loads, writebacks);
+  EXPECT_TRUE(cache.is_cached(5));
+  EXPECT_TRUE(cache.is_cached(7));
+  EXPECT_LT(slots[0], cache.get_num_slots());
+  EXPECT_EQ(loads.size(), 2);
+  EXPECT_TRUE(cache.get_transient_rows().empty());
+
+  loads.clear();
+  int64_t third[] = {5};
+  cache.lookup(third, 1, false, slots, loads, writebacks);
+  EXPECT_TRUE(loads.empty());
+  EXPECT_EQ(cache.num_hits, 1);
+  EXPECT_EQ(cache.num_misses, 5);
+  EXPECT_EQ(cache.num_cached_rows(), 2);
+  EXPECT_TRUE(writebacks.empty());
+}
+
+TEST(embedding_cache, frequent_rows_stay_cached) {
+  EmbeddingCache cache(100, 2, 1);
+  std::vector<EmbeddingCache::Transfer> loads, writebacks;
+  int slots[2];
+  for (int i = 0; i < 4; i++) {
+    int32_t hot[] = {1, 2};
+    cache.lookup(hot, 2, false, slots, loads, writebacks);
+  }
+  // a row seen less often than the least recently used row does not replace
+  // it
+  int32_t cold[] = {3};
+  cache.lookup(cold, 1, false, slots, loads, writebacks);
+  EXPECT_FALSE(cache.is_cached(3));
+  EXPECT_EQ(slots[0], 2);
+  EXPECT_EQ(cache.num_evictions, 0);
+  EXPECT_EQ(cache.num_hits, 6);
+  EXPECT_DOUBLE_EQ(cache.hit_rate(), 6.0 / 9.0);
+}
+
+TEST(embedding_cache, write_back) {
+  // replay a skewed workload that increments every row it looks up, with
+  // vectors standing for host and device memory
+  int64_t const num_rows = 64;
+  int const num_slots = 8;
+  EmbeddingCache cache(num_rows, num_slots, 2, 32);
+  std::vector<int> host(num_rows, 0), device(2 * num_slots), expected(host);
+  std::vector<EmbeddingCache::Transfer> loads, writebacks;
+  std::mt19937 gen(0);
+  std::geometric_distribution<int64_t> dist(0.2);
+  for (int batch = 0; batch < 200; batch++) {
+    int64_t indices[num_slots];
+    int slots[num_slots];
+    for (int i = 0; i < num_slots; i++) {
+      indices[i] = std::min(dist(gen), num_rows - 1);
+    }
+    loads.clear();
+    writebacks.clear();
+    cache.lookup(indices, num_slots, true, slots, loads, writebacks);
+    for (auto const &t : writebacks) {
+      host[t.row] = device[t.slot];
+    }
+    for (auto const &t : loads) {
+      device[t.slot] = host[t.row];
+    }
+    for (int i = 0; i < num_slots; i++) {
+      device[slots[i]]++;
+      expected[indices[i]]++;
+    }
+    for (auto const &t : cache.get_transient_rows()) {
+      host[t.row] = device[t.slot];
+    }
+  }
+  writebacks.clear();
+  cache.flush(writebacks);
+  for (auto const &t : writebacks) {
+    host[t.row] = device[t.slot];
+  }
+  EXPECT_EQ(host, expected);
+  EXPECT_GT(cache.num_evictions, 0);
+  EXPECT_GT(cache.hit_rate(), 0.5);
+  // nothing is left to flush
+  writebacks.clear();
+  cache.flush(writebacks);
+  EXPECT_TRUE(writebacks.empty());
+}
@@ -0,0 +1,58 @@
+#include "flexflow/utils/gradient_buckets.h"
+#include "gtest/gtest.h"
+
+using namespace FlexFlow;
+
+TEST(gradient_buckets, size_bounded) {
+  GradientBuckets buckets(100);
+  int a = buckets.add_parameter(0, 40), b = buckets.add_parameter(0, 60),
+      c = buckets.add_parameter(0, 10), d = buckets.add_parameter(0, 200),
+      e = buckets.add_parameter(0, 10);
+  ASSERT_EQ(buckets.num_buckets(), 4);
+  EXPECT_EQ(buckets.get_bucket(a), 0);
+  EXPECT_EQ(buckets.get_bucket(b), 0);
+  EXPECT_EQ(buckets.get_bytes(0), 100);
+  EXPECT_EQ(buckets.get_bucket(c), 1);
+  // a parameter larger than the bound gets a bucket of its own
+  EXPECT_EQ(buckets.get_bucket(d), 2);
+  EXPECT_EQ(buckets.get_bucket(e), 3);
+  EXPECT_EQ(buckets.get_parameters(0), (std::vector<int>{a, b}));
+
+  GradientBuckets unbucketed(0);
+  unbucketed.add_parameter(0, 1);
+  unbucketed.add_parameter(0, 1);
+  EXPECT_EQ(unbucketed.num_buckets(), 2);
+}
+
+TEST(gradient_buckets, groups_fill_separate_buckets) {
+  GradientBuckets buckets(100);
+  int a = buckets.add_parameter(7, 50), b = buckets.add_parameter(3, 50),
+      c = buckets.add_parameter(7, 50);
+  EXPECT_EQ(buckets.num_buckets(), 2);
+  EXPECT_EQ(buckets.get_bucket(a), buckets.get_bucket(c));
+  EXPECT_NE(buckets.get_bucket(a), buckets.get_bucket(b));
+  EXPECT_EQ(buckets.get_group(buckets.get_bucket(b)), 3);
+}
+
+TEST(gradient_buckets, released_in_order) {
+  GradientBuckets buckets(100);
+  int a = buckets.add_parameter(0, 60), b = buckets.add_parameter(0, 60),
+      c = buckets.add_parameter(0, 60);
+  for (int pass = 0; pass < 2; pass++) {
+    buckets.reset();
+    std::vector<int> ready;
+    // bucket 1 is complete first, but waits for bucket 0
+    buckets.mark_ready(b, ready);
+    EXPECT_TRUE(ready.empty());
+    buckets.mark_ready(b, ready);
+    buckets.mark_ready(a, ready);
+    EXPECT_EQ(ready, (std::vector<int>{0, 1}));
+    ready.clear();
+    buckets.release_remaining(ready);
+    // c was never marked, its bucket is released at the end of the pass
+    EXPECT_EQ(ready, (std::vector<int>{2}));
+    ready.clear();
+    buckets.mark_ready(c, ready);
+    EXPECT_TRUE(ready.empty());
+  }
+}
@@ -0,0 +1,49 @@
+#include "flexflow/graph.h"
+#include "gtest/gtest.h"
+
+using namespace FlexFlow;
+using namespace FlexFlow::PCG;
+
+namespace {
+
+GraphCostResultWithMemory cost_of(Node const &node,
+                                  float cost,
+                                  float mem_mb,
+                                  bool recomputed) {
+  GraphCostResultWithMemory result{
+      cost, MemoryUsage{MemoryUsageType::GLOBAL, mem_mb}, {}, {}};
+  result.views[node] = MachineView();
+  if (recomputed) {
+    result.recomputed.insert(node);
+  }
+  return result;
+}
+
+} // namespace
+
+TEST(graph_cost_with_memory, sequence_cost_merges_recomputed) {
+  Node a(1, nullptr), b(2, nullptr);
+  GraphCostResultWithMemory result = sequence_cost<GraphCostResultWithMemory>(
+      cost_of(a, 1.0f, 10.0f, true), cost_of(b, 2.0f, 20.0f, false));
+  EXPECT_FLOAT_EQ(result.cost, 3.0f);
+  EXPECT_FLOAT_EQ(result.mem_cost.num, 30.0f);
+  EXPECT_EQ(result.views.size(), 2u);
+  EXPECT_EQ(result.recomputed, std::unordered_set<Node>({a}));
+
+  result = sequence_cost<GraphCostResultWithMemory>(
+      cost_of(a, 1.0f, 10.0f, false), cost_of(b, 2.0f, 20.0f, true));
+  EXPECT_EQ(result.recomputed, std::unordered_set<Node>({b}));
+}
+
+TEST(graph_cost_with_memory, parallel_cost_merges_recomputed) {
+  Node a(1, nullptr), b(2, nullptr);
+  GraphCostResultWithMemory result = parallel_cost<GraphCostResultWithMemory>(
+      cost_of(a, 1.0f, 10.0f, true), cost_of(b, 2.0f, 20.0f, true));
+  EXPECT_FLOAT_EQ(result.cost, 2.0f);
+  EXPECT_FLOAT_EQ(result.mem_cost.num, 30.0f);
+  EXPECT_EQ(result.recomputed, std::unordered_set<Node>({a, b}));
+
+  result = parallel_cost<GraphCostResultWithMemory>(
+      cost_of(a, 1.0f, 10.0f, false), cost_of(b, 2.0f, 20.0f, false));
+  EXPECT_TRUE(result.recomputed.empty());
+}
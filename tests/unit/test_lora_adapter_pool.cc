@@ -0,0 +1,96 @@
+#include "flexflow/utils/lora_adapter_pool.h"
+#include "gtest/gtest.h"
+
+using namespace FlexFlow;
+
+TEST(lora_adapter_pool, load_once) {
+  LoraAdapterPool pool(1024, 64);
+  LoraAdapterPool::BlockId a = pool.add_block(100), b = pool.add_block(128);
+  EXPECT_EQ(pool.get_block_size(a), 128);
+  EXPECT_FALSE(pool.is_resident(a));
+
+  bool needs_load;
+  std::vector<LoraAdapterPool::Move> moves;
+  EXPECT_EQ(pool.acquire(a, 1, needs_load, moves), 0);
+  EXPECT_TRUE(needs_load);
+  EXPECT_EQ(pool.acquire(b, 1, needs_load, moves), 128);
+  EXPECT_TRUE(needs_load);
+  EXPECT_EQ(pool.acquire(a, 2, needs_load, moves), 0);
+  EXPECT_FALSE(needs_load);
+  EXPECT_TRUE(moves.empty());
+  EXPECT_EQ(pool.get_used_size(), 256);
+  EXPECT_EQ(pool.num_loads, 2);
+}
+
+TEST(lora_adapter_pool, evicts_least_recently_used) {
+  LoraAdapterPool pool(300, 100);
+  std::vector<LoraAdapterPool::BlockId> ids;
+  for (int i = 0; i < 4; i++) {
+    ids.push_back(pool.add_block(100));
+  }
+  bool needs_load;
+  std::vector<LoraAdapterPool::Move> moves;
+  pool.acquire(ids[0], 1, needs_load, moves);
+  pool.acquire(ids[1], 2, needs_load, moves);
+  pool.acquire(ids[2], 3, needs_load, moves);
+  pool.acquire(ids[0], 4, needs_load, moves);
+  // 1 is the least recently used block
+  EXPECT_EQ(pool.acquire(ids[3], 5, needs_load, moves), 100);
+  EXPECT_TRUE(needs_load);
+  EXPECT_FALSE(pool.is_resident(ids[1]));
+  EXPECT_TRUE(pool.is_resident(ids[0]));
+  EXPECT_EQ(pool.num_evictions, 1);
+
+  // blocks used by the current step are never evicted
+  EXPECT_EQ(pool.acquire(ids[0], 6, needs_load, moves), 0);
+  EXPECT_EQ(pool.acquire(ids[2], 6, needs_load, moves), 200);
+  EXPECT_EQ(pool.acquire(ids[3], 6, needs_load, moves), 100);
+  EXPECT_EQ(pool.acquire(ids[1], 6, needs_load, moves),
+            LoraAdapterPool::NONE);
+  EXPECT_EQ(pool.num_resident_blocks(), 3);
+}
+
+TEST(lora_adapter_pool, compaction) {
+  LoraAdapterPool pool(400, 100);
+  LoraAdapterPool::BlockId a = pool.add_block(100), b = pool.add_block(100),
+                           c = pool.add_block(100), d = pool.add_block(100),
+                           big = pool.add_block(200);
+  bool needs_load;
+  std::vector<LoraAdapterPool::Move> moves;
+  pool.acquire(a, 1, needs_load, moves);
+  pool.acquire(b, 2, needs_load, moves);
+  pool.acquire(c, 3, needs_load, moves);
+  pool.acquire(d, 4, needs_load, moves);
+  pool.acquire(b, 5, needs_load, moves);
+  pool.acquire(d, 5, needs_load, moves);
+  // evicting a and c leaves two separate holes of 100 bytes
+  EXPECT_EQ(pool.acquire(big, 6, needs_load, moves), 200);
+  EXPECT_TRUE(needs_load);
+  EXPECT_EQ(pool.num_compactions, 1);
+  EXPECT_EQ(pool.get_offset(b), 0);
+  EXPECT_EQ(pool.get_offset(d), 100);
+  ASSERT_EQ(moves.size(), 2);
+  EXPECT_EQ(moves[0].src, 100);
+  EXPECT_EQ(moves[0].dst, 0);
+  EXPECT_EQ(moves[1].src, 300);
+  EXPECT_EQ(moves[1].dst, 100);
+}
+
+TEST(lora_adapter_pool, overlapping_moves_are_chunked) {
+  LoraAdapterPool pool(1000, 10);
+  LoraAdapterPool::BlockId a = pool.add_block(10), b = pool.add_block(500),
+                           c = pool.add_block(500);
+  bool needs_load;
+  std::vector<LoraAdapterPool::Move> moves;
+  pool.acquire(a, 1, needs_load, moves);
+  pool.acquire(b, 2, needs_load, moves);
+  // a is evicted, leaving holes of 10 and 490 bytes
+  EXPECT_EQ(pool.acquire(c, 3, needs_load, moves), 500);
+  size_t copied = 0;
+  for (auto const &move : moves) {
+    EXPECT_LE(move.size, move.src - move.dst);
+    copied += move.size;
+  }
+  EXPECT_EQ(copied, 500);
+  EXPECT_EQ(moves.front().dst, 0);
+}
@@ -0,0 +1,43 @@
+#include "flexflow/utils/loss_scaler.h"
+#include "gtest/gtest.h"
+#include <type_traits>
+
+using namespace FlexFlow;
+
+TEST(loss_scaler, backs_off_on_overflow) {
+  LossScaler scaler(1024.0f, 3);
+  EXPECT_FLOAT_EQ(scaler.get_scale(), 1024.0f);
+  EXPECT_TRUE(scaler.update(false));
+  EXPECT_FALSE(scaler.skip_step());
+  EXPECT_FALSE(scaler.update(true));
+  EXPECT_TRUE(scaler.skip_step());
+  EXPECT_FLOAT_EQ(scaler.get_scale(), 512.0f);
+  EXPECT_FALSE(scaler.update(true));
+  EXPECT_FLOAT_EQ(scaler.get_scale(), 256.0f);
+  EXPECT_FLOAT_EQ(scaler.get_inverse_scale(), 1.0f / 256.0f);
+  EXPECT_EQ(scaler.num_steps, 3);
+  EXPECT_EQ(scaler.num_skipped_steps, 2);
+}
+
+TEST(loss_scaler, grows_after_interval) {
+  LossScaler scaler(8.0f, 3);
+  scaler.update(false);
+  scaler.update(false);
+  EXPECT_FLOAT_EQ(scaler.get_scale(), 8.0f);
+  scaler.update(false);
+  EXPECT_FLOAT_EQ(scaler.get_scale(), 16.0f);
+  // an overflow restarts the interval
+  scaler.update(false);
+  scaler.update(false);
+  scaler.update(true);
+  EXPECT_FLOAT_EQ(scaler.get_scale(), 8.0f);
+  scaler.update(false);
+  scaler.update(false);
+  EXPECT_FLOAT_EQ(scaler.get_scale(), 8.0f);
+  scaler.update(false);
+  EXPECT_FLOAT_EQ(scaler.get_scale(), 16.0f);
+}
+
+TEST(loss_scaler, is_plain_data) {
+  EXPECT_TRUE(std::is_trivially_copyable<LossScaler>::value);
+}
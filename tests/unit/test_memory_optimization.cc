@@ -0,0 +1,26 @@
+#include "flexflow/memory_optimization.h"
+#include "gtest/gtest.h"
+
+using namespace FlexFlow;
+
+TEST(memory_optimization, optimizer_states_memory) {
+  // 4 replicas of a weight of 100 elements with the two moments of Adam
+  EXPECT_EQ(optimizer_states_memory(400, 4, 2, false), 3200);
+  EXPECT_EQ(optimizer_states_memory(400, 4, 2, true), 800);
+  // a single replica is not sharded further
+  EXPECT_EQ(optimizer_states_memory(100, 1, 2, true), 800);
+  EXPECT_EQ(optimizer_states_memory(400, 4, 0, true), 0);
+}
+
+TEST(memory_optimization, should_recompute_outputs) {
+  // only run time counts by default
+  EXPECT_FALSE(should_recompute_outputs(MemoryOptimConfig(1.0), 0.1, 1000));
+  // only memory counts
+  EXPECT_TRUE(should_recompute_outputs(MemoryOptimConfig(0.0), 100, 0.1));
+  EXPECT_FALSE(should_recompute_outputs(MemoryOptimConfig(0.0), 100, 0));
+  // 0.5 * 2ms vs 0.5 * 4MB
+  EXPECT_TRUE(should_recompute_outputs(MemoryOptimConfig(0.5), 2, 4));
+  EXPECT_FALSE(should_recompute_outputs(MemoryOptimConfig(0.5), 4, 2));
+  // 0.8 * 2ms vs 0.2 * 4MB
+  EXPECT_FALSE(should_recompute_outputs(MemoryOptimConfig(0.8), 2, 4));
+}
@@ -0,0 +1,129 @@
+#include "flexflow/utils/multi_tensor_update.h"
+#include "gtest/gtest.h"
+#include <cmath>
+#include <vector>
+
+using namespace FlexFlow;
+using namespace FlexFlow::MultiTensorUpdate;
+
+namespace {
+
+// Parameters of several sizes, one of them with replicated gradients
+struct Params {
+  std::vector<size_t> sizes = {1, 13, 0, 100, 8};
+  std::vector<int> replicas = {1, 1, 1, 3, 2};
+  std::vector<std::vector<float>> grads, w, v, m;
+
+  Params() {
+    for (size_t k = 0; k < sizes.size(); k++) {
+      grads.emplace_back(sizes[k] * replicas[k]);
+      for (size_t i = 0; i < grads[k].size(); i++) {
+        grads[k][i] = std::sin(0.7f * i + k);
+      }
+      w.emplace_back(sizes[k]);
+      v.emplace_back(sizes[k]);
+      m.emplace_back(sizes[k]);
+      for (size_t i = 0; i < sizes[k]; i++) {
+        w[k][i] = std::cos(0.3f * i - k);
+        v[k][i] = 0.1f * (i % 5);
+        m[k][i] = 0.05f * (i % 3) - 0.05f;
+      }
+    }
+  }
+  std::vector<MultiTensorEntry> table() {
+    std::vector<MultiTensorEntry> entries;
+    for (size_t k = 0; k < sizes.size(); k++) {
+      entries.push_back({grads[k].data(),
+                         w[k].data(),
+                         v[k].data(),
+                         m[k].data(),
+                         sizes[k],
+                         replicas[k]});
+    }
+    return entries;
+  }
+  float grad(size_t k, size_t i) const {
+    float sum = 0.0f;
+    for (int r = 0; r < replicas[k]; r++) {
+      sum += grads[k][r * sizes[k] + i];
+    }
+    return sum;
+  }
+};
+
+void expect_near(std::vector<std::vector<float>> const &a,
+                 std::vector<std::vector<float>> const &b) {
+  ASSERT_EQ(a.size(), b.size());
+  for (size_t k = 0; k < a.size(); k++) {
+    ASSERT_EQ(a[k].size(), b[k].size());
+    for (size_t i = 0; i < a[k].size(); i++) {
+      EXPECT_NEAR(a[k][i], b[k][i], 1e-5f) << "tensor " << k << " at " << i;
+    }
+  }
+}
+
+} // namespace
+
+TEST(multi_tensor_update, sgd) {
+  for (bool nesterov : {false, true}) {
+    SGDParams params = {0.1f, 0.01f, 0.9f, nesterov};
+    Params expected, scalar, vector;
+    for (size_t k = 0; k < expected.sizes.size(); k++) {
+      for (size_t i = 0; i < expected.sizes[k]; i++) {
+        float &w = expected.w[k][i], &v = expected.v[k][i];
+        float gt = expected.grad(k, i) + params.weight_decay * w;
+        v = v * params.momentum + gt;
+        w -= params.lr * (nesterov ? gt + params.momentum * v : v);
+      }
+    }
+    std::vector<MultiTensorEntry> table = scalar.table();
+    sgd_cpu(params, table.data(), table.size(), false /*vectorize*/);
+    table = vector.table();
+    sgd_cpu(params, table.data(), table.size());
+    expect_near(scalar.w, expected.w);
+    expect_near(scalar.v, expected.v);
+    expect_near(vector.w, expected.w);
+    expect_near(vector.v, expected.v);
+  }
+}
+
+TEST(multi_tensor_update, sgd_without_momentum) {
+  SGDParams params = {0.5f, 0.0f, 0.0f, false};
+  Params expected, actual;
+  std::vector<MultiTensorEntry> table = actual.table();
+  for (auto &entry : table) {
+    // no velocity is needed
+    entry.v = nullptr;
+  }
+  sgd_cpu(params, table.data(), table.size());
+  for (size_t k = 0; k < expected.sizes.size(); k++) {
+    for (size_t i = 0; i < expected.sizes[k]; i++) {
+      expected.w[k][i] -= params.lr * expected.grad(k, i);
+    }
+  }
+  expect_near(actual.w, expected.w);
+}
+
+TEST(multi_tensor_update, adam) {
+  AdamParams params = {0.01f, 0.9f, 0.999f, 0.001f, 1e-8f};
+  Params expected, scalar, vector;
+  for (size_t k = 0; k < expected.sizes.size(); k++) {
+    for (size_t i = 0; i < expected.sizes[k]; i++) {
+      float &w = expected.w[k][i], &v = expected.v[k][i],
+            &m = expected.m[k][i];
+      float gt = expected.grad(k, i) + params.weight_decay * w;
+      m = params.beta1 * m + (1 - params.beta1) * gt;
+      v = params.beta2 * v + (1 - params.beta2) * gt * gt;
+      w -= params.alpha_t * m / (std::sqrt(v) + params.epsilon);
+    }
+  }
+  std::vector<MultiTensorEntry> table = scalar.table();
+  adam_cpu(params, table.data(), table.size(), false /*vectorize*/);
+  table = vector.table();
+  adam_cpu(params, table.data(), table.size());
+  for (Params *actual : {&scalar, &vector}) {
+    expect_near(actual->w, expected.w);
+    expect_near(actual->v, expected.v);
+    expect_near(actual->m, expected.m);
+  }
+}
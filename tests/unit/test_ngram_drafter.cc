@@ -0,0 +1,102 @@
+#include "flexflow/ngram_drafter.h"
+#include "gtest/gtest.h"
+
+using namespace FlexFlow;
+
+TEST(ngram_drafter, index_lookup) {
+  NgramIndex index(1, 3);
+  std::vector<int> document{1, 2, 3, 1, 2, 4, 1, 2};
+  index.add_document(document.data(), document.size());
+  index.add_document(document.data(), 2);
+  EXPECT_EQ(index.num_tokens(), 10);
+  EXPECT_EQ(index.num_documents(), 2);
+
+  // most recent occurrence first, occurrences without continuation skipped
+  std::vector<size_t> positions;
+  int ngram[] = {1, 2};
+  index.lookup(ngram, 2, 10, positions);
+  ASSERT_EQ(positions, (std::vector<size_t>{5, 2}));
+  EXPECT_EQ(index.token(positions[0]), 4);
+  EXPECT_EQ(index.continuation_length(positions[0]), 3);
+  EXPECT_EQ(index.continuation_length(positions[1]), 6);
+
+  positions.clear();
+  index.lookup(ngram, 2, 1, positions);
+  EXPECT_EQ(positions, (std::vector<size_t>{5}));
+
+  // n-grams do not span documents
+  positions.clear();
+  int across[] = {2, 1};
+  index.lookup(across, 2, 10, positions);
+  EXPECT_TRUE(positions.empty());
+  positions.clear();
+  int missing[] = {3, 3, 3};
+  index.lookup(missing, 3, 10, positions);
+  EXPECT_TRUE(positions.empty());
+}
+
+TEST(ngram_drafter, prompt_lookup_chain) {
+  NgramDrafter drafter;
+  // the suffix (5, 6) appeared earlier, followed by 7 8 9
+  std::vector<int> context{5, 6, 7, 8, 9, 10, 5, 6};
+  auto tree = drafter.propose(1, context, 3, 1);
+  std::vector<std::pair<int, int>> expected{{7, 1}, {8, 2}, {9, 3}};
+  EXPECT_EQ(tree, expected);
+  EXPECT_EQ(drafter.num_requests(), 1);
+
+  // the context grows incrementally
+  context.push_back(7);
+  tree = drafter.propose(1, context, 8, 1);
+  ASSERT_FALSE(tree.empty());
+  EXPECT_EQ(tree.front(), std::make_pair(8, 1));
+  EXPECT_EQ(tree.size(), 6);
+
+  drafter.remove_request(1);
+  EXPECT_EQ(drafter.num_requests(), 0);
+  EXPECT_TRUE(drafter.propose(2, {1, 2, 3}, 4, 1).empty());
+}
+
+TEST(ngram_drafter, branches_and_corpus) {
+  NgramDrafter::Config config;
+  config.min_order = 2;
+  config.max_tokens = 5;
+  NgramDrafter drafter(config);
+  drafter.set_corpus(drafter.build_corpus({{1, 2, 3, 4}, {1, 2, 5, 6}}));
+  auto tree = drafter.propose(1, {9, 1, 2}, 4, 2);
+  // both corpus continuations, most recent document first, in DFS order
+  std::vector<std::pair<int, int>> expected{
+      {5, 1}, {6, 2}, {3, 1}, {4, 2}};
+  EXPECT_EQ(tree, expected);
+
+  // a single branch when the width is 1
+  tree = drafter.propose(1, {9, 1, 2}, 4, 1);
+  EXPECT_EQ(tree.size(), 2);
+
+  // matches in the request's own context rank above corpus matches
+  tree = drafter.propose(2, {1, 2, 3, 7, 1, 2}, 4, 2);
+  ASSERT_GE(tree.size(), 2);
+  EXPECT_EQ(tree[0], std::make_pair(3, 1));
+  EXPECT_EQ(tree[1], std::make_pair(7, 2));
+
+  // the token budget bounds the tree size
+  tree = drafter.propose(3, {9, 1, 2}, 8, 3);
+  EXPECT_LE(tree.size(), 5);
+}
+
+TEST(ngram_drafter, tree_is_valid_dfs) {
+  NgramDrafter drafter;
+  std::vector<int> context;
+  for (int i = 0; i < 500; i++) {
+    context.push_back((i * 7919) % 13);
+  }
+  auto tree = drafter.propose(1, context, 8, 3);
+  ASSERT_FALSE(tree.empty());
+  EXPECT_LE(tree.size(), drafter.get_config().max_tokens);
+  EXPECT_EQ(tree.front().second, 1);
+  for (size_t i = 1; i < tree.size(); i++) {
+    // a node is either a child of the previous one or a sibling of one of its
+    // ancestors
+    EXPECT_LE(tree[i].second, tree[i - 1].second + 1);
+    EXPECT_LE(tree[i].second, 8);
+  }
+}
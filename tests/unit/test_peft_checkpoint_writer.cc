@@ -0,0 +1,98 @@
+#include "flexflow/utils/peft_checkpoint_writer.h"
+#include "gtest/gtest.h"
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+
+using namespace FlexFlow;
+namespace fs = std::filesystem;
+
+TEST(peft_checkpoint_writer, write_and_flush) {
+  fs::path folder = fs::temp_directory_path() / "ff_test_peft_checkpoint";
+  fs::remove_all(folder);
+  PEFTCheckpointWriter writer;
+  for (int i = 0; i < 16; i++) {
+    std::vector<char> buffer = writer.get_staging_buffer(1000 + i);
+    for (size_t j = 0; j < buffer.size(); j++) {
+      buffer[j] = (char)(i + j);
+    }
+    writer.write((folder / "step_1" / ("shard_" + std::to_string(i)) /
+                  "layers.0.lora_A.weight")
+                     .string(),
+                 std::move(buffer));
+  }
+  writer.flush();
+  for (int i = 0; i < 16; i++) {
+    fs::path filepath = folder / "step_1" / ("shard_" + std::to_string(i)) /
+                        "layers.0.lora_A.weight";
+    std::ifstream in(filepath, std::ios::binary);
+    ASSERT_TRUE(in.good());
+    std::vector<char> data((std::istreambuf_iterator<char>(in)),
+                           std::istreambuf_iterator<char>());
+    ASSERT_EQ(data.size(), 1000 + i);
+    EXPECT_EQ(data[7], (char)(i + 7));
+    EXPECT_FALSE(fs::exists(filepath.string() + ".tmp"));
+  }
+  // staging buffers are reused
+  EXPECT_GE(writer.get_staging_buffer(10).capacity(), 1000);
+  fs::remove_all(folder);
+}
+
+TEST(peft_checkpoint_writer, write_failure) {
+  fs::path folder = fs::temp_directory_path() / "ff_test_peft_write_failure";
+  fs::remove_all(folder);
+  fs::create_directories(folder);
+  // a file where the writer needs a directory
+  std::ofstream(folder / "step_1").put('x');
+  PEFTCheckpointWriter writer;
+  writer.write((folder / "step_1" / "layers.0.lora_A.weight").string(),
+               writer.get_staging_buffer(100));
+  writer.write((folder / "step_2" / "layers.0.lora_A.weight").string(),
+               writer.get_staging_buffer(100));
+  writer.flush();
+  // the failed file is skipped and the writer keeps going
+  EXPECT_TRUE(fs::is_regular_file(folder / "step_1"));
+  EXPECT_EQ(fs::file_size(folder / "step_2" / "layers.0.lora_A.weight"), 100u);
+  fs::remove_all(folder);
+}
+
+TEST(peft_checkpoint_writer, checkpoint_step) {
+  // one checkpoint per interval, at the first weight update after it
+  EXPECT_FALSE(is_peft_checkpoint_step(4, 1, -1));
+  EXPECT_FALSE(is_peft_checkpoint_step(3, 1, 4));
+  EXPECT_TRUE(is_peft_checkpoint_step(4, 1, 4));
+  EXPECT_FALSE(is_peft_checkpoint_step(5, 1, 4));
+  EXPECT_TRUE(is_peft_checkpoint_step(8, 1, 4));
+  // with gradient accumulation, weights are only updated every 3 steps
+  EXPECT_FALSE(is_peft_checkpoint_step(3, 3, 4));
+  EXPECT_TRUE(is_peft_checkpoint_step(6, 3, 4));
+  EXPECT_TRUE(is_peft_checkpoint_step(9, 3, 4));
+  EXPECT_FALSE(is_peft_checkpoint_step(15, 3, 4));
+  EXPECT_TRUE(is_peft_checkpoint_step(18, 3, 4));
+  // an interval shorter than the accumulation saves every update
+  EXPECT_TRUE(is_peft_checkpoint_step(3, 3, 2));
+  EXPECT_TRUE(is_peft_checkpoint_step(6, 3, 2));
+}
+
+TEST(peft_checkpoint_writer, find_latest_checkpoint) {
+  fs::path folder = fs::temp_directory_path() / "ff_test_peft_resume";
+  fs::remove_all(folder);
+  std::vector<std::string> files = {"shard_0/layers.0.lora_A.weight",
+                                    "shard_0/layers.0.lora_B.weight",
+                                    "shard_1/layers.0.lora_A.weight"};
+  EXPECT_EQ(find_latest_peft_checkpoint(folder.string(), files), -1);
+  PEFTCheckpointWriter writer;
+  for (int step : {4, 8, 12}) {
+    for (std::string const &file : files) {
+      writer.write((folder / ("step_" + std::to_string(step)) / file).string(),
+                   writer.get_staging_buffer(16));
+    }
+  }
+  writer.flush();
+  // step 12 was interrupted before shard 1 was written
+  fs::remove(folder / "step_12" / files[2]);
+  fs::create_directories(folder / "step_x");
+  EXPECT_EQ(find_latest_peft_checkpoint(folder.string(), files), 8);
+  EXPECT_EQ(find_latest_peft_checkpoint(folder.string(), {files[0]}), 12);
+  fs::remove_all(folder);
+}
@@ -0,0 +1,129 @@
+#include "flexflow/utils/peft_chunking.h"
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <vector>
+
+using namespace FlexFlow;
+
+namespace {
+
+// Schedules the chunks of an entry in batches with the given free tokens,
+// and checks that each token runs its backward pass once, after the keys and
+// values it attends to are in the KV cache
+std::vector<PeftChunk> schedule_entry(int entry_length,
+                                      std::vector<int> const &free_tokens,
+                                      bool truncated_backprop) {
+  std::vector<PeftChunk> chunks;
+  int num_fwd_tokens = 0, num_bwd_tokens = 0;
+  for (size_t b = 0; num_bwd_tokens < entry_length; b++) {
+    PeftChunk chunk =
+        get_next_peft_chunk(entry_length,
+                            num_fwd_tokens,
+                            num_bwd_tokens,
+                            free_tokens[std::min(b, free_tokens.size() - 1)],
+                            truncated_backprop);
+    if (chunk.num_tokens == 0) {
+      continue;
+    }
+    int chunk_end = chunk.first_token_depth + chunk.num_tokens;
+    EXPECT_LE(chunk.first_token_depth, num_fwd_tokens);
+    num_fwd_tokens = std::max(num_fwd_tokens, chunk_end);
+    if (chunk.bwd) {
+      EXPECT_EQ(chunk.first_bwd_chunk, num_bwd_tokens == 0);
+      if (!truncated_backprop) {
+        // the later tokens already ran their backward pass
+        EXPECT_EQ(chunk_end, entry_length - num_bwd_tokens);
+      }
+      num_bwd_tokens += chunk.num_tokens;
+      EXPECT_EQ(chunk.last_bwd_chunk, num_bwd_tokens == entry_length);
+    }
+    chunks.push_back(chunk);
+  }
+  EXPECT_EQ(num_fwd_tokens, entry_length);
+  return chunks;
+}
+
+} // namespace
+
+TEST(peft_chunking, whole_entry) {
+  for (bool truncated_backprop : {false, true}) {
+    PeftChunk chunk = get_next_peft_chunk(100, 0, 0, 128, truncated_backprop);
+    EXPECT_EQ(chunk.first_token_depth, 0);
+    EXPECT_EQ(chunk.num_tokens, 100);
+    EXPECT_TRUE(chunk.bwd && chunk.first_bwd_chunk && chunk.last_bwd_chunk);
+    EXPECT_EQ(get_next_peft_chunk(100, 0, 0, 0, truncated_backprop).num_tokens,
+              0);
+  }
+}
+
+TEST(peft_chunking, exact_chunks_run_backward_in_reverse) {
+  // entries longer than the free tokens make progress in every batch
+  std::vector<PeftChunk> chunks = schedule_entry(100, {40}, false);
+  ASSERT_EQ(chunks.size(), 5u);
+  EXPECT_FALSE(chunks[0].bwd);
+  EXPECT_FALSE(chunks[1].bwd);
+  int depths[] = {0, 40, 80, 40, 0};
+  int num_tokens[] = {40, 40, 20, 40, 40};
+  for (int c = 0; c < 5; c++) {
+    EXPECT_EQ(chunks[c].first_token_depth, depths[c]);
+    EXPECT_EQ(chunks[c].num_tokens, num_tokens[c]);
+  }
+  // free tokens that vary between batches, including batches without any
+  schedule_entry(100, {30, 0, 64, 8, 0, 100}, false);
+  schedule_entry(100, {1}, false);
+}
+
+TEST(peft_chunking, truncated_chunks_run_in_order) {
+  std::vector<PeftChunk> chunks = schedule_entry(100, {64}, true);
+  ASSERT_EQ(chunks.size(), 2u);
+  EXPECT_EQ(chunks[0].num_tokens, 64);
+  EXPECT_EQ(chunks[1].first_token_depth, 64);
+  EXPECT_EQ(chunks[1].num_tokens, 36);
+  EXPECT_TRUE(chunks[0].bwd && chunks[1].bwd);
+  schedule_entry(100, {30, 0, 64, 8, 0, 100}, true);
+}
+
+TEST(peft_chunking, chunked_labels_match_entry) {
+  std::vector<int> entry;
+  for (int i = 0; i < 10; i++) {
+    entry.push_back(100 + i);
+  }
+  std::vector<int> labels(entry.size());
+  int num_labels = get_peft_chunk_labels(
+      entry.data(), (int)entry.size(), -1 /*next_token_id*/, labels.data());
+  ASSERT_EQ(num_labels, 9);
+  for (int j = 0; j < num_labels; j++) {
+    EXPECT_EQ(labels[j], entry[j + 1]);
+  }
+  float scale = get_peft_loss_scale((int)entry.size(), (int)entry.size());
+
+  // the chunks of the entry produce the same labels, and the same total
+  // weight in the accumulated loss gradients
+  std::vector<int> chunked_labels;
+  float chunked_weight = 0.0f;
+  for (int begin : {0, 4, 8}) {
+    int end = std::min(begin + 4, (int)entry.size());
+    int next_token_id = end < (int)entry.size() ? entry[end] : -1;
+    std::vector<int> chunk_labels(end - begin);
+    int num_chunk_labels = get_peft_chunk_labels(entry.data() + begin,
+                                                 end - begin,
+                                                 next_token_id,
+                                                 chunk_labels.data());
+    EXPECT_EQ(num_chunk_labels, next_token_id >= 0 ? end - begin : 1);
+    chunked_labels.insert(chunked_labels.end(),
+                          chunk_labels.begin(),
+                          chunk_labels.begin() + num_chunk_labels);
+    chunked_weight +=
+        num_chunk_labels * get_peft_loss_scale((int)entry.size(), end - begin);
+  }
+  EXPECT_EQ(chunked_labels,
+            std::vector<int>(labels.begin(), labels.begin() + num_labels));
+  EXPECT_FLOAT_EQ(chunked_weight, num_labels * scale);
+  EXPECT_FLOAT_EQ(chunked_weight, 1.0f);
+}
+
+TEST(peft_chunking, single_token_entry) {
+  int token = 7, label = -1;
+  EXPECT_EQ(get_peft_chunk_labels(&token, 1, -1, &label), 0);
+  EXPECT_EQ(get_peft_loss_scale(1, 1), 0.0f);
+}
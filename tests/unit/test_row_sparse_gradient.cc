@@ -0,0 +1,112 @@
+#include "flexflow/utils/row_sparse_gradient.h"
+#include "gtest/gtest.h"
+#include <cmath>
+#include <random>
+#include <set>
+
+using namespace FlexFlow;
+
+TEST(row_sparse_gradient, deduplicates_rows) {
+  // bags {5, 2, 5}, {}, {700, 2}
+  int64_t indices[] = {5, 2, 5, 700, 2};
+  int lengths[] = {3, 0, 2};
+  float output_grad[] = {1, 10, 2, 20, 3, 30};
+  RowSparseGradient grad;
+  grad.build(indices, lengths, 3, output_grad, 1000, 2, AGGR_MODE_SUM);
+  ASSERT_EQ(grad.num_unique_rows(), 3);
+  EXPECT_EQ(grad.row(0), 2);
+  EXPECT_EQ(grad.row(1), 5);
+  EXPECT_EQ(grad.row(2), 700);
+  EXPECT_FLOAT_EQ(grad.row_values(0)[0], 1 + 3);
+  EXPECT_FLOAT_EQ(grad.row_values(0)[1], 10 + 30);
+  EXPECT_FLOAT_EQ(grad.row_values(1)[0], 2);
+  EXPECT_FLOAT_EQ(grad.row_values(2)[1], 30);
+
+  // averaged bags scale every entry by the length of its bag
+  int32_t indices32[] = {5, 2, 5, 700, 2};
+  grad.build(indices32, lengths, 3, output_grad, 1000, 2, AGGR_MODE_AVG);
+  ASSERT_EQ(grad.num_unique_rows(), 3);
+  EXPECT_FLOAT_EQ(grad.row_values(0)[0], 1.0f / 3 + 3.0f / 2);
+  EXPECT_FLOAT_EQ(grad.row_values(1)[1], 20.0f / 3);
+}
+
+TEST(row_sparse_gradient, matches_dense_updates) {
+  int const num_rows = 70000, block_size = 5, num_bags = 64;
+  std::mt19937 gen(0);
+  std::vector<int> lengths;
+  std::vector<int64_t> indices;
+  std::vector<float> output_grad;
+  for (int b = 0; b < num_bags; b++) {
+    lengths.push_back(gen() % 4);
+    for (int i = 0; i < lengths.back(); i++) {
+      // many duplicates in the first rows, and keys over two bytes
+      indices.push_back(gen() % 2 ? gen() % 8 : gen() % num_rows);
+    }
+    for (int j = 0; j < block_size; j++) {
+      output_grad.push_back((gen() % 100) / 50.0f - 1.0f);
+    }
+  }
+  std::vector<float> dense(num_rows * block_size, 0.0f);
+  for (size_t i = 0, b = 0; b < lengths.size(); b++) {
+    for (int k = 0; k < lengths[b]; k++, i++) {
+      for (int j = 0; j < block_size; j++) {
+        dense[indices[i] * block_size + j] += output_grad[b * block_size + j];
+      }
+    }
+  }
+  RowSparseGradient grad;
+  grad.build(indices.data(),
+             lengths.data(),
+             num_bags,
+             output_grad.data(),
+             num_rows,
+             block_size,
+             AGGR_MODE_SUM);
+  for (size_t i = 1; i < grad.num_unique_rows(); i++) {
+    EXPECT_LT(grad.row(i - 1), grad.row(i));
+  }
+
+  std::set<int64_t> touched_rows(indices.begin(), indices.end());
+  EXPECT_EQ(grad.num_unique_rows(), touched_rows.size());
+
+  float const lr = 0.1f, wd = 0.01f, eps = 1e-8f;
+  std::vector<float> weight(num_rows * block_size, 1.0f), expected = weight;
+  grad.apply_sgd(lr, wd, weight.data());
+  for (int r = 0; r < num_rows; r++) {
+    // rows no bag uses are not decayed
+    bool touched = touched_rows.count(r) > 0;
+    for (int j = 0; j < block_size; j++) {
+      float &w = expected[r * block_size + j];
+      if (touched) {
+        w -= lr * (dense[r * block_size + j] + wd * w);
+      }
+      ASSERT_NEAR(weight[r * block_size + j], w, 1e-5);
+    }
+  }
+
+  std::vector<float> state(num_rows, 0.5f), expected_state = state;
+  weight.assign(num_rows * block_size, 1.0f);
+  expected = weight;
+  grad.apply_rowwise_adagrad(lr, wd, eps, weight.data(), state.data());
+  for (size_t i = 0; i < grad.num_unique_rows(); i++) {
+    int64_t r = grad.row(i);
+    float sum = 0.0f;
+    for (int j = 0; j < block_size; j++) {
+      float g = dense[r * block_size + j] + wd;
+      sum += g * g;
+    }
+    expected_state[r] += sum / block_size;
+    for (int j = 0; j < block_size; j++) {
+      float g = dense[r * block_size + j] + wd;
+      expected[r * block_size + j] -=
+          lr * g / (std::sqrt(expected_state[r]) + eps);
+    }
+  }
+  for (int r = 0; r < num_rows; r++) {
+    ASSERT_NEAR(state[r], expected_state[r], 1e-5);
+    for (int j = 0; j < block_size; j++) {
+      ASSERT_NEAR(
+          weight[r * block_size + j], expected[r * block_size + j], 1e-5);
+    }
+  }
+}
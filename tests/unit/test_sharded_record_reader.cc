@@ -0,0 +1,86 @@
+#include "flexflow/utils/sharded_record_reader.h"
+#include "flexflow/utils/epoch_sampler.h"
+#include "gtest/gtest.h"
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+
+using namespace FlexFlow;
+namespace fs = std::filesystem;
+
+// Writes records 0..n-1 of two int32s each, split into shards of the given
+// number of records
+static std::vector<std::string> write_shards(fs::path const &folder,
+                                             std::vector<int> const &sizes) {
+  fs::remove_all(folder);
+  fs::create_directories(folder);
+  std::vector<std::string> paths;
+  int32_t record = 0;
+  for (size_t i = 0; i < sizes.size(); i++) {
+    paths.push_back((folder / ("shard_" + std::to_string(i))).string());
+    std::ofstream out(paths.back(), std::ios::binary);
+    for (int j = 0; j < sizes[i]; j++, record++) {
+      int32_t data[2] = {record, -record};
+      out.write((char const *)data, sizeof(data));
+    }
+  }
+  return paths;
+}
+
+TEST(sharded_record_reader, batches_span_shards) {
+  fs::path folder = fs::temp_directory_path() / "ff_test_record_reader";
+  std::vector<std::string> paths = write_shards(folder, {5, 0, 3, 6});
+  ShardedRecordReader reader(paths, 2 * sizeof(int32_t), 4, 2, 2);
+  EXPECT_EQ(reader.get_num_records(), 14);
+  // the last two records do not fill a batch
+  EXPECT_EQ(reader.get_num_batches(), 3);
+  for (int epoch = 0; epoch < 3; epoch++) {
+    for (int batch = 0; batch < 3; batch++) {
+      int32_t const *data = (int32_t const *)reader.next_batch();
+      for (int i = 0; i < 4; i++) {
+        EXPECT_EQ(data[2 * i], batch * 4 + i);
+        EXPECT_EQ(data[2 * i + 1], -(batch * 4 + i));
+      }
+    }
+    // resetting at the start of an epoch keeps the prefetched batches
+    reader.reset();
+  }
+  EXPECT_GE(reader.get_bytes_read(), 9 * 4 * 2 * sizeof(int32_t));
+  EXPECT_GT(reader.get_bytes_per_second(), 0);
+  fs::remove_all(folder);
+}
+
+TEST(sharded_record_reader, reset_restarts_epoch) {
+  fs::path folder = fs::temp_directory_path() / "ff_test_record_reader_reset";
+  std::vector<std::string> paths = write_shards(folder, {64, 64});
+  ShardedRecordReader reader(paths, 2 * sizeof(int32_t), 8, 3, 4);
+  for (int round = 0; round < 20; round++) {
+    for (int batch = 0; batch < round % 7 + 1; batch++) {
+      int32_t const *data = (int32_t const *)reader.next_batch();
+      EXPECT_EQ(data[0], batch * 8);
+      EXPECT_EQ(data[14], batch * 8 + 7);
+    }
+    reader.reset();
+  }
+  fs::remove_all(folder);
+}
+
+TEST(sharded_record_reader, shuffled_epochs) {
+  fs::path folder =
+      fs::temp_directory_path() / "ff_test_record_reader_shuffle";
+  std::vector<std::string> paths = write_shards(folder, {50, 30, 20});
+  ShardedRecordReader reader(paths, 2 * sizeof(int32_t), 16, 2, 3, 5);
+  EpochSampler sampler(100, 16, 5);
+  std::vector<size_t> order;
+  for (int epoch = 0; epoch < 3; epoch++) {
+    sampler.get_epoch_order(epoch, order);
+    for (int batch = 0; batch < 6; batch++) {
+      int32_t const *data = (int32_t const *)reader.next_batch();
+      for (int i = 0; i < 16; i++) {
+        EXPECT_EQ(data[2 * i], order[batch * 16 + i]);
+        EXPECT_EQ(data[2 * i + 1], -(int32_t)order[batch * 16 + i]);
+      }
+    }
+  }
+  fs::remove_all(folder);
+}
@@ -0,0 +1,126 @@
+#include "flexflow/speculation_controller.h"
+#include "gtest/gtest.h"
+#include <sstream>
+
+using namespace FlexFlow;
+
+TEST(speculation_controller, tree_size) {
+  SpeculationController controller;
+  controller.set_branching(2, 3);
+  EXPECT_EQ(controller.tree_size(1, 3), 1);
+  EXPECT_EQ(controller.tree_size(2, 3), 2);
+  EXPECT_EQ(controller.tree_size(5, 3), 2 + 3 * 3);
+  EXPECT_EQ(controller.tree_size(5, 1), 5);
+}
+
+TEST(speculation_controller, expected_accepted_tokens) {
+  SpeculationController controller;
+  controller.set_branching(0, 2);
+  EXPECT_NEAR(controller.expected_accepted_tokens(0.5, 1, 1), 0.5, 1e-9);
+  EXPECT_NEAR(
+      controller.expected_accepted_tokens(0.5, 3, 1), 0.5 + 0.25 + 0.125, 1e-9);
+  // two candidates for the first layer: 1 - 0.5^2
+  EXPECT_NEAR(controller.expected_accepted_tokens(0.5, 2, 2),
+              0.75 + 0.75 * 0.5,
+              1e-9);
+}
+
+TEST(speculation_controller, acceptance_rate_tracks_observations) {
+  SpeculationController controller;
+  double prior = controller.get_acceptance_rate(1, "");
+  for (int i = 0; i < 20; i++) {
+    controller.record(1, "code", 8, 8);
+    controller.record(2, "chat", 8, 0);
+  }
+  EXPECT_GT(controller.get_acceptance_rate(1, "code"), prior);
+  EXPECT_LT(controller.get_acceptance_rate(2, "chat"), prior);
+  // new requests start from their class estimate
+  EXPECT_GT(controller.get_acceptance_rate(3, "code"),
+            controller.get_acceptance_rate(4, "chat"));
+  controller.remove_request(1);
+  EXPECT_NEAR(controller.get_acceptance_rate(1, "code"),
+              controller.get_acceptance_rate(3, "code"),
+              1e-12);
+}
+
+TEST(speculation_controller, plan_follows_acceptance) {
+  SpeculationController controller;
+  controller.set_max_depth(8);
+  for (int i = 0; i < 20; i++) {
+    controller.record(1, "", 8, 8);
+    controller.record(2, "", 8, 0);
+  }
+  std::vector<SpeculationController::Plan> plans =
+      controller.plan({{1, ""}, {2, ""}}, 1000);
+  ASSERT_EQ(plans.size(), 2);
+  EXPECT_EQ(plans[0].depth, 8);
+  EXPECT_EQ(plans[1].depth, 1);
+}
+
+TEST(speculation_controller, plan_respects_budget) {
+  SpeculationController controller;
+  controller.set_max_depth(8);
+  controller.set_branching(2, 4);
+  std::vector<std::pair<SpeculationController::RequestGuid, std::string>>
+      requests;
+  for (int i = 0; i < 8; i++) {
+    for (int j = 0; j < 10; j++) {
+      controller.record(i, "", 8, i);
+    }
+    requests.push_back({i, ""});
+  }
+  for (int budget : {8, 20, 40, 1000}) {
+    std::vector<SpeculationController::Plan> plans =
+        controller.plan(requests, budget);
+    int total = 0;
+    for (auto const &plan : plans) {
+      EXPECT_GE(plan.depth, 1);
+      EXPECT_LE(plan.depth, 8);
+      EXPECT_GE(plan.width, 1);
+      EXPECT_LE(plan.width, 4);
+      total += controller.tree_size(plan.depth, plan.width);
+    }
+    EXPECT_LE(total, budget);
+    // requests with higher acceptance never get shallower trees
+    for (size_t i = 1; i < plans.size(); i++) {
+      EXPECT_GE(plans[i].depth, plans[i - 1].depth);
+    }
+  }
+}
+
+TEST(speculation_controller, plan_budget_below_num_requests) {
+  SpeculationController controller;
+  std::vector<std::pair<SpeculationController::RequestGuid, std::string>>
+      requests;
+  for (int i = 0; i < 6; i++) {
+    for (int j = 0; j < 10; j++) {
+      controller.record(i, "", 8, i);
+    }
+    requests.push_back({i, ""});
+  }
+  for (int budget : {-1, 0, 3, 5}) {
+    std::vector<SpeculationController::Plan> plans =
+        controller.plan(requests, budget);
+    ASSERT_EQ(plans.size(), requests.size());
+    int total = 0;
+    for (auto const &plan : plans) {
+      total += controller.tree_size(plan.depth, plan.width);
+    }
+    EXPECT_EQ(total, std::max(budget, 0));
+    // the requests with the highest acceptance keep speculating
+    for (int i = 0; i < 6; i++) {
+      EXPECT_EQ(plans[i].depth, i >= 6 - budget ? 1 : 0);
+    }
+  }
+}
+
+TEST(speculation_controller, export_stats) {
+  SpeculationController controller;
+  controller.record(1, "code", 4, 2);
+  controller.record(1, "code", 4, 4);
+  std::ostringstream oss;
+  controller.export_stats(oss);
+  std::string stats = oss.str();
+  EXPECT_NE(stats.find("\"code\""), std::string::npos);
+  EXPECT_NE(stats.find("accepted_tokens_histogram"), std::string::npos);
+}
@@ -0,0 +1,52 @@
+#include "flexflow/utils/token_dataset.h"
+#include "gtest/gtest.h"
+#include <cstdio>
+#include <fstream>
+
+using namespace FlexFlow;
+
+TEST(token_dataset, round_trip) {
+  std::string path = "test_token_dataset_round_trip.bin";
+  std::vector<std::pair<std::vector<int32_t>, std::vector<int32_t>>> entries{
+      {{1, 2, 3}, {}},
+      {{}, {4, 5}},
+      {{6}, {7, 8, 9}},
+  };
+  TokenDataset::write(path, entries);
+  ASSERT_TRUE(TokenDataset::is_token_dataset(path));
+  {
+    TokenDataset dataset(path);
+    ASSERT_EQ(dataset.size(), entries.size());
+    EXPECT_EQ(dataset.get_num_tokens(), 9);
+    for (size_t i = 0; i < entries.size(); i++) {
+      EXPECT_EQ(dataset.input(i).to_vector(), entries[i].first);
+      EXPECT_EQ(dataset.output(i).to_vector(), entries[i].second);
+    }
+    EXPECT_EQ(dataset.input(2)[0], 6);
+    EXPECT_EQ(dataset.max_entry_length(), 4);
+  }
+  std::remove(path.c_str());
+}
+
+TEST(token_dataset, empty) {
+  std::string path = "test_token_dataset_empty.bin";
+  TokenDataset::write(path, {});
+  {
+    TokenDataset dataset(path);
+    EXPECT_EQ(dataset.size(), 0);
+    EXPECT_EQ(dataset.get_num_tokens(), 0);
+    EXPECT_EQ(dataset.max_entry_length(), 0);
+  }
+  std::remove(path.c_str());
+}
+
+TEST(token_dataset, rejects_json) {
+  std::string path = "test_token_dataset_prompts.json";
+  {
+    std::ofstream out(path);
+    out << "[\"Three tips for staying healthy are: \"]";
+  }
+  EXPECT_FALSE(TokenDataset::is_token_dataset(path));
+  EXPECT_FALSE(TokenDataset::is_token_dataset("does_not_exist.bin"));
+  std::remove(path.c_str());
+}
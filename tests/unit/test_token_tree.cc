@@ -0,0 +1,110 @@
+#include "flexflow/token_tree.h"
+#include "gtest/gtest.h"
+
+using namespace FlexFlow;
+
+TEST(token_tree, build) {
+  TokenTreeArena trees(2, 8);
+  trees.reset(1, 100, 10);
+  int a = trees.add_node(1, 0, 1, 0.5f);
+  int b = trees.add_node(1, 0, 2, 0.25f);
+  int c = trees.add_node(1, a, 3);
+  EXPECT_EQ(trees.size(0), 0);
+  ASSERT_EQ(trees.size(1), 4);
+  EXPECT_EQ(trees.token(1, 0), 100);
+  EXPECT_EQ(trees.depth(1, 0), 10);
+  EXPECT_EQ(trees.parent(1, 0), TokenTreeArena::NONE);
+  EXPECT_EQ(trees.depth(1, c), 12);
+  EXPECT_EQ(trees.parent(1, c), a);
+  EXPECT_FLOAT_EQ(trees.prob(1, b), 0.25f);
+  EXPECT_EQ(trees.first_child(1, 0), a);
+  EXPECT_EQ(trees.next_sibling(1, a), b);
+  EXPECT_EQ(trees.next_sibling(1, b), TokenTreeArena::NONE);
+  EXPECT_EQ(trees.find_child(1, 0, 2), b);
+  EXPECT_EQ(trees.find_child(1, 0, 3), TokenTreeArena::NONE);
+
+  // trees are reused in place
+  trees.reset(1, 7, 0);
+  EXPECT_EQ(trees.size(1), 1);
+  EXPECT_EQ(trees.first_child(1, 0), TokenTreeArena::NONE);
+  for (int i = 1; i < 8; i++) {
+    EXPECT_EQ(trees.add_node(1, i - 1, i), i);
+  }
+  EXPECT_EQ(trees.add_node(1, 0, 9), TokenTreeArena::NONE);
+  trees.clear(1);
+  EXPECT_EQ(trees.size(1), 0);
+}
+
+TEST(token_tree, verify) {
+  TokenTreeArena trees(1, 16);
+  // root -> {1 -> {3, 4}, 2 -> {5}}, stored layer by layer
+  trees.reset(0, 0, 5);
+  trees.add_node(0, 0, 1);
+  trees.add_node(0, 0, 2);
+  trees.add_node(0, 1, 3);
+  trees.add_node(0, 1, 4);
+  trees.add_node(0, 2, 5);
+  std::vector<int> accepted;
+
+  // the model continues with 2 after the root and 5 after 2
+  int outputs[] = {2, 9, 5, 9, 9, 7};
+  trees.verify(0, outputs, 6, accepted);
+  EXPECT_EQ(accepted, (std::vector<int>{0, 2, 5}));
+
+  // a token matching the output of a node that is not its parent is rejected
+  int other[] = {1, 5, 9, 9, 9, 9};
+  trees.verify(0, other, 6, accepted);
+  EXPECT_EQ(accepted, (std::vector<int>{0, 1}));
+
+  // nodes without outputs are never accepted
+  trees.verify(0, outputs, 5, accepted);
+  EXPECT_EQ(accepted, (std::vector<int>{0, 2}));
+  trees.verify(0, outputs, 1, accepted);
+  EXPECT_EQ(accepted, (std::vector<int>{0}));
+}
+
+TEST(token_tree, merge) {
+  TokenTreeArena trees(1, 6), other(1, 6);
+  trees.reset(0, 0, 3);
+  trees.add_node(0, 0, 1, 0.5f);
+  trees.add_node(0, 1, 2, 0.5f);
+  other.reset(0, 0, 3);
+  other.add_node(0, 0, 1, 0.9f);
+  other.add_node(0, 0, 4);
+  other.add_node(0, 1, 5);
+  other.add_node(0, 2, 6);
+  other.add_node(0, 3, 7);
+
+  // 7 does not fit
+  EXPECT_EQ(trees.merge(0, other, 0), 1);
+  ASSERT_EQ(trees.size(0), 6);
+  // shared nodes keep their probability, new nodes follow their parents
+  EXPECT_FLOAT_EQ(trees.prob(0, 1), 0.5f);
+  EXPECT_EQ(trees.find_child(0, 1, 2), 2);
+  int four = trees.find_child(0, 0, 4);
+  int five = trees.find_child(0, 1, 5);
+  ASSERT_NE(four, TokenTreeArena::NONE);
+  ASSERT_NE(five, TokenTreeArena::NONE);
+  EXPECT_EQ(trees.find_child(0, four, 6), 5);
+  for (int node = 1; node < trees.size(0); node++) {
+    EXPECT_LT(trees.parent(0, node), node);
+    EXPECT_EQ(trees.depth(0, node), trees.depth(0, trees.parent(0, node)) + 1);
+  }
+  // merging again adds nothing
+  EXPECT_EQ(trees.merge(0, other, 0), 1);
+  EXPECT_EQ(trees.size(0), 6);
+}
+
+TEST(token_tree, ancestor_masks) {
+  TokenTreeArena trees(1, 8);
+  trees.reset(0, 0, 0);
+  trees.add_node(0, 0, 1);
+  trees.add_node(0, 0, 2);
+  trees.add_node(0, 1, 3);
+  unsigned long long masks[8];
+  trees.ancestor_masks(0, masks);
+  EXPECT_EQ(masks[0], 0b1111ULL);
+  EXPECT_EQ(masks[1], 0b1010ULL);
+  EXPECT_EQ(masks[2], 0b0100ULL);
+  EXPECT_EQ(masks[3], 0b1000ULL);
+}